@@ -0,0 +1,357 @@
+/**
+ * @file bench_load.c
+ * @author Shubham More
+ * @brief A multi-threaded HTTP load generator for benchmarking the proxy.
+ *
+ * Each of the -c client threads holds one connection to the proxy and
+ * sends requests on it back to back, a new one as soon as the last
+ * response is complete (a closed loop), reconnecting whenever the proxy
+ * closes the connection, or for every request with -K. URLs name objects
+ * of the mock origin (see bench_origin.c): object ranks are drawn from a
+ * Zipf distribution, so a few objects are very popular and most are
+ * rarely asked for, and each object has a fixed size, log-uniformly
+ * distributed between -s and -S bytes.
+ *
+ * Requests that complete during the warm-up are not counted. At the end
+ * the throughput, error counts and latency percentiles of the measured
+ * requests are printed.
+ *
+ * Usage: bench_load [-c conns] [-d secs] [-w secs] [-n objects] [-z s]
+ *                   [-s bytes] [-S bytes] [-K] [-o host:port] [proxy host:port]
+ */
+
+#define _GNU_SOURCE
+#include "socket_util.h"
+#include "bench_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+
+// --- Constants ---
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_DURATION 10            // Seconds measured
+#define DEFAULT_WARMUP 2               // Seconds before measuring starts
+#define DEFAULT_OBJECTS 10000
+#define DEFAULT_ZIPF 0.99
+#define DEFAULT_MIN_SIZE 1024
+#define DEFAULT_MAX_SIZE 65536
+#define RESPONSE_TIMEOUT 10            // Seconds without progress before a response counts as failed
+#define READ_BUFFER_SIZE 65536
+#define CLIENT_STACK_SIZE (256 * 1024)
+
+// --- Structs ---
+
+// Per-thread counters, merged at the end
+typedef struct {
+    pthread_t thread;
+    uint64_t seed;
+    BenchSamples latency;      // Nanoseconds per measured request
+    uint64_t bytes;            // Response bytes of measured requests
+    uint64_t connects;         // TCP connections opened
+    uint64_t connect_errors;   // Connections that failed to open
+    uint64_t status_errors;    // Responses other than 2xx or 304
+    uint64_t io_errors;        // Responses cut short or timed out
+} ClientThread;
+
+// --- Global State ---
+static DnsAddrs proxy_addrs;
+static const char *origin = "127.0.0.1:9000";
+static BenchZipf popularity;
+static size_t min_size = DEFAULT_MIN_SIZE;
+static size_t max_size = DEFAULT_MAX_SIZE;
+static int keep_alive = 1;
+static int measuring = 0;              // Set while samples count (both read with __atomic)
+static int stopping = 0;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief The fixed size of an object: log-uniform between the limits,
+ * chosen by hashing its id so every run agrees.
+ */
+static size_t object_size(size_t id) {
+    if (max_size <= min_size) return min_size;
+    uint64_t state = (id + 1) * 0x9E3779B97F4A7C15ull;
+    double u = bench_rand_unit(&state);
+    return (size_t)(min_size * pow((double)max_size / min_size, u));
+}
+
+/**
+ * @brief Opens a connection to the proxy.
+ * @return The socket, or -1.
+ */
+static int connect_proxy() {
+    for (int i = 0; i < proxy_addrs.count; i++) {
+        int fd = socket_connect_addr(&proxy_addrs.addrs[i], 0);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct timeval timeout = { RESPONSE_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        return fd;
+    }
+    return -1;
+}
+
+/**
+ * @brief Sends a whole buffer.
+ * @return 0 on success, -1 on failure.
+ */
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads one response, framed by Content-Length or by the
+ * connection closing.
+ * @param status Set to the status code.
+ * @param bytes Set to the response's size, head included.
+ * @param reusable Set to non-zero if the connection may carry another request.
+ * @return 0 on success, -1 if the response was cut short or malformed.
+ */
+static int read_response(int fd, char *buffer, int *status, uint64_t *bytes, int *reusable) {
+    size_t len = 0;
+    char *end = NULL;
+    while (!end) {
+        if (len == READ_BUFFER_SIZE - 1) return -1; // Head too long
+        ssize_t n = recv(fd, buffer + len, READ_BUFFER_SIZE - 1 - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len += n;
+        buffer[len] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+    }
+
+    size_t head_len = end + 4 - buffer;
+    end[2] = '\0';
+    if (sscanf(buffer, "HTTP/%*d.%*d %d", status) != 1) return -1;
+    *reusable = strstr(buffer, "HTTP/1.1") == buffer && !strcasestr(buffer, "\r\nConnection: close");
+    const char *content_length = strcasestr(buffer, "\r\nContent-Length:");
+    *bytes = len;
+
+    if (content_length) {
+        size_t remaining = head_len + strtoull(content_length + 17, NULL, 10);
+        while (*bytes < remaining) {
+            size_t want = remaining - *bytes < READ_BUFFER_SIZE ? remaining - *bytes : READ_BUFFER_SIZE;
+            ssize_t n = recv(fd, buffer, want, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            *bytes += n;
+        }
+        return *bytes == remaining ? 0 : -1; // More than one response means a framing bug
+    }
+
+    // Delimited by the connection closing
+    *reusable = 0;
+    for (;;) {
+        ssize_t n = recv(fd, buffer, READ_BUFFER_SIZE, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) return 0;
+        *bytes += n;
+    }
+}
+
+/**
+ * @brief Client thread: sends requests until told to stop.
+ */
+static void *client_thread(void *arg) {
+    ClientThread *self = (ClientThread *)arg;
+    char *buffer = malloc(READ_BUFFER_SIZE);
+    if (!buffer) return NULL;
+    char request[512];
+    int fd = -1;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+        if (fd < 0) {
+            fd = connect_proxy();
+            if (fd < 0) {
+                self->connect_errors++;
+                usleep(10000);
+                continue;
+            }
+            self->connects++;
+        }
+
+        size_t id = bench_zipf_next(&popularity, &self->seed);
+        int len = snprintf(request, sizeof(request),
+                           "GET http://%s/obj/%zu?size=%zu HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                           origin, id, object_size(id), origin, keep_alive ? "" : "Connection: close\r\n");
+
+        int counted = __atomic_load_n(&measuring, __ATOMIC_RELAXED);
+        uint64_t started = bench_now_ns();
+        int status = 0, reusable = 0;
+        uint64_t bytes = 0;
+        int rc = send_all(fd, request, len);
+        if (rc == 0) rc = read_response(fd, buffer, &status, &bytes, &reusable);
+        uint64_t elapsed = bench_now_ns() - started;
+
+        // Only requests that started and finished inside the measured window count
+        if (counted && __atomic_load_n(&measuring, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+            if (rc < 0) {
+                self->io_errors++;
+            } else {
+                if ((status < 200 || status > 299) && status != 304) self->status_errors++;
+                bench_samples_add(&self->latency, elapsed);
+                self->bytes += bytes;
+            }
+        }
+        if (rc < 0 || !reusable || !keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * @brief Prints command-line usage.
+ */
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-c conns] [-d secs] [-w secs] [-n objects] [-z s] [-s bytes] [-S bytes] [-K] [-o host:port] [proxy host:port]\n"
+        "  -c  Concurrent connections, one thread each (default: %d)\n"
+        "  -d  Seconds measured (default: %d)\n"
+        "  -w  Seconds of warm-up before measuring (default: %d)\n"
+        "  -n  Distinct objects requested (default: %d)\n"
+        "  -z  Zipf exponent of object popularity; 0 for uniform (default: %.2f)\n"
+        "  -s  Smallest object, in bytes (default: %d)\n"
+        "  -S  Largest object, in bytes (default: %d)\n"
+        "  -K  A new connection for every request instead of keep-alive\n"
+        "  -o  Origin named in the URLs (default: 127.0.0.1:9000)\n"
+        "  The proxy defaults to 127.0.0.1:8080.\n",
+        prog, DEFAULT_CONNECTIONS, DEFAULT_DURATION, DEFAULT_WARMUP, DEFAULT_OBJECTS, DEFAULT_ZIPF,
+        DEFAULT_MIN_SIZE, DEFAULT_MAX_SIZE);
+}
+
+
+// --- Main Function ---
+int main(int argc, char *argv[]) {
+    int connections = DEFAULT_CONNECTIONS;
+    int duration = DEFAULT_DURATION;
+    int warmup = DEFAULT_WARMUP;
+    long objects = DEFAULT_OBJECTS;
+    double zipf = DEFAULT_ZIPF;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:w:n:z:s:S:Ko:h")) != -1) {
+        switch (opt) {
+            case 'c': connections = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'n': objects = atol(optarg); break;
+            case 'z': zipf = atof(optarg); break;
+            case 's': min_size = strtoul(optarg, NULL, 10); break;
+            case 'S': max_size = strtoul(optarg, NULL, 10); break;
+            case 'K': keep_alive = 0; break;
+            case 'o': origin = optarg; break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (connections <= 0 || duration <= 0 || warmup < 0 || objects <= 0 || zipf < 0 || min_size == 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // host:port of the proxy
+    char proxy[256] = "127.0.0.1:8080";
+    if (optind < argc) snprintf(proxy, sizeof(proxy), "%s", argv[optind]);
+    char *colon = strrchr(proxy, ':');
+    const char *proxy_port = "8080";
+    if (colon) {
+        *colon = '\0';
+        proxy_port = colon + 1;
+    }
+    if (dns_cache_resolve(proxy, proxy_port, &proxy_addrs) < 0) {
+        fprintf(stderr, "Cannot resolve proxy %s.\n", proxy);
+        exit(EXIT_FAILURE);
+    }
+    if (bench_zipf_init(&popularity, (size_t)objects, zipf) != 0) {
+        perror("malloc for Zipf table");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ClientThread *clients = calloc(connections, sizeof(ClientThread));
+    if (!clients) {
+        perror("calloc for client threads");
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CLIENT_STACK_SIZE);
+    int started = 0;
+    for (; started < connections; started++) {
+        clients[started].seed = 0x853C49E6748FEA9Bull * (started + 1);
+        if (pthread_create(&clients[started].thread, &attr, client_thread, &clients[started]) != 0) {
+            perror("pthread_create (client)");
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    printf("Load: %d connection(s)%s, %ld object(s), Zipf %.2f, %zu-%zu bytes, via %s:%s to %s.\n",
+           started, keep_alive ? "" : " (new one per request)", objects, zipf, min_size, max_size,
+           proxy, proxy_port, origin);
+    fflush(stdout);
+
+    sleep(warmup);
+    __atomic_store_n(&measuring, 1, __ATOMIC_RELAXED);
+    uint64_t window_start = bench_now_ns();
+    sleep(duration);
+    __atomic_store_n(&measuring, 0, __ATOMIC_RELAXED);
+    double seconds = (bench_now_ns() - window_start) / 1e9;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+
+    BenchSamples all = { 0 };
+    uint64_t bytes = 0, connects = 0, connect_errors = 0, status_errors = 0, io_errors = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(clients[i].thread, NULL);
+        bytes += clients[i].bytes;
+        connects += clients[i].connects;
+        connect_errors += clients[i].connect_errors;
+        status_errors += clients[i].status_errors;
+        io_errors += clients[i].io_errors;
+        bench_samples_merge(&all, &clients[i].latency);
+    }
+
+    printf("Throughput: %.0f requests/s, %.1f MB/s over %.1f s; %llu connection(s) opened\n",
+           all.count / seconds, bytes / seconds / (1 << 20), seconds, (unsigned long long)connects);
+    printf("Errors: %llu status, %llu cut short or timed out, %llu failed connect(s)\n",
+           (unsigned long long)status_errors, (unsigned long long)io_errors,
+           (unsigned long long)connect_errors);
+    bench_samples_report(stdout, "Request latency", &all, seconds, 1000.0, "us");
+
+    bench_samples_free(&all);
+    bench_zipf_destroy(&popularity);
+    free(clients);
+    return status_errors || io_errors || connect_errors ? 1 : 0;
+}
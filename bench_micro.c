@@ -0,0 +1,325 @@
+/**
+ * @file bench_micro.c
+ * @author Shubham More
+ * @brief Microbenchmarks of the request parser and the cache.
+ *
+ * Three benchmarks, each timing every operation on its own:
+ *
+ * - parse: ParsedRequest_parse() of a typical browser request head, on a
+ *   ParsedRequest that is reset between requests, as the engines do.
+ * - cache: lookups (cache_acquire() and cache_release()) mixed with
+ *   cache_put() of Zipf-distributed objects, from 1, 2, 4, ... threads
+ *   up to -t, so contention on the shards shows as lost throughput.
+ * - evict: cache_put() of objects never seen before into a full cache,
+ *   with admission filtering off so that every insertion evicts.
+ *
+ * The cache is built with the same layout and policies as the proxy's
+ * (-S, -P, -A). Reported latencies include the cost of reading the clock,
+ * some 20 ns.
+ *
+ * Usage: bench_micro [-b parse|cache|evict] [-n ops] [-t threads] [-k keys]
+ *                    [-z s] [-r percent] [-o bytes] [-m megabytes] [-S shards]
+ *                    [-P lru|clock|gdsf] [-A tinylfu|all]
+ */
+
+#define _GNU_SOURCE
+#include "proxy_parse.h"
+#include "cache.h"
+#include "bench_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+// --- Constants ---
+#define DEFAULT_OPS 1000000          // Operations per benchmark (per thread for cache)
+#define DEFAULT_THREADS 8            // Most threads the cache benchmark runs with
+#define DEFAULT_KEYS 100000          // Distinct objects the cache benchmark uses
+#define DEFAULT_ZIPF 0.99
+#define DEFAULT_READ_PERCENT 90      // Share of cache operations that are lookups
+#define DEFAULT_OBJECT_SIZE 4096
+#define DEFAULT_CACHE_MB 256
+#define DEFAULT_SHARDS 16
+#define URL_SIZE 64
+
+// --- Structs ---
+
+// One thread of a cache benchmark
+typedef struct {
+    pthread_t thread;
+    uint64_t seed;
+    long ops;
+    int evict;                  // Put only new objects instead of the read/put mix
+    long first_key;             // Start of this thread's new objects, for evict
+    BenchSamples get_latency;
+    BenchSamples put_latency;
+    long hits;
+} CacheWorker;
+
+// --- Global State ---
+static const char parse_request[] =
+    "GET http://www.example.com/articles/2024/05/a-fairly-typical-page.html?ref=home&utm_source=feed HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:126.0) Gecko/20100101 Firefox/126.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=4f9a1c2e7b3d8a6f0e5c; theme=dark; consent=1\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+static char (*urls)[URL_SIZE];       // Cache keys of the objects
+static long num_keys = DEFAULT_KEYS;
+static BenchZipf popularity;
+static int read_percent = DEFAULT_READ_PERCENT;
+static size_t object_size = DEFAULT_OBJECT_SIZE;
+static char *object;                 // Body stored for every object
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Times ParsedRequest_parse() on a reused ParsedRequest.
+ */
+static int bench_parse(long ops) {
+    struct ParsedRequest *req = ParsedRequest_create();
+    BenchSamples samples = { 0 };
+    if (!req) return -1;
+
+    uint64_t started = bench_now_ns();
+    for (long i = 0; i < ops; i++) {
+        uint64_t t0 = bench_now_ns();
+        ParsedRequest_reset(req);
+        int rc = ParsedRequest_parse(req, parse_request, sizeof(parse_request) - 1);
+        bench_samples_add(&samples, bench_now_ns() - t0);
+        if (rc != 0) {
+            fprintf(stderr, "Parse failed.\n");
+            ParsedRequest_destroy(req);
+            bench_samples_free(&samples);
+            return -1;
+        }
+    }
+    double seconds = (bench_now_ns() - started) / 1e9;
+
+    char name[64];
+    snprintf(name, sizeof(name), "parse (%zu bytes)", sizeof(parse_request) - 1);
+    bench_samples_report(stdout, name, &samples, seconds, 1.0, "ns");
+    bench_samples_free(&samples);
+    ParsedRequest_destroy(req);
+    return 0;
+}
+
+/**
+ * @brief Formats the key of object number id.
+ */
+static void format_url(char *url, long id) {
+    snprintf(url, URL_SIZE, "http://bench.example/obj/%ld", id);
+}
+
+/**
+ * @brief Cache benchmark thread: the read/put mix, or puts of new objects.
+ */
+static void *cache_worker(void *arg) {
+    CacheWorker *self = (CacheWorker *)arg;
+    time_t fresh_until = time(NULL) + 3600;
+    char url[URL_SIZE];
+    for (long i = 0; i < self->ops; i++) {
+        if (self->evict) {
+            format_url(url, self->first_key + i);
+            uint64_t t0 = bench_now_ns();
+            cache_put(url, object, object_size, 10, fresh_until);
+            bench_samples_add(&self->put_latency, bench_now_ns() - t0);
+            continue;
+        }
+
+        const char *key = urls[bench_zipf_next(&popularity, &self->seed)];
+        if ((long)(bench_rand(&self->seed) % 100) < read_percent) {
+            uint64_t t0 = bench_now_ns();
+            CacheEntry *entry = cache_acquire(key);
+            cache_release(entry);
+            bench_samples_add(&self->get_latency, bench_now_ns() - t0);
+            if (entry) self->hits++;
+        } else {
+            uint64_t t0 = bench_now_ns();
+            cache_put(key, object, object_size, 10, fresh_until);
+            bench_samples_add(&self->put_latency, bench_now_ns() - t0);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs one round of cache workers and reports their latencies.
+ */
+static int run_cache_round(const char *label, int threads, long ops, int evict) {
+    CacheWorker *workers = calloc(threads, sizeof(CacheWorker));
+    if (!workers) return -1;
+
+    uint64_t started = bench_now_ns();
+    int running = 0;
+    for (; running < threads; running++) {
+        CacheWorker *w = &workers[running];
+        w->seed = 0x9E3779B97F4A7C15ull * (running + 1);
+        w->ops = ops;
+        w->evict = evict;
+        w->first_key = num_keys + (long)running * ops;
+        if (pthread_create(&w->thread, NULL, cache_worker, w) != 0) {
+            perror("pthread_create (cache worker)");
+            break;
+        }
+    }
+    BenchSamples gets = { 0 }, puts = { 0 };
+    long hits = 0;
+    for (int i = 0; i < running; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hits += workers[i].hits;
+        bench_samples_merge(&gets, &workers[i].get_latency);
+        bench_samples_merge(&puts, &workers[i].put_latency);
+    }
+    double seconds = (bench_now_ns() - started) / 1e9;
+
+    char name[64];
+    if (gets.count) {
+        snprintf(name, sizeof(name), "%s get x%d", label, running);
+        bench_samples_report(stdout, name, &gets, seconds, 1.0, "ns");
+        printf("%-24s %10.1f%% hits\n", "", 100.0 * hits / gets.count);
+    }
+    snprintf(name, sizeof(name), "%s put x%d", label, running);
+    bench_samples_report(stdout, name, &puts, seconds, 1.0, "ns");
+    bench_samples_free(&gets);
+    bench_samples_free(&puts);
+    free(workers);
+    return running == threads ? 0 : -1;
+}
+
+/**
+ * @brief Fills the cache with every object once, most popular last.
+ */
+static void populate_cache() {
+    time_t fresh_until = time(NULL) + 3600;
+    for (long i = num_keys - 1; i >= 0; i--) cache_put(urls[i], object, object_size, 10, fresh_until);
+}
+
+/**
+ * @brief Prints command-line usage.
+ */
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-b parse|cache|evict] [-n ops] [-t threads] [-k keys] [-z s] [-r percent] [-o bytes] [-m megabytes] [-S shards] [-P lru|clock|gdsf] [-A tinylfu|all]\n"
+        "  -b  Run only this benchmark (default: all three)\n"
+        "  -n  Operations per benchmark, per thread for cache (default: %d)\n"
+        "  -t  Most threads for the cache benchmark, doubling from 1 (default: %d)\n"
+        "  -k  Distinct objects for the cache benchmark (default: %d)\n"
+        "  -z  Zipf exponent of object popularity (default: %.2f)\n"
+        "  -r  Percentage of cache operations that are lookups (default: %d)\n"
+        "  -o  Object size in bytes (default: %d)\n"
+        "  -m  Cache size in megabytes (default: %d)\n"
+        "  -S  Cache shards (default: %d)\n"
+        "  -P  Eviction policy (default: lru)\n"
+        "  -A  Admission policy (default: tinylfu)\n",
+        prog, DEFAULT_OPS, DEFAULT_THREADS, DEFAULT_KEYS, DEFAULT_ZIPF, DEFAULT_READ_PERCENT,
+        DEFAULT_OBJECT_SIZE, DEFAULT_CACHE_MB, DEFAULT_SHARDS);
+}
+
+
+// --- Main Function ---
+int main(int argc, char *argv[]) {
+    const char *only = NULL;
+    long ops = DEFAULT_OPS;
+    int max_threads = DEFAULT_THREADS;
+    double zipf = DEFAULT_ZIPF;
+    long cache_mb = DEFAULT_CACHE_MB;
+    cache_config_t config = { 0, 0, DEFAULT_SHARDS, CACHE_POLICY_LRU, CACHE_ADMIT_TINYLFU,
+                              CACHE_OBJECTIVE_OBJECTS, NULL };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:t:k:z:r:o:m:S:P:A:h")) != -1) {
+        switch (opt) {
+            case 'b': only = optarg; break;
+            case 'n': ops = atol(optarg); break;
+            case 't': max_threads = atoi(optarg); break;
+            case 'k': num_keys = atol(optarg); break;
+            case 'z': zipf = atof(optarg); break;
+            case 'r': read_percent = atoi(optarg); break;
+            case 'o': object_size = strtoul(optarg, NULL, 10); break;
+            case 'm': cache_mb = atol(optarg); break;
+            case 'S': config.num_shards = atoi(optarg); break;
+            case 'P':
+                if (strcmp(optarg, "lru") == 0) config.policy = CACHE_POLICY_LRU;
+                else if (strcmp(optarg, "clock") == 0) config.policy = CACHE_POLICY_CLOCK;
+                else if (strcmp(optarg, "gdsf") == 0) config.policy = CACHE_POLICY_GDSF;
+                else {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'A':
+                if (strcmp(optarg, "tinylfu") == 0) config.admission = CACHE_ADMIT_TINYLFU;
+                else if (strcmp(optarg, "all") == 0) config.admission = CACHE_ADMIT_ALL;
+                else {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (ops <= 0 || max_threads <= 0 || num_keys <= 0 || cache_mb <= 0 || object_size == 0 ||
+        read_percent < 0 || read_percent > 100 || config.num_shards <= 0 ||
+        (only && strcmp(only, "parse") != 0 && strcmp(only, "cache") != 0 && strcmp(only, "evict") != 0)) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    config.max_size = (size_t)cache_mb << 20;
+    config.max_element_size = object_size;
+
+    if (!only || strcmp(only, "parse") == 0) {
+        if (bench_parse(ops) != 0) exit(EXIT_FAILURE);
+    }
+    if (only && strcmp(only, "parse") == 0) return 0;
+
+    object = malloc(object_size);
+    urls = malloc(num_keys * sizeof(*urls));
+    if (!object || !urls || bench_zipf_init(&popularity, num_keys, zipf) != 0) {
+        perror("malloc for cache benchmark");
+        exit(EXIT_FAILURE);
+    }
+    memset(object, 'x', object_size);
+    for (long i = 0; i < num_keys; i++) format_url(urls[i], i);
+
+    if (!only || strcmp(only, "cache") == 0) {
+        if (cache_init(&config) != 0) exit(EXIT_FAILURE);
+        populate_cache();
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            if (run_cache_round("cache", threads, ops, 0) != 0) exit(EXIT_FAILURE);
+            if (threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+        }
+        cache_destroy();
+    }
+
+    if (!only || strcmp(only, "evict") == 0) {
+        // Every put is a new object into a full cache, and is let in
+        cache_config_t evict_config = config;
+        evict_config.admission = CACHE_ADMIT_ALL;
+        if (cache_init(&evict_config) != 0) exit(EXIT_FAILURE);
+        populate_cache();
+        if (run_cache_round("evict", 1, ops, 1) != 0) exit(EXIT_FAILURE);
+        if (max_threads > 1 && run_cache_round("evict", max_threads, ops / max_threads, 1) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        cache_destroy();
+    }
+
+    bench_zipf_destroy(&popularity);
+    free(urls);
+    free(object);
+    return 0;
+}
@@ -0,0 +1,275 @@
+/**
+ * @file bench_origin.c
+ * @author Shubham More
+ * @brief A mock origin server for benchmarking the proxy.
+ *
+ * Answers every GET or HEAD with a body of the size the URL asks for
+ * (`size=N` anywhere in it, 1024 bytes otherwise), after a configurable
+ * delay that stands in for a distant or slow origin. Responses carry a
+ * Content-Length and a max-age, so the proxy can keep connections to it
+ * alive and cache what it sends.
+ *
+ * Each connection gets a thread of its own, on a small stack, since the
+ * origin spends most of its time in the simulated delay rather than in
+ * I/O. Bodies are sent from one shared read-only buffer.
+ *
+ * Usage: bench_origin [-l ms] [-j ms] [-m secs] [-S bytes] [port]
+ */
+
+#define _GNU_SOURCE
+#include "socket_util.h"
+#include "bench_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+// --- Constants ---
+#define DEFAULT_PORT 9000
+#define DEFAULT_SIZE 1024              // Body size when the URL names none
+#define DEFAULT_MAX_SIZE (16 << 20)    // Largest body served
+#define DEFAULT_MAX_AGE 3600           // Seconds responses may be cached
+#define REQUEST_BUFFER_SIZE 16384      // Longest request head accepted
+#define ORIGIN_STACK_SIZE (128 * 1024)
+#define ORIGIN_BACKLOG 4096
+
+// --- Global State ---
+static int latency_us = 0;             // Delay before each response
+static int jitter_us = 0;              // Up to this much more, uniformly
+static int max_age = DEFAULT_MAX_AGE;  // 0 marks responses no-store
+static size_t max_size = DEFAULT_MAX_SIZE;
+static char *body;                     // max_size bytes shared by every response
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Sends a whole buffer.
+ * @return 0 on success, -1 on failure.
+ */
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sleeps for the configured latency plus jitter.
+ */
+static void simulate_latency(uint64_t *rng) {
+    long delay = latency_us;
+    if (jitter_us > 0) delay += (long)(bench_rand(rng) % (uint64_t)(jitter_us + 1));
+    if (delay <= 0) return;
+    struct timespec ts = { delay / 1000000, (delay % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * @brief Finds a header's value in a request head, case-insensitively.
+ * @return The value's first byte, or NULL if the header is absent.
+ */
+static const char *find_header(const char *head, const char *name) {
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t') value++;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Answers one request head.
+ * @return Non-zero if the connection stays open for another request.
+ */
+static int answer(int fd, char *head, uint64_t *rng) {
+    char *line_end = strstr(head, "\r\n");
+    if (line_end) *line_end = '\0';
+    char method[16], target[8192], version[16];
+    int fields = sscanf(head, "%15s %8191s %15s", method, target, version);
+    if (line_end) *line_end = '\r';
+    if (fields != 3) {
+        static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, bad, sizeof(bad) - 1);
+        return 0;
+    }
+
+    int keep_alive = strcmp(version, "HTTP/1.1") == 0;
+    const char *connection = find_header(head, "Connection");
+    if (connection) {
+        if (strncasecmp(connection, "close", 5) == 0) keep_alive = 0;
+        else if (strncasecmp(connection, "keep-alive", 10) == 0) keep_alive = 1;
+    }
+
+    size_t size = DEFAULT_SIZE;
+    const char *size_param = strstr(target, "size=");
+    if (size_param) size = strtoul(size_param + 5, NULL, 10);
+    if (size > max_size) size = max_size;
+
+    simulate_latency(rng);
+
+    char response_head[256];
+    int len;
+    if (max_age > 0) {
+        len = snprintf(response_head, sizeof(response_head),
+                       "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n"
+                       "Cache-Control: public, max-age=%d\r\n%s\r\n",
+                       size, max_age, keep_alive ? "" : "Connection: close\r\n");
+    } else {
+        len = snprintf(response_head, sizeof(response_head),
+                       "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n"
+                       "Cache-Control: no-store\r\n%s\r\n",
+                       size, keep_alive ? "" : "Connection: close\r\n");
+    }
+    if (send_all(fd, response_head, len) < 0) return 0;
+    if (strcmp(method, "HEAD") != 0 && send_all(fd, body, size) < 0) return 0;
+    return keep_alive;
+}
+
+/**
+ * @brief Serves one connection until it closes; a request body, if any,
+ * is skipped.
+ */
+static void *connection_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    uint64_t rng = bench_now_ns() | 1;
+    char *buffer = malloc(REQUEST_BUFFER_SIZE + 1);
+    size_t len = 0;
+    size_t skip = 0; // Body bytes still to be discarded
+    int open = buffer != NULL;
+
+    while (open) {
+        char *end = NULL;
+        if (skip == 0) {
+            buffer[len] = '\0';
+            end = strstr(buffer, "\r\n\r\n");
+        }
+        if (!end) {
+            if (len == REQUEST_BUFFER_SIZE) break;
+            ssize_t n = recv(fd, buffer + len, REQUEST_BUFFER_SIZE - len, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            size_t dropped = (size_t)n < skip ? (size_t)n : skip;
+            skip -= dropped;
+            memmove(buffer + len, buffer + len + dropped, n - dropped);
+            len += n - dropped;
+            continue;
+        }
+
+        size_t head_len = end + 4 - buffer;
+        end[2] = '\0'; // The head, with its last header line ended
+        const char *content_length = find_header(buffer, "Content-Length");
+        size_t body_len = content_length ? strtoul(content_length, NULL, 10) : 0;
+        open = answer(fd, buffer, &rng);
+
+        len -= head_len;
+        memmove(buffer, buffer + head_len, len);
+        size_t buffered = body_len < len ? body_len : len;
+        len -= buffered;
+        memmove(buffer, buffer + buffered, len);
+        skip = body_len - buffered;
+    }
+    free(buffer);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Prints command-line usage.
+ */
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-l ms] [-j ms] [-m secs] [-S bytes] [port]\n"
+        "  -l  Milliseconds before each response is sent, fractions allowed (default: 0)\n"
+        "  -j  Up to this many more milliseconds, uniformly at random (default: 0)\n"
+        "  -m  max-age of responses; 0 marks them no-store (default: %d)\n"
+        "  -S  Largest body served, in bytes (default: %d)\n"
+        "  port defaults to %d. Bodies are size=N bytes if the URL says so, %d otherwise.\n",
+        prog, DEFAULT_MAX_AGE, DEFAULT_MAX_SIZE, DEFAULT_PORT, DEFAULT_SIZE);
+}
+
+
+// --- Main Function ---
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "l:j:m:S:h")) != -1) {
+        switch (opt) {
+            case 'l':
+                latency_us = (int)(atof(optarg) * 1000);
+                break;
+            case 'j':
+                jitter_us = (int)(atof(optarg) * 1000);
+                break;
+            case 'm':
+                max_age = atoi(optarg);
+                break;
+            case 'S':
+                max_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    int port = optind < argc ? atoi(argv[optind]) : DEFAULT_PORT;
+    if (port <= 0 || port > 65535 || latency_us < 0 || jitter_us < 0 || max_age < 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    body = malloc(max_size ? max_size : 1);
+    if (!body) {
+        perror("malloc for response body");
+        exit(EXIT_FAILURE);
+    }
+    memset(body, 'x', max_size);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket_listen_tcp(port, ORIGIN_BACKLOG, 0);
+    if (listen_fd < 0) exit(EXIT_FAILURE);
+    printf("Mock origin listening on port %d: latency %.1f ms + up to %.1f ms, max-age %d.\n",
+           port, latency_us / 1000.0, jitter_us / 1000.0, max_age);
+    fflush(stdout);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, ORIGIN_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) perror("accept");
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, connection_thread, (void *)(intptr_t)fd) != 0) {
+            perror("pthread_create (connection)");
+            close(fd);
+        }
+    }
+    return 0;
+}
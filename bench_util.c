@@ -0,0 +1,166 @@
+/**
+ * @file bench_util.c
+ * @author Shubham More
+ * @brief Implementation of the benchmark helpers.
+ *
+ * Zipf ranks are drawn by a binary search of the cumulative distribution,
+ * which costs a few dozen comparisons even for millions of keys and keeps
+ * the draw exact for any exponent.
+ */
+
+#include "bench_util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Orders samples for qsort().
+ */
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief The sample at a percentile of a sorted set (nearest rank).
+ */
+static uint64_t percentile(const BenchSamples *samples, double p) {
+    size_t rank = (size_t)ceil(p / 100.0 * samples->count);
+    if (rank == 0) rank = 1;
+    return samples->values[rank - 1];
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Nanoseconds on the monotonic clock.
+ */
+uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Next value of a xorshift64* generator.
+ */
+uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+ * @brief A uniform double in [0, 1).
+ */
+double bench_rand_unit(uint64_t *state) {
+    return (bench_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Builds the cumulative distribution of a Zipf law.
+ */
+int bench_zipf_init(BenchZipf *zipf, size_t n, double s) {
+    zipf->n = n;
+    zipf->cdf = malloc(n * sizeof(double));
+    if (!zipf->cdf) return -1;
+    double total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += 1.0 / pow((double)(i + 1), s);
+        zipf->cdf[i] = total;
+    }
+    for (size_t i = 0; i < n; i++) zipf->cdf[i] /= total;
+    zipf->cdf[n - 1] = 1.0;
+    return 0;
+}
+
+/**
+ * @brief Draws a rank, most popular first.
+ */
+size_t bench_zipf_next(const BenchZipf *zipf, uint64_t *state) {
+    double u = bench_rand_unit(state);
+    size_t lo = 0, hi = zipf->n - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (zipf->cdf[mid] > u) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+/**
+ * @brief Frees a Zipf table.
+ */
+void bench_zipf_destroy(BenchZipf *zipf) {
+    free(zipf->cdf);
+    zipf->cdf = NULL;
+    zipf->n = 0;
+}
+
+/**
+ * @brief Records one sample.
+ */
+int bench_samples_add(BenchSamples *samples, uint64_t value) {
+    if (samples->count == samples->cap) {
+        size_t cap = samples->cap ? samples->cap * 2 : 4096;
+        uint64_t *grown = realloc(samples->values, cap * sizeof(uint64_t));
+        if (!grown) return -1;
+        samples->values = grown;
+        samples->cap = cap;
+    }
+    samples->values[samples->count++] = value;
+    return 0;
+}
+
+/**
+ * @brief Moves every sample of one set into another.
+ */
+int bench_samples_merge(BenchSamples *into, BenchSamples *from) {
+    if (into->count + from->count > into->cap) {
+        size_t cap = into->count + from->count;
+        uint64_t *grown = realloc(into->values, cap * sizeof(uint64_t));
+        if (!grown) return -1;
+        into->values = grown;
+        into->cap = cap;
+    }
+    if (from->count) memcpy(into->values + into->count, from->values, from->count * sizeof(uint64_t));
+    into->count += from->count;
+    bench_samples_free(from);
+    return 0;
+}
+
+/**
+ * @brief Frees a sample set.
+ */
+void bench_samples_free(BenchSamples *samples) {
+    free(samples->values);
+    samples->values = NULL;
+    samples->count = samples->cap = 0;
+}
+
+/**
+ * @brief Sorts the samples and prints their count, rate and percentiles.
+ */
+void bench_samples_report(FILE *out, const char *name, BenchSamples *samples, double seconds,
+                          double divisor, const char *unit) {
+    if (samples->count == 0) {
+        fprintf(out, "%-24s no samples\n", name);
+        return;
+    }
+    qsort(samples->values, samples->count, sizeof(uint64_t), compare_samples);
+    double sum = 0;
+    for (size_t i = 0; i < samples->count; i++) sum += samples->values[i];
+
+    fprintf(out, "%-24s %10zu ops %12.0f ops/s   %s: mean %.2f p50 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+            name, samples->count, seconds > 0 ? samples->count / seconds : 0, unit,
+            sum / samples->count / divisor, percentile(samples, 50) / divisor,
+            percentile(samples, 99) / divisor, percentile(samples, 99.9) / divisor,
+            samples->values[samples->count - 1] / divisor);
+}
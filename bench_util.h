@@ -0,0 +1,106 @@
+/**
+ * @file bench_util.h
+ * @author Shubham More
+ * @brief Helpers shared by the benchmark programs: clocks, a fast random
+ * generator, Zipf-distributed keys and latency percentiles.
+ *
+ * Latencies are kept as raw samples, one per operation, and sorted when
+ * reported, so percentiles are exact rather than bucketed. Each benchmark
+ * thread fills its own sample set and the sets are merged at the end.
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @struct BenchSamples
+ * @brief A growable set of latency samples.
+ */
+typedef struct {
+    uint64_t *values;
+    size_t count;
+    size_t cap;
+} BenchSamples;
+
+/**
+ * @struct BenchZipf
+ * @brief Ranks 0..n-1 drawn with probability proportional to 1 / (rank + 1)^s.
+ */
+typedef struct {
+    double *cdf;    // Cumulative probability up to and including each rank
+    size_t n;
+} BenchZipf;
+
+/**
+ * @brief Nanoseconds on the monotonic clock.
+ */
+uint64_t bench_now_ns();
+
+/**
+ * @brief Next value of a xorshift64* generator.
+ * @param state The generator's state; any value but 0 to start.
+ */
+uint64_t bench_rand(uint64_t *state);
+
+/**
+ * @brief A uniform double in [0, 1).
+ * @param state The generator's state.
+ */
+double bench_rand_unit(uint64_t *state);
+
+/**
+ * @brief Builds the cumulative distribution of a Zipf law.
+ * @param zipf The table to fill.
+ * @param n Number of ranks.
+ * @param s The exponent; 0 makes every rank equally likely.
+ * @return 0 on success, -1 on failure.
+ */
+int bench_zipf_init(BenchZipf *zipf, size_t n, double s);
+
+/**
+ * @brief Draws a rank, most popular first.
+ * @param zipf The distribution.
+ * @param state The generator's state.
+ */
+size_t bench_zipf_next(const BenchZipf *zipf, uint64_t *state);
+
+/**
+ * @brief Frees a Zipf table.
+ */
+void bench_zipf_destroy(BenchZipf *zipf);
+
+/**
+ * @brief Records one sample.
+ * @return 0 on success, -1 if no memory could be had (the sample is lost).
+ */
+int bench_samples_add(BenchSamples *samples, uint64_t value);
+
+/**
+ * @brief Moves every sample of one set into another.
+ * @return 0 on success, -1 on failure (the source is left as it was).
+ */
+int bench_samples_merge(BenchSamples *into, BenchSamples *from);
+
+/**
+ * @brief Frees a sample set.
+ */
+void bench_samples_free(BenchSamples *samples);
+
+/**
+ * @brief Sorts the samples and prints their count, rate and percentiles.
+ * @param out The stream to print to.
+ * @param name What was measured.
+ * @param samples The samples; sorted in place.
+ * @param seconds The time they were collected over, for the rate.
+ * @param divisor What a sample is divided by for printing (1000 prints
+ * nanosecond samples in microseconds).
+ * @param unit Name of the printed unit.
+ */
+void bench_samples_report(FILE *out, const char *name, BenchSamples *samples, double seconds,
+                          double divisor, const char *unit);
+
+#endif
@@ -5,123 +5,1191 @@
  *
  * This file contains the logic for the LRU cache. It uses a hash table
  * for O(1) average time complexity lookups and a doubly-linked list to
- * manage the LRU order. Thread safety is ensured using POSIX read-write locks.
+ * manage the LRU order.
+ *
+ * The cache is split into a power-of-two number of shards selected by URL
+ * hash. Every shard is an independent LRU cache with its own hash table,
+ * list, size budget (an equal share of the total) and mutex, so threads
+ * working on different URLs rarely touch the same lock or cache line.
+ *
+ * Entries are immutable once inserted and reference counted: the cache owns
+ * one reference while an entry is linked, and every cache_acquire() adds
+ * another. Eviction or replacement only unlinks an entry and drops the
+ * cache's reference, so a response that is still being sent stays valid
+ * until its last holder calls cache_release().
+ *
+ * Three eviction policies are available. Strict LRU moves an entry to the
+ * head of its shard's list on every hit, so lookups take the shard lock.
+ * CLOCK keeps the entries of a shard on a ring swept by a hand: a hit only
+ * sets the entry's reference bit, and the hand clears bits and evicts the
+ * first entry found unreferenced. CLOCK lookups take no lock at all;
+ * entries are published with release stores, and entry headers and
+ * replaced index tables are freed through epoch-based reclamation, so a
+ * reader probing the index never touches freed memory. GDSF (Greedy Dual
+ * Size Frequency) keeps each shard's entries in a min-heap on a priority
+ * of L + hits * cost / size, where L is the priority of the last eviction
+ * and cost depends on the objective: 1 to maximize object hits, the size
+ * to maximize byte hits, or the origin fetch time to save the most
+ * latency. Large, rarely hit objects therefore go first, and L rising with
+ * every eviction ages out entries that were popular long ago. Hits update
+ * the heap, so GDSF lookups take the shard lock like LRU.
+ *
+ * Each shard indexes its entries with an open-addressing table probed
+ * linearly. A slot holds the entry's 64-bit hash next to the entry pointer,
+ * so a probe only dereferences an entry whose full hash matches, and the
+ * URL itself is stored once, in the entry. Removal leaves a tombstone, which
+ * keeps probe runs intact for readers that are walking them without a lock.
+ * When a table passes 3/4 occupancy a replacement sized for the live count
+ * is allocated and entries are migrated a few slots per insert; until the
+ * old table is drained lookups check both. Unlike Robin Hood or cuckoo
+ * schemes this never moves an entry that a lock-free reader might be about
+ * to find, which is what keeps CLOCK lookups lock-free.
+ *
+ * Entry headers (with the URL inline) and contents are carved from the slab
+ * allocator (slab.h) instead of the heap, and each shard charges an entry
+ * the chunk sizes it really occupies. Contents are a chain of segments:
+ * one of the exact size when the object's length is known up front, else
+ * segments doubling from 16 KiB, so an entry grows by linking memory, never
+ * by copying it. Only the filler writes, and it publishes each extension
+ * of the size with a release store after the bytes (and any new segment)
+ * are in place, so readers walk the chain up to the size they loaded
+ * without a lock. The allocator itself is capped at the
+ * configured total, so when page-level fragmentation would take the cache
+ * past it, allocation fails and the shard evicts until memory comes free.
+ *
+ * With TinyLFU admission (W-TinyLFU), every lookup is recorded in a
+ * per-shard frequency sketch, and new entries first land in a small window
+ * LRU holding 1% of the shard. Entries pushed out of the window only
+ * enter the main area if the sketch rates them more popular than each
+ * entry they would displace there; otherwise the newcomer is dropped. A
+ * scan of one-off URLs therefore churns the window, not the working set.
+ *
+ * A snapshot is a header, a table of one section per shard, and the
+ * sections: each entry as a fixed record (sizes, freshness, and its
+ * standing under the policy and the sketch) followed by the URL and the
+ * contents. A section lists its shard's main area next victim first, then
+ * its window. Restoring maps the file and lets a few loader threads take
+ * sections in turn; as entries are inserted in saved order they rebuild
+ * each list, ring or heap as it was (order across sections is only
+ * approximate, since entries are rehashed into new shards). Restored
+ * entries skip the admission filter unless they were still in the window.
  */
 
 #include "cache.h"
+#include "epoch.h"
+#include "slab.h"
+#include "sketch.h"
+#include "metrics.h"
+#include "logger.h"
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define HASH_TABLE_SIZE 1024 // Power of 2 for efficient modulo
+#define INITIAL_TABLE_SLOTS 64 // Slots per shard at startup; power of 2 for efficient modulo
+#define MIGRATE_STEP 64        // Old-table slots moved per insert while resizing
+#define MAX_CACHE_SHARDS 1024
+#define MAX_ALLOC_RETRIES 8    // Evictions tried when the slab limit is reached
+#define RESIZE_BATCH 64        // Evictions per shard lock hold while shrinking
+#define CACHE_LINE_SIZE 64
+#define WINDOW_PERCENT 1       // Share of a shard given to the admission window
+#define SKETCH_BYTES_PER_KEY 1024 // Shard bytes per frequency sketch column
+#define FIRST_SEGMENT_SIZE (16 * 1024) // First segment of a fill of unknown length; fits any head
+#define MAX_SEGMENT_SIZE (256 * 1024)  // Segments stop doubling here
+#define SNAPSHOT_MAGIC 0x50414e53u     // "SNAP"
+#define SNAPSHOT_RECORD_MAGIC 0x59544e45u // "ENTY"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 8               // Records start on multiples of this
+#define SNAPSHOT_BUFFER_SIZE (1024 * 1024) // Write buffer while saving
+#define MAX_SNAPSHOT_LOADERS 8         // Threads restoring a snapshot
 
-// A node in the doubly-linked list (for LRU tracking)
-typedef struct CacheNode {
-    char *url;
-    char *data;
-    int size;
-    struct CacheNode *prev;
-    struct CacheNode *next;
-} CacheNode;
+// A piece of an entry's contents; every segment but the last is full
+typedef struct Segment {
+    struct Segment *next;
+    size_t capacity;
+    char data[];
+} Segment;
 
-// An entry in the hash table
-typedef struct HashEntry {
-    char *url;
-    CacheNode *node;
-    struct HashEntry *next; // For handling hash collisions
-} HashEntry;
+// A node in the doubly-linked list (LRU order, window order, or the CLOCK ring)
+struct CacheEntry {
+    Segment *segments;  // Contents, in order
+    Segment *tail;      // Segment being filled (filler only)
+    size_t tail_used;   // Bytes written to it (filler only)
+    size_t size;        // Bytes of contents so far (atomic)
+    unsigned char state;      // cache_fill_state_t (atomic)
+    CacheWaiter *waiters;     // Readers waiting for it to grow; under the shard lock (atomic)
+    size_t url_len;
+    size_t charge;      // Slab bytes held by the header and contents
+    int refcount;       // The cache's reference plus one per acquire (atomic)
+    uint64_t hash_val;
+    unsigned char referenced; // CLOCK reference bit, set by hits (atomic)
+    unsigned char in_window;  // Still in the admission window, not the main area
+    unsigned int hits;        // Lookups served since insertion (GDSF)
+    unsigned int fetch_ms;    // Time the origin took to produce the response
+    time_t fresh_until;       // When the response goes stale (atomic)
+    double priority;          // GDSF priority
+    size_t heap_index;        // Position in the shard's GDSF heap
+    struct CacheEntry *prev;
+    struct CacheEntry *next;
+    char url[];         // Stored once, with the header
+};
 
-// --- Global Cache State ---
-static size_t MAX_CACHE_SIZE;
-static size_t MAX_ELEMENT_SIZE;
-static size_t current_cache_size = 0;
+// A slot in the open-addressing index
+typedef struct {
+    uint64_t hash;      // Hash of the entry's URL, checked before touching it
+    CacheEntry *node;   // NULL if never used, TOMBSTONE once removed (atomic)
+} HashSlot;
+
+// An open-addressing index; slots[] has mask + 1 elements
+typedef struct {
+    size_t mask;
+    size_t used;        // Slots that are not empty (live entries and tombstones)
+    HashSlot slots[];
+} HashTable;
+
+// Marks a slot whose entry was removed; probes continue past it
+#define TOMBSTONE ((CacheEntry *)&tombstone_marker)
+static char tombstone_marker;
+
+// A doubly-linked list of entries, most recently used first
+typedef struct {
+    CacheEntry *head;
+    CacheEntry *tail;
+} EntryList;
+
+// One independently locked slice of the cache
+typedef struct {
+    pthread_mutex_t lock;
+    size_t max_size;            // This shard's share of the total budget
+    size_t current_size;
+    HashTable *table;           // Receives all inserts (atomic)
+    HashTable *old_table;       // Being drained into table while resizing (atomic)
+    size_t migrate_pos;         // Next old_table slot to move
+    EntryList lru;              // Main area; the tail is the next victim (LRU)
+    CacheEntry *clock_hand;     // Next entry the hand examines (CLOCK)
+    size_t count;               // Entries in the main area
+    CacheEntry **heap;          // Main area as a min-heap on priority (GDSF)
+    size_t heap_capacity;
+    double inflation;           // Priority of the last eviction (GDSF)
+    FrequencySketch *sketch;    // Recent lookups per URL; NULL without admission
+    EntryList window;           // New entries awaiting admission
+    size_t window_size;
+    size_t window_max;
+    size_t window_count;
+} __attribute__((aligned(CACHE_LINE_SIZE))) CacheShard;
+
+// State shared by cache_entry_await() and its callback
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+} WaitState;
+
+// Start of a snapshot file; a table of sections follows
+typedef struct {
+    uint32_t magic;       // SNAPSHOT_MAGIC, written last, once the rest is complete
+    uint32_t version;
+    uint32_t record_size; // sizeof(SnapshotRecord), as a layout check
+    uint32_t sections;    // One per shard of the cache that wrote it
+    uint64_t entries;
+    uint64_t bytes;       // Contents only, without records and URLs
+} SnapshotHeader;
+
+// The records of one shard, next victim first
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t entries;
+} SnapshotSection;
 
-// The main cache data structures
-static HashEntry *hash_table[HASH_TABLE_SIZE];
-static CacheNode *lru_head = NULL;
-static CacheNode *lru_tail = NULL;
+// A saved entry; the URL and contents follow, padded to SNAPSHOT_ALIGN
+typedef struct {
+    uint32_t magic;       // SNAPSHOT_RECORD_MAGIC
+    uint32_t url_len;
+    uint64_t size;
+    int64_t fresh_until;
+    double credit;        // GDSF priority above the shard's inflation
+    uint32_t fetch_ms;
+    uint32_t hits;        // GDSF hits
+    uint8_t freq;         // Frequency sketch estimate
+    uint8_t referenced;   // CLOCK reference bit
+    uint8_t in_window;
+    uint8_t pad[5];
+} SnapshotRecord;
 
-// Synchronization primitive
-static pthread_rwlock_t cache_lock;
+// An entry held while it is written to a snapshot
+typedef struct {
+    CacheEntry *node;
+    SnapshotRecord record;
+} SavedEntry;
+
+// A snapshot being restored in the background
+typedef struct {
+    const unsigned char *map;   // The whole file, until the last loader unmaps it
+    size_t map_size;
+    const SnapshotSection *sections;
+    uint32_t section_count;
+    uint32_t next_section;      // Next section for a loader to take (atomic)
+    pthread_t loaders[MAX_SNAPSHOT_LOADERS];
+    int num_loaders;            // Threads started, to be joined
+    int running;                // Threads still loading (atomic)
+    int stop;                   // Set to make them quit early (atomic)
+    size_t entries;             // Entries restored so far (atomic)
+    size_t bytes;               // Their contents (atomic)
+    struct timespec started;
+} SnapshotRestore;
+
+// --- Global Cache State ---
+static size_t MAX_ELEMENT_SIZE;      // (atomic)
+static cache_policy_t policy = CACHE_POLICY_LRU;
+static cache_objective_t objective = CACHE_OBJECTIVE_OBJECTS;
+static CacheShard *shards = NULL;
+static unsigned int shard_mask = 0;
+static const cache_tier_t *lower_tier = NULL;
+static uint64_t hash_seed;
+static SnapshotRestore restore;
 
 // --- Private Helper Functions ---
 
+// wyhash constants
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+/**
+ * @brief 64x64->128 bit multiply, folded back to 64 bits.
+ */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief Hashes a URL with wyhash.
+ *
+ * Consumes 8 bytes per step and mixes them with full-width multiplies, so
+ * every bit of the result depends on every input byte. The seed is picked
+ * per process, so crafted URLs cannot be lined up to collide.
+ */
+static uint64_t hash(const char *url) {
+    const unsigned char *p = (const unsigned char *)url;
+    size_t len = strlen(url);
+    uint64_t seed = hash_seed, a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (read32(p) << 32) | read32(p + ((len >> 3) << 2));
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+                see1 = hash_mix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ see1);
+                see2 = hash_mix(read64(p + 32) ^ HASH_P3, read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    return hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed));
+}
+
+/**
+ * @brief Picks the shard for a URL hash.
+ *
+ * Table slots use the low bits of the hash, so the shard comes from the
+ * high bits to keep the two choices independent.
+ */
+static CacheShard *shard_for(uint64_t hash_val) {
+    return &shards[(hash_val >> 48) & shard_mask];
+}
+
+/**
+ * @brief Allocates an empty index with the given power-of-2 slot count.
+ */
+static HashTable *table_create(size_t slots) {
+    HashTable *table = calloc(1, sizeof(HashTable) + slots * sizeof(HashSlot));
+    if (!table) {
+        perror("Failed to allocate cache index");
+        return NULL;
+    }
+    table->mask = slots - 1;
+    return table;
+}
+
+/**
+ * @brief Frees an index (epoch reclamation callback).
+ */
+static void free_table(void *arg) {
+    free(arg);
+}
+
+/**
+ * @brief Finds the entry for a URL in one index.
+ *
+ * Safe without the shard lock, inside an epoch section: slots are only
+ * ever filled or turned into tombstones, never emptied, so a probe run
+ * cannot end early under a concurrent writer.
+ */
+static CacheEntry *table_find(const HashTable *table, uint64_t hash_val, const char *url) {
+    for (size_t i = hash_val & table->mask; ; i = (i + 1) & table->mask) {
+        CacheEntry *node = __atomic_load_n(&table->slots[i].node, __ATOMIC_ACQUIRE);
+        if (!node) return NULL;
+        if (node != TOMBSTONE && __atomic_load_n(&table->slots[i].hash, __ATOMIC_RELAXED) == hash_val &&
+            node->hash_val == hash_val && strcmp(node->url, url) == 0) {
+            return node;
+        }
+    }
+}
+
+/**
+ * @brief Adds an entry to an index, reusing the first tombstone on its
+ * probe run. The caller has already removed any entry with the same URL.
+ */
+static void table_insert(HashTable *table, CacheEntry *node) {
+    for (size_t i = node->hash_val & table->mask; ; i = (i + 1) & table->mask) {
+        HashSlot *slot = &table->slots[i];
+        if (slot->node && slot->node != TOMBSTONE) continue;
+        if (!slot->node) table->used++;
+        __atomic_store_n(&slot->hash, node->hash_val, __ATOMIC_RELAXED);
+        // The release store publishes the hash and the finished entry
+        __atomic_store_n(&slot->node, node, __ATOMIC_RELEASE);
+        return;
+    }
+}
+
+/**
+ * @brief Replaces an entry's slot with a tombstone, if it is in this index.
+ */
+static void table_erase(HashTable *table, CacheEntry *node) {
+    for (size_t i = node->hash_val & table->mask; ; i = (i + 1) & table->mask) {
+        HashSlot *slot = &table->slots[i];
+        if (!slot->node) return;
+        if (slot->node == node) {
+            __atomic_store_n(&slot->node, TOMBSTONE, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Finds a URL in a shard, checking the table being drained too.
+ */
+static CacheEntry *shard_find(CacheShard *shard, uint64_t hash_val, const char *url) {
+    CacheEntry *node = table_find(__atomic_load_n(&shard->table, __ATOMIC_ACQUIRE), hash_val, url);
+    if (node) return node;
+    HashTable *old_table = __atomic_load_n(&shard->old_table, __ATOMIC_ACQUIRE);
+    return old_table ? table_find(old_table, hash_val, url) : NULL;
+}
+
 /**
- * @brief Simple hash function for URLs.
+ * @brief Moves up to max_slots slots of the old table into the new one,
+ * and retires the old table once it is drained. Caller holds the shard lock.
  */
-static unsigned int hash(const char *url) {
-    unsigned int hash_val = 0;
-    for (; *url; ++url) {
-        hash_val = (hash_val << 5) + *url;
+static void migrate(CacheShard *shard, size_t max_slots) {
+    HashTable *old_table = shard->old_table;
+    if (!old_table) return;
+
+    // Entries are copied, not moved: a reader may still be probing the old
+    // table, and removals tombstone both copies until it is retired.
+    for (; max_slots > 0 && shard->migrate_pos <= old_table->mask; max_slots--, shard->migrate_pos++) {
+        CacheEntry *node = old_table->slots[shard->migrate_pos].node;
+        if (node && node != TOMBSTONE) table_insert(shard->table, node);
     }
-    return hash_val % HASH_TABLE_SIZE;
+    if (shard->migrate_pos <= old_table->mask) return;
+
+    __atomic_store_n(&shard->old_table, NULL, __ATOMIC_RELEASE);
+    if (policy == CACHE_POLICY_CLOCK) epoch_retire(old_table, free_table);
+    else free_table(old_table);
 }
 
 /**
- * @brief Detaches a node from the LRU list.
+ * @brief Makes room in the shard's index for one more entry.
+ *
+ * Once the table is 3/4 occupied (tombstones included) a replacement with
+ * room for twice the live entries is started; tombstones are dropped in
+ * the process, so a table churned by replacements may come back smaller.
+ * Caller holds the shard lock.
+ * @return 0 on success, -1 if the table is full and cannot be replaced.
  */
-static void lru_detach(CacheNode *node) {
+static int reserve_slot(CacheShard *shard) {
+    migrate(shard, MIGRATE_STEP);
+
+    HashTable *table = shard->table;
+    if ((table->used + 1) * 4 <= (table->mask + 1) * 3) return 0;
+
+    // A resize is only started once the previous one has finished
+    migrate(shard, SIZE_MAX);
+    table = shard->table;
+
+    size_t slots = INITIAL_TABLE_SLOTS;
+    while (slots < 2 * (shard->count + shard->window_count + 1)) slots <<= 1;
+    HashTable *new_table = table_create(slots);
+    if (!new_table) {
+        // Keep inserting into the current table while it has empty slots
+        return table->used < table->mask ? 0 : -1;
+    }
+
+    shard->migrate_pos = 0;
+    __atomic_store_n(&shard->old_table, table, __ATOMIC_RELEASE);
+    __atomic_store_n(&shard->table, new_table, __ATOMIC_RELEASE);
+    migrate(shard, MIGRATE_STEP);
+    return 0;
+}
+
+/**
+ * @brief Detaches a node from an LRU list.
+ */
+static void lru_detach(EntryList *list, CacheEntry *node) {
     if (node->prev) node->prev->next = node->next;
-    else lru_head = node->next;
-    
+    else list->head = node->next;
+
     if (node->next) node->next->prev = node->prev;
-    else lru_tail = node->prev;
+    else list->tail = node->prev;
 }
 
 /**
- * @brief Attaches a node to the front of the LRU list (most recently used).
+ * @brief Attaches a node to the front of an LRU list (most recently used).
  */
-static void lru_attach(CacheNode *node) {
-    node->next = lru_head;
+static void lru_attach(EntryList *list, CacheEntry *node) {
+    node->next = list->head;
     node->prev = NULL;
-    if (lru_head) lru_head->prev = node;
-    lru_head = node;
-    if (lru_tail == NULL) lru_tail = node;
+    if (list->head) list->head->prev = node;
+    list->head = node;
+    if (list->tail == NULL) list->tail = node;
+}
+
+/**
+ * @brief Adds a node to the CLOCK ring just behind the hand, so it is the
+ * last one the hand reaches.
+ */
+static void clock_insert(CacheShard *shard, CacheEntry *node) {
+    CacheEntry *hand = shard->clock_hand;
+    if (!hand) {
+        node->next = node->prev = node;
+        shard->clock_hand = node;
+        return;
+    }
+    node->next = hand;
+    node->prev = hand->prev;
+    hand->prev->next = node;
+    hand->prev = node;
+}
+
+/**
+ * @brief Removes a node from the CLOCK ring.
+ */
+static void clock_remove(CacheShard *shard, CacheEntry *node) {
+    if (node->next == node) {
+        shard->clock_hand = NULL;
+        return;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    if (shard->clock_hand == node) shard->clock_hand = node->next;
+}
+
+/**
+ * @brief Sweeps the hand to the first unreferenced entry.
+ *
+ * Referenced entries get their bit cleared and a second chance. Hits may
+ * keep setting bits while the hand moves, so after two full turns the
+ * entry under the hand is taken regardless.
+ */
+static CacheEntry *clock_victim(CacheShard *shard) {
+    CacheEntry *node = shard->clock_hand;
+    for (size_t steps = 0; node && steps < 2 * shard->count; steps++) {
+        if (!__atomic_load_n(&node->referenced, __ATOMIC_RELAXED)) break;
+        __atomic_store_n(&node->referenced, 0, __ATOMIC_RELAXED);
+        node = node->next;
+    }
+    shard->clock_hand = node;
+    return node;
+}
+
+/**
+ * @brief The entry clock_victim() would take, found without moving the
+ * hand or clearing any bits: the first unreferenced one within a turn,
+ * or else the one under the hand, where a sweep clearing them all ends.
+ */
+static CacheEntry *clock_peek(CacheShard *shard) {
+    CacheEntry *node = shard->clock_hand;
+    for (size_t steps = 0; node && steps < shard->count; steps++) {
+        if (!__atomic_load_n(&node->referenced, __ATOMIC_RELAXED)) return node;
+        node = node->next;
+    }
+    return shard->clock_hand;
+}
+
+/**
+ * @brief What it would cost to lose an entry, in units of the objective.
+ */
+static double gdsf_cost(const CacheEntry *node) {
+    switch (objective) {
+        case CACHE_OBJECTIVE_BYTES: return (double)node->charge;
+        case CACHE_OBJECTIVE_LATENCY: return node->fetch_ms ? node->fetch_ms : 1;
+        default: return 1.0;
+    }
+}
+
+/**
+ * @brief Swaps two heap positions, keeping the entries' indices current.
+ */
+static void heap_swap(CacheShard *shard, size_t a, size_t b) {
+    CacheEntry *tmp = shard->heap[a];
+    shard->heap[a] = shard->heap[b];
+    shard->heap[b] = tmp;
+    shard->heap[a]->heap_index = a;
+    shard->heap[b]->heap_index = b;
+}
+
+/**
+ * @brief Restores heap order above a position.
+ */
+static void heap_sift_up(CacheShard *shard, size_t index) {
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (shard->heap[parent]->priority <= shard->heap[index]->priority) break;
+        heap_swap(shard, index, parent);
+        index = parent;
+    }
+}
+
+/**
+ * @brief Restores heap order below a position in a heap of size entries.
+ */
+static void heap_sift_down(CacheShard *shard, size_t index, size_t size) {
+    for (;;) {
+        size_t smallest = index, left = 2 * index + 1, right = left + 1;
+        if (left < size && shard->heap[left]->priority < shard->heap[smallest]->priority) smallest = left;
+        if (right < size && shard->heap[right]->priority < shard->heap[smallest]->priority) smallest = right;
+        if (smallest == index) break;
+        heap_swap(shard, index, smallest);
+        index = smallest;
+    }
+}
+
+/**
+ * @brief Grows the GDSF heap so every entry in the shard, plus one, fits.
+ * Caller holds the shard lock.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int reserve_heap(CacheShard *shard) {
+    if (policy != CACHE_POLICY_GDSF) return 0;
+    size_t needed = shard->count + shard->window_count + 1;
+    if (needed <= shard->heap_capacity) return 0;
+
+    size_t capacity = shard->heap_capacity ? shard->heap_capacity * 2 : INITIAL_TABLE_SLOTS;
+    while (capacity < needed) capacity *= 2;
+    CacheEntry **heap = realloc(shard->heap, capacity * sizeof(CacheEntry *));
+    if (!heap) {
+        perror("realloc for cache heap");
+        return -1;
+    }
+    shard->heap = heap;
+    shard->heap_capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Adds a node to the GDSF heap; reserve_heap() made room for it.
+ * The heap holds shard->count entries before the caller counts this one.
+ */
+static void gdsf_insert(CacheShard *shard, CacheEntry *node) {
+    node->hits = 1;
+    node->priority = shard->inflation + gdsf_cost(node) / node->charge;
+    node->heap_index = shard->count;
+    shard->heap[shard->count] = node;
+    heap_sift_up(shard, node->heap_index);
+}
+
+/**
+ * @brief Removes a node from the GDSF heap, which holds shard->count
+ * entries until the caller uncounts this one.
+ */
+static void gdsf_remove(CacheShard *shard, CacheEntry *node) {
+    size_t index = node->heap_index, last = shard->count - 1;
+    if (index == last) return;
+    heap_swap(shard, index, last);
+    heap_sift_down(shard, index, last);
+    heap_sift_up(shard, index);
+}
+
+/**
+ * @brief Credits a hit to a node and moves it down the eviction order.
+ */
+static void gdsf_touch(CacheShard *shard, CacheEntry *node) {
+    node->hits++;
+    node->priority = shard->inflation + node->hits * gdsf_cost(node) / node->charge;
+    heap_sift_down(shard, node->heap_index, shard->count);
+}
+
+/**
+ * @brief The lowest-priority node. Every remaining priority is at least
+ * its value, so it also becomes the new inflation floor.
+ */
+static CacheEntry *gdsf_victim(CacheShard *shard) {
+    if (shard->count == 0) return NULL;
+    shard->inflation = shard->heap[0]->priority;
+    return shard->heap[0];
+}
+
+/**
+ * @brief Makes a new node known to the eviction policy.
+ */
+static void policy_insert(CacheShard *shard, CacheEntry *node) {
+    if (policy == CACHE_POLICY_CLOCK) clock_insert(shard, node);
+    else if (policy == CACHE_POLICY_GDSF) gdsf_insert(shard, node);
+    else lru_attach(&shard->lru, node);
+    shard->count++;
+}
+
+/**
+ * @brief Removes a node from the eviction policy.
+ */
+static void policy_remove(CacheShard *shard, CacheEntry *node) {
+    if (policy == CACHE_POLICY_CLOCK) clock_remove(shard, node);
+    else if (policy == CACHE_POLICY_GDSF) gdsf_remove(shard, node);
+    else lru_detach(&shard->lru, node);
+    shard->count--;
+}
+
+/**
+ * @brief Picks the next node to evict, or NULL if the shard is empty.
+ */
+static CacheEntry *policy_victim(CacheShard *shard) {
+    if (policy == CACHE_POLICY_CLOCK) return clock_victim(shard);
+    if (policy == CACHE_POLICY_GDSF) return gdsf_victim(shard);
+    return shard->lru.tail;
+}
+
+/**
+ * @brief The node policy_victim() would pick, without the state it
+ * changes on the way (clock bits and hand, the GDSF inflation floor).
+ */
+static CacheEntry *policy_peek(CacheShard *shard) {
+    if (policy == CACHE_POLICY_CLOCK) return clock_peek(shard);
+    if (policy == CACHE_POLICY_GDSF) return shard->count ? shard->heap[0] : NULL;
+    return shard->lru.tail;
+}
+
+/**
+ * @brief Adds a new node to the admission window.
+ */
+static void window_insert(CacheShard *shard, CacheEntry *node) {
+    node->in_window = 1;
+    lru_attach(&shard->window, node);
+    shard->window_size += node->charge;
+    shard->window_count++;
+}
+
+/**
+ * @brief Removes a node from the admission window.
+ */
+static void window_remove(CacheShard *shard, CacheEntry *node) {
+    node->in_window = 0;
+    lru_detach(&shard->window, node);
+    shard->window_size -= node->charge;
+    shard->window_count--;
+}
+
+/**
+ * @brief Picks the next node to evict from anywhere in the shard: the main
+ * area's victim, or the oldest window entry if the main area is empty.
+ */
+static CacheEntry *any_victim(CacheShard *shard) {
+    CacheEntry *node = policy_victim(shard);
+    return node ? node : shard->window.tail;
+}
+
+/**
+ * @brief Frees a node's contents.
+ */
+static void free_segments(CacheEntry *node) {
+    while (node->segments) {
+        Segment *segment = node->segments;
+        node->segments = segment->next;
+        slab_free(segment, sizeof(Segment) + segment->capacity);
+    }
 }
 
 /**
  * @brief Frees a cache node and its contents.
  */
-static void free_node(CacheNode *node) {
+static void free_node(CacheEntry *node) {
     if (node) {
-        free(node->url);
-        free(node->data);
-        free(node);
+        free_segments(node);
+        slab_free(node, sizeof(CacheEntry) + node->url_len + 1);
+    }
+}
+
+/**
+ * @brief Frees what is left of a node whose data was already released
+ * (epoch reclamation callback).
+ */
+static void free_node_header(void *arg) {
+    free_node((CacheEntry *)arg);
+}
+
+/**
+ * @brief Takes a reference unless the entry is already on its way out.
+ *
+ * Lock-free readers may find an entry whose last reference was just
+ * dropped; it must not be brought back to life.
+ */
+static int try_ref(CacheEntry *node) {
+    int refs = __atomic_load_n(&node->refcount, __ATOMIC_RELAXED);
+    while (refs > 0) {
+        if (__atomic_compare_exchange_n(&node->refcount, &refs, refs + 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Unlinks a node from its shard's hash table and eviction policy and
+ * drops the cache's reference to it. Caller must hold the shard lock.
+ */
+static void remove_node(CacheShard *shard, CacheEntry *node) {
+    table_erase(shard->table, node);
+    if (shard->old_table) table_erase(shard->old_table, node);
+
+    if (node->in_window) window_remove(shard, node);
+    else policy_remove(shard, node);
+    shard->current_size -= node->charge;
+    cache_release(node);
+}
+
+/**
+ * @brief Evicts a node to make room, handing it to the lower tier if there
+ * is one. Caller must hold the shard lock.
+ */
+static void evict_node(CacheShard *shard, CacheEntry *node) {
+    log_message(LOG_LEVEL_DEBUG, "Cache Evict: %s", node->url);
+    metrics_add(METRIC_CACHE_EVICTIONS, 1);
+    if (lower_tier) {
+        cache_retain(node);
+        lower_tier->evicted(node);
+    }
+    remove_node(shard, node);
+}
+
+/**
+ * @brief Evicts elements chosen by the policy until there is enough space.
+ */
+static void evict(CacheShard *shard, size_t space_needed) {
+    while (shard->current_size + space_needed > shard->max_size) {
+        CacheEntry *node_to_evict = policy_victim(shard);
+        if (!node_to_evict) break;
+        evict_node(shard, node_to_evict);
+    }
+}
+
+/**
+ * @brief Moves entries that overflow the window into the main area if the
+ * frequency sketch rates them above what they would displace.
+ *
+ * A candidate that needs room is compared with the main area's next
+ * victim before anything is evicted, and only if it wins does the main
+ * area make room for it; a tie goes to the incumbent. The victim is only
+ * peeked at for the comparison, so a rejected candidate is dropped from
+ * the cache and costs the main area nothing, not even clock second
+ * chances or GDSF aging.
+ */
+static void admit_from_window(CacheShard *shard) {
+    size_t main_max = shard->max_size - shard->window_max;
+    while (shard->window_size > shard->window_max) {
+        CacheEntry *candidate = shard->window.tail;
+
+        int admit = 1;
+        if (shard->current_size - shard->window_size + candidate->charge > main_max) {
+            CacheEntry *victim = policy_peek(shard);
+            admit = victim && candidate->charge <= main_max &&
+                    sketch_estimate(shard->sketch, victim->hash_val) <
+                    sketch_estimate(shard->sketch, candidate->hash_val);
+            // An empty main area always has room for a winner, so this ends
+            while (admit && shard->current_size - shard->window_size + candidate->charge > main_max) {
+                evict_node(shard, policy_victim(shard));
+            }
+        }
+
+        if (admit) {
+            window_remove(shard, candidate);
+            policy_insert(shard, candidate);
+        } else {
+            log_message(LOG_LEVEL_DEBUG, "Cache Reject: %s", candidate->url);
+            remove_node(shard, candidate);
+        }
+    }
+}
+
+/**
+ * @brief Allocates cache memory, evicting from the shard while the slab
+ * limit is reached. Caller must not hold the shard lock.
+ */
+static void *alloc_evicting(CacheShard *shard, size_t size) {
+    for (int attempt = 0; ; attempt++) {
+        void *ptr = slab_alloc(size);
+        if (ptr || attempt == MAX_ALLOC_RETRIES) return ptr;
+
+        pthread_mutex_lock(&shard->lock);
+        CacheEntry *victim = any_victim(shard);
+        if (victim) evict_node(shard, victim);
+        pthread_mutex_unlock(&shard->lock);
+        if (!victim) return NULL;
+        // Retired headers only return to the slab once reclaimed
+        if (policy == CACHE_POLICY_CLOCK) epoch_reclaim();
+    }
+}
+
+
+/**
+ * @brief Links a new segment of at least capacity bytes to a node being
+ * filled; the segment gets all of the slab chunk it occupies.
+ * @return 0 on success, -1 if no memory could be had.
+ */
+static int add_segment(CacheEntry *node, size_t capacity) {
+    size_t bytes = slab_chunk_size(sizeof(Segment) + capacity);
+    Segment *segment = alloc_evicting(shard_for(node->hash_val), bytes);
+    if (!segment) return -1;
+    segment->next = NULL;
+    segment->capacity = bytes - sizeof(Segment);
+    // Readers only follow the link once the size says it is there
+    if (node->tail) node->tail->next = segment;
+    else node->segments = segment;
+    node->tail = segment;
+    node->tail_used = 0;
+    node->charge += bytes;
+    return 0;
+}
+
+/**
+ * @brief Wakes every reader waiting on a node.
+ *
+ * The filler stores the new size or state before checking for waiters, and
+ * a reader registers before checking the size and state, both sequentially
+ * consistent, so a reader that the filler misses sees the update itself.
+ */
+static void wake_readers(CacheEntry *node) {
+    if (!__atomic_load_n(&node->waiters, __ATOMIC_SEQ_CST)) return;
+
+    CacheShard *shard = shard_for(node->hash_val);
+    pthread_mutex_lock(&shard->lock);
+    CacheWaiter *waiter = node->waiters;
+    __atomic_store_n(&node->waiters, NULL, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&shard->lock);
+
+    while (waiter) {
+        // A woken waiter may be gone as soon as its callback returns
+        CacheWaiter *next = waiter->next;
+        waiter->callback(waiter->arg);
+        waiter = next;
+    }
+}
+
+/**
+ * @brief Wakes a blocked cache_entry_await() (waiter callback).
+ */
+static void wake_blocked(void *arg) {
+    WaitState *state = (WaitState *)arg;
+    pthread_mutex_lock(&state->lock);
+    state->done = 1;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+
+/**
+ * @brief Links a complete entry into its shard under the cache's own
+ * reference, replacing any entry stored under the same URL.
+ *
+ * An entry restored from a snapshot instead yields to one already there,
+ * which live traffic fetched more recently, and takes back its saved place
+ * in the eviction order.
+ */
+static void link_entry(CacheEntry *entry, const SnapshotRecord *restored) {
+    CacheShard *shard = shard_for(entry->hash_val);
+    size_t charge = entry->charge;
+
+    pthread_mutex_lock(&shard->lock);
+    if (charge > shard->max_size) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    // First, check if item already exists. If so, replace it.
+    // Entries are immutable, so replace it with the new one;
+    // readers still holding the old one keep it alive.
+    CacheEntry *existing = shard_find(shard, entry->hash_val, entry->url);
+    if (existing && restored) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    if (existing) remove_node(shard, existing);
+
+    if (reserve_slot(shard) != 0 || reserve_heap(shard) != 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    cache_retain(entry); // The cache's own reference
+
+    // Add to the eviction policy; with admission, new entries start in the
+    // window, and restored ones go back where they were
+    if (shard->sketch && (!restored || restored->in_window)) {
+        window_insert(shard, entry);
+    } else {
+        evict(shard, charge);
+        policy_insert(shard, entry);
+        if (restored && policy == CACHE_POLICY_GDSF) {
+            entry->hits = restored->hits;
+            entry->priority = shard->inflation + restored->credit;
+            heap_sift_down(shard, entry->heap_index, shard->count);
+            heap_sift_up(shard, entry->heap_index);
+        }
+    }
+
+    // Add to the index; this publishes the finished entry
+    table_insert(shard->table, entry);
+
+    shard->current_size += charge;
+    if (!restored) {
+        log_message(LOG_LEVEL_DEBUG, "Cache Add: %s, Size: %zu, Shard Size: %zu", entry->url, entry->size,
+                    shard->current_size);
+    }
+    if (shard->sketch) admit_from_window(shard);
+
+    pthread_mutex_unlock(&shard->lock);
+    if (policy == CACHE_POLICY_CLOCK) epoch_reclaim();
+}
+
+/**
+ * @brief Orders saved entries by ascending GDSF credit, i.e. eviction order.
+ */
+static int compare_credit(const void *a, const void *b) {
+    double x = ((const SavedEntry *)a)->record.credit, y = ((const SavedEntry *)b)->record.credit;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Takes a reference to every entry of a shard, next victim first,
+ * along with what the snapshot keeps of its standing.
+ * @return The entries (free with free()), or NULL if the shard is empty or
+ * memory ran out.
+ */
+static SavedEntry *collect_shard(CacheShard *shard, size_t *count) {
+    pthread_mutex_lock(&shard->lock);
+    size_t main_count = shard->count, total = main_count + shard->window_count, n = 0;
+    SavedEntry *saved = total ? malloc(total * sizeof(SavedEntry)) : NULL;
+    if (!saved) {
+        if (total) perror("malloc for cache snapshot");
+        pthread_mutex_unlock(&shard->lock);
+        *count = 0;
+        return NULL;
+    }
+
+    // The main area in eviction order, then the window, which is younger
+    CacheEntry *node = policy == CACHE_POLICY_CLOCK ? shard->clock_hand : shard->lru.tail;
+    for (size_t i = 0; i < main_count; i++) {
+        if (policy == CACHE_POLICY_GDSF) node = shard->heap[i];
+        saved[n++].node = node;
+        if (policy == CACHE_POLICY_CLOCK) node = node->next;
+        else if (policy == CACHE_POLICY_LRU) node = node->prev;
+    }
+    for (node = shard->window.tail; node; node = node->prev) saved[n++].node = node;
+
+    for (size_t i = 0; i < n; i++) {
+        node = saved[i].node;
+        SnapshotRecord *record = &saved[i].record;
+        memset(record, 0, sizeof(*record));
+        record->magic = SNAPSHOT_RECORD_MAGIC;
+        record->url_len = (uint32_t)node->url_len;
+        record->fetch_ms = node->fetch_ms;
+        record->size = node->size;
+        record->fresh_until = (int64_t)cache_entry_fresh_until(node);
+        record->in_window = node->in_window;
+        record->referenced = __atomic_load_n(&node->referenced, __ATOMIC_RELAXED);
+        if (policy == CACHE_POLICY_GDSF && !node->in_window) {
+            record->hits = node->hits;
+            record->credit = node->priority - shard->inflation;
+        }
+        if (shard->sketch) record->freq = (uint8_t)sketch_estimate(shard->sketch, node->hash_val);
+        cache_retain(node);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // The heap is only partially ordered
+    if (policy == CACHE_POLICY_GDSF) qsort(saved, main_count, sizeof(SavedEntry), compare_credit);
+    *count = n;
+    return saved;
+}
+
+/**
+ * @brief The bytes a record takes in a snapshot, URL, contents and padding
+ * included.
+ */
+static uint64_t record_span(const SnapshotRecord *record) {
+    uint64_t span = sizeof(SnapshotRecord) + record->url_len + record->size;
+    return (span + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+/**
+ * @brief Appends a held entry to a snapshot: its record, URL and contents.
+ * @return 0 on success, -1 on a write error.
+ */
+static int write_record(FILE *file, const SavedEntry *saved) {
+    static const char padding[SNAPSHOT_ALIGN];
+    const SnapshotRecord *record = &saved->record;
+    if (fwrite(record, sizeof(SnapshotRecord), 1, file) != 1) return -1;
+    if (fwrite(saved->node->url, 1, record->url_len, file) != record->url_len) return -1;
+    for (size_t offset = 0; offset < record->size; ) {
+        const char *data = NULL;
+        size_t n = cache_entry_read(saved->node, offset, &data);
+        if (fwrite(data, 1, n, file) != n) return -1;
+        offset += n;
     }
+    size_t pad = record_span(record) - (sizeof(SnapshotRecord) + record->url_len + record->size);
+    return fwrite(padding, 1, pad, file) == pad ? 0 : -1;
 }
 
 /**
- * @brief Evicts the least recently used elements until there is enough space.
+ * @brief Puts one saved entry back into the cache.
  */
-static void evict(size_t space_needed) {
-    while (current_cache_size + space_needed > MAX_CACHE_SIZE && lru_tail) {
-        CacheNode *node_to_evict = lru_tail;
-        
-        // Remove from hash table
-        unsigned int index = hash(node_to_evict->url);
-        HashEntry *entry = hash_table[index];
-        HashEntry *prev = NULL;
-        while (entry) {
-            if (strcmp(entry->url, node_to_evict->url) == 0) {
-                if (prev) prev->next = entry->next;
-                else hash_table[index] = entry->next;
-                free(entry->url);
-                free(entry);
+static void restore_record(const char *url, const char *data, const SnapshotRecord *record) {
+    CacheEntry *entry = cache_fill_begin(url, record->size);
+    if (!entry) return;
+    if (cache_fill_append(entry, data, record->size) == 0) {
+        entry->fetch_ms = record->fetch_ms;
+        entry->fresh_until = (time_t)record->fresh_until;
+        entry->referenced = record->referenced;
+        // Nobody else has seen the entry yet
+        entry->state = CACHE_COMPLETE;
+
+        // Restore its popularity first; admission compares it with the incumbents'
+        CacheShard *shard = shard_for(entry->hash_val);
+        if (shard->sketch) {
+            for (unsigned int i = 0; i < record->freq; i++) sketch_increment(shard->sketch, entry->hash_val);
+        }
+        link_entry(entry, record);
+        __atomic_add_fetch(&restore.entries, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&restore.bytes, record->size, __ATOMIC_RELAXED);
+    }
+    cache_release(entry);
+}
+
+/**
+ * @brief Restores snapshot sections until none are left (loader thread).
+ *
+ * Each section is streamed from the mapping in order, so a shard's entries
+ * are inserted next victim first and end up in their saved order. The last
+ * loader to finish reports and unmaps the file.
+ */
+static void *snapshot_loader(void *arg) {
+    (void)arg;
+    char *url = NULL;
+    size_t url_capacity = 0;
+
+    for (;;) {
+        uint32_t index = __atomic_fetch_add(&restore.next_section, 1, __ATOMIC_RELAXED);
+        if (index >= restore.section_count) break;
+        const SnapshotSection *section = &restore.sections[index];
+        const unsigned char *p = restore.map + section->offset, *end = p + section->length;
+
+        // Start reading the section in before walking it
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        const unsigned char *first_page = restore.map + (section->offset & ~(uint64_t)(page - 1));
+        madvise((void *)first_page, (size_t)(end - first_page), MADV_WILLNEED);
+
+        while (!__atomic_load_n(&restore.stop, __ATOMIC_RELAXED) && (size_t)(end - p) >= sizeof(SnapshotRecord)) {
+            SnapshotRecord record;
+            memcpy(&record, p, sizeof(record));
+            size_t left = (size_t)(end - p);
+            if (record.magic != SNAPSHOT_RECORD_MAGIC || record.url_len == 0 ||
+                record.size > left || record_span(&record) > left) {
+                fprintf(stderr, "Cache snapshot section %u is corrupt; skipping the rest of it.\n", index);
                 break;
             }
-            prev = entry;
-            entry = entry->next;
+            if (record.url_len >= url_capacity) {
+                char *grown = realloc(url, record.url_len + 1);
+                if (!grown) {
+                    perror("realloc for snapshot URL");
+                    break;
+                }
+                url = grown;
+                url_capacity = record.url_len + 1;
+            }
+            const char *data = (const char *)p + sizeof(SnapshotRecord);
+            memcpy(url, data, record.url_len);
+            url[record.url_len] = '\0';
+            restore_record(url, data + record.url_len, &record);
+            p += record_span(&record);
         }
-        
-        // Remove from LRU list
-        lru_detach(node_to_evict);
-        current_cache_size -= node_to_evict->size;
-        
-        // Free the node itself
-        printf("Cache Evict: %s\n", node_to_evict->url);
-        free_node(node_to_evict);
     }
+    free(url);
+
+    if (__atomic_sub_fetch(&restore.running, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed_ms = (now.tv_sec - restore.started.tv_sec) * 1000 +
+                          (now.tv_nsec - restore.started.tv_nsec) / 1000000;
+        printf("Cache snapshot %s: %zu object(s), %zu bytes in %ld ms.\n",
+               __atomic_load_n(&restore.stop, __ATOMIC_RELAXED) ? "restore stopped" : "restored",
+               __atomic_load_n(&restore.entries, __ATOMIC_RELAXED),
+               __atomic_load_n(&restore.bytes, __ATOMIC_RELAXED), elapsed_ms);
+        munmap((void *)restore.map, restore.map_size);
+        restore.map = NULL;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Makes a restore still in progress quit and waits for its loaders.
+ * @return 1 if the restore was cut short, 0 if it had finished or there was none.
+ */
+static int stop_loaders() {
+    if (restore.num_loaders == 0) return 0;
+    int interrupted = __atomic_load_n(&restore.running, __ATOMIC_ACQUIRE) > 0;
+    __atomic_store_n(&restore.stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < restore.num_loaders; i++) pthread_join(restore.loaders[i], NULL);
+    restore.num_loaders = 0;
+    restore.stop = 0;
+    return interrupted;
 }
 
 
@@ -130,16 +1198,106 @@ static void evict(size_t space_needed) {
 /**
  * @brief Initializes the cache.
  */
-int cache_init(size_t max_size, size_t max_element_size) {
-    MAX_CACHE_SIZE = max_size;
-    MAX_ELEMENT_SIZE = max_element_size;
-    
-    if (pthread_rwlock_init(&cache_lock, NULL) != 0) {
-        perror("Failed to initialize cache lock");
+int cache_init(const cache_config_t *config) {
+    if (slab_init(config->max_size) != 0) return -1;
+
+    unsigned int num_shards = 1;
+    while ((int)num_shards < config->num_shards && num_shards < MAX_CACHE_SHARDS) num_shards <<= 1;
+
+    shards = aligned_alloc(CACHE_LINE_SIZE, num_shards * sizeof(CacheShard));
+    if (!shards) {
+        perror("Failed to allocate cache shards");
         return -1;
     }
+    memset(shards, 0, num_shards * sizeof(CacheShard));
 
-    memset(hash_table, 0, sizeof(hash_table));
+    for (unsigned int i = 0; i < num_shards; i++) {
+        if (pthread_mutex_init(&shards[i].lock, NULL) != 0) {
+            perror("Failed to initialize cache lock");
+            while (i-- > 0) pthread_mutex_destroy(&shards[i].lock);
+            free(shards);
+            shards = NULL;
+            return -1;
+        }
+        shards[i].max_size = config->max_size / num_shards;
+        shards[i].table = table_create(INITIAL_TABLE_SLOTS);
+        if (config->admission == CACHE_ADMIT_TINYLFU) {
+            shards[i].sketch = sketch_create(shards[i].max_size / SKETCH_BYTES_PER_KEY);
+            shards[i].window_max = shards[i].max_size * WINDOW_PERCENT / 100;
+        }
+        if (!shards[i].table || (config->admission == CACHE_ADMIT_TINYLFU && !shards[i].sketch)) {
+            for (unsigned int j = 0; j <= i; j++) {
+                free(shards[j].table);
+                sketch_destroy(shards[j].sketch);
+                pthread_mutex_destroy(&shards[j].lock);
+            }
+            free(shards);
+            shards = NULL;
+            return -1;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    hash_seed = hash_mix((uint64_t)now.tv_nsec ^ HASH_P0, ((uint64_t)now.tv_sec << 20) ^ (uint64_t)getpid() ^ HASH_P2);
+
+    shard_mask = num_shards - 1;
+    policy = config->policy;
+    objective = config->objective;
+    lower_tier = config->lower_tier;
+    MAX_ELEMENT_SIZE = config->max_element_size;
+    // An object must fit in a single shard
+    if (MAX_ELEMENT_SIZE > config->max_size / num_shards) MAX_ELEMENT_SIZE = config->max_size / num_shards;
+    static const char *policy_names[] = { "LRU", "CLOCK", "GDSF" };
+    printf("Cache split into %u shard(s) of %zu bytes, %s eviction, %s admission.\n", num_shards,
+           config->max_size / num_shards, policy_names[policy],
+           config->admission == CACHE_ADMIT_TINYLFU ? "W-TinyLFU" : "unfiltered");
+    return 0;
+}
+
+/**
+ * @brief Changes the size budget, evicting incrementally to a smaller one.
+ */
+int cache_resize(size_t max_size, size_t max_element_size) {
+    if (!shards || max_size == 0) return -1;
+    unsigned int num_shards = shard_mask + 1;
+    size_t shard_size = max_size / num_shards;
+    if (max_element_size > shard_size) max_element_size = shard_size;
+    __atomic_store_n(&MAX_ELEMENT_SIZE, max_element_size, __ATOMIC_RELAXED);
+
+    // A larger budget may be used at once; a smaller one only binds the slab
+    // once the shards are back under it
+    size_t evicted = 0;
+    slab_stats_t slab;
+    slab_stats(&slab);
+    if (max_size > slab.limit) slab_set_limit(max_size);
+    for (unsigned int i = 0; i < num_shards; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->max_size = shard_size;
+        if (shard->sketch) shard->window_max = shard_size * WINDOW_PERCENT / 100;
+        int batch = 0;
+        while (shard->current_size > shard->max_size) {
+            CacheEntry *victim = any_victim(shard);
+            if (!victim) break;
+            evict_node(shard, victim);
+            evicted++;
+            if (++batch == RESIZE_BATCH) {
+                // Let lookups and fills on this shard in between batches
+                batch = 0;
+                pthread_mutex_unlock(&shard->lock);
+                if (policy == CACHE_POLICY_CLOCK) epoch_reclaim();
+                pthread_mutex_lock(&shard->lock);
+            }
+        }
+        if (shard->sketch) admit_from_window(shard);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (max_size < slab.limit) slab_set_limit(max_size);
+    if (policy == CACHE_POLICY_CLOCK) epoch_reclaim();
+
+    log_message(LOG_LEVEL_INFO, "Cache resized to %u shard(s) of %zu bytes, objects up to %zu bytes; %zu evicted.",
+                num_shards, shard_size, max_element_size, evicted);
     return 0;
 }
 
@@ -147,148 +1305,498 @@ int cache_init(size_t max_size, size_t max_element_size) {
  * @brief Destroys the cache, freeing all memory.
  */
 void cache_destroy() {
-    pthread_rwlock_wrlock(&cache_lock);
-    
-    CacheNode *current = lru_head;
-    while (current) {
-        CacheNode *next = current->next;
-        free_node(current);
-        current = next;
-    }
-    
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        HashEntry *entry = hash_table[i];
-        while (entry) {
-            HashEntry *next = entry->next;
-            free(entry->url);
-            free(entry);
-            entry = next;
-        }
+    if (!shards) return;
+    stop_loaders();
+    for (unsigned int i = 0; i <= shard_mask; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        // Entries still being sent are freed by their last cache_release()
+        CacheEntry *node;
+        while ((node = any_victim(shard)) != NULL) remove_node(shard, node);
+        free(shard->old_table);
+        free(shard->table);
+        sketch_destroy(shard->sketch);
+        free(shard->heap);
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
     }
-    
-    pthread_rwlock_unlock(&cache_lock);
-    pthread_rwlock_destroy(&cache_lock);
+    free(shards);
+    shards = NULL;
+    epoch_reclaim();
+    slab_destroy();
 }
 
 /**
  * @brief Retrieves an item from the cache.
  */
-char* cache_get(const char *url, int *size) {
-    pthread_rwlock_rdlock(&cache_lock);
-
-    unsigned int index = hash(url);
-    HashEntry *entry = hash_table[index];
-    
-    while (entry) {
-        if (strcmp(entry->url, url) == 0) {
-            // Found it. Now upgrade lock to write to modify LRU list.
-            pthread_rwlock_unlock(&cache_lock);
-            pthread_rwlock_wrlock(&cache_lock);
-
-            // Need to re-check if it's still there after re-acquiring lock
-            // This is a common pattern: optimistic read, then write lock for modification
-            entry = hash_table[index]; // Re-start search from bucket head
-            while (entry) {
-                 if (strcmp(entry->url, url) == 0) {
-                     // Still there, proceed.
-                     lru_detach(entry->node);
-                     lru_attach(entry->node);
-                     
-                     char *data_copy = malloc(entry->node->size);
-                     if (data_copy) {
-                         memcpy(data_copy, entry->node->data, entry->node->size);
-                         *size = entry->node->size;
-                     }
-                     pthread_rwlock_unlock(&cache_lock);
-                     return data_copy;
-                 }
-                 entry = entry->next;
+CacheEntry* cache_acquire(const char *url) {
+    uint64_t hash_val = hash(url);
+    CacheShard *shard = shard_for(hash_val);
+    // Misses count too: that is how a newcomer earns admission
+    if (shard->sketch) sketch_increment(shard->sketch, hash_val);
+
+    if (policy == CACHE_POLICY_CLOCK) {
+        // Lock-free: the epoch keeps every table and entry we can reach allocated
+        epoch_enter();
+        CacheEntry *node = shard_find(shard, hash_val, url);
+        if (node && try_ref(node)) {
+            // Avoid dirtying the cache line when the bit is already set
+            if (!__atomic_load_n(&node->referenced, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&node->referenced, 1, __ATOMIC_RELAXED);
             }
-            // If we are here, item was deleted between lock release/acquire
-            pthread_rwlock_unlock(&cache_lock);
-            return NULL;
+        } else {
+            node = NULL;
         }
-        entry = entry->next;
+        epoch_exit();
+        return node;
     }
 
-    pthread_rwlock_unlock(&cache_lock);
-    return NULL;
+    // A hit reorders the LRU list or GDSF heap, so even lookups need exclusive access;
+    // sharding is what keeps this lock uncontended.
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *node = shard_find(shard, hash_val, url);
+    if (node && !node->in_window && policy == CACHE_POLICY_GDSF) {
+        gdsf_touch(shard, node);
+    } else if (node) {
+        EntryList *list = node->in_window ? &shard->window : &shard->lru;
+        lru_detach(list, node);
+        lru_attach(list, node);
+    }
+    if (node) __atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    return node;
 }
 
 /**
- * @brief Adds an item to the cache.
+ * @brief Drops a reference; the last one frees the entry.
  */
-void cache_put(const char *url, const char *data, int size) {
-    if (size > MAX_ELEMENT_SIZE) {
-        return; // Item is too large to cache
+void cache_release(CacheEntry *entry) {
+    if (!entry || __atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    if (policy == CACHE_POLICY_CLOCK) {
+        // A lock-free reader may still try_ref() the header, but nobody can
+        // reach the contents any more
+        free_segments(entry);
+        epoch_retire(entry, free_node_header);
+    } else {
+        free_node(entry);
     }
+}
 
-    pthread_rwlock_wrlock(&cache_lock);
+/**
+ * @brief Takes another reference to a held entry.
+ */
+void cache_retain(CacheEntry *entry) {
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+}
 
-    // First, check if item already exists. If so, update it.
-    unsigned int index = hash(url);
-    HashEntry *entry = hash_table[index];
-    while (entry) {
-        if (strcmp(entry->url, url) == 0) {
-            // It exists. Just update data and size, and move to front.
-            free(entry->node->data);
-            entry->node->data = malloc(size);
-            if (!entry->node->data) { /* Handle malloc failure */
-                pthread_rwlock_unlock(&cache_lock);
-                return;
-            }
-            memcpy(entry->node->data, data, size);
-            current_cache_size -= entry->node->size;
-            current_cache_size += size;
-            entry->node->size = size;
-
-            lru_detach(entry->node);
-            lru_attach(entry->node);
-            
-            // Check if we need to evict after update
-            evict(0);
-
-            pthread_rwlock_unlock(&cache_lock);
-            return;
+/**
+ * @brief The URL an entry is stored under.
+ */
+const char *cache_entry_url(const CacheEntry *entry) {
+    return entry->url;
+}
+
+/**
+ * @brief Finds the contiguous bytes of an entry at an offset.
+ */
+size_t cache_entry_read(const CacheEntry *entry, size_t offset, const char **data) {
+    // Everything up to the loaded size, segments included, is in place
+    size_t size = __atomic_load_n(&entry->size, __ATOMIC_ACQUIRE);
+    if (offset >= size) return 0;
+
+    const Segment *segment = entry->segments;
+    size_t start = 0;
+    while (offset >= start + segment->capacity) {
+        start += segment->capacity;
+        segment = segment->next;
+    }
+    size_t end = start + segment->capacity < size ? start + segment->capacity : size;
+    *data = segment->data + (offset - start);
+    return end - offset;
+}
+
+/**
+ * @brief The number of bytes an entry holds so far.
+ */
+size_t cache_entry_size(const CacheEntry *entry) {
+    return __atomic_load_n(&entry->size, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Whether an entry is complete, or still or never to be.
+ */
+cache_fill_state_t cache_entry_state(const CacheEntry *entry) {
+    return (cache_fill_state_t)__atomic_load_n(&entry->state, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Waits for an entry being filled to grow past an offset.
+ */
+int cache_entry_wait(CacheEntry *entry, size_t offset, CacheWaiter *waiter) {
+    CacheShard *shard = shard_for(entry->hash_val);
+    pthread_mutex_lock(&shard->lock);
+    waiter->next = entry->waiters;
+    __atomic_store_n(&entry->waiters, waiter, __ATOMIC_SEQ_CST);
+    // Checked after registering; see wake_readers()
+    int ready = __atomic_load_n(&entry->size, __ATOMIC_SEQ_CST) > offset ||
+                __atomic_load_n(&entry->state, __ATOMIC_SEQ_CST) != CACHE_FILLING;
+    if (ready) __atomic_store_n(&entry->waiters, waiter->next, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&shard->lock);
+    return ready ? -1 : 0;
+}
+
+/**
+ * @brief Takes a waiter back before its callback has run.
+ */
+int cache_entry_cancel_wait(CacheEntry *entry, CacheWaiter *waiter) {
+    CacheShard *shard = shard_for(entry->hash_val);
+    int removed = -1;
+    pthread_mutex_lock(&shard->lock);
+    for (CacheWaiter **link = &entry->waiters; *link; link = &(*link)->next) {
+        if (*link == waiter) {
+            __atomic_store_n(link, waiter->next, __ATOMIC_SEQ_CST);
+            removed = 0;
+            break;
         }
-        entry = entry->next;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return removed;
+}
+
+/**
+ * @brief Blocks until an entry holds more than offset bytes or its fill ends.
+ */
+void cache_entry_await(CacheEntry *entry, size_t offset) {
+    WaitState state;
+    state.done = 0;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    CacheWaiter waiter = { wake_blocked, &state, NULL };
+    if (cache_entry_wait(entry, offset, &waiter) == 0) {
+        // The filler always ends its fill, so this needs no timeout
+        pthread_mutex_lock(&state.lock);
+        while (!state.done) pthread_cond_wait(&state.cond, &state.lock);
+        pthread_mutex_unlock(&state.lock);
     }
 
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+}
 
-    // Item does not exist. Create new node and add it.
-    evict(size);
+/**
+ * @brief When the cached response goes stale.
+ */
+time_t cache_entry_fresh_until(const CacheEntry *entry) {
+    return __atomic_load_n(&entry->fresh_until, __ATOMIC_RELAXED);
+}
 
-    CacheNode *new_node = malloc(sizeof(CacheNode));
-    HashEntry *new_entry = malloc(sizeof(HashEntry));
+/**
+ * @brief How long the origin took to deliver the entry.
+ */
+unsigned int cache_entry_fetch_ms(const CacheEntry *entry) {
+    return entry->fetch_ms;
+}
 
-    if (!new_node || !new_entry) {
-        free(new_node); free(new_entry);
-        pthread_rwlock_unlock(&cache_lock);
-        return;
+/**
+ * @brief Extends the entry's freshness.
+ */
+void cache_entry_refresh(CacheEntry *entry, time_t fresh_until) {
+    __atomic_store_n(&entry->fresh_until, fresh_until, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the per-object size limit.
+ */
+size_t cache_max_element_size() {
+    return __atomic_load_n(&MAX_ELEMENT_SIZE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Starts filling a new entry.
+ */
+CacheEntry *cache_fill_begin(const char *url, size_t size_hint) {
+    if (size_hint > cache_max_element_size()) {
+        return NULL; // Item is too large to cache
     }
 
-    new_node->url = strdup(url);
-    new_node->data = malloc(size);
-    if (!new_node->url || !new_node->data) {
-        free(new_node->url); free(new_node->data);
-        free(new_node); free(new_entry);
-        pthread_rwlock_unlock(&cache_lock);
-        return;
+    uint64_t hash_val = hash(url);
+    CacheShard *shard = shard_for(hash_val);
+    size_t url_len = strlen(url);
+    size_t header_size = sizeof(CacheEntry) + url_len + 1;
+
+    CacheEntry *new_node = alloc_evicting(shard, header_size);
+    if (!new_node) return NULL;
+    new_node->segments = new_node->tail = NULL;
+    new_node->tail_used = 0;
+    new_node->size = 0;
+    new_node->state = CACHE_FILLING;
+    new_node->waiters = NULL;
+    new_node->url_len = url_len;
+    memcpy(new_node->url, url, url_len + 1);
+    new_node->charge = slab_chunk_size(header_size);
+    new_node->hash_val = hash_val;
+    new_node->refcount = 1; // The filler's reference
+    new_node->referenced = 0;
+    new_node->in_window = 0;
+    new_node->fetch_ms = 0;
+    new_node->fresh_until = 0;
+
+    if (add_segment(new_node, size_hint ? size_hint : FIRST_SEGMENT_SIZE) != 0) {
+        free_node(new_node);
+        return NULL;
+    }
+    return new_node;
+}
+
+/**
+ * @brief Appends bytes to an entry being filled.
+ */
+int cache_fill_append(CacheEntry *entry, const char *data, size_t len) {
+    size_t size = entry->size; // Only the filler writes it
+    if (size + len > cache_max_element_size()) return -1;
+
+    while (len > 0) {
+        if (entry->tail_used == entry->tail->capacity) {
+            size_t capacity = entry->tail->capacity * 2;
+            if (capacity > MAX_SEGMENT_SIZE) capacity = MAX_SEGMENT_SIZE;
+            if (add_segment(entry, capacity) != 0) return -1;
+        }
+        size_t n = entry->tail->capacity - entry->tail_used;
+        if (n > len) n = len;
+        memcpy(entry->tail->data + entry->tail_used, data, n);
+        entry->tail_used += n;
+        size += n;
+        data += n;
+        len -= n;
+    }
+
+    // Publishes the bytes (and new segments) to lock-free readers
+    __atomic_store_n(&entry->size, size, __ATOMIC_SEQ_CST);
+    wake_readers(entry);
+    return 0;
+}
+
+/**
+ * @brief Completes a fill and publishes the entry.
+ */
+void cache_fill_commit(CacheEntry *entry, unsigned int fetch_ms, time_t fresh_until) {
+    entry->fetch_ms = fetch_ms;
+    __atomic_store_n(&entry->fresh_until, fresh_until, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->state, CACHE_COMPLETE, __ATOMIC_SEQ_CST);
+    wake_readers(entry);
+    link_entry(entry, NULL);
+}
+
+/**
+ * @brief Completes a fill without publishing the entry.
+ */
+void cache_fill_finish(CacheEntry *entry) {
+    __atomic_store_n(&entry->state, CACHE_COMPLETE, __ATOMIC_SEQ_CST);
+    wake_readers(entry);
+}
+
+/**
+ * @brief Abandons a fill that has not been committed.
+ */
+void cache_fill_abort(CacheEntry *entry) {
+    if (__atomic_load_n(&entry->state, __ATOMIC_SEQ_CST) != CACHE_FILLING) return;
+    __atomic_store_n(&entry->state, CACHE_ABORTED, __ATOMIC_SEQ_CST);
+    wake_readers(entry);
+}
+
+/**
+ * @brief Adds a complete item to the cache.
+ */
+void cache_put(const char *url, const char *data, size_t size, unsigned int fetch_ms, time_t fresh_until) {
+    CacheEntry *entry = cache_fill_begin(url, size);
+    if (!entry) return;
+    if (cache_fill_append(entry, data, size) == 0) cache_fill_commit(entry, fetch_ms, fresh_until);
+    cache_release(entry);
+}
+
+/**
+ * @brief Drops the entry stored under a URL.
+ */
+void cache_remove(const char *url) {
+    uint64_t hash_val = hash(url);
+    CacheShard *shard = shard_for(hash_val);
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *node = shard_find(shard, hash_val, url);
+    if (node) remove_node(shard, node);
+    pthread_mutex_unlock(&shard->lock);
+    if (node && policy == CACHE_POLICY_CLOCK) epoch_reclaim();
+    // The lower tier may hold an older copy even when memory held none
+    if (lower_tier) lower_tier->removed(url);
+}
+
+/**
+ * @brief Writes the cache's object count and per-size-class memory usage.
+ */
+void cache_dump_stats(FILE *out) {
+    size_t objects = 0, charged = 0;
+    for (unsigned int i = 0; i <= shard_mask; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        objects += shards[i].count + shards[i].window_count;
+        charged += shards[i].current_size;
+        pthread_mutex_unlock(&shards[i].lock);
     }
-    memcpy(new_node->data, data, size);
-    new_node->size = size;
+    fprintf(out, "Cache: %zu object(s), %zu bytes charged\n", objects, charged);
+    slab_dump_stats(out);
+}
 
-    // Add to LRU list
-    lru_attach(new_node);
+/**
+ * @brief Writes every entry, in eviction order, to a snapshot file.
+ */
+int cache_snapshot_save(const char *path) {
+    if (!shards) return -1;
+    // The cache holds less than the snapshot still being loaded, which is kept
+    if (stop_loaders()) {
+        fprintf(stderr, "Cache snapshot restore cut short; not saving over it.\n");
+        return -1;
+    }
 
-    // Add to hash table
-    new_entry->url = strdup(url);
-    new_entry->node = new_node;
-    new_entry->next = hash_table[index];
-    hash_table[index] = new_entry;
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        fprintf(stderr, "Cache snapshot path too long: %s\n", path);
+        return -1;
+    }
+    uint32_t section_count = shard_mask + 1;
+    SnapshotSection *sections = calloc(section_count, sizeof(SnapshotSection));
+    if (!sections) {
+        perror("calloc for snapshot sections");
+        return -1;
+    }
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        perror("fopen for cache snapshot");
+        free(sections);
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, SNAPSHOT_BUFFER_SIZE);
 
-    current_cache_size += size;
-    printf("Cache Add: %s, Size: %d, Total Cache Size: %zu\n", url, size, current_cache_size);
+    // Without the magic, a snapshot cut short is never mistaken for a whole one
+    SnapshotHeader header = { 0, SNAPSHOT_VERSION, sizeof(SnapshotRecord), section_count, 0, 0 };
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+                 fwrite(sections, sizeof(SnapshotSection), section_count, file) != section_count;
+    uint64_t offset = sizeof(header) + (uint64_t)section_count * sizeof(SnapshotSection);
 
-    pthread_rwlock_unlock(&cache_lock);
+    // One shard at a time, so only its entries are held while they are written
+    for (uint32_t i = 0; i < section_count; i++) {
+        size_t count;
+        SavedEntry *saved = collect_shard(&shards[i], &count);
+        sections[i].offset = offset;
+        for (size_t j = 0; j < count; j++) {
+            if (!failed && write_record(file, &saved[j]) != 0) failed = 1;
+            offset += record_span(&saved[j].record);
+            header.bytes += saved[j].record.size;
+            cache_release(saved[j].node);
+        }
+        sections[i].length = offset - sections[i].offset;
+        sections[i].entries = count;
+        header.entries += count;
+        free(saved);
+    }
+
+    header.magic = SNAPSHOT_MAGIC;
+    if (!failed) {
+        failed = fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1 ||
+                 fwrite(sections, sizeof(SnapshotSection), section_count, file) != section_count;
+    }
+    free(sections);
+    if (fclose(file) != 0) failed = 1;
+    if (failed) {
+        perror("write for cache snapshot");
+        unlink(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) != 0) {
+        perror("rename for cache snapshot");
+        unlink(tmp_path);
+        return -1;
+    }
+    printf("Cache snapshot saved to %s: %llu object(s), %llu bytes.\n", path,
+           (unsigned long long)header.entries, (unsigned long long)header.bytes);
+    return 0;
+}
+
+/**
+ * @brief Starts restoring a snapshot file in the background.
+ */
+int cache_snapshot_load(const char *path) {
+    if (!shards || restore.num_loaders) return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) perror("open for cache snapshot");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "Cache snapshot %s is not a snapshot; starting cold.\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t map_size = (size_t)st.st_size;
+    void *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap for cache snapshot");
+        return -1;
+    }
+    madvise(map, map_size, MADV_SEQUENTIAL);
+
+    SnapshotHeader header;
+    memcpy(&header, map, sizeof(header));
+    const SnapshotSection *sections = (const SnapshotSection *)((const char *)map + sizeof(header));
+    uint64_t data_start = sizeof(header) + (uint64_t)header.sections * sizeof(SnapshotSection);
+    int valid = header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION &&
+                header.record_size == sizeof(SnapshotRecord) && header.sections <= MAX_CACHE_SHARDS &&
+                data_start <= map_size;
+    for (uint32_t i = 0; valid && i < header.sections; i++) {
+        valid = sections[i].offset >= data_start && sections[i].offset <= map_size &&
+                sections[i].length <= map_size - sections[i].offset;
+    }
+    if (!valid) {
+        fprintf(stderr, "Cache snapshot %s is incomplete or from another version; starting cold.\n", path);
+        munmap(map, map_size);
+        return -1;
+    }
+
+    restore.map = map;
+    restore.map_size = map_size;
+    restore.sections = sections;
+    restore.section_count = header.sections;
+    restore.next_section = 0;
+    restore.entries = restore.bytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &restore.started);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus < 1 ? 1 : cpus > MAX_SNAPSHOT_LOADERS ? MAX_SNAPSHOT_LOADERS : (int)cpus;
+    if (wanted > (int)header.sections) wanted = header.sections ? (int)header.sections : 1;
+    restore.running = wanted;
+
+    // Loaders take no signals, so a shutdown never runs on one and joins itself
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    while (restore.num_loaders < wanted &&
+           pthread_create(&restore.loaders[restore.num_loaders], NULL, snapshot_loader, NULL) == 0) {
+        restore.num_loaders++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (restore.num_loaders < wanted) {
+        perror("pthread_create for snapshot loader");
+        // The threads that did start count themselves out; the rest never will
+        if (__atomic_sub_fetch(&restore.running, wanted - restore.num_loaders, __ATOMIC_ACQ_REL) == 0) {
+            munmap(map, map_size);
+            restore.map = NULL;
+        }
+        if (restore.num_loaders == 0) return -1;
+    }
+    printf("Restoring cache snapshot %s: %llu object(s) with %d loader(s).\n", path,
+           (unsigned long long)header.entries, restore.num_loaders);
+    return 0;
 }
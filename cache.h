@@ -6,24 +6,123 @@
  * This module provides a cache to store HTTP responses. It uses a hash table
  * for fast lookups and a doubly-linked list to maintain the
  * least-recently-used (LRU) order for efficient eviction. The cache is
- * thread-safe, using read-write locks for synchronization.
+ * thread-safe: it is split into shards by URL hash, each with its own lock,
+ * table, LRU list and share of the size budget.
+ *
+ * Objects are stored in slab memory whose total is capped at the configured
+ * size, so the limit bounds the memory the cache really holds.
+ *
+ * Lookups hand out reference-counted, immutable entries rather than copies,
+ * so a hit is sent straight from cache memory. An entry stays valid while it
+ * is held, even if it is evicted or replaced in the meantime.
+ *
+ * An entry's contents are a chain of segments that are filled in place as
+ * the response arrives from the origin (cache_fill_begin() and friends), so
+ * a response is never copied or regrown on its way into the cache, and a
+ * fill that outgrows the object size limit is abandoned the moment it does.
+ * Segments are only ever appended to, which lets other holders read the
+ * part that has arrived while the rest is still being written, and wait
+ * for more (cache_entry_wait()). Only complete entries are published for
+ * lookups; a fill in progress is shared with readers explicitly.
+ *
+ * Every entry carries the time it stops being fresh. The cache itself never
+ * looks at it; callers decide whether a stale entry may be served or must
+ * be revalidated with the origin first (see http_cache.h).
+ *
+ * The contents can be saved to a snapshot file at shutdown and restored in
+ * the background at startup, so a restart does not begin with an empty
+ * cache.
  */
 
 #ifndef CACHE_H
 #define CACHE_H
 
 #include <stddef.h>
+#include <stdio.h>
 #include <time.h>
 
+// A cached response; opaque, immutable once complete, and reference counted
+typedef struct CacheEntry CacheEntry;
+
+// How far an entry's contents have been filled
+typedef enum {
+    CACHE_FILLING,  // Still arriving; more bytes may follow
+    CACHE_COMPLETE, // Every byte is in
+    CACHE_ABORTED   // The fill was abandoned; the contents will stay incomplete
+} cache_fill_state_t;
+
+/**
+ * @brief Called when an entry a reader waits on has grown or its fill has
+ * ended, on the thread that filled it.
+ */
+typedef void (*cache_callback_t)(void *arg);
+
+/**
+ * @struct CacheWaiter
+ * @brief A reader waiting for an entry to grow; owned by the caller and left
+ * untouched by the cache once its callback has started.
+ */
+typedef struct CacheWaiter {
+    cache_callback_t callback;
+    void *arg;
+    struct CacheWaiter *next; // Internal
+} CacheWaiter;
+
+// How entries are chosen for eviction
+typedef enum {
+    CACHE_POLICY_LRU,   // Strict LRU; hits take the shard lock to reorder
+    CACHE_POLICY_CLOCK, // CLOCK (approximate LRU); hits are lock-free
+    CACHE_POLICY_GDSF   // Greedy Dual Size Frequency; size- and cost-aware
+} cache_policy_t;
+
+// What GDSF eviction tries to maximize
+typedef enum {
+    CACHE_OBJECTIVE_OBJECTS, // Object hit ratio: small objects are worth keeping
+    CACHE_OBJECTIVE_BYTES,   // Byte hit ratio: every byte is worth the same
+    CACHE_OBJECTIVE_LATENCY  // Origin time saved: slow-to-fetch objects are worth keeping
+} cache_objective_t;
+
+// Which new objects are let into the cache
+typedef enum {
+    CACHE_ADMIT_ALL,     // Every object that fits
+    CACHE_ADMIT_TINYLFU  // W-TinyLFU: only objects more popular than what they displace
+} cache_admission_t;
+
+/**
+ * @struct cache_tier_t
+ * @brief A lower tier that takes over the objects evicted from memory.
+ */
+typedef struct {
+    // Offered every complete object evicted to make room, with a reference
+    // of its own to release. Runs under a shard lock, so it must not block.
+    void (*evicted)(CacheEntry *entry);
+    // The object stored under the URL is no longer valid (see cache_remove())
+    void (*removed)(const char *url);
+} cache_tier_t;
+
+/**
+ * @struct cache_config_t
+ * @brief Limits and layout of the cache.
+ */
+typedef struct {
+    size_t max_size;          // Maximum total size of all objects (in bytes)
+    size_t max_element_size;  // Maximum size of a single object (in bytes)
+    int num_shards;           // Independently locked shards; rounded up to a power of 2
+    cache_policy_t policy;    // Eviction policy
+    cache_admission_t admission; // Admission filter
+    cache_objective_t objective; // What GDSF optimizes (ignored by other policies)
+    const cache_tier_t *lower_tier; // Receives evicted objects; NULL to drop them
+} cache_config_t;
+
 /**
  * @brief Initializes the cache with specified limits.
  *
- * This function must be called before any other cache function.
- * @param max_size The maximum total size of all objects in the cache (in bytes).
- * @param max_element_size The maximum size of a single object (in bytes).
+ * This function must be called before any other cache function. Each shard
+ * gets an equal share of max_size, and no object may exceed one share.
+ * @param config The cache limits and shard count.
  * @return 0 on success, -1 on failure.
  */
-int cache_init(size_t max_size, size_t max_element_size);
+int cache_init(const cache_config_t *config);
 
 /**
  * @brief Frees all resources used by the cache.
@@ -33,25 +132,252 @@ int cache_init(size_t max_size, size_t max_element_size);
 void cache_destroy();
 
 /**
- * @brief Retrieves an object from the cache.
+ * @brief Changes the size budget while the cache is in use.
+ *
+ * Every shard gets its new share at once. A shard over its share is then
+ * evicted down to it a batch at a time, one shard after another, so
+ * lookups are never held up for long and evicted objects still move to the
+ * lower tier. Entries that fit stay where they are. The admission sketch
+ * keeps the width it was created with.
+ * @param max_size The new total budget in bytes.
+ * @param max_element_size The new per-object limit, capped at one share.
+ * @return 0 on success, -1 if the cache is not initialized or max_size is 0.
+ */
+int cache_resize(size_t max_size, size_t max_element_size);
+
+/**
+ * @brief Looks up an object and takes a reference to it.
  *
  * If the object is found, it is marked as recently used.
  * @param url The URL key for the object.
- * @param size Pointer to a variable that will be filled with the object's size.
- * @return A pointer to the cached data if found, otherwise NULL.
- * @note The returned data is a copy and must be freed by the caller.
+ * @return The entry if found, otherwise NULL.
+ * @note The caller must hand the entry back with cache_release().
+ */
+CacheEntry* cache_acquire(const char *url);
+
+/**
+ * @brief Drops a reference taken by cache_acquire().
+ *
+ * The entry's memory is freed once it has been evicted and the last
+ * reference is released.
+ * @param entry The entry (NULL is ignored).
+ */
+void cache_release(CacheEntry *entry);
+
+/**
+ * @brief Takes another reference to a held entry.
+ * @param entry A held entry; the new reference is dropped with cache_release().
+ */
+void cache_retain(CacheEntry *entry);
+
+/**
+ * @brief The URL an entry is stored under.
+ * @param entry A held entry.
+ * @return Its URL, valid until the entry is released.
+ */
+const char *cache_entry_url(const CacheEntry *entry);
+
+/**
+ * @brief Finds the contiguous bytes of an entry at an offset.
+ *
+ * The contents are split into segments, so a read returns at most the rest
+ * of the segment the offset falls in; read again from offset + the result
+ * for the next piece. The first piece always holds the whole response head.
+ * @param entry A held entry.
+ * @param offset Where to read from.
+ * @param data Set to the bytes at offset, valid until the entry is released.
+ * @return The number of bytes at data, or 0 if nothing has arrived past offset (yet).
+ */
+size_t cache_entry_read(const CacheEntry *entry, size_t offset, const char **data);
+
+/**
+ * @brief The number of bytes an entry holds so far.
+ * @param entry A held entry.
+ * @return Its size; final once the entry is complete.
+ */
+size_t cache_entry_size(const CacheEntry *entry);
+
+/**
+ * @brief Whether an entry is complete, or still or never to be.
+ * @param entry A held entry.
+ * @return Its fill state. Entries returned by cache_acquire() are always complete.
+ */
+cache_fill_state_t cache_entry_state(const CacheEntry *entry);
+
+/**
+ * @brief Waits for an entry being filled to grow past an offset.
+ * @param entry A held entry.
+ * @param offset The number of bytes the reader has consumed.
+ * @param waiter Filled-in callback and argument; registered (and owned by the
+ * cache until its callback runs) if 0 is returned.
+ * @return 0 if the callback will run once the entry holds more than offset
+ * bytes or its fill ends, -1 if either is already the case.
+ */
+int cache_entry_wait(CacheEntry *entry, size_t offset, CacheWaiter *waiter);
+
+/**
+ * @brief Takes a waiter back before its callback has run.
+ * @param entry The entry it waits on.
+ * @param waiter The waiter.
+ * @return 0 if it was removed and its callback will not run, -1 if the
+ * callback has already run or is about to.
+ */
+int cache_entry_cancel_wait(CacheEntry *entry, CacheWaiter *waiter);
+
+/**
+ * @brief Blocks until an entry holds more than offset bytes or its fill ends.
+ * @param entry A held entry.
+ * @param offset The number of bytes the caller has consumed.
+ */
+void cache_entry_await(CacheEntry *entry, size_t offset);
+
+/**
+ * @brief When a cached response stops being fresh.
+ * @param entry A held entry.
+ * @return The wall-clock time from which the entry must be revalidated.
+ */
+time_t cache_entry_fresh_until(const CacheEntry *entry);
+
+/**
+ * @brief How long the origin took to deliver a cached response.
+ * @param entry A held, complete entry.
+ * @return The fetch time given to cache_fill_commit(), in milliseconds.
+ */
+unsigned int cache_entry_fetch_ms(const CacheEntry *entry);
+
+/**
+ * @brief Extends an entry's freshness after the origin confirmed it (304).
+ * @param entry A held entry.
+ * @param fresh_until The new time from which it must be revalidated.
+ */
+void cache_entry_refresh(CacheEntry *entry, time_t fresh_until);
+
+/**
+ * @brief The largest object the cache will accept.
+ *
+ * Lets callers skip filling an entry for a response whose length is already
+ * known to be too large.
+ * @return The max element size passed to cache_init or cache_resize (in bytes).
+ */
+size_t cache_max_element_size();
+
+/**
+ * @brief Starts filling a new entry with a response as it arrives.
+ *
+ * The entry is private to the caller (and whoever it shares it with through
+ * cache_retain()) until cache_fill_commit() publishes it.
+ * @param url The URL key for the object.
+ * @param size_hint The object's full size if known, else 0; a known size
+ * is stored in a single segment.
+ * @return The entry, holding the caller's reference, or NULL if the object
+ * is too large or no memory could be had.
+ */
+CacheEntry *cache_fill_begin(const char *url, size_t size_hint);
+
+/**
+ * @brief Appends the next bytes of the response to an entry being filled
+ * and wakes its waiting readers.
+ * @param entry An entry from cache_fill_begin(), still filling.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ * @return 0 on success, -1 if the object would exceed the max element size
+ * or no memory could be had; the caller should then abandon the fill.
+ */
+int cache_fill_append(CacheEntry *entry, const char *data, size_t len);
+
+/**
+ * @brief Completes a fill and publishes the entry for lookups.
+ *
+ * Any object stored under the same URL is replaced. If the cache is full,
+ * objects are evicted to make space as chosen by the eviction policy. With
+ * TinyLFU admission the object may also be dropped later, when it leaves the
+ * admission window, if it is less popular than the objects it would evict.
+ * Readers already holding the entry see it complete either way.
+ * @param entry An entry from cache_fill_begin(), still filling.
+ * @param fetch_ms How long the origin took to deliver it, in milliseconds;
+ * weighs the object under the latency objective.
+ * @param fresh_until The wall-clock time from which it must be revalidated.
  */
-char* cache_get(const char *url, int *size);
+void cache_fill_commit(CacheEntry *entry, unsigned int fetch_ms, time_t fresh_until);
 
 /**
- * @brief Adds an object to the cache.
+ * @brief Completes a fill without publishing it.
  *
- * If the cache is full, the least recently used objects are evicted to make space.
- * If the object is larger than the max element size, it is not cached.
+ * For a response that is stored in another form instead (see
+ * http_compress.h): readers already holding the entry see it complete, but
+ * lookups never find it, and its memory goes with the last reference.
+ * @param entry An entry from cache_fill_begin(), still filling.
+ */
+void cache_fill_finish(CacheEntry *entry);
+
+/**
+ * @brief Abandons a fill that has not been committed (no-op otherwise).
+ *
+ * Readers are woken and see the entry aborted; its memory goes once the
+ * last of them, and the filler, release it.
+ * @param entry An entry from cache_fill_begin().
+ */
+void cache_fill_abort(CacheEntry *entry);
+
+/**
+ * @brief Adds a complete object to the cache (a fill in one step).
  * @param url The URL key for the object.
  * @param data The data to be cached.
  * @param size The size of the data.
+ * @param fetch_ms How long the origin took to deliver it, in milliseconds.
+ * @param fresh_until The wall-clock time from which it must be revalidated.
+ */
+void cache_put(const char *url, const char *data, size_t size, unsigned int fetch_ms, time_t fresh_until);
+
+/**
+ * @brief Drops the object stored under a URL, if any, here and in the
+ * lower tier.
+ *
+ * Used when a response shows that the stored copy is no longer valid.
+ * Holders of the entry keep it until they release it.
+ * @param url The URL key for the object.
+ */
+void cache_remove(const char *url);
+
+/**
+ * @brief Writes every object in the cache to a snapshot file, shard by
+ * shard and in eviction order, together with what each has earned under
+ * the policy (recency position, reference bit, GDSF hits, sketch count).
+ *
+ * Meant for shutdown, so the next process can start warm with
+ * cache_snapshot_load(). Only one shard's entries are held at a time, and
+ * only while collected under its lock; the cache keeps serving meanwhile.
+ * The file is written next to path and renamed over it once complete.
+ * If a restore is still in progress it is stopped and nothing is written,
+ * since the snapshot being restored holds more than the cache does.
+ * @param path The snapshot file.
+ * @return 0 on success, -1 if nothing was written (the previous snapshot
+ * is kept).
+ */
+int cache_snapshot_save(const char *path);
+
+/**
+ * @brief Starts restoring a snapshot written by cache_snapshot_save().
+ *
+ * Returns as soon as the file is mapped and checked: loader threads then
+ * stream its sections into the cache in parallel while requests are
+ * already being served, and report when done. Objects are rehashed, so the
+ * shard count and size may differ from the run that saved them; ones that
+ * no longer fit are evicted coldest first. An object fetched by live
+ * traffic before its saved copy is restored keeps the newer copy.
+ * @param path The snapshot file.
+ * @return 0 if a restore started, -1 if there is no valid snapshot (the
+ * cache starts cold).
+ */
+int cache_snapshot_load(const char *path);
+
+/**
+ * @brief Writes the cache's object count and per-size-class memory usage.
+ *
+ * Reports, for every slab size class, how many chunks are in use and how
+ * much of its pages' memory is lost to rounding and free chunks.
+ * @param out The stream to write to.
  */
-void cache_put(const char *url, const char *data, int size);
+void cache_dump_stats(FILE *out);
 
 #endif
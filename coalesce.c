@@ -0,0 +1,276 @@
+/**
+ * @file coalesce.c
+ * @author Shubham More
+ * @brief Implementation of the in-flight fetch registry.
+ *
+ * In-flight fetches are kept in a fixed hash of buckets, each a mutex and a
+ * short list; only URLs that are being fetched right now are in it, so the
+ * lists stay short without ever resizing. A fetch record holds the URL, the
+ * list of waiters and, once streaming, a reference to the entry being
+ * filled. Ending or streaming a fetch takes the waiters under the bucket
+ * lock and runs the callbacks after dropping it, so a callback may freely
+ * take other locks (an event loop's handover list, a waiter's condition).
+ */
+
+#include "coalesce.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define COALESCE_BUCKETS 256 // Power of 2 for efficient modulo
+
+// A fetch in flight and the requests waiting on it
+typedef struct InflightFetch {
+    struct InflightFetch *next;
+    CoalesceWaiter *waiters;
+    CacheEntry *stream;     // Entry being filled, once shared
+    char url[];
+} InflightFetch;
+
+typedef struct {
+    pthread_mutex_t lock;
+    InflightFetch *fetches;
+} Bucket;
+
+// State shared by coalesce_wait() and its callback
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+} WaitState;
+
+static Bucket buckets[COALESCE_BUCKETS];
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief The bucket for a URL (FNV-1a).
+ */
+static Bucket *bucket_for(const char *url) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)url; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return &buckets[h & (COALESCE_BUCKETS - 1)];
+}
+
+/**
+ * @brief Finds the fetch record for a URL. Caller must hold the bucket lock.
+ */
+static InflightFetch **find_fetch(Bucket *bucket, const char *url) {
+    InflightFetch **link = &bucket->fetches;
+    while (*link && strcmp((*link)->url, url) != 0) link = &(*link)->next;
+    return link;
+}
+
+/**
+ * @brief Runs the callbacks of a list of waiters taken off a record.
+ */
+static void wake_waiters(CoalesceWaiter *waiter) {
+    while (waiter) {
+        // A woken waiter may be gone as soon as its callback returns
+        CoalesceWaiter *next = waiter->next;
+        waiter->callback(waiter->arg);
+        waiter = next;
+    }
+}
+
+/**
+ * @brief Wakes a blocked coalesce_wait() (waiter callback).
+ */
+static void wake_blocked(void *arg) {
+    WaitState *state = (WaitState *)arg;
+    pthread_mutex_lock(&state->lock);
+    state->done = 1;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Initializes the bucket locks.
+ */
+int coalesce_init() {
+    for (int i = 0; i < COALESCE_BUCKETS; i++) {
+        if (pthread_mutex_init(&buckets[i].lock, NULL) != 0) {
+            perror("pthread_mutex_init for coalescing bucket");
+            while (--i >= 0) pthread_mutex_destroy(&buckets[i].lock);
+            return -1;
+        }
+        buckets[i].fetches = NULL;
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees the registry.
+ */
+void coalesce_destroy() {
+    for (int i = 0; i < COALESCE_BUCKETS; i++) {
+        while (buckets[i].fetches) {
+            InflightFetch *fetch = buckets[i].fetches;
+            buckets[i].fetches = fetch->next;
+            cache_release(fetch->stream);
+            free(fetch);
+        }
+        pthread_mutex_destroy(&buckets[i].lock);
+    }
+}
+
+/**
+ * @brief Joins the fetch for a URL, or starts one.
+ */
+coalesce_status_t coalesce_join(const char *url, CoalesceWaiter *waiter) {
+    Bucket *bucket = bucket_for(url);
+    waiter->stream = NULL;
+    pthread_mutex_lock(&bucket->lock);
+
+    InflightFetch *fetch = *find_fetch(bucket, url);
+    if (fetch && fetch->stream) {
+        cache_retain(fetch->stream);
+        waiter->stream = fetch->stream;
+        pthread_mutex_unlock(&bucket->lock);
+        return COALESCE_STREAMING;
+    }
+    if (fetch) {
+        waiter->next = fetch->waiters;
+        fetch->waiters = waiter;
+        pthread_mutex_unlock(&bucket->lock);
+        return COALESCE_WAITING;
+    }
+
+    // Without a record the caller still fetches; it just has no company
+    size_t url_len = strlen(url);
+    fetch = malloc(sizeof(InflightFetch) + url_len + 1);
+    if (fetch) {
+        memcpy(fetch->url, url, url_len + 1);
+        fetch->waiters = NULL;
+        fetch->stream = NULL;
+        fetch->next = bucket->fetches;
+        bucket->fetches = fetch;
+    } else {
+        perror("malloc for in-flight fetch");
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return COALESCE_LEADER;
+}
+
+/**
+ * @brief Removes a waiter that has not been woken yet.
+ */
+int coalesce_cancel(const char *url, CoalesceWaiter *waiter) {
+    Bucket *bucket = bucket_for(url);
+    int removed = -1;
+    pthread_mutex_lock(&bucket->lock);
+    InflightFetch *fetch = *find_fetch(bucket, url);
+    if (fetch) {
+        for (CoalesceWaiter **link = &fetch->waiters; *link; link = &(*link)->next) {
+            if (*link == waiter) {
+                *link = waiter->next;
+                removed = 0;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return removed;
+}
+
+/**
+ * @brief Shares the entry being filled with the waiters.
+ */
+void coalesce_stream(const char *url, CacheEntry *entry) {
+    Bucket *bucket = bucket_for(url);
+    pthread_mutex_lock(&bucket->lock);
+    InflightFetch *fetch = *find_fetch(bucket, url);
+    if (!fetch || fetch->stream) {
+        pthread_mutex_unlock(&bucket->lock);
+        return;
+    }
+    cache_retain(entry);
+    fetch->stream = entry;
+    CoalesceWaiter *waiters = fetch->waiters;
+    fetch->waiters = NULL;
+    for (CoalesceWaiter *waiter = waiters; waiter; waiter = waiter->next) {
+        cache_retain(entry);
+        waiter->stream = entry;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    wake_waiters(waiters);
+}
+
+/**
+ * @brief Ends a fetch and wakes its waiters.
+ */
+void coalesce_finish(const char *url) {
+    Bucket *bucket = bucket_for(url);
+    pthread_mutex_lock(&bucket->lock);
+    InflightFetch **link = find_fetch(bucket, url);
+    InflightFetch *fetch = *link;
+    if (fetch) *link = fetch->next;
+    pthread_mutex_unlock(&bucket->lock);
+    if (!fetch) return;
+
+    wake_waiters(fetch->waiters);
+    cache_release(fetch->stream);
+    free(fetch);
+}
+
+/**
+ * @brief Joins the fetch for a URL and blocks until it ends or streams.
+ */
+coalesce_status_t coalesce_wait(const char *url, int timeout_ms, CacheEntry **stream) {
+    WaitState state;
+    state.done = 0;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    CoalesceWaiter waiter = { wake_blocked, &state, NULL, NULL };
+    coalesce_status_t status = coalesce_join(url, &waiter);
+
+    if (status == COALESCE_WAITING) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&state.lock);
+        int rc = 0;
+        while (!state.done && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&state.cond, &state.lock, &deadline);
+        }
+        if (!state.done) {
+            pthread_mutex_unlock(&state.lock);
+            if (coalesce_cancel(url, &waiter) == 0) {
+                status = COALESCE_TIMEOUT;
+            } else {
+                // Lost the race with the leader; its callback still needs this frame
+                pthread_mutex_lock(&state.lock);
+                while (!state.done) pthread_cond_wait(&state.cond, &state.lock);
+            }
+        }
+        if (status != COALESCE_TIMEOUT) {
+            pthread_mutex_unlock(&state.lock);
+            status = waiter.stream ? COALESCE_STREAMING : COALESCE_DONE;
+        }
+    }
+    *stream = waiter.stream;
+
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+    return status;
+}
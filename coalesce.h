@@ -0,0 +1,119 @@
+/**
+ * @file coalesce.h
+ * @author Shubham More
+ * @brief Interface for collapsing concurrent cache misses on the same URL
+ * into a single origin fetch.
+ *
+ * When a popular object expires, every request for it misses at once. The
+ * first miss registers an in-flight fetch for the URL and becomes its
+ * leader; later misses join it as waiters instead of fetching themselves,
+ * and are woken when the leader finishes (by then the response is in the
+ * cache, if it could be stored). Waiters give up after a timeout and fetch
+ * on their own, so a slow or stuck leader delays them but cannot block them.
+ *
+ * A leader that is filling a cache entry whose final size is already known
+ * can hand it out with coalesce_stream(); from then on waiters, and later
+ * joiners, are given the entry to send along while it is still arriving,
+ * instead of waiting for the whole response.
+ *
+ * Waiters are owned by the caller, which makes the module usable both from
+ * blocking worker threads (coalesce_wait()) and from event loops that park
+ * a connection and resume it from the wake-up callback.
+ */
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "cache.h"
+
+// Result of joining the fetch for a URL
+typedef enum {
+    COALESCE_LEADER,    // Nothing was in flight: fetch, then call coalesce_finish()
+    COALESCE_WAITING,   // A fetch is in flight; the waiter's callback runs when it ends
+    COALESCE_DONE,      // The fetch waited for has ended; look the URL up again
+    COALESCE_TIMEOUT,   // The fetch waited for did not end in time
+    COALESCE_STREAMING  // The response is arriving in a cache entry that can be read along
+} coalesce_status_t;
+
+/**
+ * @brief Called once the fetch a waiter joined has ended or started
+ * streaming, on the leader's thread.
+ */
+typedef void (*coalesce_callback_t)(void *arg);
+
+/**
+ * @struct CoalesceWaiter
+ * @brief A request waiting on another's fetch; owned by the caller and left
+ * untouched by the module once its callback has started.
+ */
+typedef struct CoalesceWaiter {
+    coalesce_callback_t callback;
+    void *arg;
+    CacheEntry *stream;          // Set if woken to read along; the waiter's own reference
+    struct CoalesceWaiter *next; // Internal
+} CoalesceWaiter;
+
+/**
+ * @brief Initializes the in-flight fetch registry.
+ * @return 0 on success, -1 on failure.
+ */
+int coalesce_init();
+
+/**
+ * @brief Frees the registry. No fetch may be in flight.
+ */
+void coalesce_destroy();
+
+/**
+ * @brief Joins the fetch for a URL, or starts one.
+ * @param url The cache key.
+ * @param waiter Filled-in callback and argument; registered (and owned by
+ * the module until its callback runs) on COALESCE_WAITING. Its stream is
+ * set on COALESCE_STREAMING, and by the time the callback runs if the
+ * response is to be read along; otherwise it is NULL.
+ * @return COALESCE_LEADER, COALESCE_WAITING or COALESCE_STREAMING.
+ */
+coalesce_status_t coalesce_join(const char *url, CoalesceWaiter *waiter);
+
+/**
+ * @brief Takes a waiter back before its fetch has ended (e.g. on timeout).
+ * @param url The URL the waiter joined.
+ * @param waiter The waiter.
+ * @return 0 if it was removed and its callback will not run, -1 if the
+ * callback has already run or is about to.
+ */
+int coalesce_cancel(const char *url, CoalesceWaiter *waiter);
+
+/**
+ * @brief Shares the cache entry the leader is filling with the waiters.
+ *
+ * Only worth doing when the entry cannot end up abandoned for being too
+ * large: readers that have started sending cannot fall back to a fetch of
+ * their own. Waiting requests are woken with the entry, and later joiners
+ * get it at once, until the fetch ends. No-op if nothing is in flight for
+ * the URL or an entry is already being shared.
+ * @param url The URL the caller became leader for.
+ * @param entry The entry being filled; the registry takes its own references.
+ */
+void coalesce_stream(const char *url, CacheEntry *entry);
+
+/**
+ * @brief Ends the leader's fetch and wakes every waiter.
+ *
+ * The callbacks run on the calling thread before this returns.
+ * @param url The URL the caller became leader for.
+ */
+void coalesce_finish(const char *url);
+
+/**
+ * @brief Joins the fetch for a URL and blocks until it ends.
+ * @param url The cache key.
+ * @param timeout_ms How long to wait for another request's fetch.
+ * @param stream Set to the entry to read along on COALESCE_STREAMING (a
+ * reference for the caller to release), else NULL.
+ * @return COALESCE_LEADER (returned at once), COALESCE_DONE,
+ * COALESCE_STREAMING or COALESCE_TIMEOUT.
+ */
+coalesce_status_t coalesce_wait(const char *url, int timeout_ms, CacheEntry **stream);
+
+#endif
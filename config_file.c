@@ -0,0 +1,127 @@
+/**
+ * @file config_file.c
+ * @author Shubham More
+ * @brief Implementation of the configuration file reader.
+ *
+ * The whole file is read into one buffer and split in place: every line,
+ * key and value is cut out of it with a terminating NUL, so the settings
+ * handed to the caller need no allocations of their own and stay valid for
+ * as long as the caller keeps the buffer.
+ */
+
+#include "config_file.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define MAX_CONFIG_SIZE (1024 * 1024) // Anything larger is not a configuration file
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Reads a whole file into a NUL-terminated buffer.
+ * @return The buffer (free with free()), or NULL on error.
+ */
+static char *read_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        log_message(LOG_LEVEL_ERROR, "Cannot open configuration file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    size_t cap = 4096, len = 0;
+    char *text = malloc(cap);
+    while (text) {
+        len += fread(text + len, 1, cap - len - 1, file);
+        if (len < cap - 1) break;
+        if (cap >= MAX_CONFIG_SIZE) {
+            log_message(LOG_LEVEL_ERROR, "Configuration file %s is too large", path);
+            free(text);
+            text = NULL;
+            break;
+        }
+        char *grown = realloc(text, cap * 2);
+        if (!grown) free(text);
+        text = grown;
+        cap *= 2;
+    }
+    if (text && ferror(file)) {
+        log_message(LOG_LEVEL_ERROR, "Cannot read configuration file %s: %s", path, strerror(errno));
+        free(text);
+        text = NULL;
+    }
+    fclose(file);
+    if (text) text[len] = '\0';
+    return text;
+}
+
+/**
+ * @brief Trims whitespace from both ends of a string, in place.
+ * @return The first character that is not whitespace.
+ */
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+/**
+ * @brief Finds where a line's comment starts: a '#' at the start of the
+ * line or after whitespace. One inside a word, as in a path or URL, is
+ * part of the value.
+ * @return The '#', or NULL if the line has no comment.
+ */
+static char *find_comment(char *line) {
+    for (char *p = line; (p = strchr(p, '#')) != NULL; p++) {
+        if (p == line || isspace((unsigned char)p[-1])) return p;
+    }
+    return NULL;
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Reads a configuration file and applies its settings in order.
+ */
+char *config_file_load(const char *path, config_setting_fn apply, void *arg) {
+    char *text = read_file(path);
+    if (!text) return NULL;
+
+    char *line = text;
+    for (int number = 1; line; number++) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        char *comment = find_comment(line);
+        if (comment) *comment = '\0';
+
+        char *setting = trim(line);
+        line = next;
+        if (*setting == '\0') continue;
+
+        char *equals = strchr(setting, '=');
+        if (!equals) {
+            log_message(LOG_LEVEL_ERROR, "%s:%d: expected 'key = value'", path, number);
+            free(text);
+            return NULL;
+        }
+        *equals = '\0';
+        char *key = trim(setting);
+        char *value = trim(equals + 1);
+        if (*key == '\0' || *value == '\0') {
+            log_message(LOG_LEVEL_ERROR, "%s:%d: expected 'key = value'", path, number);
+            free(text);
+            return NULL;
+        }
+        if (apply(arg, key, value) != 0) {
+            log_message(LOG_LEVEL_ERROR, "%s:%d: invalid setting '%s = %s'", path, number, key, value);
+            free(text);
+            return NULL;
+        }
+    }
+    return text;
+}
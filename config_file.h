@@ -0,0 +1,39 @@
+/**
+ * @file config_file.h
+ * @author Shubham More
+ * @brief Interface for reading the proxy's configuration file.
+ *
+ * The file holds one setting per line, as "key = value". Blank lines are
+ * skipped, and a '#' at the start of a line or after whitespace starts a
+ * comment that runs to the end of the line; one inside a word is kept.
+ * Keys and values are trimmed of surrounding whitespace. The module only
+ * knows the syntax; what a key means is up to the caller, which is handed
+ * each setting in file order.
+ */
+
+#ifndef CONFIG_FILE_H
+#define CONFIG_FILE_H
+
+/**
+ * @brief Applies one setting.
+ * @param arg The argument given to config_file_load().
+ * @param key The setting's name.
+ * @param value Its value, never empty.
+ * @return 0 on success, -1 if the key is unknown or the value invalid.
+ */
+typedef int (*config_setting_fn)(void *arg, const char *key, const char *value);
+
+/**
+ * @brief Reads a configuration file and applies its settings in order.
+ *
+ * Errors are logged with the file name and line number. Settings before
+ * the bad line have been applied by then.
+ * @param path The file.
+ * @param apply Called with every setting.
+ * @param arg Passed to apply.
+ * @return The file's text, which the keys and values handed to apply point
+ * into (free with free() once none are used), or NULL on error.
+ */
+char *config_file_load(const char *path, config_setting_fn apply, void *arg);
+
+#endif
@@ -0,0 +1,787 @@
+/**
+ * @file disk_cache.c
+ * @author Shubham More
+ * @brief Implementation of the on-disk second tier of the cache.
+ *
+ * The tier's space is a ring of segment files of equal size, each mapped
+ * into memory whole. A segment starts with a small header (its generation
+ * and how much of it is used) followed by records appended back to back:
+ * a record header, the URL and the stored response. Only the writer thread
+ * appends, copying an evicted entry into the mapping; the kernel writes the
+ * pages back in its own time. When the current segment cannot take the
+ * next record the writer moves on to the next one in the ring, dropping
+ * whatever that held and giving it a new generation.
+ *
+ * An in-memory hash of URL to record locates objects. Every record written
+ * is also appended to an index journal as a fixed 32-byte entry (URL
+ * hash, segment, generation, offset and freshness), and every removal as a
+ * tombstone. At startup the journal is replayed, each entry checked against
+ * the record it points to (a reused segment has a newer generation, and a
+ * record cut short by a crash has no valid header), and then rewritten with
+ * just the live objects; the writer compacts it the same way whenever dead
+ * entries pile up.
+ *
+ * Hits are served from the segment file with sendfile(). A segment being
+ * read is pinned by a reader count, and the writer waits for it to drop to
+ * zero before reusing the segment, so a response is never overwritten
+ * while it is being sent.
+ */
+
+#define _GNU_SOURCE
+#include "disk_cache.h"
+#include "http_response.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DISK_MIN_SEGMENT_SIZE (64UL * 1024 * 1024) // Segments are at least this large
+#define DISK_MAX_SEGMENTS 256       // Segments grow past the minimum to stay within this many files
+#define DISK_MIN_SEGMENTS 2         // One being filled, one being read while the other is reused
+#define SEGMENT_HEADER_SIZE 64      // Records start this far into a segment
+#define DISK_QUEUE_SLOTS 1024       // Evicted entries waiting for the writer
+#define DISK_QUEUE_BYTES (64 * 1024 * 1024) // Memory they may hold while waiting
+#define DISK_COMPACT_SLACK 4096     // Dead journal entries tolerated beyond the live count
+#define MIN_INDEX_BUCKETS 1024
+#define MAX_INDEX_BUCKETS (1 << 22)
+#define BYTES_PER_BUCKET (64 * 1024) // Expected disk space per object, to size the hash
+#define SEGMENT_MAGIC 0x47455350u   // "PSEG"
+#define RECORD_MAGIC 0x43455250u    // "PREC"
+#define INDEX_TOMBSTONE UINT32_MAX  // Segment number of a removal in the journal
+
+// --- Structs ---
+
+// Start of every segment file
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;    // Bumped on every reuse; 0 if never used
+    uint64_t segment_size;  // Size the segment was laid out for
+    uint64_t used;          // Bytes in use, this header included
+} SegmentHeader;
+
+// Precedes each stored response in a segment
+typedef struct {
+    uint32_t magic;
+    uint32_t url_len;
+    uint64_t data_len;
+    uint32_t generation;    // Of the segment when written
+    uint32_t persistent;    // The response is self-delimiting
+} DiskRecord;
+
+// One entry of the index journal
+typedef struct {
+    uint64_t hash;          // Of the URL
+    uint64_t offset;        // Of the record in its segment
+    int64_t fresh_until;
+    uint32_t segment;       // INDEX_TOMBSTONE for a removal
+    uint32_t generation;    // Of the segment when written
+} IndexRecord;
+
+// An object stored on disk, in the in-memory index
+typedef struct DiskObject {
+    struct DiskObject *next;
+    struct DiskObject *seg_prev, *seg_next; // Objects in the same segment
+    uint64_t hash;
+    int segment;
+    off_t offset;           // Of the record
+    off_t data_offset;      // Of the response
+    size_t length;
+    time_t fresh_until;
+    int persistent;
+    char url[];
+} DiskObject;
+
+// A mapped segment file
+typedef struct {
+    int fd;
+    char *map;
+    int readers;            // Hits being sent from it
+    DiskObject *objects;    // Indexed objects stored in it
+} DiskSegment;
+
+// Work for the writer: an entry to store, or a removal to journal
+typedef struct {
+    CacheEntry *entry;      // NULL for a removal
+    uint64_t hash;
+} DiskJob;
+
+// --- Global State ---
+static int enabled = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Guards everything below
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;    // Writer waits for jobs
+static pthread_cond_t readers_cond = PTHREAD_COND_INITIALIZER; // Writer waits for a segment's readers
+static pthread_t writer;
+static int stopping = 0;
+
+static char *directory = NULL;
+static size_t segment_size;
+static int num_segments;
+static DiskSegment *segments = NULL;
+static int current;                 // Segment being appended to
+static uint32_t next_generation = 1;
+
+static DiskObject **buckets = NULL;
+static size_t bucket_mask;
+static size_t object_count = 0;
+static size_t stored_bytes = 0;
+
+static DiskJob queue[DISK_QUEUE_SLOTS];
+static size_t queue_head = 0, queue_count = 0, queue_bytes = 0;
+static uint64_t writing_hash;       // URL of the entry the writer is copying
+static int writing_cancelled;       // It was removed meanwhile
+
+static int index_fd = -1;
+static size_t journal_records = 0;
+static int compact_needed = 0;      // A removal could not be queued
+
+static unsigned long objects_written = 0, objects_dropped = 0, disk_hits = 0;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Hashes a URL (FNV-1a). Stored in the journal, so it must not
+ * change between runs.
+ */
+static uint64_t url_hash(const char *url, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)url[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * @brief The header of a mapped segment.
+ */
+static SegmentHeader *segment_header(int index) {
+    return (SegmentHeader *)segments[index].map;
+}
+
+/**
+ * @brief Builds the path of a file in the disk cache directory.
+ */
+static void file_path(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/%s", directory, name);
+}
+
+/**
+ * @brief Finds the link to the object stored under a URL. Caller must hold the lock.
+ */
+static DiskObject **find_object(uint64_t hash, const char *url) {
+    DiskObject **link = &buckets[hash & bucket_mask];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->url, url) != 0)) link = &(*link)->next;
+    return link;
+}
+
+/**
+ * @brief Unlinks and frees an object. Caller must hold the lock.
+ */
+static void unlink_object(DiskObject **link) {
+    DiskObject *object = *link;
+    *link = object->next;
+    if (object->seg_prev) object->seg_prev->seg_next = object->seg_next;
+    else segments[object->segment].objects = object->seg_next;
+    if (object->seg_next) object->seg_next->seg_prev = object->seg_prev;
+    object_count--;
+    stored_bytes -= object->length;
+    free(object);
+}
+
+/**
+ * @brief Adds an object to the index, replacing any under the same URL.
+ * Caller must hold the lock.
+ */
+static void insert_object(DiskObject *object) {
+    DiskObject **link = find_object(object->hash, object->url);
+    if (*link) unlink_object(link);
+    object->next = buckets[object->hash & bucket_mask];
+    buckets[object->hash & bucket_mask] = object;
+    object->seg_prev = NULL;
+    object->seg_next = segments[object->segment].objects;
+    if (object->seg_next) object->seg_next->seg_prev = object;
+    segments[object->segment].objects = object;
+    object_count++;
+    stored_bytes += object->length;
+}
+
+/**
+ * @brief Creates an index object for a record.
+ */
+static DiskObject *new_object(uint64_t hash, int segment, off_t offset, const DiskRecord *record,
+                              const char *url, time_t fresh_until) {
+    DiskObject *object = malloc(sizeof(DiskObject) + record->url_len + 1);
+    if (!object) {
+        perror("malloc for disk cache object");
+        return NULL;
+    }
+    object->hash = hash;
+    object->segment = segment;
+    object->offset = offset;
+    object->data_offset = offset + sizeof(DiskRecord) + record->url_len;
+    object->length = record->data_len;
+    object->fresh_until = fresh_until;
+    object->persistent = record->persistent;
+    memcpy(object->url, url, record->url_len);
+    object->url[record->url_len] = '\0';
+    return object;
+}
+
+/**
+ * @brief Drops every indexed object stored in a segment, walking just that
+ * segment's list rather than the whole index. Caller must hold the lock.
+ */
+static void drop_segment_objects(int segment) {
+    while (segments[segment].objects) {
+        DiskObject *object = segments[segment].objects;
+        unlink_object(find_object(object->hash, object->url));
+    }
+}
+
+/**
+ * @brief Drops every indexed object whose URL has a hash (a journal
+ * tombstone). Caller must hold the lock.
+ */
+static void drop_hash(uint64_t hash) {
+    DiskObject **link = &buckets[hash & bucket_mask];
+    while (*link) {
+        if ((*link)->hash == hash) unlink_object(link);
+        else link = &(*link)->next;
+    }
+}
+
+/**
+ * @brief Opens and maps a segment file, laying it out afresh unless it
+ * holds a segment of the configured size.
+ * @return 0 on success, -1 on failure.
+ */
+static int open_segment(int index) {
+    char name[32], path[4096];
+    snprintf(name, sizeof(name), "segment-%03d", index);
+    file_path(path, sizeof(path), name);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open for disk cache segment");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size != segment_size && ftruncate(fd, segment_size) != 0)) {
+        perror("ftruncate for disk cache segment");
+        close(fd);
+        return -1;
+    }
+    // Reserve the blocks up front: storing into a mapping with no space behind it raises SIGBUS
+    if (fallocate(fd, 0, 0, segment_size) != 0 && errno != EOPNOTSUPP) {
+        perror("fallocate for disk cache segment");
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap for disk cache segment");
+        close(fd);
+        return -1;
+    }
+    segments[index].fd = fd;
+    segments[index].map = map;
+    segments[index].readers = 0;
+    segments[index].objects = NULL;
+
+    SegmentHeader *header = segment_header(index);
+    if (header->magic != SEGMENT_MAGIC || header->segment_size != segment_size ||
+        header->used < SEGMENT_HEADER_SIZE || header->used > segment_size) {
+        header->magic = SEGMENT_MAGIC;
+        header->generation = 0;
+        header->segment_size = segment_size;
+        header->used = SEGMENT_HEADER_SIZE;
+    }
+    if (header->generation >= next_generation) next_generation = header->generation + 1;
+    return 0;
+}
+
+/**
+ * @brief Checks a journal entry against the record it points to and, if
+ * it is intact, indexes the object.
+ */
+static void load_record(const IndexRecord *entry, time_t now) {
+    if (entry->segment == INDEX_TOMBSTONE) {
+        drop_hash(entry->hash);
+        return;
+    }
+    if (entry->segment >= (uint32_t)num_segments || entry->fresh_until <= now) return;
+    const SegmentHeader *header = segment_header(entry->segment);
+    if (entry->generation == 0 || entry->generation != header->generation) return; // Reused since
+
+    uint64_t offset = entry->offset;
+    if (offset < SEGMENT_HEADER_SIZE || offset + sizeof(DiskRecord) > header->used) return;
+    const DiskRecord *record = (const DiskRecord *)(segments[entry->segment].map + offset);
+    if (record->magic != RECORD_MAGIC || record->generation != entry->generation ||
+        record->url_len > header->used || record->data_len > header->used ||
+        offset + sizeof(DiskRecord) + record->url_len + record->data_len > header->used) return;
+
+    const char *url = (const char *)(record + 1);
+    if (url_hash(url, record->url_len) != entry->hash) return;
+    DiskObject *object = new_object(entry->hash, entry->segment, offset, record, url, entry->fresh_until);
+    if (object) insert_object(object);
+}
+
+/**
+ * @brief Replays the index journal into the in-memory index.
+ */
+static void load_index(time_t now) {
+    char path[4096];
+    file_path(path, sizeof(path), "index");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return; // First run
+
+    IndexRecord entries[256];
+    ssize_t got;
+    while ((got = read(fd, entries, sizeof(entries))) > 0) {
+        for (size_t i = 0; i < (size_t)got / sizeof(IndexRecord); i++) load_record(&entries[i], now);
+        // A journal cut short by a crash may end in a partial entry; drop it
+        if (got % sizeof(IndexRecord) != 0) break;
+    }
+    close(fd);
+}
+
+/**
+ * @brief Rewrites the index journal with one entry per live object and
+ * reopens it for appending. Only the writer thread (or init) calls this.
+ * @param records The entries.
+ * @param count The number of entries.
+ * @return 0 on success, -1 on failure (the old journal stays in use).
+ */
+static int write_index(const IndexRecord *records, size_t count) {
+    char path[4096], tmp_path[4096];
+    file_path(path, sizeof(path), "index");
+    file_path(tmp_path, sizeof(tmp_path), "index.tmp");
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open for disk cache index");
+        return -1;
+    }
+    size_t total = count * sizeof(IndexRecord), written = 0;
+    while (written < total) {
+        ssize_t n = write(fd, (const char *)records + written, total - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("write for disk cache index");
+            close(fd);
+            unlink(tmp_path);
+            return -1;
+        }
+        written += n;
+    }
+    if (rename(tmp_path, path) != 0) {
+        perror("rename for disk cache index");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open for disk cache index");
+        return -1;
+    }
+    if (index_fd >= 0) close(index_fd);
+    index_fd = fd;
+    journal_records = count;
+    return 0;
+}
+
+/**
+ * @brief Snapshots the live objects as journal entries. Caller must hold the lock.
+ * @return The entries (to free), or NULL if no memory could be had.
+ */
+static IndexRecord *snapshot_index(size_t *count) {
+    IndexRecord *records = malloc((object_count ? object_count : 1) * sizeof(IndexRecord));
+    if (!records) {
+        perror("malloc for disk cache index");
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i <= bucket_mask; i++) {
+        for (DiskObject *object = buckets[i]; object; object = object->next) {
+            IndexRecord *record = &records[n++];
+            record->hash = object->hash;
+            record->offset = object->offset;
+            record->fresh_until = object->fresh_until;
+            record->segment = object->segment;
+            record->generation = segment_header(object->segment)->generation;
+        }
+    }
+    *count = n;
+    return records;
+}
+
+/**
+ * @brief Rewrites the journal from the in-memory index. Caller must hold
+ * the lock, which is dropped while writing.
+ */
+static void compact_index() {
+    size_t count;
+    IndexRecord *records = snapshot_index(&count);
+    if (!records) return;
+    compact_needed = 0;
+    pthread_mutex_unlock(&lock);
+    // Removals made meanwhile are still queued, so they land in the new journal
+    write_index(records, count); // On failure the old journal stays in use
+    free(records);
+    pthread_mutex_lock(&lock);
+}
+
+/**
+ * @brief Appends an entry to the index journal (writer thread only).
+ */
+static void append_index(const IndexRecord *record) {
+    if (index_fd < 0) return;
+    ssize_t n;
+    do {
+        n = write(index_fd, record, sizeof(*record));
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)sizeof(*record)) {
+        perror("write for disk cache index");
+        compact_needed = 1;
+        return;
+    }
+    journal_records++;
+}
+
+/**
+ * @brief Empties the next segment in the ring and makes it current.
+ * Caller must hold the lock; waits for hits still being sent from it.
+ */
+static void start_segment(int index) {
+    drop_segment_objects(index);
+    while (segments[index].readers > 0) pthread_cond_wait(&readers_cond, &lock);
+    SegmentHeader *header = segment_header(index);
+    header->generation = next_generation++;
+    header->used = SEGMENT_HEADER_SIZE;
+    current = index;
+}
+
+/**
+ * @brief Appends an entry to the current segment and indexes it (writer
+ * thread only). Caller must hold the lock, which is dropped while copying.
+ */
+static void write_entry(CacheEntry *entry, uint64_t hash) {
+    const char *url = cache_entry_url(entry);
+    size_t url_len = strlen(url);
+    size_t data_len = cache_entry_size(entry);
+    size_t record_len = (sizeof(DiskRecord) + url_len + data_len + 7) & ~(size_t)7;
+    if (record_len > segment_size - SEGMENT_HEADER_SIZE) {
+        objects_dropped++;
+        return;
+    }
+
+    if (segment_header(current)->used + record_len > segment_size) {
+        start_segment((current + 1) % num_segments);
+    }
+    int segment = current;
+    SegmentHeader *header = segment_header(segment);
+    off_t offset = header->used;
+    uint32_t generation = header->generation;
+    pthread_mutex_unlock(&lock);
+
+    // Nobody reads past the header's used mark, so the copy needs no lock
+    char *dest = segments[segment].map + offset;
+    DiskRecord record = { RECORD_MAGIC, (uint32_t)url_len, data_len, generation, 0 };
+    memcpy(dest + sizeof(DiskRecord), url, url_len);
+    HttpResponse resp; // Finds out whether the stored response is self-delimiting
+    http_response_init(&resp, 0);
+    char *body = dest + sizeof(DiskRecord) + url_len;
+    size_t copied = 0;
+    while (copied < data_len) {
+        const char *data;
+        size_t len = cache_entry_read(entry, copied, &data);
+        memcpy(body + copied, data, len);
+        if (resp.state != RESPONSE_ERROR && http_response_feed(&resp, data, len) != (ssize_t)len) {
+            resp.keep_alive = 0; // Trailing bytes past the response
+        }
+        copied += len;
+    }
+    record.persistent = http_response_reusable(&resp);
+    http_response_free(&resp);
+    memcpy(dest, &record, sizeof(record));
+
+    time_t fresh_until = cache_entry_fresh_until(entry);
+    pthread_mutex_lock(&lock);
+    header->used = offset + record_len;
+    if (writing_cancelled) return; // Removed while being copied
+
+    DiskObject *object = new_object(hash, segment, offset, &record, url, fresh_until);
+    if (!object) return;
+    insert_object(object);
+    objects_written++;
+    IndexRecord index_record = { hash, (uint64_t)offset, fresh_until, (uint32_t)segment, generation };
+    append_index(&index_record);
+}
+
+/**
+ * @brief Writes queued entries to disk until the tier is destroyed.
+ */
+static void *writer_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!queue_count && !compact_needed && !stopping) pthread_cond_wait(&work_cond, &lock);
+        if (stopping) break;
+
+        if (queue_count) {
+            DiskJob job = queue[queue_head];
+            queue_head = (queue_head + 1) % DISK_QUEUE_SLOTS;
+            queue_count--;
+            if (job.entry) {
+                queue_bytes -= cache_entry_size(job.entry);
+                writing_hash = job.hash;
+                writing_cancelled = 0;
+                write_entry(job.entry, job.hash);
+                writing_hash = 0;
+                pthread_mutex_unlock(&lock);
+                cache_release(job.entry);
+                pthread_mutex_lock(&lock);
+            } else {
+                IndexRecord tombstone = { job.hash, 0, 0, INDEX_TOMBSTONE, 0 };
+                append_index(&tombstone);
+            }
+        }
+        if (compact_needed || journal_records > 2 * object_count + DISK_COMPACT_SLACK) compact_index();
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * @brief Unmaps and closes the segments opened so far and frees the index.
+ */
+static void close_all() {
+    for (size_t i = 0; buckets && i <= bucket_mask; i++) {
+        while (buckets[i]) unlink_object(&buckets[i]);
+    }
+    free(buckets);
+    buckets = NULL;
+    for (int i = 0; segments && i < num_segments; i++) {
+        if (segments[i].map) munmap(segments[i].map, segment_size);
+        if (segments[i].fd >= 0) close(segments[i].fd);
+    }
+    free(segments);
+    segments = NULL;
+    if (index_fd >= 0) close(index_fd);
+    index_fd = -1;
+    free(directory);
+    directory = NULL;
+}
+
+// --- Public API Functions ---
+
+/**
+ * @brief Opens the disk tier and loads its index.
+ */
+int disk_cache_init(const char *dir, size_t max_size) {
+    segment_size = (max_size / DISK_MAX_SEGMENTS + (1 << 20) - 1) & ~(size_t)((1 << 20) - 1);
+    if (segment_size < DISK_MIN_SEGMENT_SIZE) segment_size = DISK_MIN_SEGMENT_SIZE;
+    num_segments = max_size / segment_size;
+    if (num_segments < DISK_MIN_SEGMENTS) {
+        fprintf(stderr, "Disk cache needs at least %lu MB.\n", DISK_MIN_SEGMENTS * DISK_MIN_SEGMENT_SIZE >> 20);
+        return -1;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir for disk cache");
+        return -1;
+    }
+    directory = strdup(dir);
+
+    size_t num_buckets = MIN_INDEX_BUCKETS;
+    while (num_buckets < max_size / BYTES_PER_BUCKET && num_buckets < MAX_INDEX_BUCKETS) num_buckets <<= 1;
+    buckets = calloc(num_buckets, sizeof(DiskObject *));
+    segments = calloc(num_segments, sizeof(DiskSegment));
+    if (!directory || !buckets || !segments) {
+        perror("calloc for disk cache");
+        close_all();
+        return -1;
+    }
+    bucket_mask = num_buckets - 1;
+    for (int i = 0; i < num_segments; i++) segments[i].fd = -1;
+
+    uint32_t newest = 0;
+    current = 0;
+    for (int i = 0; i < num_segments; i++) {
+        if (open_segment(i) != 0) {
+            close_all();
+            return -1;
+        }
+        if (segment_header(i)->generation > newest) {
+            newest = segment_header(i)->generation;
+            current = i;
+        }
+    }
+    if (newest == 0) start_segment(0); // Fresh directory
+
+    // Replay the journal, then start it over with only what is still live
+    load_index(time(NULL));
+    size_t count;
+    IndexRecord *records = snapshot_index(&count);
+    if (!records || write_index(records, count) != 0) {
+        free(records);
+        close_all();
+        return -1;
+    }
+    free(records);
+
+    stopping = 0;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        perror("pthread_create for disk cache writer");
+        close_all();
+        return -1;
+    }
+    enabled = 1;
+    printf("Disk cache in %s: %d segment(s) of %zu MB, %zu object(s) loaded.\n",
+           dir, num_segments, segment_size >> 20, object_count);
+    return 0;
+}
+
+/**
+ * @brief Stops the writer and closes the disk tier.
+ */
+void disk_cache_destroy() {
+    if (!enabled) return;
+    pthread_mutex_lock(&lock);
+    enabled = 0;
+    stopping = 1;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+
+    for (; queue_count > 0; queue_count--) {
+        cache_release(queue[queue_head].entry);
+        queue_head = (queue_head + 1) % DISK_QUEUE_SLOTS;
+    }
+    queue_bytes = 0;
+    close_all();
+}
+
+/**
+ * @brief Queues an evicted entry for the writer.
+ */
+void disk_cache_store(CacheEntry *entry) {
+    size_t size = cache_entry_size(entry);
+    // The index is only consulted for fresh objects; a stale one is not worth the write
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED) || cache_entry_state(entry) != CACHE_COMPLETE ||
+        cache_entry_fresh_until(entry) <= time(NULL)) {
+        cache_release(entry);
+        return;
+    }
+    const char *url = cache_entry_url(entry);
+    uint64_t hash = url_hash(url, strlen(url));
+
+    pthread_mutex_lock(&lock);
+    if (stopping || queue_count == DISK_QUEUE_SLOTS || queue_bytes + size > DISK_QUEUE_BYTES) {
+        // The writer is behind; dropping keeps evictions from waiting on the disk
+        objects_dropped++;
+        pthread_mutex_unlock(&lock);
+        cache_release(entry);
+        return;
+    }
+    DiskJob *job = &queue[(queue_head + queue_count) % DISK_QUEUE_SLOTS];
+    job->entry = entry;
+    job->hash = hash;
+    queue_count++;
+    queue_bytes += size;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Drops the object stored under a URL, on disk or queued.
+ */
+void disk_cache_remove(const char *url) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) return;
+    uint64_t hash = url_hash(url, strlen(url));
+
+    pthread_mutex_lock(&lock);
+    int journaled = 0;
+    DiskObject **link = find_object(hash, url);
+    if (*link) {
+        unlink_object(link);
+        journaled = 1;
+    }
+    // A queued copy would bring the object back once written
+    for (size_t i = 0; i < queue_count; i++) {
+        DiskJob *job = &queue[(queue_head + i) % DISK_QUEUE_SLOTS];
+        if (job->entry && job->hash == hash && strcmp(cache_entry_url(job->entry), url) == 0) {
+            queue_bytes -= cache_entry_size(job->entry);
+            cache_release(job->entry);
+            job->entry = NULL; // Journals the removal instead
+        }
+    }
+    if (writing_hash == hash) {
+        writing_cancelled = 1;
+        journaled = 1;
+    }
+    if (journaled) {
+        if (queue_count < DISK_QUEUE_SLOTS) {
+            DiskJob *job = &queue[(queue_head + queue_count) % DISK_QUEUE_SLOTS];
+            job->entry = NULL;
+            job->hash = hash;
+            queue_count++;
+        } else {
+            compact_needed = 1; // The rewritten journal leaves it out just the same
+        }
+        pthread_cond_signal(&work_cond);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Looks up a fresh object on disk and pins its segment.
+ */
+int disk_cache_lookup(const char *url, time_t now, DiskHit *hit) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) return -1;
+    uint64_t hash = url_hash(url, strlen(url));
+
+    pthread_mutex_lock(&lock);
+    DiskObject *object = *find_object(hash, url);
+    if (!object || object->fresh_until <= now) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    segments[object->segment].readers++;
+    disk_hits++;
+    hit->fd = segments[object->segment].fd;
+    hit->offset = object->data_offset;
+    hit->length = object->length;
+    hit->persistent = object->persistent;
+    hit->segment = object->segment;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/**
+ * @brief Unpins the segment of a disk hit.
+ */
+void disk_cache_release(DiskHit *hit) {
+    pthread_mutex_lock(&lock);
+    if (--segments[hit->segment].readers == 0) pthread_cond_broadcast(&readers_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Writes the disk tier's counters.
+ */
+void disk_cache_dump_stats(FILE *out) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&lock);
+    fprintf(out, "Disk cache: %zu object(s), %zu bytes in %d segment(s) of %zu MB; "
+                 "%lu written, %lu dropped, %lu hit(s), %zu queued\n",
+            object_count, stored_bytes, num_segments, segment_size >> 20,
+            objects_written, objects_dropped, disk_hits, queue_count);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,102 @@
+/**
+ * @file disk_cache.h
+ * @author Shubham More
+ * @brief Interface for the persistent, on-disk second tier of the cache.
+ *
+ * Objects evicted from the in-memory cache to make room are written to
+ * disk instead of being lost, so the cache can hold far more than fits in
+ * memory, and what it holds survives a restart. Writes happen on a
+ * background thread fed by a queue: an eviction only queues the entry,
+ * and the request path never waits for the disk. An object whose entry
+ * was evicted from memory is found here and sent to the client with
+ * sendfile(), straight from the page cache.
+ *
+ * The disk space is split into a ring of fixed-size segment files that are
+ * filled in turn, append-only; once the ring is full the oldest segment is
+ * emptied and reused, so eviction from disk is FIFO and costs nothing.
+ * Every object written is recorded in a compact index journal, which is
+ * read back (and compacted) at startup for a warm restart.
+ */
+
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include "cache.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * @struct DiskHit
+ * @brief An object found on disk, held until disk_cache_release(). Its
+ * segment is not reused while it is held.
+ */
+typedef struct {
+    int fd;         // Segment file holding the object
+    off_t offset;   // Where the response starts in it; may be advanced while sending
+    size_t length;  // Bytes of the response from offset; may be reduced while sending
+    int persistent; // The stored response is self-delimiting, so the client may persist
+    int segment;    // Internal
+} DiskHit;
+
+/**
+ * @brief Opens (or creates) the disk tier and loads its index.
+ *
+ * Segment files and the index live in dir, which is created if missing.
+ * Objects from a previous run whose records are intact become available
+ * again; everything else in the directory is reused as free space.
+ * @param dir Directory holding the segment files and the index.
+ * @param max_size Disk space to use, in bytes; rounded down to whole segments.
+ * @return 0 on success, -1 on failure.
+ */
+int disk_cache_init(const char *dir, size_t max_size);
+
+/**
+ * @brief Stops the writer thread and closes the disk tier.
+ *
+ * Objects still queued for writing are dropped; everything written so far
+ * is kept for the next run.
+ */
+void disk_cache_destroy();
+
+/**
+ * @brief Queues an entry evicted from memory for writing to disk.
+ *
+ * Never blocks: stale or incomplete entries, and any that arrive while
+ * the queue is full, are dropped instead. Meant as the cache's lower tier
+ * (see cache_tier_t); a no-op unless the disk tier is initialized.
+ * @param entry A complete entry; the disk tier takes over this reference.
+ */
+void disk_cache_store(CacheEntry *entry);
+
+/**
+ * @brief Drops the object stored on disk under a URL, if any, including
+ * one still queued for writing.
+ * @param url The URL key for the object.
+ */
+void disk_cache_remove(const char *url);
+
+/**
+ * @brief Looks up a fresh object on disk.
+ * @param url The URL key for the object.
+ * @param now The current wall-clock time; stale objects are not returned.
+ * @param hit Filled in if the object is found.
+ * @return 0 if found (release the hit with disk_cache_release()), -1 if not
+ * or the disk tier is not in use.
+ */
+int disk_cache_lookup(const char *url, time_t now, DiskHit *hit);
+
+/**
+ * @brief Hands back an object found by disk_cache_lookup().
+ * @param hit The hit; its segment may be reused once every hit on it is back.
+ */
+void disk_cache_release(DiskHit *hit);
+
+/**
+ * @brief Writes the disk tier's object count, space used and write counters.
+ * @param out The stream to write to.
+ */
+void disk_cache_dump_stats(FILE *out);
+
+#endif
@@ -0,0 +1,476 @@
+/**
+ * @file dns_cache.c
+ * @author Shubham More
+ * @brief Implementation of the asynchronous, TTL-aware resolver cache.
+ *
+ * Entries live in a chained hash table keyed by host and port and protected
+ * by a single mutex. A lookup that cannot be answered from the table marks
+ * the entry in flight and appends it to a job queue; resolver threads pop
+ * jobs, run getaddrinfo() (so /etc/hosts and nsswitch keep working) without
+ * holding the lock, publish the result, wake blocking callers and run the
+ * callbacks of asynchronous ones. Concurrent misses for the same name share
+ * a single resolution.
+ *
+ * getaddrinfo() does not report record TTLs, so after publishing an answer
+ * the resolver thread asks the DNS server for the records directly with
+ * res_nquery() and shortens the entry's lifetime to the smallest TTL
+ * seen. Names the DNS does not know (e.g. from /etc/hosts) keep the
+ * configured maximum.
+ */
+
+#define _GNU_SOURCE
+#include "dns_cache.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DNS_TABLE_SIZE 256      // Power of 2 for efficient modulo
+#define MAX_DNS_HOST 256        // Longest host name cached
+#define MAX_DNS_PORT 32         // Longest port / service name cached
+#define MAX_DNS_ENTRIES 4096    // Entries kept before expired ones are swept
+#define MIN_DNS_TTL 1           // Floor on any TTL so a result is always usable once
+
+// An asynchronous caller waiting for an in-flight lookup
+typedef struct DnsWaiter {
+    dns_callback_t callback;
+    void *arg;
+    struct DnsWaiter *next;
+} DnsWaiter;
+
+// The cached result for one host:port
+typedef struct DnsEntry {
+    char host[MAX_DNS_HOST];
+    char port[MAX_DNS_PORT];
+    DnsAddrs addrs;
+    int resolved;               // A result (positive or negative) is present
+    int failed;                 // The last result was a failure
+    time_t resolved_at;
+    time_t expires;             // Fresh until
+    time_t stale_until;         // A positive answer may be served until
+    int in_flight;              // Queued for, or being handled by, a resolver
+    int probing;                // A resolver is still reading its record TTL
+    DnsWaiter *waiters;
+    struct DnsEntry *next;      // For handling hash collisions
+    struct DnsEntry *next_job;  // Link in the job queue
+} DnsEntry;
+
+// --- Global Resolver State ---
+static int max_ttl = 0;
+static int negative_ttl = 0;
+static int stale_ttl = 0;
+static int entry_count = 0;
+static time_t last_sweep = 0;
+static DnsEntry *dns_table[DNS_TABLE_SIZE];
+static DnsEntry *job_head = NULL;
+static DnsEntry *job_tail = NULL;
+static int stopping = 0;
+static pthread_t *resolver_threads = NULL;
+static int num_resolver_threads = 0;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;   // A job was queued
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;  // A job finished
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Seconds on the monotonic clock.
+ */
+static time_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @brief FNV-1a hash of a host and port.
+ */
+static unsigned int hash_key(const char *host, const char *port) {
+    unsigned int h = 2166136261u;
+    for (; *host; ++host) {
+        h ^= (unsigned char)*host;
+        h *= 16777619u;
+    }
+    h ^= ':';
+    h *= 16777619u;
+    for (; *port; ++port) {
+        h ^= (unsigned char)*port;
+        h *= 16777619u;
+    }
+    return h & (DNS_TABLE_SIZE - 1);
+}
+
+/**
+ * @brief Drops entries nobody is resolving whose answers can no longer be
+ * served. Runs at most once per second. Caller must hold dns_lock.
+ */
+static void sweep_expired(time_t now) {
+    if (now == last_sweep) return;
+    last_sweep = now;
+    for (int i = 0; i < DNS_TABLE_SIZE; i++) {
+        DnsEntry **link = &dns_table[i];
+        while (*link) {
+            DnsEntry *e = *link;
+            int dead = e->resolved && now >= e->expires && (e->failed || now >= e->stale_until);
+            if (dead && !e->in_flight && !e->probing) {
+                *link = e->next;
+                free(e);
+                entry_count--;
+            } else {
+                link = &e->next;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Finds (and optionally creates) the entry for a host:port.
+ * Caller must hold dns_lock.
+ */
+static DnsEntry *find_entry(const char *host, const char *port, int create, time_t now) {
+    unsigned int index = hash_key(host, port);
+    for (DnsEntry *e = dns_table[index]; e; e = e->next) {
+        if (strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0) return e;
+    }
+    if (!create) return NULL;
+    if (strlen(host) >= MAX_DNS_HOST || strlen(port) >= MAX_DNS_PORT) return NULL;
+
+    if (entry_count >= MAX_DNS_ENTRIES) sweep_expired(now);
+
+    DnsEntry *e = calloc(1, sizeof(DnsEntry));
+    if (!e) return NULL;
+    strcpy(e->host, host);
+    strcpy(e->port, port);
+    e->next = dns_table[index];
+    dns_table[index] = e;
+    entry_count++;
+    return e;
+}
+
+/**
+ * @brief Hands an entry to the resolver threads unless one already has it.
+ * Caller must hold dns_lock.
+ */
+static void queue_job(DnsEntry *e) {
+    if (e->in_flight) return;
+    e->in_flight = 1;
+    e->next_job = NULL;
+    if (job_tail) job_tail->next_job = e;
+    else job_head = e;
+    job_tail = e;
+    pthread_cond_signal(&job_cond);
+}
+
+/**
+ * @brief Answers from an entry if it holds a usable result.
+ * Caller must hold dns_lock.
+ * @return DNS_OK or DNS_FAILED, or DNS_PENDING if it must be resolved.
+ */
+static dns_status_t answer_from_entry(DnsEntry *e, DnsAddrs *out, time_t now) {
+    if (!e->resolved) return DNS_PENDING;
+    if (now < e->expires) {
+        if (e->failed) return DNS_FAILED;
+        *out = e->addrs;
+        return DNS_OK;
+    }
+    if (!e->failed && now < e->stale_until) {
+        // Serve the expired answer and refresh it behind the caller's back
+        *out = e->addrs;
+        queue_job(e);
+        return DNS_OK;
+    }
+    return DNS_PENDING;
+}
+
+/**
+ * @brief Orders getaddrinfo() results for connecting: duplicates removed,
+ * and the two families interleaved starting with the preferred one.
+ */
+static void collect_addresses(struct addrinfo *res, DnsAddrs *out) {
+    dns_sockaddr_t first[DNS_MAX_ADDRS], second[DNS_MAX_ADDRS];
+    int n_first = 0, n_second = 0;
+    int preferred = res ? res->ai_family : AF_UNSPEC;
+
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) continue;
+        if (ai->ai_addrlen > sizeof(dns_sockaddr_t)) continue;
+
+        dns_sockaddr_t addr;
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+
+        dns_sockaddr_t *list = ai->ai_family == preferred ? first : second;
+        int *count = ai->ai_family == preferred ? &n_first : &n_second;
+        int duplicate = 0;
+        for (int i = 0; i < *count; i++) {
+            if (memcmp(&list[i], &addr, sizeof(addr)) == 0) duplicate = 1;
+        }
+        if (!duplicate && *count < DNS_MAX_ADDRS) list[(*count)++] = addr;
+    }
+
+    out->count = 0;
+    for (int i = 0; out->count < DNS_MAX_ADDRS && (i < n_first || i < n_second); i++) {
+        if (i < n_first) out->addrs[out->count++] = first[i];
+        if (i < n_second && out->count < DNS_MAX_ADDRS) out->addrs[out->count++] = second[i];
+    }
+}
+
+/**
+ * @brief Resolves a name with getaddrinfo().
+ * @return 0 on success, -1 if the name does not resolve.
+ */
+static int resolve_name(const char *host, const char *port, int flags, DnsAddrs *out) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC; // IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        if (!(flags & AI_NUMERICHOST)) log_message(LOG_LEVEL_WARN, "getaddrinfo (%s): %s", host, gai_strerror(rc));
+        return -1;
+    }
+    collect_addresses(res, out);
+    freeaddrinfo(res);
+    return out->count > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Asks the DNS server for the smallest TTL on a name's records.
+ * @return The TTL in seconds, or -1 if the DNS has no answer for it.
+ */
+static int query_ttl(res_state state, const char *host, int family) {
+    unsigned char answer[NS_PACKETSZ * 4];
+    ns_type type = family == AF_INET6 ? ns_t_aaaa : ns_t_a;
+    int len = res_nquery(state, host, ns_c_in, type, answer, sizeof(answer));
+    if (len <= 0) return -1;
+
+    ns_msg msg;
+    if (ns_initparse(answer, len, &msg) < 0) return -1;
+
+    // Addresses reached through a CNAME chain expire with the shortest link
+    long ttl = -1;
+    int count = ns_msg_count(msg, ns_s_an);
+    for (int i = 0; i < count; i++) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+        if (ns_rr_type(rr) != type && ns_rr_type(rr) != ns_t_cname) continue;
+        if (ttl < 0 || (long)ns_rr_ttl(rr) < ttl) ttl = ns_rr_ttl(rr);
+    }
+    return (int)ttl;
+}
+
+/**
+ * @brief Entry point of a resolver thread.
+ */
+static void *resolver_main(void *args) {
+    (void)args;
+    struct __res_state state;
+    int have_state = res_ninit(&state) == 0;
+    if (have_state) {
+        // TTL probes are best effort; never hold a resolver up for long
+        state.retrans = 1;
+        state.retry = 1;
+    }
+
+    pthread_mutex_lock(&dns_lock);
+    while (1) {
+        while (!stopping && !job_head) pthread_cond_wait(&job_cond, &dns_lock);
+        if (stopping) break;
+
+        DnsEntry *e = job_head;
+        job_head = e->next_job;
+        if (!job_head) job_tail = NULL;
+
+        char host[MAX_DNS_HOST], port[MAX_DNS_PORT];
+        strcpy(host, e->host);
+        strcpy(port, e->port);
+        pthread_mutex_unlock(&dns_lock);
+
+        DnsAddrs addrs;
+        int ok = resolve_name(host, port, 0, &addrs) == 0;
+        time_t now = now_seconds();
+
+        pthread_mutex_lock(&dns_lock);
+        e->resolved = 1;
+        e->failed = !ok;
+        e->resolved_at = now;
+        if (ok) {
+            e->addrs = addrs;
+            e->expires = now + max_ttl;
+            e->stale_until = e->expires + stale_ttl;
+        } else {
+            // A failed refresh drops the stale answer too
+            e->expires = now + negative_ttl;
+            e->stale_until = e->expires;
+        }
+        DnsWaiter *waiters = e->waiters;
+        e->waiters = NULL;
+        e->in_flight = 0;
+        e->probing = ok && have_state;
+        pthread_cond_broadcast(&done_cond);
+        pthread_mutex_unlock(&dns_lock);
+
+        while (waiters) {
+            DnsWaiter *w = waiters;
+            waiters = w->next;
+            w->callback(w->arg);
+            free(w);
+        }
+
+        // Shorten the lifetime to the records' own TTL, if the DNS has them
+        int ttl = (ok && have_state) ? query_ttl(&state, host, addrs.addrs[0].sa.sa_family) : -1;
+
+        pthread_mutex_lock(&dns_lock);
+        e->probing = 0;
+        if (ttl >= 0 && !e->failed && e->resolved_at == now) {
+            if (ttl < MIN_DNS_TTL) ttl = MIN_DNS_TTL;
+            if (now + ttl < e->expires) {
+                e->expires = now + ttl;
+                e->stale_until = e->expires + stale_ttl;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    if (have_state) res_nclose(&state);
+    return NULL;
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Starts the resolver threads.
+ */
+int dns_cache_init(int num_resolvers, int ttl_cap, int failure_ttl, int stale_window) {
+    if (num_resolvers < 1) num_resolvers = 1;
+    max_ttl = ttl_cap > MIN_DNS_TTL ? ttl_cap : MIN_DNS_TTL;
+    negative_ttl = failure_ttl > MIN_DNS_TTL ? failure_ttl : MIN_DNS_TTL;
+    stale_ttl = stale_window > 0 ? stale_window : 0;
+    stopping = 0;
+
+    resolver_threads = calloc(num_resolvers, sizeof(pthread_t));
+    if (!resolver_threads) {
+        perror("calloc for resolver threads");
+        return -1;
+    }
+    for (num_resolver_threads = 0; num_resolver_threads < num_resolvers; num_resolver_threads++) {
+        if (pthread_create(&resolver_threads[num_resolver_threads], NULL, resolver_main, NULL) != 0) {
+            perror("pthread_create (resolver)");
+            dns_cache_destroy();
+            return -1;
+        }
+    }
+
+    printf("Resolver cache initialized with %d resolver thread(s), TTL cap %ds.\n",
+           num_resolvers, max_ttl);
+    return 0;
+}
+
+/**
+ * @brief Stops the resolver threads and frees the cache.
+ */
+void dns_cache_destroy() {
+    pthread_mutex_lock(&dns_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&dns_lock);
+
+    for (int i = 0; i < num_resolver_threads; i++) pthread_join(resolver_threads[i], NULL);
+    free(resolver_threads);
+    resolver_threads = NULL;
+    num_resolver_threads = 0;
+
+    pthread_mutex_lock(&dns_lock);
+    for (int i = 0; i < DNS_TABLE_SIZE; i++) {
+        DnsEntry *e = dns_table[i];
+        while (e) {
+            DnsEntry *next = e->next;
+            while (e->waiters) {
+                DnsWaiter *w = e->waiters;
+                e->waiters = w->next;
+                free(w);
+            }
+            free(e);
+            e = next;
+        }
+        dns_table[i] = NULL;
+    }
+    job_head = job_tail = NULL;
+    entry_count = 0;
+    pthread_mutex_unlock(&dns_lock);
+}
+
+/**
+ * @brief Looks a host up without blocking.
+ */
+dns_status_t dns_cache_lookup(const char *host, const char *port, DnsAddrs *out,
+                              dns_callback_t callback, void *arg) {
+    // Literal addresses need no resolver and no cache entry
+    if (resolve_name(host, port, AI_NUMERICHOST, out) == 0) return DNS_OK;
+
+    time_t now = now_seconds();
+    pthread_mutex_lock(&dns_lock);
+    DnsEntry *e = find_entry(host, port, 1, now);
+    if (!e || !resolver_threads) {
+        pthread_mutex_unlock(&dns_lock);
+        return DNS_FAILED;
+    }
+
+    dns_status_t status = answer_from_entry(e, out, now);
+    if (status == DNS_PENDING) {
+        if (callback) {
+            DnsWaiter *w = malloc(sizeof(DnsWaiter));
+            if (!w) {
+                pthread_mutex_unlock(&dns_lock);
+                return DNS_FAILED;
+            }
+            w->callback = callback;
+            w->arg = arg;
+            w->next = e->waiters;
+            e->waiters = w;
+        }
+        queue_job(e);
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return status;
+}
+
+/**
+ * @brief Looks a host up, waiting for the resolver if needed.
+ */
+int dns_cache_resolve(const char *host, const char *port, DnsAddrs *out) {
+    if (resolve_name(host, port, AI_NUMERICHOST, out) == 0) return 0;
+
+    pthread_mutex_lock(&dns_lock);
+    if (!resolver_threads) {
+        // Resolver cache not running: resolve in the calling thread
+        pthread_mutex_unlock(&dns_lock);
+        return resolve_name(host, port, 0, out);
+    }
+
+    dns_status_t status;
+    while (1) {
+        time_t now = now_seconds();
+        DnsEntry *e = find_entry(host, port, 1, now);
+        if (!e) {
+            status = DNS_FAILED;
+            break;
+        }
+        status = answer_from_entry(e, out, now);
+        if (status != DNS_PENDING) break;
+        queue_job(e);
+        pthread_cond_wait(&done_cond, &dns_lock);
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return status == DNS_OK ? 0 : -1;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file dns_cache.h
+ * @author Shubham More
+ * @brief Interface for the asynchronous, TTL-aware resolver cache.
+ *
+ * Origin host names are resolved by a small pool of resolver threads and
+ * the results kept in memory keyed by "host:port". Positive answers live
+ * for the TTL of the DNS records (capped by a configured maximum), failed
+ * lookups are cached for a short negative TTL, and an expired answer keeps
+ * being served for a stale window while a refresh runs in the background.
+ * Lookups never block the caller unless it asks to wait, so an event loop
+ * can park a connection and resume it from a completion callback.
+ */
+
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DNS_MAX_ADDRS 8 // Addresses kept per host:port
+
+// One resolved socket address (IPv4 or IPv6, port included)
+typedef union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} dns_sockaddr_t;
+
+/**
+ * @struct DnsAddrs
+ * @brief The addresses of a host in connection order: families are
+ * interleaved (first family first) so a dead IPv6 or IPv4 path costs a
+ * single failed attempt before the other family is tried.
+ */
+typedef struct {
+    int count;
+    dns_sockaddr_t addrs[DNS_MAX_ADDRS];
+} DnsAddrs;
+
+// Result of a non-blocking lookup
+typedef enum {
+    DNS_OK,       // Addresses filled in (possibly stale, with a refresh queued)
+    DNS_FAILED,   // The name does not resolve (possibly a cached failure)
+    DNS_PENDING   // A resolver thread is working on it; the callback will run
+} dns_status_t;
+
+/**
+ * @brief Called from a resolver thread once a pending lookup has finished.
+ * The result is in the cache by then; look it up again to read it.
+ */
+typedef void (*dns_callback_t)(void *arg);
+
+/**
+ * @brief Starts the resolver threads and sets the cache policy.
+ * @param num_resolvers Resolver threads (at least 1).
+ * @param max_ttl Upper bound, in seconds, on how long an answer is fresh;
+ * also used when the record TTL cannot be determined.
+ * @param negative_ttl Seconds a failed lookup is remembered.
+ * @param stale_ttl Seconds an expired answer may still be served while it
+ * is refreshed in the background.
+ * @return 0 on success, -1 on failure.
+ */
+int dns_cache_init(int num_resolvers, int max_ttl, int negative_ttl, int stale_ttl);
+
+/**
+ * @brief Stops the resolver threads and frees every cached entry.
+ */
+void dns_cache_destroy();
+
+/**
+ * @brief Looks a host up without blocking.
+ * @param host The host name or numeric address.
+ * @param port The port (numeric string or service name).
+ * @param out Filled with the addresses on DNS_OK.
+ * @param callback Invoked on a resolver thread when a DNS_PENDING lookup
+ * completes; may be NULL.
+ * @param arg Passed to the callback.
+ * @return DNS_OK, DNS_FAILED or DNS_PENDING.
+ */
+dns_status_t dns_cache_lookup(const char *host, const char *port, DnsAddrs *out,
+                              dns_callback_t callback, void *arg);
+
+/**
+ * @brief Looks a host up, waiting for the resolver if it is not cached.
+ * @param host The host name or numeric address.
+ * @param port The port (numeric string or service name).
+ * @param out Filled with the addresses on success.
+ * @return 0 on success, -1 if the name does not resolve.
+ */
+int dns_cache_resolve(const char *host, const char *port, DnsAddrs *out);
+
+#endif
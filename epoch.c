@@ -0,0 +1,199 @@
+/**
+ * @file epoch.c
+ * @author Shubham More
+ * @brief Implementation of epoch-based memory reclamation.
+ *
+ * A global epoch counter advances only when every thread inside a
+ * read-side critical section has observed its current value. An object
+ * retired during epoch e can therefore be freed once the counter reaches
+ * e + 2: every reader that might have seen it has exited by then.
+ *
+ * Each thread registers a record on first use; records are never freed,
+ * only recycled when their thread exits. Retired objects go onto a
+ * lock-free stack, and reclamation is done by whichever thread calls
+ * epoch_reclaim() first, under a trylock so callers never wait.
+ */
+
+#include "epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define RECLAIM_THRESHOLD 64 // Retired objects queued before a retire also reclaims
+
+// Per-thread reader state
+typedef struct EpochThread {
+    unsigned long state;        // (epoch << 1) | 1 while inside a section, else 0
+    int nesting;
+    int in_use;                 // Owned by a live thread
+    struct EpochThread *next;   // Link in the append-only registry
+} EpochThread;
+
+// An object waiting to be freed
+typedef struct Retired {
+    void *ptr;
+    void (*free_fn)(void *);
+    unsigned long epoch;        // Global epoch when it was retired
+    struct Retired *next;
+} Retired;
+
+// --- Global Epoch State ---
+static unsigned long global_epoch = 1;
+static EpochThread *registry = NULL;
+static Retired *retired = NULL;
+static long retired_count = 0;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread EpochThread *self = NULL;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Thread-exit destructor: hands the thread's record back for reuse.
+ */
+static void release_record(void *arg) {
+    EpochThread *rec = (EpochThread *)arg;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    rec->nesting = 0;
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Creates the key whose destructor recycles thread records.
+ */
+static void make_key() {
+    pthread_key_create(&thread_key, release_record);
+}
+
+/**
+ * @brief Returns the calling thread's record, registering one if needed.
+ */
+static EpochThread *get_self() {
+    if (self) return self;
+    pthread_once(&key_once, make_key);
+
+    // Recycle the record of a thread that has exited
+    EpochThread *rec;
+    for (rec = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+    }
+
+    if (!rec) {
+        rec = calloc(1, sizeof(EpochThread));
+        if (!rec) {
+            perror("calloc for epoch record");
+            abort(); // Readers cannot run unprotected
+        }
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&registry, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&registry, &rec->next, rec, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(thread_key, rec);
+    self = rec;
+    return rec;
+}
+
+/**
+ * @brief Pushes a chain of retired objects onto the shared stack.
+ */
+static void push_retired(Retired *first, Retired *last) {
+    last->next = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired, &last->next, first, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Announces the calling thread as a reader of the current epoch.
+ */
+void epoch_enter() {
+    EpochThread *rec = get_self();
+    if (rec->nesting++ > 0) return;
+
+    // Re-check after publishing: a reader must never announce an epoch the
+    // reclaimer has already moved past.
+    unsigned long epoch;
+    do {
+        epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&rec->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) != epoch);
+}
+
+/**
+ * @brief Leaves the read-side critical section.
+ */
+void epoch_exit() {
+    EpochThread *rec = self;
+    if (--rec->nesting > 0) return;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Queues an object to be freed after a grace period.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    Retired *r = malloc(sizeof(Retired));
+    if (!r) {
+        // Freeing now could pull memory from under a reader; leak instead
+        perror("malloc for retired object");
+        return;
+    }
+    r->ptr = ptr;
+    r->free_fn = free_fn;
+    r->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    push_retired(r, r);
+
+    if (__atomic_add_fetch(&retired_count, 1, __ATOMIC_RELAXED) >= RECLAIM_THRESHOLD) epoch_reclaim();
+}
+
+/**
+ * @brief Advances the epoch and frees whatever has become unreachable.
+ */
+void epoch_reclaim() {
+    if (pthread_mutex_trylock(&reclaim_lock) != 0) return;
+
+    // The epoch may advance only once every active reader has seen it
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    int can_advance = 1;
+    for (EpochThread *rec = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch) {
+            can_advance = 0;
+            break;
+        }
+    }
+    if (can_advance) {
+        __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+        epoch++;
+    }
+
+    Retired *list = __atomic_exchange_n(&retired, NULL, __ATOMIC_ACQUIRE);
+    Retired *keep_first = NULL, *keep_last = NULL;
+    long freed = 0;
+    while (list) {
+        Retired *r = list;
+        list = r->next;
+        if (r->epoch + 2 <= epoch) {
+            r->free_fn(r->ptr);
+            free(r);
+            freed++;
+        } else {
+            r->next = keep_first;
+            keep_first = r;
+            if (!keep_last) keep_last = r;
+        }
+    }
+    if (keep_first) push_retired(keep_first, keep_last);
+    __atomic_sub_fetch(&retired_count, freed, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&reclaim_lock);
+}
@@ -0,0 +1,45 @@
+/**
+ * @file epoch.h
+ * @author Shubham More
+ * @brief Interface for epoch-based memory reclamation.
+ *
+ * Lets readers walk shared, pointer-linked structures without taking any
+ * lock. A reader brackets its traversal with epoch_enter()/epoch_exit();
+ * a writer that unlinks an object hands it to epoch_retire() instead of
+ * freeing it, and the object is only freed once every reader that could
+ * still see it has left its critical section.
+ *
+ * Read-side critical sections must be short (a lookup, not a send), since
+ * a thread parked inside one holds back all reclamation.
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/**
+ * @brief Begins a read-side critical section in the calling thread.
+ *
+ * Sections may nest; only the outermost enter/exit pair has an effect.
+ */
+void epoch_enter();
+
+/**
+ * @brief Ends the calling thread's read-side critical section.
+ */
+void epoch_exit();
+
+/**
+ * @brief Schedules an unlinked object to be freed once no reader can
+ * reach it any more. Safe to call from any thread.
+ * @param ptr The object; it must already be unreachable for new readers.
+ * @param free_fn Called with ptr when it is safe to free.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/**
+ * @brief Advances the epoch if possible and frees retired objects that
+ * have become unreachable. Cheap to call often; concurrent callers skip.
+ */
+void epoch_reclaim();
+
+#endif
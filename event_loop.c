@@ -0,0 +1,2829 @@
+/**
+ * @file event_loop.c
+ * @author Shubham More
+ * @brief Implementation of the epoll-based, event-driven proxy engine.
+ *
+ * Every event loop owns an epoll instance on which its listening socket is
+ * registered: either the shared listener with EPOLLEXCLUSIVE, so an
+ * incoming connection wakes exactly one loop, or a private SO_REUSEPORT
+ * listener in multi-reactor mode. Client and origin sockets are non-blocking
+ * and registered edge-triggered for both directions; whenever either socket
+ * of a connection reports readiness, the connection's state machine is
+ * driven forward until it would block.
+ *
+ * A loop can take its readiness events from an io_uring instead of epoll.
+ * Each socket then has a multishot poll armed on the ring, which completes
+ * on every wakeup just like an edge-triggered epoll registration, and the
+ * listener has a multishot accept that delivers new sockets without any
+ * accept() calls. Arming and cancelling polls are queued in the ring rather
+ * than made as epoll_ctl() calls, so everything a batch of events changed
+ * is handed to the kernel by the single io_uring_enter() that waits for the
+ * next batch. The state machine is the same for both, except that a ring
+ * loop also relays responses with receives and sends on the ring rather
+ * than on readiness.
+ */
+
+#define _GNU_SOURCE
+#include "event_loop.h"
+#include "proxy_parse.h"
+#include "socket_util.h"
+#include "upstream_pool.h"
+#include "upstream_guard.h"
+#include "http_response.h"
+#include "dns_cache.h"
+#include "metrics.h"
+#include "logger.h"
+#include "relay_queue.h"
+#include "uring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+#ifdef ENABLE_CACHE
+#include "cache.h"
+#include "http_cache.h"
+#include "coalesce.h"
+#include "disk_cache.h"
+#include "http_compress.h"
+#endif
+
+#define MAX_EVENTS 256              // Events fetched per epoll_wait call
+#define REQUEST_BUFFER_SIZE 8192    // Initial client read buffer; grows for longer request heads
+#define DEFAULT_RELAY_BUFFER_SIZE 65536 // Per-loop scratch buffer for the relay, unless configured
+#define MAX_SPARE_PIPES 64          // Empty splice pipes a loop keeps for reuse
+#define MAX_SPARE_REQUESTS 64       // Parsed requests a loop keeps for reuse
+#define WATCH_EVENTS (POLLIN | POLLOUT | POLLRDHUP) // Readiness every socket is watched for
+#define URING_DATA_IGNORE 0         // user_data of ring operations whose completion needs nothing
+#define URING_DATA_ACCEPT 1         // user_data of the ring's accept on the listener
+#define URING_DATA_RELAY (1ULL << 63) // Set in the user_data of relay operations, with the connection's address
+#define URING_DATA_SEND 1ULL        // ...and this bit for a send to the client rather than a receive
+#define URING_MAX_GENERATION (1U << 31) // Watch slot generations stay below it, clear of URING_DATA_RELAY
+#define RING_RELAY_MEMORY (4 * 1024 * 1024) // Receive buffers registered per io_uring loop
+#define RING_SEND_CHUNKS 16         // Queue chunks one ring send takes at a time
+
+// --- Structs ---
+
+// States of the per-connection state machine
+typedef enum {
+    CONN_READ_REQUEST,  // Accumulating the request head from the client
+    #ifdef ENABLE_CACHE
+    CONN_COALESCING,    // Waiting for another request's fetch of the same URL
+    #endif
+    CONN_RESOLVING,     // Waiting for a resolver thread to look up the origin
+    CONN_CONNECTING,    // Non-blocking connect to the origin in progress
+    CONN_SEND_REQUEST,  // Writing the rewritten request to the origin
+    CONN_SEND_BODY,     // Streaming the request body from the client to the origin
+    CONN_RELAY,         // Relaying the origin's response to the client
+    CONN_WRITE_CLIENT,  // Flushing a complete response (hit or error)
+    CONN_CLOSED         // Closed, waiting to be freed at the end of the batch
+} conn_state_t;
+
+// Result of running one step of the state machine
+typedef enum {
+    STEP_CONTINUE,  // State changed, keep driving
+    STEP_WAIT,      // Would block, wait for the next readiness event
+    STEP_DONE       // Connection finished (or failed), close it
+} step_result_t;
+
+typedef struct Connection Connection;
+typedef struct EventLoop EventLoop;
+
+// Stored in epoll_event.data.ptr so a connection can own two sockets
+typedef struct {
+    Connection *conn;
+    int is_origin;
+    unsigned watch;             // Slot of the socket's poll on the loop's ring + 1, or 0
+} EventTag;
+
+// A poll on a loop's ring. Its completions name the slot and generation, so
+// ones that arrive after the socket was let go are recognized and dropped.
+typedef struct {
+    EventTag *tag;              // Whom to tell; NULL once let go
+    int fd;
+    uint32_t generation;        // Bumped whenever the slot is reused; never 0, below URING_MAX_GENERATION
+    int armed;                  // The poll is in the kernel and will complete again
+    unsigned next_free;         // Free list link (slot + 1), or 0
+    int pending;                // On the pending list; the slot is not freed meanwhile
+    unsigned next_pending;      // Pending list link (slot + 1), or 0
+} WatchSlot;
+
+// What a connection's send to the client on the ring is made from
+typedef enum {
+    RING_SEND_NONE,             // No send in flight
+    RING_SEND_BUFFER,           // A receive buffer, straight from the origin
+    RING_SEND_QUEUE             // The head of the relay queue
+} ring_send_t;
+
+struct Connection {
+    conn_state_t state;
+    EventLoop *loop;            // Owning loop (for resolver callbacks)
+    int client_fd;
+    int origin_fd;
+    EventTag client_tag;
+    EventTag origin_tag;
+    int origin_ready;           // Set once the origin reported writable/error
+    int origin_reused;          // origin_fd came from the upstream pool
+    int origin_retried;         // Already retried a stale pooled connection
+    int keep_alive;             // Request was sent with upstream keep-alive
+    uint64_t request_started;   // metrics_now() when the current request's head was parsed, or 0
+    uint64_t connect_started;   // When the pending connect to the origin began
+    uint64_t request_sent;      // When the request went to the origin, until its first byte is back
+    AccessInfo access;          // The current request, for the access log
+
+    UpstreamGuard *guard;       // Admission to the origin, held until the exchange ends
+    int guard_trial;            // The admission is the half-open circuit's trial
+    uint64_t origin_activity;   // metrics_now() of the exchange's latest progress
+    uint64_t deadline;          // metrics_now() by which the exchange must end, or 0
+    uint64_t timer_expiry;      // Key in the loop's timer heap; may be earlier than the real expiry
+    int timer_index;            // Position in the loop's timer heap + 1, or 0
+    int origin_timed_out;       // The last connect attempt ran out of time
+
+    DnsAddrs addrs;             // Origin addresses, in connection order
+    int addr_index;             // Next address to try
+    int callback_pending;       // A resolver, coalescing or cache fill callback is outstanding
+    int callback_orphaned;      // Closed while callback_pending; freed when the callback lands
+    Connection *next_handed_back; // Link in the loop's handover list
+
+    char *request_buffer;       // Bytes read from the client and not used yet
+    size_t request_len;
+    size_t request_cap;         // Grows up to MAX_REQUEST_HEAD_SIZE + 1 for long heads
+    struct ParsedRequest *req;  // Created with the first bytes of a head, parsed once it is in
+    int client_keep_alive;      // Client allows another request after this one
+    int keep_open;              // Current response lets the client connection persist
+    const char *url_string;     // Kept in req's storage
+
+    char *upstream_request;     // Serialized request for the origin
+    size_t upstream_request_len;
+    size_t upstream_sent;
+
+    int has_body;               // The request has a body to forward
+    HttpResponse body;          // Finds the end of the body in what the client sends
+    size_t body_buffered;       // Bytes at the front of request_buffer that belong to the body
+    size_t body_sent;           // Of those, bytes already sent to the origin
+    int body_replayable;        // The whole body came with the head, so it can be sent again
+    int expect_continue;        // The client waits for 100 Continue before sending the rest
+
+    HttpResponse resp;          // Framing of the origin's response
+    size_t bytes_relayed;
+    int cacheable;              // Response may still go into the cache
+
+    int pipe_fds[2];            // splice() pipe borrowed from the loop, or -1
+    size_t pipe_len;            // Bytes in the pipe not yet sent to the client
+    int splice_unavailable;     // No pipe could be had; copy instead
+    RelayQueue queue;           // Response bytes read ahead of a slow client
+
+    // The relay through the loop's ring (see step_ring_relay())
+    int ring_relay;             // The current response is relayed through the ring
+    int ring_spliced;           // It moved on to the splice path, for the rest of its body
+    int ring_recv;              // A receive from the origin is in flight
+    int ring_recv_dropped;      // Its result is no longer wanted: the origin was let go
+    ring_send_t ring_send;      // A send to the client in flight, and what it is made from
+    unsigned ring_buffer;       // The receive buffer a RING_SEND_BUFFER send is made from
+    const char *ring_send_data; // Bytes that send was given, and how many
+    size_t ring_send_len;
+    struct msghdr ring_msg;     // What a RING_SEND_QUEUE send points the kernel at
+    struct iovec ring_iov[RING_SEND_CHUNKS];
+
+    char *pending;              // Bytes waiting to be written to the client
+    #ifdef ENABLE_CACHE
+    CacheEntry *hit;            // Cache entry being sent; pending points into it
+    size_t hit_offset;          // Bytes of it queued so far
+    CacheWaiter fill_waiter;    // Registration while caught up with the entry's fill
+    DiskHit disk_hit;           // Object being sent from the disk tier
+    int on_disk;                // disk_hit is held
+    #endif
+    size_t pending_len;
+    size_t pending_off;
+    int origin_done;            // Response complete, origin released
+
+    #ifdef ENABLE_CACHE
+    char *held;                 // Response bytes that arrived before the head was complete
+    size_t held_len;
+    CacheEntry *fill;           // Entry being filled with the response
+    struct timespec fetch_started; // When the origin request began (cache cost)
+    CacheEntry *stale;          // Stored copy the request revalidates or replaces
+    int revalidating;           // Origin response held back until it shows 304 or not
+    time_t fresh_until;         // Freshness of the response being stored
+    http_cache_mode_t cache_mode; // How the cache may answer the current request
+    int coalesce_leader;        // Other requests may be waiting on this fetch
+    CoalesceWaiter coalesce_waiter; // Registration while waiting on another's fetch
+
+    // Links in the loop's list of connections waiting on another's fetch
+    Connection *wait_prev;
+    Connection *wait_next;
+    time_t wait_since;
+    int is_waiting;
+    #endif
+
+    Connection *next_closed;    // Link in the loop's deferred-free list
+
+    // Links in the loop's idle list (waiting for a request head)
+    Connection *idle_prev;
+    Connection *idle_next;
+    time_t idle_since;
+    int is_idle;
+};
+
+// State owned by a single event loop thread
+struct EventLoop {
+    int epoll_fd;
+    int listen_fd;
+    int owns_listener;          // listen_fd is this loop's SO_REUSEPORT socket
+    int cpu;                    // CPU to pin to, or -1
+    int client_idle_timeout;    // Seconds a client may wait between requests
+    Connection **timers;        // Binary min-heap of connections talking to origins, by timer_expiry
+    int timer_count;
+    int timer_cap;
+    #ifdef ENABLE_CACHE
+    int coalesce_timeout;       // Seconds a miss waits on an identical fetch
+    Connection *waiting_head;   // Oldest waiting connection (list is in wait order)
+    Connection *waiting_tail;
+    #endif
+    Connection *closed;         // Connections to free after the current batch
+    Connection *idle_head;      // Oldest idle connection (list is in idle order)
+    Connection *idle_tail;
+
+    // Connections handed back by other threads (DNS lookup, coalesced fetch or cache fill progress)
+    int wake_fd;                // eventfd that wakes the loop
+    EventTag wake_tag;
+    pthread_mutex_t handback_lock;
+    Connection *handed_back;
+
+    int spare_pipes[MAX_SPARE_PIPES][2]; // Empty splice pipes ready for reuse
+    int spare_pipe_count;
+    struct ParsedRequest *spare_requests[MAX_SPARE_REQUESTS]; // Reset requests ready for reuse
+    int spare_request_count;
+
+    char *relay_buffer;         // Scratch buffer for the relay, shared by the loop's connections
+    size_t relay_size;
+
+    // io_uring event source, used instead of epoll_fd when use_uring is set
+    int use_uring;
+    Uring ring;
+    int accept_multishot;       // The kernel keeps the ring's accept armed
+    WatchSlot *watches;
+    unsigned watch_cap;
+    unsigned free_watch;        // Head of the free slot list (slot + 1), or 0
+    unsigned pending_slots;     // Head of the slots whose arm or cancel found the ring full (slot + 1), or 0
+    int accept_pending;         // The ring's accept found it full and still has to be queued
+    UringBuffers relay_buffers; // Receive buffers for relaying on the ring; ring is NULL without them
+
+    int open_connections;       // Connections accepted and not freed yet
+    int draining;               // Shutting down: no new connections, and exit once the last is done
+    int accept_cancel;          // The ring's accept still has to be cancelled for the drain
+};
+
+// --- Global State ---
+static atomic_int stop_requested;   // event_loop_stop() was called
+static pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the two below
+static EventLoop *running_loops = NULL; // Loops to wake for a stop
+static int running_count = 0;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Seconds on the monotonic clock.
+ */
+static time_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Milliseconds elapsed on the monotonic clock since a given time.
+ */
+static unsigned int elapsed_ms(const struct timespec *since) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int)((ts.tv_sec - since->tv_sec) * 1000 + (ts.tv_nsec - since->tv_nsec) / 1000000);
+}
+#endif
+
+/**
+ * @brief Appends a connection to the loop's idle list.
+ *
+ * Every connection waits the same timeout, so appending keeps the list
+ * sorted by expiry and the event loop only ever checks its head.
+ */
+static void idle_list_add(EventLoop *loop, Connection *conn) {
+    if (conn->is_idle || loop->client_idle_timeout <= 0) return;
+    conn->is_idle = 1;
+    conn->idle_since = now_seconds();
+    conn->idle_next = NULL;
+    conn->idle_prev = loop->idle_tail;
+    if (loop->idle_tail) loop->idle_tail->idle_next = conn;
+    else loop->idle_head = conn;
+    loop->idle_tail = conn;
+}
+
+/**
+ * @brief Removes a connection from the loop's idle list.
+ */
+static void idle_list_remove(EventLoop *loop, Connection *conn) {
+    if (!conn->is_idle) return;
+    conn->is_idle = 0;
+    if (conn->idle_prev) conn->idle_prev->idle_next = conn->idle_next;
+    else loop->idle_head = conn->idle_next;
+    if (conn->idle_next) conn->idle_next->idle_prev = conn->idle_prev;
+    else loop->idle_tail = conn->idle_prev;
+}
+
+/**
+ * @brief Swaps two slots of the timer heap, keeping the connections'
+ * positions in step.
+ */
+static void timer_swap(EventLoop *loop, int a, int b) {
+    Connection *conn = loop->timers[a];
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = conn;
+    loop->timers[a]->timer_index = a + 1;
+    loop->timers[b]->timer_index = b + 1;
+}
+
+/**
+ * @brief Moves a heap entry up to where its key belongs.
+ */
+static void timer_sift_up(EventLoop *loop, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (loop->timers[parent]->timer_expiry <= loop->timers[i]->timer_expiry) return;
+        timer_swap(loop, i, parent);
+        i = parent;
+    }
+}
+
+/**
+ * @brief Moves a heap entry down to where its key belongs.
+ */
+static void timer_sift_down(EventLoop *loop, int i) {
+    for (;;) {
+        int first = i;
+        int left = 2 * i + 1, right = left + 1;
+        if (left < loop->timer_count && loop->timers[left]->timer_expiry < loop->timers[first]->timer_expiry) {
+            first = left;
+        }
+        if (right < loop->timer_count && loop->timers[right]->timer_expiry < loop->timers[first]->timer_expiry) {
+            first = right;
+        }
+        if (first == i) return;
+        timer_swap(loop, i, first);
+        i = first;
+    }
+}
+
+/**
+ * @brief Takes a connection's timer out of the heap (no-op if absent).
+ */
+static void timer_remove(EventLoop *loop, Connection *conn) {
+    if (!conn->timer_index) return;
+    int i = conn->timer_index - 1;
+    int last = --loop->timer_count;
+    conn->timer_index = 0;
+    if (i == last) return;
+    loop->timers[i] = loop->timers[last];
+    loop->timers[i]->timer_index = i + 1;
+    timer_sift_up(loop, i);
+    timer_sift_down(loop, i);
+}
+
+/**
+ * @brief Arms a connection's timer, or brings it forward.
+ *
+ * A later expiry is not written to the heap: check_timers() finds it when
+ * the old key comes up, so the progress that keeps pushing an exchange's
+ * expiry back costs no heap work.
+ */
+static void timer_set(EventLoop *loop, Connection *conn, uint64_t expiry) {
+    if (conn->timer_index) {
+        if (expiry >= conn->timer_expiry) return;
+        conn->timer_expiry = expiry;
+        timer_sift_up(loop, conn->timer_index - 1);
+        return;
+    }
+    if (loop->timer_count == loop->timer_cap) {
+        int cap = loop->timer_cap ? loop->timer_cap * 2 : 64;
+        Connection **grown = realloc(loop->timers, cap * sizeof(Connection *));
+        if (!grown) return; // Unbounded until the connection is driven again
+        loop->timers = grown;
+        loop->timer_cap = cap;
+    }
+    conn->timer_expiry = expiry;
+    loop->timers[loop->timer_count] = conn;
+    conn->timer_index = ++loop->timer_count;
+    timer_sift_up(loop, loop->timer_count - 1);
+}
+
+/**
+ * @brief When the connection's exchange with its origin runs out of time,
+ * given the stage it is in.
+ * @return A metrics_now() time, or 0 if the origin is not being waited on.
+ */
+static uint64_t origin_expiry(Connection *conn) {
+    upstream_timeouts_t timeouts = upstream_guard_timeouts();
+    uint64_t since = conn->origin_activity;
+    int stage_ms = 0;
+    switch (conn->state) {
+        case CONN_CONNECTING:
+            since = conn->connect_started;
+            stage_ms = timeouts.connect_ms;
+            break;
+        case CONN_SEND_REQUEST:
+            stage_ms = timeouts.idle_ms;
+            break;
+        case CONN_SEND_BODY:
+            // Waiting for the client to send more is up to the client idle timeout
+            if (conn->body_sent < conn->body_buffered) stage_ms = timeouts.idle_ms;
+            break;
+        case CONN_RELAY:
+            if (conn->origin_done) return 0; // Only the client is left to drain it
+            stage_ms = conn->request_sent ? timeouts.first_byte_ms : timeouts.idle_ms;
+            break;
+        default:
+            return 0;
+    }
+    uint64_t expiry = stage_ms > 0 ? since + (uint64_t)stage_ms * 1000 : 0;
+    if (conn->deadline && (!expiry || conn->deadline < expiry)) expiry = conn->deadline;
+    return expiry;
+}
+
+/**
+ * @brief Keeps a connection's timer in line with the stage it has reached.
+ */
+static void update_timer(EventLoop *loop, Connection *conn) {
+    uint64_t expiry = origin_expiry(conn);
+    if (expiry) timer_set(loop, conn, expiry);
+    else timer_remove(loop, conn);
+}
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Appends a connection to the loop's list of connections waiting on
+ * another request's fetch; like the idle list, it stays sorted by expiry.
+ */
+static void waiting_list_add(EventLoop *loop, Connection *conn) {
+    conn->is_waiting = 1;
+    conn->wait_since = now_seconds();
+    conn->wait_prev = loop->waiting_tail;
+    conn->wait_next = NULL;
+    if (loop->waiting_tail) loop->waiting_tail->wait_next = conn;
+    else loop->waiting_head = conn;
+    loop->waiting_tail = conn;
+}
+
+/**
+ * @brief Removes a connection from the waiting list (no-op if absent).
+ */
+static void waiting_list_remove(EventLoop *loop, Connection *conn) {
+    if (!conn->is_waiting) return;
+    conn->is_waiting = 0;
+    if (conn->wait_prev) conn->wait_prev->wait_next = conn->wait_next;
+    else loop->waiting_head = conn->wait_next;
+    if (conn->wait_next) conn->wait_next->wait_prev = conn->wait_prev;
+    else loop->waiting_tail = conn->wait_prev;
+}
+
+/**
+ * @brief Lets go of the connection's cache fill, abandoning it unless it
+ * was committed.
+ */
+static void drop_fill(Connection *conn) {
+    if (!conn->fill) return;
+    cache_fill_abort(conn->fill);
+    cache_release(conn->fill);
+    conn->fill = NULL;
+}
+
+/**
+ * @brief Wakes the requests waiting on this connection's fetch, if it led one.
+ */
+static void end_coalescing(Connection *conn) {
+    if (!conn->coalesce_leader) return;
+    conn->coalesce_leader = 0;
+    coalesce_finish(conn->url_string);
+}
+#endif
+
+/**
+ * @brief Queues a multishot poll for a watch slot on the loop's ring.
+ * @return 0 on success, -1 if the ring would not take it.
+ */
+static int ring_arm(EventLoop *loop, unsigned slot, unsigned events) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (!sqe) return -1;
+    WatchSlot *watch = &loop->watches[slot];
+    uring_prep_poll(sqe, watch->fd, events, 1, ((uint64_t)watch->generation << 32) | slot);
+    watch->armed = 1;
+    return 0;
+}
+
+/**
+ * @brief Puts a watch slot back on the free list.
+ */
+static void ring_free_slot(EventLoop *loop, unsigned slot) {
+    WatchSlot *watch = &loop->watches[slot];
+    watch->tag = NULL;
+    watch->next_free = loop->free_watch;
+    loop->free_watch = slot + 1;
+}
+
+/**
+ * @brief Watches a socket through a multishot poll on the loop's ring.
+ * @return 0 on success, -1 on failure.
+ */
+static int ring_watch(EventLoop *loop, int fd, EventTag *tag, unsigned events) {
+    if (!loop->free_watch) {
+        unsigned cap = loop->watch_cap ? loop->watch_cap * 2 : MAX_EVENTS;
+        WatchSlot *grown = realloc(loop->watches, cap * sizeof(WatchSlot));
+        if (!grown) return -1;
+        // New slots go on the free list lowest first
+        for (unsigned i = cap; i > loop->watch_cap; i--) {
+            grown[i - 1].generation = 0;
+            grown[i - 1].armed = 0;
+            grown[i - 1].tag = NULL;
+            grown[i - 1].pending = 0;
+            grown[i - 1].next_free = loop->free_watch;
+            loop->free_watch = i;
+        }
+        loop->watches = grown;
+        loop->watch_cap = cap;
+    }
+
+    unsigned slot = loop->free_watch - 1;
+    WatchSlot *watch = &loop->watches[slot];
+    loop->free_watch = watch->next_free;
+    if (++watch->generation >= URING_MAX_GENERATION) watch->generation = 1;
+    watch->tag = tag;
+    watch->fd = fd;
+    if (ring_arm(loop, slot, events) < 0) {
+        ring_free_slot(loop, slot);
+        return -1;
+    }
+    tag->watch = slot + 1;
+    return 0;
+}
+
+/**
+ * @brief Queues the cancellation of a watch slot's poll on the loop's ring.
+ * @return 0 on success, -1 if the ring would not take it.
+ */
+static int ring_cancel(EventLoop *loop, unsigned slot) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (!sqe) return -1;
+    uring_prep_cancel(sqe, ((uint64_t)loop->watches[slot].generation << 32) | slot, URING_DATA_IGNORE);
+    return 0;
+}
+
+/**
+ * @brief Queues the ring's accept on the listener.
+ * @return 0 on success, -1 if the ring would not take it.
+ */
+static int ring_accept(EventLoop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (!sqe) return -1;
+    uring_prep_accept(sqe, loop->listen_fd, SOCK_NONBLOCK | SOCK_CLOEXEC, loop->accept_multishot, URING_DATA_ACCEPT);
+    return 0;
+}
+
+/**
+ * @brief Puts a watch slot whose arm or cancel the ring had no room for
+ * on the loop's pending list, once.
+ */
+static void ring_defer(EventLoop *loop, unsigned slot) {
+    WatchSlot *watch = &loop->watches[slot];
+    if (watch->pending) return;
+    watch->pending = 1;
+    watch->next_pending = loop->pending_slots;
+    loop->pending_slots = slot + 1;
+}
+
+/**
+ * @brief Queues what found the ring full (the accept, polls to arm again
+ * and cancels), and the cancel of the accept once the loop drains, before
+ * the next io_uring_enter() hands them to the kernel. What still finds no
+ * room stays for the wait after.
+ */
+static void ring_flush_pending(EventLoop *loop) {
+    if (loop->accept_cancel) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+        if (!sqe) return;
+        uring_prep_cancel(sqe, URING_DATA_ACCEPT, URING_DATA_IGNORE);
+        loop->accept_cancel = 0;
+    }
+    if (loop->draining) loop->accept_pending = 0;
+    if (loop->accept_pending) {
+        if (ring_accept(loop) < 0) return;
+        loop->accept_pending = 0;
+    }
+    while (loop->pending_slots) {
+        unsigned slot = loop->pending_slots - 1;
+        WatchSlot *watch = &loop->watches[slot];
+        // What a slot needs now follows from its state: a socket still
+        // watched is armed again, a poll let go is cancelled, unless it
+        // ended on its own meanwhile
+        if (watch->tag && !watch->armed) {
+            if (ring_arm(loop, slot, watch->tag == &loop->wake_tag ? POLLIN : WATCH_EVENTS) < 0) return;
+        } else if (!watch->tag && watch->armed) {
+            if (ring_cancel(loop, slot) < 0) return;
+        }
+        loop->pending_slots = watch->next_pending;
+        watch->pending = 0;
+        if (!watch->tag && !watch->armed) ring_free_slot(loop, slot);
+    }
+}
+
+/**
+ * @brief Stops watching a socket on the loop's ring.
+ *
+ * A poll still in the kernel is cancelled, and its slot is only reused
+ * once its last completion is in. Until then the poll keeps the socket
+ * open, so closing the descriptor right after this is fine. A cancel the
+ * ring has no room for is never dropped: the slot waits on the pending
+ * list, which is flushed before the next wait.
+ */
+static void ring_unwatch(EventLoop *loop, EventTag *tag) {
+    if (!tag->watch) return;
+    unsigned slot = tag->watch - 1;
+    WatchSlot *watch = &loop->watches[slot];
+    tag->watch = 0;
+    watch->tag = NULL;
+    if (!watch->armed) {
+        if (!watch->pending) ring_free_slot(loop, slot); // Else the flush frees it
+        return;
+    }
+    if (ring_cancel(loop, slot) < 0) ring_defer(loop, slot);
+}
+
+/**
+ * @brief Registers a socket for edge-triggered read and write readiness.
+ */
+static int watch_fd(EventLoop *loop, int fd, EventTag *tag) {
+    if (loop->use_uring) return ring_watch(loop, fd, tag, WATCH_EVENTS);
+    struct epoll_event ev;
+    ev.events = WATCH_EVENTS | EPOLLET;
+    ev.data.ptr = tag;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * @brief Stops watching a socket that stays open (e.g. one going back to
+ * the upstream pool).
+ */
+static void unwatch_fd(EventLoop *loop, int fd, EventTag *tag) {
+    if (loop->use_uring) ring_unwatch(loop, tag);
+    else epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ * @brief Closes a watched socket. epoll forgets it on close, but a poll on
+ * the ring has to be cancelled.
+ */
+static void close_watched(EventLoop *loop, int fd, EventTag *tag) {
+    if (loop->use_uring) ring_unwatch(loop, tag);
+    close(fd);
+}
+
+/**
+ * @brief The user_data of a connection's relay operation on the ring.
+ */
+static uint64_t ring_relay_data(Connection *conn, int send) {
+    return URING_DATA_RELAY | (uint64_t)(uintptr_t)conn | (send ? URING_DATA_SEND : 0);
+}
+
+/**
+ * @brief Gives up on a relay operation in flight on one of the
+ * connection's sockets, which is about to be closed.
+ *
+ * The operation completes with -ECANCELED, or with whatever it got before
+ * the cancel went in. If the ring has no room for the cancel, shutting the
+ * socket down ends the operation instead.
+ */
+static void ring_relay_cancel(EventLoop *loop, Connection *conn, int send, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe) uring_prep_cancel(sqe, ring_relay_data(conn, send), URING_DATA_IGNORE);
+    else shutdown(fd, SHUT_RDWR);
+}
+
+/**
+ * @brief Makes sure no relay receive from the origin is still wanted, so
+ * its socket may be closed. A socket with a receive in flight may not go
+ * back to the pool: the receive would take the next response's bytes.
+ */
+static void drop_ring_recv(EventLoop *loop, Connection *conn) {
+    if (!conn->ring_recv || conn->ring_recv_dropped) return;
+    conn->ring_recv_dropped = 1;
+    ring_relay_cancel(loop, conn, 0, conn->origin_fd);
+}
+
+/**
+ * @brief Drops the pending output buffer.
+ */
+static void clear_pending(Connection *conn) {
+    #ifdef ENABLE_CACHE
+    // A cache hit is sent from cache memory, not a copy
+    if (conn->hit) conn->pending = NULL;
+    #endif
+    free(conn->pending);
+    conn->pending = NULL;
+    conn->pending_len = conn->pending_off = 0;
+}
+
+/**
+ * @brief Replaces the pending output with a copy of the given bytes.
+ */
+static int set_pending(Connection *conn, const char *data, size_t len) {
+    clear_pending(conn);
+    conn->pending = malloc(len);
+    if (!conn->pending) {
+        conn->pending_len = conn->pending_off = 0;
+        return -1;
+    }
+    memcpy(conn->pending, data, len);
+    conn->pending_len = len;
+    conn->pending_off = 0;
+    return 0;
+}
+
+/**
+ * @brief Counts bytes sent to the client, for the metrics and the access
+ * log, and as progress of the exchange.
+ */
+static void count_sent(Connection *conn, size_t n) {
+    metrics_add(METRIC_BYTES_OUT, n);
+    conn->access.bytes += n;
+    conn->origin_activity = metrics_now(); // A relay waiting on a slow client is not idle
+}
+
+/**
+ * @brief Writes as much pending output as the socket accepts.
+ * @return 1 when everything was written, 0 if it would block, -1 on error.
+ */
+static int flush_pending(Connection *conn, int fd) {
+    while (conn->pending_off < conn->pending_len) {
+        ssize_t sent = send(fd, conn->pending + conn->pending_off,
+                            conn->pending_len - conn->pending_off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->pending_off += sent;
+        count_sent(conn, sent);
+    }
+    clear_pending(conn);
+    return 1;
+}
+
+/**
+ * @brief Lends the connection an empty splice pipe, reusing a spare one.
+ * @return 0 on success, -1 if no pipe could be created.
+ */
+static int take_pipe(EventLoop *loop, Connection *conn) {
+    if (loop->spare_pipe_count > 0) {
+        loop->spare_pipe_count--;
+        conn->pipe_fds[0] = loop->spare_pipes[loop->spare_pipe_count][0];
+        conn->pipe_fds[1] = loop->spare_pipes[loop->spare_pipe_count][1];
+        return 0;
+    }
+    return socket_make_pipe(conn->pipe_fds, 1);
+}
+
+/**
+ * @brief Gives the connection's pipe back to the loop, or closes it if it
+ * still holds data or the loop has enough spares.
+ */
+static void put_pipe(EventLoop *loop, Connection *conn) {
+    if (conn->pipe_fds[0] < 0) return;
+    if (conn->pipe_len == 0 && loop->spare_pipe_count < MAX_SPARE_PIPES) {
+        loop->spare_pipes[loop->spare_pipe_count][0] = conn->pipe_fds[0];
+        loop->spare_pipes[loop->spare_pipe_count][1] = conn->pipe_fds[1];
+        loop->spare_pipe_count++;
+    } else {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    conn->pipe_len = 0;
+}
+
+/**
+ * @brief Gives the connection a parsed request to feed, reusing a spare one.
+ * @return 0 on success, -1 if no memory could be had.
+ */
+static int take_request(EventLoop *loop, Connection *conn) {
+    if (loop->spare_request_count > 0) {
+        conn->req = loop->spare_requests[--loop->spare_request_count];
+        return 0;
+    }
+    conn->req = ParsedRequest_create();
+    return conn->req ? 0 : -1;
+}
+
+/**
+ * @brief Gives the connection's parsed request back to the loop, or frees
+ * it if the loop has enough spares.
+ */
+static void put_request(EventLoop *loop, Connection *conn) {
+    if (!conn->req) return;
+    if (loop->spare_request_count < MAX_SPARE_REQUESTS) {
+        ParsedRequest_reset(conn->req);
+        loop->spare_requests[loop->spare_request_count++] = conn->req;
+    } else {
+        ParsedRequest_destroy(conn->req);
+    }
+    conn->req = NULL;
+    conn->url_string = NULL;
+}
+
+/**
+ * @brief Sends as much of the pipe's contents to the client as it accepts.
+ * @return 1 when the pipe is empty, 0 if it would block, -1 on error.
+ */
+static int flush_pipe(Connection *conn) {
+    while (conn->pipe_len > 0) {
+        ssize_t sent = splice(conn->pipe_fds[0], NULL, conn->client_fd, NULL, conn->pipe_len,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->pipe_len -= sent;
+        count_sent(conn, sent);
+    }
+    return 1;
+}
+
+/**
+ * @brief Moves the oldest bytes in the pipe to the end of the relay queue,
+ * making room in the pipe while the client is behind. Everything queued
+ * is older than everything piped, so order is kept.
+ * @return 0 on success, -1 on failure (the bytes are lost).
+ */
+static int spill_pipe(EventLoop *loop, Connection *conn) {
+    size_t want = conn->pipe_len < loop->relay_size ? conn->pipe_len : loop->relay_size;
+    ssize_t n = read(conn->pipe_fds[0], loop->relay_buffer, want);
+    if (n <= 0) {
+        log_errno("read (relay pipe)");
+        return -1;
+    }
+    conn->pipe_len -= n;
+    return relay_queue_push(&conn->queue, loop->relay_buffer, n);
+}
+
+/**
+ * @brief Whether the origin socket has bytes waiting to be read.
+ */
+static int origin_readable(Connection *conn) {
+    int available = 0;
+    return ioctl(conn->origin_fd, FIONREAD, &available) == 0 && available > 0;
+}
+
+/**
+ * @brief Queues a simple HTTP error response and switches to flushing it.
+ */
+static step_result_t queue_error(Connection *conn, int status_code, const char *status_message) {
+    char response[512];
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.0 %d %s\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n",
+        status_code, status_message);
+
+    conn->access.status = status_code;
+    if (set_pending(conn, response, len) < 0) return STEP_DONE;
+    conn->keep_open = 0;
+    conn->state = CONN_WRITE_CLIENT;
+    return STEP_CONTINUE;
+}
+
+/**
+ * @brief Ends the connection's admission to its origin, if it holds one.
+ */
+static void release_guard(Connection *conn, upstream_outcome_t outcome) {
+    if (!conn->guard) return;
+    upstream_guard_release(conn->guard, conn->guard_trial, outcome);
+    conn->guard = NULL;
+}
+
+/**
+ * @brief Answers with an error the origin is to blame for, and counts it
+ * against the origin.
+ */
+static step_result_t origin_error(Connection *conn, int status_code, const char *status_message) {
+    metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+    release_guard(conn, UPSTREAM_FAILED);
+    return queue_error(conn, status_code, status_message);
+}
+
+/**
+ * @brief Wakes a loop through its eventfd, from any thread.
+ */
+static void wake_loop(EventLoop *loop) {
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) log_errno("write (eventfd)");
+}
+
+/**
+ * @brief Resolver, coalescing or cache fill callback: queues the connection for its
+ * loop and wakes it. Runs on another thread, so it touches nothing but the
+ * handover list.
+ */
+static void hand_back(void *arg) {
+    Connection *conn = (Connection *)arg;
+    EventLoop *loop = conn->loop;
+
+    pthread_mutex_lock(&loop->handback_lock);
+    conn->next_handed_back = loop->handed_back;
+    loop->handed_back = conn;
+    pthread_mutex_unlock(&loop->handback_lock);
+
+    wake_loop(loop);
+}
+
+/**
+ * @brief Starts a non-blocking connect to the next origin address that
+ * will take one.
+ */
+static step_result_t connect_origin(EventLoop *loop, Connection *conn) {
+    while (conn->addr_index < conn->addrs.count) {
+        int fd = socket_connect_addr(&conn->addrs.addrs[conn->addr_index++], 1);
+        if (fd < 0) continue;
+
+        if (watch_fd(loop, fd, &conn->origin_tag) < 0) {
+            log_errno("epoll_ctl (destination)");
+            close(fd);
+            continue;
+        }
+        conn->origin_fd = fd;
+        conn->origin_reused = 0;
+        conn->origin_ready = 0;
+        conn->connect_started = metrics_now();
+        conn->state = CONN_CONNECTING;
+        return STEP_CONTINUE;
+    }
+    if (conn->origin_timed_out) {
+        metrics_add(METRIC_UPSTREAM_TIMEOUTS, 1);
+        return origin_error(conn, 504, "Gateway Timeout");
+    }
+    return origin_error(conn, 502, "Bad Gateway");
+}
+
+/**
+ * @brief Looks the origin up in the resolver cache; on a miss the
+ * connection is parked until a resolver thread hands it back.
+ */
+static step_result_t resolve_origin(EventLoop *loop, Connection *conn) {
+    switch (dns_cache_lookup(conn->req->host, conn->req->port, &conn->addrs, hand_back, conn)) {
+        case DNS_OK:
+            conn->addr_index = 0;
+            return connect_origin(loop, conn);
+        case DNS_PENDING:
+            conn->callback_pending = 1;
+            conn->state = CONN_RESOLVING;
+            return STEP_WAIT;
+        case DNS_FAILED:
+            break;
+    }
+    return origin_error(conn, 502, "Bad Gateway");
+}
+
+/**
+ * @brief Gets a connection to the origin: a pooled keep-alive connection if
+ * one is idle, otherwise a new non-blocking connect.
+ */
+static step_result_t open_origin(EventLoop *loop, Connection *conn) {
+    struct ParsedRequest *req = conn->req;
+    int fd = -1;
+
+    conn->upstream_sent = 0;
+    conn->body_sent = 0;
+    http_response_free(&conn->resp);
+    http_response_init(&conn->resp, strcmp(req->method, "HEAD") == 0);
+
+    // A body that cannot be sent again must not go out on a pooled connection that may be stale
+    if (conn->keep_alive && !conn->origin_retried && (!conn->has_body || conn->body_replayable)) {
+        fd = upstream_pool_get(req->host, req->port);
+    }
+    if (fd < 0) return resolve_origin(loop, conn);
+
+    socket_set_nonblocking(fd);
+    conn->origin_fd = fd;
+    conn->origin_reused = 1;
+    conn->origin_activity = metrics_now();
+    conn->state = CONN_SEND_REQUEST;
+    if (watch_fd(loop, fd, &conn->origin_tag) < 0) {
+        log_errno("epoll_ctl (destination)");
+        return queue_error(conn, 502, "Bad Gateway");
+    }
+    return STEP_CONTINUE;
+}
+
+/**
+ * @brief Drops a stale pooled connection and starts over on a fresh one.
+ */
+static step_result_t retry_origin(EventLoop *loop, Connection *conn) {
+    close_watched(loop, conn->origin_fd, &conn->origin_tag);
+    conn->origin_fd = -1;
+    conn->origin_retried = 1;
+    conn->ring_relay = conn->ring_spliced = 0; // The next origin is watched until its relay starts
+    return open_origin(loop, conn);
+}
+
+/**
+ * @brief Hands the origin connection back to the pool, or closes it.
+ */
+static void release_origin(EventLoop *loop, Connection *conn, int reusable) {
+    if (conn->origin_fd < 0) return;
+    if (reusable && conn->keep_alive && !conn->ring_recv) {
+        unwatch_fd(loop, conn->origin_fd, &conn->origin_tag);
+        upstream_pool_put(conn->req->host, conn->req->port, conn->origin_fd);
+    } else {
+        drop_ring_recv(loop, conn);
+        close_watched(loop, conn->origin_fd, &conn->origin_tag);
+    }
+    conn->origin_fd = -1;
+}
+
+/**
+ * @brief Serializes the request for the origin and connects to it, once
+ * the origin admits it.
+ */
+static step_result_t start_origin_request(EventLoop *loop, Connection *conn) {
+    upstream_admission_t admission;
+    conn->guard = upstream_guard_acquire(conn->req->host, conn->req->port, &admission, &conn->guard_trial);
+    if (admission != UPSTREAM_ADMITTED) {
+        metrics_add(METRIC_UPSTREAM_REJECTED, 1);
+        return queue_error(conn, 503, "Service Unavailable");
+    }
+    conn->origin_timed_out = 0;
+    conn->keep_alive = upstream_should_keep_alive(conn->req);
+    conn->upstream_request = upstream_build_request(conn->req, conn->keep_alive, &conn->upstream_request_len);
+    if (!conn->upstream_request) return queue_error(conn, 500, "Internal Server Error");
+    return open_origin(loop, conn);
+}
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Switches to sending a held cache entry straight from cache memory.
+ * The connection takes over the caller's reference.
+ */
+static void serve_hit(Connection *conn, CacheEntry *entry) {
+    clear_pending(conn);
+    conn->hit = entry;
+    conn->hit_offset = 0;
+    // Follows the stored response's framing, to tell whether the client may persist
+    http_response_free(&conn->resp);
+    http_response_init(&conn->resp, 0);
+    conn->state = CONN_WRITE_CLIENT;
+}
+
+/**
+ * @brief Drops the cache entry being sent, if any.
+ */
+static void drop_hit(Connection *conn) {
+    clear_pending(conn);
+    cache_release(conn->hit);
+    conn->hit = NULL;
+    if (conn->on_disk) disk_cache_release(&conn->disk_hit);
+    conn->on_disk = 0;
+}
+
+/**
+ * @brief Writes as much of a disk hit to the client as the socket takes.
+ * @return 1 once it is all sent, 0 if the socket is full, -1 on error.
+ */
+static int flush_disk_hit(Connection *conn) {
+    while (conn->disk_hit.length > 0) {
+        ssize_t sent = sendfile(conn->client_fd, conn->disk_hit.fd, &conn->disk_hit.offset,
+                                conn->disk_hit.length);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (sent <= 0) return -1;
+        conn->disk_hit.length -= sent;
+        count_sent(conn, sent);
+    }
+    return 1;
+}
+
+/**
+ * @brief Holds on to response bytes until the head is complete. A head is
+ * bounded, so the buffer is allocated once and never grows.
+ * @return 0 on success, -1 if the bytes do not fit or no memory could be had.
+ */
+static int hold_bytes(Connection *conn, const char *data, size_t len) {
+    if (!conn->held) conn->held = malloc(MAX_RESPONSE_HEAD_SIZE + RESPONSE_HOLD_READ_SIZE);
+    if (!conn->held || conn->held_len + len > MAX_RESPONSE_HEAD_SIZE + RESPONSE_HOLD_READ_SIZE) return -1;
+    memcpy(conn->held + conn->held_len, data, len);
+    conn->held_len += len;
+    return 0;
+}
+
+/**
+ * @brief Decides from the complete head whether the response may be stored
+ * and, if so, starts filling a cache entry with what has arrived.
+ *
+ * When the head gives the full length, the fill cannot outgrow the cache
+ * midway, so requests waiting on this fetch are handed the entry to send
+ * along as it fills.
+ */
+static void start_fill(Connection *conn) {
+    size_t expected = http_response_expected_size(&conn->resp, conn->held_len);
+    const char *fill_key = http_compress_fill_key(conn->req, &conn->resp);
+    if (fill_key && http_cache_storable(&conn->resp, time(NULL), &conn->fresh_until)) {
+        conn->fill = cache_fill_begin(fill_key, expected);
+    }
+    if (conn->fill && cache_fill_append(conn->fill, conn->held, conn->held_len) == 0) {
+        // Waiters asked for the URL, so only a response as sent is theirs
+        if (expected && conn->coalesce_leader && strcmp(fill_key, conn->url_string) == 0) {
+            coalesce_stream(conn->url_string, conn->fill);
+        }
+    } else {
+        drop_fill(conn);
+        conn->cacheable = 0;
+    }
+}
+#endif
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Serves the request from a fresh stored copy, or fetches it.
+ *
+ * A miss on a URL that another request is already fetching parks the
+ * connection until that fetch ends, then looks the URL up again; a second
+ * miss (the response could not be stored, or the wait timed out) fetches
+ * independently. If the fetch streams into a cache entry, the connection
+ * sends that along instead.
+ * @param may_wait Non-zero to join a fetch in flight rather than start one.
+ */
+static step_result_t lookup_or_fetch(EventLoop *loop, Connection *conn, int may_wait) {
+    http_cache_mode_t mode = conn->cache_mode;
+    uint64_t lookup_started = metrics_now();
+    CacheEntry *hit = mode != HTTP_CACHE_BYPASS ? http_compress_lookup(conn->req) : NULL;
+    if (hit && mode == HTTP_CACHE_LOOKUP && time(NULL) < cache_entry_fresh_until(hit)) {
+        metrics_observe(METRIC_LOOKUP_LATENCY, lookup_started);
+        conn->access.cache = LOG_CACHE_HIT;
+        metrics_add(METRIC_CACHE_HITS, 1);
+        serve_hit(conn, hit);
+        return STEP_CONTINUE;
+    }
+    // An object evicted from memory may still be on disk
+    int on_disk = !hit && mode == HTTP_CACHE_LOOKUP &&
+                  http_compress_disk_lookup(conn->req, time(NULL), &conn->disk_hit) == 0;
+    if (mode != HTTP_CACHE_BYPASS) metrics_observe(METRIC_LOOKUP_LATENCY, lookup_started);
+    if (on_disk) {
+        conn->access.cache = LOG_CACHE_DISK_HIT;
+        metrics_add(METRIC_CACHE_HITS, 1);
+        clear_pending(conn);
+        conn->on_disk = 1;
+        conn->state = CONN_WRITE_CLIENT;
+        return STEP_CONTINUE;
+    }
+
+    if (may_wait && mode == HTTP_CACHE_LOOKUP && loop->coalesce_timeout > 0) {
+        conn->coalesce_waiter.callback = hand_back;
+        conn->coalesce_waiter.arg = conn;
+        switch (coalesce_join(conn->url_string, &conn->coalesce_waiter)) {
+            case COALESCE_WAITING:
+                cache_release(hit);
+                conn->callback_pending = 1;
+                conn->state = CONN_COALESCING;
+                waiting_list_add(loop, conn);
+                return STEP_WAIT;
+            case COALESCE_STREAMING:
+                cache_release(hit);
+                conn->access.cache = LOG_CACHE_STREAM;
+                metrics_add(METRIC_CACHE_HITS, 1);
+                serve_hit(conn, conn->coalesce_waiter.stream);
+                conn->coalesce_waiter.stream = NULL;
+                return STEP_CONTINUE;
+            default:
+                conn->coalesce_leader = 1;
+                break;
+        }
+    }
+
+    conn->access.cache = mode == HTTP_CACHE_BYPASS ? LOG_CACHE_BYPASS : hit ? LOG_CACHE_STALE : LOG_CACHE_MISS;
+    if (mode != HTTP_CACHE_BYPASS) metrics_add(METRIC_CACHE_MISSES, 1);
+    clock_gettime(CLOCK_MONOTONIC, &conn->fetch_started);
+    conn->cacheable = mode != HTTP_CACHE_BYPASS;
+    conn->stale = hit;
+    const char *stale_head = NULL;
+    size_t stale_head_len = hit ? cache_entry_read(hit, 0, &stale_head) : 0;
+    conn->revalidating = hit && http_cache_add_validators(conn->req, stale_head, stale_head_len) == 0;
+    return start_origin_request(loop, conn);
+}
+#endif
+
+/**
+ * @brief Decides how to serve a request whose head has been parsed.
+ *
+ * The head is dropped from the buffer (the parser has its own copy), which
+ * leaves the start of the body, if any, at its front.
+ */
+static step_result_t process_request(EventLoop *loop, Connection *conn, size_t head_len) {
+    metrics_add(METRIC_REQUESTS, 1);
+    conn->request_started = metrics_now();
+    int deadline_ms = upstream_guard_timeouts().deadline_ms;
+    if (deadline_ms > 0) conn->deadline = conn->request_started + (uint64_t)deadline_ms * 1000;
+    idle_list_remove(loop, conn);
+    conn->request_len -= head_len;
+    memmove(conn->request_buffer, conn->request_buffer + head_len, conn->request_len);
+
+    struct ParsedRequest *req = conn->req;
+    if (!req->host) {
+        log_message(LOG_LEVEL_WARN, "Request is missing Host header or absolute URI.");
+        return queue_error(conn, 400, "Bad Request");
+    }
+
+    size_t body_length;
+    request_body_t framing = ParsedRequest_bodyFraming(req, &body_length);
+    switch (framing) {
+        case REQUEST_BODY_NONE:
+            break;
+        case REQUEST_BODY_LENGTH:
+        case REQUEST_BODY_CHUNKED: {
+            http_body_init(&conn->body, framing == REQUEST_BODY_LENGTH ? BODY_LENGTH : BODY_CHUNKED, body_length);
+            ssize_t used = http_response_feed(&conn->body, conn->request_buffer, conn->request_len);
+            if (used < 0) {
+                log_message(LOG_LEVEL_WARN, "Malformed request body.");
+                return queue_error(conn, 400, "Bad Request");
+            }
+            conn->has_body = 1;
+            conn->body_buffered = used;
+            conn->body_replayable = conn->body.state == RESPONSE_DONE;
+            conn->expect_continue = ParsedRequest_expectsContinue(req);
+            break;
+        }
+        case REQUEST_BODY_INVALID:
+            log_message(LOG_LEVEL_WARN, "Request body framing is not supported.");
+            return queue_error(conn, 400, "Bad Request");
+    }
+
+    conn->client_keep_alive = loop->client_idle_timeout > 0 && ParsedRequest_keepAlive(req);
+
+    // The full URL is the cache key; it is built in the request's own storage
+    conn->url_string = ParsedRequest_url(req);
+    if (!conn->url_string) return queue_error(conn, 500, "Internal Server Error");
+
+    #ifdef ENABLE_CACHE
+    // Requests with a body always bypass the cache, so their body is always forwarded
+    conn->cache_mode = http_cache_request_mode(req);
+    // An unsafe method may change what the URL returns
+    if (http_cache_request_invalidates(req)) http_compress_invalidate(req);
+    return lookup_or_fetch(loop, conn, 1);
+    #else
+    return start_origin_request(loop, conn);
+    #endif
+}
+
+/**
+ * @brief Records how long the current request took and logs it, once it
+ * is over.
+ */
+static void end_request(Connection *conn) {
+    if (!conn->request_started) return;
+    AccessInfo *access = &conn->access;
+    access->total_us = metrics_observe(METRIC_REQUEST_LATENCY, conn->request_started);
+    conn->request_started = 0;
+    // Errors were recorded when queued; anything else is the status of what was relayed or served
+    if (!access->status) access->status = conn->resp.status_code;
+    log_access(conn->req ? conn->req->method : NULL, conn->url_string, access);
+
+    dns_sockaddr_t client = access->client;
+    memset(access, 0, sizeof(*access));
+    access->client = client;
+}
+
+/**
+ * @brief Resets a persistent connection to wait for its next request.
+ *
+ * Everything belonging to the finished request is released; bytes that
+ * followed it (a pipelined request) move to the front of the buffer.
+ */
+static step_result_t next_request(EventLoop *loop, Connection *conn) {
+    end_request(conn);
+    release_guard(conn, UPSTREAM_ABANDONED); // Still held only if the origin was never heard back from
+    #ifdef ENABLE_CACHE
+    end_coalescing(conn);
+    #endif
+    put_request(loop, conn);
+    free(conn->upstream_request);
+    conn->upstream_request = NULL;
+    conn->upstream_request_len = conn->upstream_sent = 0;
+    http_response_free(&conn->resp);
+    http_response_init(&conn->resp, 0); // A disk hit has no status of its own to replace the last one
+    clear_pending(conn);
+    relay_queue_clear(&conn->queue);
+    if (conn->has_body) {
+        conn->request_len -= conn->body_buffered;
+        memmove(conn->request_buffer, conn->request_buffer + conn->body_buffered, conn->request_len);
+        http_response_free(&conn->body);
+    }
+    conn->has_body = conn->body_replayable = conn->expect_continue = 0;
+    conn->body_buffered = conn->body_sent = 0;
+    #ifdef ENABLE_CACHE
+    drop_hit(conn);
+    drop_fill(conn);
+    free(conn->held);
+    conn->held = NULL;
+    conn->held_len = 0;
+    cache_release(conn->stale);
+    conn->stale = NULL;
+    conn->revalidating = 0;
+    #endif
+    if (conn->origin_fd >= 0) {
+        drop_ring_recv(loop, conn);
+        close_watched(loop, conn->origin_fd, &conn->origin_tag);
+        conn->origin_fd = -1;
+    }
+    conn->origin_ready = conn->origin_reused = conn->origin_retried = 0;
+    conn->origin_done = 0;
+    conn->keep_alive = conn->client_keep_alive = conn->keep_open = 0;
+    conn->request_sent = 0;
+    conn->bytes_relayed = 0;
+    conn->cacheable = 0;
+    conn->deadline = 0;
+    conn->origin_timed_out = 0;
+    conn->ring_relay = conn->ring_spliced = 0;
+    put_pipe(loop, conn);
+
+    conn->state = CONN_READ_REQUEST;
+    idle_list_add(loop, conn);
+    return STEP_CONTINUE;
+}
+
+/**
+ * @brief Reads from the client until a full request head has arrived.
+ *
+ * The head is fed to the parser after every read, which picks up its
+ * search where it left off. A pipelined request may already be buffered
+ * from an earlier read, so the buffer is checked before reading more; it
+ * starts small and grows only for long heads.
+ */
+static step_result_t step_read_request(EventLoop *loop, Connection *conn) {
+    if (!conn->request_buffer) {
+        conn->request_buffer = malloc(REQUEST_BUFFER_SIZE);
+        if (!conn->request_buffer) return STEP_DONE;
+        conn->request_cap = REQUEST_BUFFER_SIZE;
+    }
+    if (!conn->req && take_request(loop, conn) < 0) return queue_error(conn, 500, "Internal Server Error");
+
+    for (;;) {
+        ssize_t head_len = ParsedRequest_feed(conn->req, conn->request_buffer, conn->request_len);
+        if (head_len > 0) return process_request(loop, conn, head_len);
+        if (head_len < 0) {
+            if (conn->request_len > MAX_REQUEST_HEAD_SIZE) {
+                log_message(LOG_LEVEL_WARN, "Request head exceeds %d bytes.", MAX_REQUEST_HEAD_SIZE);
+            } else {
+                log_message(LOG_LEVEL_WARN, "Failed to parse request.");
+            }
+            return queue_error(conn, 400, "Bad Request");
+        }
+
+        if (conn->request_len == conn->request_cap) {
+            size_t cap = conn->request_cap * 2;
+            if (cap > MAX_REQUEST_HEAD_SIZE + 1) cap = MAX_REQUEST_HEAD_SIZE + 1;
+            char *grown = realloc(conn->request_buffer, cap);
+            if (!grown) return STEP_DONE;
+            conn->request_buffer = grown;
+            conn->request_cap = cap;
+        }
+
+        ssize_t bytes_read = recv(conn->client_fd, conn->request_buffer + conn->request_len,
+                                  conn->request_cap - conn->request_len, 0);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WAIT;
+            log_errno("recv");
+            return STEP_DONE;
+        }
+        if (bytes_read == 0) return STEP_DONE; // Client went away
+
+        conn->request_len += bytes_read;
+    }
+}
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Waits for the fetch this request joined, then sends it along or
+ * tries the cache again.
+ */
+static step_result_t step_coalescing(EventLoop *loop, Connection *conn) {
+    if (conn->callback_pending) return STEP_WAIT;
+    waiting_list_remove(loop, conn);
+    if (conn->coalesce_waiter.stream) {
+        conn->access.cache = LOG_CACHE_STREAM;
+        metrics_add(METRIC_CACHE_HITS, 1);
+        CacheEntry *entry = conn->coalesce_waiter.stream;
+        conn->coalesce_waiter.stream = NULL;
+        serve_hit(conn, entry);
+        return STEP_CONTINUE;
+    }
+    return lookup_or_fetch(loop, conn, 0);
+}
+#endif
+
+/**
+ * @brief Waits for a resolver thread to finish looking up the origin.
+ */
+static step_result_t step_resolving(EventLoop *loop, Connection *conn) {
+    if (conn->callback_pending) return STEP_WAIT;
+    return resolve_origin(loop, conn);
+}
+
+/**
+ * @brief Waits for the non-blocking connect to the origin to complete,
+ * falling back to the origin's next address if it fails.
+ */
+static step_result_t step_connecting(EventLoop *loop, Connection *conn) {
+    if (!conn->origin_ready) return STEP_WAIT;
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->origin_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        if (err) errno = err;
+        log_errno("connect (destination)");
+        close_watched(loop, conn->origin_fd, &conn->origin_tag);
+        conn->origin_fd = -1;
+        return connect_origin(loop, conn);
+    }
+
+    conn->access.connect_us = metrics_observe(METRIC_CONNECT_LATENCY, conn->connect_started);
+    conn->origin_activity = metrics_now();
+    conn->state = CONN_SEND_REQUEST;
+    return STEP_CONTINUE;
+}
+
+/**
+ * @brief Sends the serialized request to the origin.
+ */
+static step_result_t step_send_request(EventLoop *loop, Connection *conn) {
+    if (conn->upstream_sent == 0) conn->request_sent = metrics_now();
+    while (conn->upstream_sent < conn->upstream_request_len) {
+        ssize_t sent = send(conn->origin_fd, conn->upstream_request + conn->upstream_sent,
+                            conn->upstream_request_len - conn->upstream_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WAIT;
+            if (conn->origin_reused && !conn->origin_retried) return retry_origin(loop, conn);
+            log_errno("send (destination)");
+            return origin_error(conn, 502, "Bad Gateway");
+        }
+        conn->upstream_sent += sent;
+        conn->origin_activity = metrics_now();
+    }
+
+    conn->state = conn->has_body ? CONN_SEND_BODY : CONN_RELAY;
+    return STEP_CONTINUE;
+}
+
+/**
+ * @brief Streams the request body from the client to the origin.
+ *
+ * Body bytes are read into the request buffer and sent on from there, so
+ * no more than one buffer of the body is held at a time, and bytes past
+ * its end stay in the buffer as the next request. A client waiting on
+ * Expect: 100-continue is told to go ahead before the first read. While
+ * waiting for the client, the connection counts as idle.
+ */
+static step_result_t step_send_body(EventLoop *loop, Connection *conn) {
+    for (;;) {
+        if (conn->pending) {
+            // The 100 Continue goes out before the client sends the rest
+            int rc = flush_pending(conn, conn->client_fd);
+            if (rc < 0) {
+                log_errno("send (client)");
+                return STEP_DONE;
+            }
+            if (rc == 0) return STEP_WAIT;
+        }
+
+        while (conn->body_sent < conn->body_buffered) {
+            ssize_t sent = send(conn->origin_fd, conn->request_buffer + conn->body_sent,
+                                conn->body_buffered - conn->body_sent, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WAIT;
+                if (conn->origin_reused && !conn->origin_retried) return retry_origin(loop, conn);
+                log_errno("send (destination)");
+                return origin_error(conn, 502, "Bad Gateway");
+            }
+            conn->body_sent += sent;
+            conn->origin_activity = metrics_now();
+        }
+        if (conn->body.state == RESPONSE_DONE) {
+            conn->state = CONN_RELAY;
+            return STEP_CONTINUE;
+        }
+
+        // Everything buffered was body, and has been sent; read the next part in its place
+        conn->request_len = conn->body_buffered = conn->body_sent = 0;
+        if (conn->expect_continue) {
+            static const char go_ahead[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            conn->expect_continue = 0;
+            if (set_pending(conn, go_ahead, sizeof(go_ahead) - 1) < 0) return STEP_DONE;
+            continue;
+        }
+
+        ssize_t bytes_read = recv(conn->client_fd, conn->request_buffer, conn->request_cap, 0);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                idle_list_add(loop, conn);
+                return STEP_WAIT;
+            }
+            log_errno("recv");
+            return STEP_DONE;
+        }
+        if (bytes_read == 0) return STEP_DONE; // Client went away mid-body
+        idle_list_remove(loop, conn);
+        conn->origin_activity = metrics_now(); // The origin's turn to take it starts now
+
+        ssize_t used = http_response_feed(&conn->body, conn->request_buffer, bytes_read);
+        if (used < 0) {
+            log_message(LOG_LEVEL_WARN, "Malformed request body.");
+            return queue_error(conn, 400, "Bad Request");
+        }
+        conn->request_len = bytes_read;
+        conn->body_buffered = used;
+    }
+}
+
+/**
+ * @brief Called once the origin's response is complete (or cut short).
+ */
+static void finish_response(EventLoop *loop, Connection *conn) {
+    int complete = conn->resp.state == RESPONSE_DONE;
+
+    #ifdef ENABLE_CACHE
+    if (complete && conn->fill) {
+        http_compress_commit(conn->fill, conn->req, elapsed_ms(&conn->fetch_started), conn->fresh_until);
+    } else if (conn->stale) {
+        // The stored copy is outdated and this response cannot replace it
+        cache_remove(cache_entry_url(conn->stale));
+    }
+    drop_fill(conn);
+    end_coalescing(conn);
+    #endif
+
+    release_guard(conn, complete ? UPSTREAM_OK : UPSTREAM_FAILED);
+    int reusable = complete && http_response_reusable(&conn->resp);
+    release_origin(loop, conn, reusable);
+    conn->keep_open = conn->client_keep_alive && reusable;
+    conn->origin_done = 1;
+}
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Called when the origin answered a revalidation with 304: the
+ * stored copy is refreshed from the 304's headers and sent instead.
+ */
+static step_result_t serve_revalidated(EventLoop *loop, Connection *conn) {
+    time_t refreshed;
+    if (http_cache_freshness(http_response_head(&conn->resp), conn->resp.head_len, time(NULL), &refreshed) == 0) {
+        cache_entry_refresh(conn->stale, refreshed);
+    }
+    conn->access.cache = LOG_CACHE_REVALIDATED;
+    end_coalescing(conn);
+    release_guard(conn, UPSTREAM_OK);
+
+    release_origin(loop, conn, http_response_reusable(&conn->resp));
+    conn->origin_done = 1;
+    CacheEntry *entry = conn->stale;
+    conn->stale = NULL;
+    serve_hit(conn, entry);
+    return STEP_CONTINUE;
+}
+#endif
+
+/**
+ * @brief How much to read from the origin next.
+ * @param client_blocked Bytes are already waiting for the client.
+ * @return Bytes, 0 if the relay queue has no room for more.
+ */
+static size_t relay_read_size(EventLoop *loop, Connection *conn, int client_blocked) {
+    // Until the head is in, a response that may be stored is held back in small reads
+    size_t want = loop->relay_size;
+    #ifdef ENABLE_CACHE
+    if (conn->cacheable && !conn->fill && want > RESPONSE_HOLD_READ_SIZE) want = RESPONSE_HOLD_READ_SIZE;
+    #endif
+    if (client_blocked) {
+        // Read ahead of the client only as far as its queue has room
+        size_t room = relay_queue_room(&conn->queue);
+        if (room < want) want = room;
+    }
+    return want;
+}
+
+/**
+ * @brief Handles the origin closing its end of the relay, or failing a
+ * read (errno is set). A reused connection that closed before answering
+ * is retried on a fresh one.
+ */
+static step_result_t relay_read_ended(EventLoop *loop, Connection *conn, int failed) {
+    if (conn->origin_reused && !conn->origin_retried && conn->bytes_relayed == 0) {
+        // The origin closed the idle connection before answering
+        return retry_origin(loop, conn);
+    }
+    if (failed) {
+        log_errno("recv (destination)");
+        metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+    } else if (conn->resp.state != RESPONSE_ERROR) {
+        http_response_eof(&conn->resp);
+    }
+    finish_response(loop, conn);
+    return STEP_CONTINUE;
+}
+
+/**
+ * @brief Takes in bytes read from the origin: frames them, and feeds the
+ * cache or holds them back while it is not known yet whether they may be
+ * stored or are to be relayed at all.
+ * @param out Set to what goes to the client now: the bytes, those held
+ * back so far, or nothing.
+ * @param result Set when the connection moved on instead (a 304 swapped
+ * for the stored copy, or a failed revalidation).
+ * @return 0 to send *out and then call relay_input_done(), -1 if *result
+ * says what happens next.
+ */
+static int relay_input(EventLoop *loop, Connection *conn, const char *data, size_t bytes_read,
+                       const char **out, size_t *out_len, step_result_t *result) {
+    if (conn->request_sent) {
+        conn->access.ttfb_us = metrics_observe(METRIC_TTFB_LATENCY, conn->request_sent);
+        conn->request_sent = 0;
+    }
+    metrics_add(METRIC_BYTES_IN, bytes_read);
+    conn->origin_activity = metrics_now();
+
+    ssize_t used = bytes_read;
+    if (conn->resp.state != RESPONSE_ERROR) used = http_response_feed(&conn->resp, data, bytes_read);
+    if (used < 0) {
+        // Relay until the origin closes, but never cache or reuse
+        log_message(LOG_LEVEL_WARN, "Malformed response from %s.", conn->req->host);
+        metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+        used = bytes_read;
+    } else if ((size_t)used < bytes_read) {
+        conn->resp.keep_alive = 0; // Origin sent more than one response
+    }
+    conn->bytes_relayed += used;
+    *out = data;
+    *out_len = used;
+
+    #ifdef ENABLE_CACHE
+    if (conn->cacheable && !conn->fill) {
+        // Whether the response may be stored is only known once its head is in
+        if (hold_bytes(conn, data, used) < 0) conn->cacheable = 0;
+    } else if (conn->fill && cache_fill_append(conn->fill, data, used) < 0) {
+        // Outgrew the object limit (or cache memory): drop it from the cache now
+        drop_fill(conn);
+        conn->cacheable = 0;
+    }
+
+    if (conn->revalidating) {
+        if (!conn->cacheable) {
+            *result = queue_error(conn, 502, "Bad Gateway");
+            return -1;
+        }
+        if (conn->resp.state == RESPONSE_HEAD) {
+            *out_len = 0; // Hold back until the status is known
+            return 0;
+        }
+        conn->revalidating = 0;
+        if (conn->resp.status_code == 304) {
+            *result = serve_revalidated(loop, conn);
+            return -1;
+        }
+        // Anything else replaces the stored copy; relay what was held back
+        *out = conn->held;
+        *out_len = conn->held_len;
+    }
+
+    // Once the head is in, HTTP decides whether the response may be stored
+    if (conn->cacheable && !conn->fill && conn->resp.state != RESPONSE_HEAD) start_fill(conn);
+    #else
+    (void)loop;
+    (void)result;
+    #endif
+    return 0;
+}
+
+/**
+ * @brief Finishes with bytes taken in by relay_input() once its output
+ * went out or was queued.
+ */
+static void relay_input_done(EventLoop *loop, Connection *conn) {
+    #ifdef ENABLE_CACHE
+    if (conn->held && conn->resp.state != RESPONSE_HEAD) {
+        free(conn->held);
+        conn->held = NULL;
+        conn->held_len = 0;
+    }
+    #endif
+    if (conn->resp.state == RESPONSE_DONE) finish_response(loop, conn);
+}
+
+/**
+ * @brief Puts bytes from the origin on their way to the client through the
+ * ring: sent straight from their receive buffer if nothing is ahead of
+ * them, else copied into the relay queue behind what is.
+ * @param buffer The receive buffer the bytes are in, or -1 if elsewhere;
+ * it is recycled once done with.
+ * @return 0 on success, -1 if no memory could be had or the ring would not
+ * take the send.
+ */
+static int ring_relay_output(EventLoop *loop, Connection *conn, const char *out, size_t out_len, int buffer) {
+    if (out_len > 0 && buffer >= 0 && conn->ring_send == RING_SEND_NONE && conn->queue.len == 0) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+        if (!sqe) {
+            uring_buffer_recycle(&loop->relay_buffers, buffer);
+            return -1;
+        }
+        // Takes what fits in the socket right away, so the buffer is soon free for other receives
+        uring_prep_send(sqe, conn->client_fd, out, out_len, MSG_NOSIGNAL | MSG_DONTWAIT, ring_relay_data(conn, 1));
+        conn->ring_send = RING_SEND_BUFFER;
+        conn->ring_buffer = buffer;
+        conn->ring_send_data = out;
+        conn->ring_send_len = out_len;
+        return 0;
+    }
+    int rc = out_len > 0 ? relay_queue_push(&conn->queue, out, out_len) : 0;
+    if (buffer >= 0) uring_buffer_recycle(&loop->relay_buffers, buffer);
+    return rc;
+}
+
+/**
+ * @brief Sends the oldest queued bytes to the client through the ring.
+ * @return 0 on success, -1 if the ring would not take the send.
+ */
+static int ring_send_queue(EventLoop *loop, Connection *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (!sqe) return -1;
+    memset(&conn->ring_msg, 0, sizeof(conn->ring_msg));
+    conn->ring_msg.msg_iov = conn->ring_iov;
+    conn->ring_msg.msg_iovlen = relay_queue_peek(&conn->queue, conn->ring_iov, RING_SEND_CHUNKS);
+    uring_prep_sendmsg(sqe, conn->client_fd, &conn->ring_msg, MSG_NOSIGNAL, ring_relay_data(conn, 1));
+    conn->ring_send = RING_SEND_QUEUE;
+    return 0;
+}
+
+/**
+ * @brief Relays the origin's response to the client through the loop's
+ * ring.
+ *
+ * At most one receive from the origin and one send to the client are in
+ * flight. The receive takes one of the loop's registered buffers only
+ * once bytes arrive, so an origin that is slow to answer ties up none.
+ * Received bytes are sent on from their buffer when nothing is ahead of
+ * them, without waiting for room; what the socket did not take goes to
+ * the front of the relay queue, and the queue is sent with a waiting
+ * send. The next receive is made as soon as the queue has room, so as in
+ * step_relay() the origin is read at its own pace until a slow client's
+ * queue is full. Completions land in ring_relay_completion(), which drives
+ * the connection on; this step only starts what is not in flight yet.
+ *
+ * A body step_relay() would splice goes back to it once its head is in and
+ * nothing is in flight: copying through the ring buffers costs about half
+ * the throughput of splicing on large bodies, and the ring's own splice
+ * always runs on a kernel worker thread that blocks on the socket.
+ */
+static step_result_t step_ring_relay(EventLoop *loop, Connection *conn) {
+    if (conn->ring_send == RING_SEND_NONE && conn->queue.len > 0 && ring_send_queue(loop, conn) < 0) {
+        log_message(LOG_LEVEL_ERROR, "The event loop's ring would not take a relay send.");
+        return STEP_DONE;
+    }
+    int client_blocked = conn->ring_send != RING_SEND_NONE || conn->queue.len > 0;
+    if (conn->origin_done) {
+        if (client_blocked) return STEP_WAIT;
+        return conn->keep_open ? next_request(loop, conn) : STEP_DONE;
+    }
+    if (conn->ring_recv) return STEP_WAIT;
+    if (!conn->cacheable && !conn->splice_unavailable && http_response_spliceable(&conn->resp)) {
+        if (conn->ring_send != RING_SEND_NONE) return STEP_WAIT;
+        if (watch_fd(loop, conn->origin_fd, &conn->origin_tag) < 0) {
+            log_errno("epoll_ctl (destination)");
+            return STEP_DONE;
+        }
+        conn->ring_relay = 0;
+        conn->ring_spliced = 1;
+        return STEP_CONTINUE;
+    }
+
+    size_t want = relay_read_size(loop, conn, client_blocked);
+    if (want == 0) return STEP_WAIT; // The send's completion makes room
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (!sqe) {
+        log_message(LOG_LEVEL_ERROR, "The event loop's ring would not take a relay receive.");
+        return STEP_DONE;
+    }
+    uring_prep_recv(sqe, conn->origin_fd, want, loop->relay_buffers.group, ring_relay_data(conn, 0));
+    conn->ring_recv = 1;
+    return STEP_WAIT;
+}
+
+/**
+ * @brief Takes in a relay receive's completion.
+ */
+static step_result_t ring_received(EventLoop *loop, Connection *conn, const struct io_uring_cqe *cqe) {
+    int buffer = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    conn->ring_recv = 0;
+    if (conn->ring_recv_dropped) {
+        conn->ring_recv_dropped = 0;
+        if (buffer >= 0) uring_buffer_recycle(&loop->relay_buffers, buffer);
+        return STEP_CONTINUE;
+    }
+
+    const char *data = buffer >= 0 ? uring_buffer(&loop->relay_buffers, buffer) : NULL;
+    ssize_t bytes_read = cqe->res;
+    if (bytes_read == -ENOBUFS) {
+        // Every buffer is in use; the bytes are there, so read them here
+        size_t want = relay_read_size(loop, conn, conn->ring_send != RING_SEND_NONE || conn->queue.len > 0);
+        if (want == 0) return STEP_CONTINUE;
+        bytes_read = recv(conn->origin_fd, loop->relay_buffer, want, 0);
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return STEP_CONTINUE;
+        if (bytes_read < 0) bytes_read = -errno;
+        data = loop->relay_buffer;
+    }
+    if (bytes_read == -EINTR) return STEP_CONTINUE;
+    if (bytes_read <= 0) {
+        errno = (int)-bytes_read;
+        return relay_read_ended(loop, conn, bytes_read < 0);
+    }
+
+    const char *out;
+    size_t out_len;
+    step_result_t result;
+    if (relay_input(loop, conn, data, bytes_read, &out, &out_len, &result) < 0) {
+        if (buffer >= 0) uring_buffer_recycle(&loop->relay_buffers, buffer);
+        return result;
+    }
+    int rc = ring_relay_output(loop, conn, out, out_len, out == data ? buffer : -1);
+    if (out != data && buffer >= 0) uring_buffer_recycle(&loop->relay_buffers, buffer);
+    if (rc < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to pass on a response from %s.", conn->req->host);
+        return STEP_DONE;
+    }
+    relay_input_done(loop, conn);
+    return STEP_CONTINUE;
+}
+
+/**
+ * @brief Takes in a relay send's completion.
+ */
+static step_result_t ring_sent(EventLoop *loop, Connection *conn, const struct io_uring_cqe *cqe) {
+    ring_send_t kind = conn->ring_send;
+    conn->ring_send = RING_SEND_NONE;
+    int failed = cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR;
+    size_t sent = cqe->res > 0 ? (size_t)cqe->res : 0;
+    if (!failed) count_sent(conn, sent);
+
+    if (kind == RING_SEND_QUEUE) {
+        relay_queue_consume(&conn->queue, sent);
+    } else {
+        // What the socket did not take goes ahead of anything queued meanwhile
+        if (!failed && sent < conn->ring_send_len &&
+            relay_queue_push_front(&conn->queue, conn->ring_send_data + sent, conn->ring_send_len - sent) < 0) {
+            failed = 1;
+        }
+        uring_buffer_recycle(&loop->relay_buffers, conn->ring_buffer);
+    }
+    if (failed) {
+        errno = cqe->res < 0 ? -cqe->res : ENOMEM;
+        log_errno("send (client)");
+        return STEP_DONE;
+    }
+    return STEP_CONTINUE;
+}
+
+/**
+ * @brief Relays the origin's response to the client.
+ *
+ * Data is read into the loop's scratch buffer and sent straight on; only
+ * what the client cannot take right now is copied into the connection's
+ * relay queue. The origin keeps being read at its own pace while the
+ * client drains the queue, until the queue (or all queues together) is
+ * full; only then is the rest left in the origin socket. Bodies that will
+ * not be cached and are delimited by a byte count are instead spliced
+ * through a pipe borrowed from the loop, never entering user space; the
+ * pipe plays the role of the queue, and once it is full with the client
+ * behind, its oldest bytes spill into the queue so the origin can be read
+ * on. Queued bytes always go out before piped ones. The origin connection
+ * is released as soon as the response has been framed completely, while
+ * the client may still be draining it.
+ *
+ * While revalidating a stored copy nothing is relayed until the head is
+ * complete, so that a 304 can be swapped for the stored response.
+ *
+ * On a loop with ring receive buffers the relay runs on the ring instead
+ * (see step_ring_relay()), at least until the head is in; the origin is
+ * not watched meanwhile.
+ */
+static step_result_t step_relay(EventLoop *loop, Connection *conn) {
+    if (conn->ring_relay) return step_ring_relay(loop, conn);
+    if (loop->relay_buffers.ring && !conn->ring_spliced) {
+        // A 100 Continue goes out first, so from here on only the ring sends to the client
+        if (conn->pending) {
+            int rc = flush_pending(conn, conn->client_fd);
+            if (rc < 0) {
+                log_errno("send (client)");
+                return STEP_DONE;
+            }
+            if (rc == 0) return STEP_WAIT;
+        }
+        unwatch_fd(loop, conn->origin_fd, &conn->origin_tag);
+        conn->ring_relay = 1;
+        return step_ring_relay(loop, conn);
+    }
+    for (;;) {
+        // Whatever is buffered goes out first: leftover output, then the queue, then the pipe
+        int client_blocked = 0;
+        if (conn->pending) {
+            int rc = flush_pending(conn, conn->client_fd);
+            if (rc < 0) {
+                log_errno("send (client)");
+                return STEP_DONE;
+            }
+            client_blocked = rc == 0;
+        }
+        if (!client_blocked && conn->queue.len > 0) {
+            ssize_t sent = relay_queue_send(&conn->queue, conn->client_fd, 0);
+            if (sent < 0) {
+                log_errno("send (client)");
+                return STEP_DONE;
+            }
+            count_sent(conn, sent);
+            client_blocked = conn->queue.len > 0;
+        }
+        if (!client_blocked && conn->pipe_len > 0) {
+            int rc = flush_pipe(conn);
+            if (rc < 0) {
+                log_errno("splice (client)");
+                return STEP_DONE;
+            }
+            client_blocked = rc == 0;
+        }
+
+        if (conn->origin_done) {
+            if (client_blocked) return STEP_WAIT;
+            return conn->keep_open ? next_request(loop, conn) : STEP_DONE;
+        }
+
+        if (!conn->cacheable && !conn->splice_unavailable && http_response_spliceable(&conn->resp)) {
+            if (conn->pipe_fds[0] < 0 && take_pipe(loop, conn) < 0) {
+                conn->splice_unavailable = 1;
+                continue;
+            }
+            size_t want = RELAY_PIPE_SIZE - conn->pipe_len;
+            if (conn->resp.framing == BODY_LENGTH && conn->resp.body_remaining < want) {
+                want = conn->resp.body_remaining;
+            }
+            ssize_t moved = want ? splice(conn->origin_fd, NULL, conn->pipe_fds[1], NULL, want,
+                                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK) : -1;
+            if (want == 0) errno = EAGAIN;
+            if (moved < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // The pipe is full if the origin has more: with the client behind, copy on instead
+                    if (client_blocked && conn->pipe_len > 0 && relay_queue_room(&conn->queue) > 0 &&
+                        origin_readable(conn)) {
+                        if (spill_pipe(loop, conn) < 0) return STEP_DONE;
+                        continue;
+                    }
+                    return STEP_WAIT;
+                }
+                log_errno("splice (destination)");
+                metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+                finish_response(loop, conn);
+                continue;
+            }
+            if (moved == 0) {
+                http_response_eof(&conn->resp);
+                finish_response(loop, conn);
+                continue;
+            }
+            http_response_skip(&conn->resp, moved);
+            metrics_add(METRIC_BYTES_IN, moved);
+            conn->origin_activity = metrics_now();
+            conn->pipe_len += moved;
+            conn->bytes_relayed += moved;
+            if (conn->resp.state == RESPONSE_DONE) finish_response(loop, conn);
+            continue;
+        }
+
+        if (conn->pipe_len > 0) return STEP_WAIT; // Copied bytes must not overtake piped ones
+
+        size_t want = relay_read_size(loop, conn, client_blocked);
+        if (want == 0) return STEP_WAIT;
+        ssize_t bytes_read = recv(conn->origin_fd, loop->relay_buffer, want, 0);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WAIT;
+            return relay_read_ended(loop, conn, 1);
+        }
+        if (bytes_read == 0) return relay_read_ended(loop, conn, 0);
+
+        const char *out;
+        size_t out_len;
+        step_result_t result;
+        if (relay_input(loop, conn, loop->relay_buffer, bytes_read, &out, &out_len, &result) < 0) return result;
+
+        ssize_t sent = 0;
+        if (!client_blocked && out_len > 0) {
+            sent = send(conn->client_fd, out, out_len, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    log_errno("send (client)");
+                    return STEP_DONE;
+                }
+                sent = 0;
+            }
+            count_sent(conn, sent);
+        }
+        if ((size_t)sent < out_len) {
+            if (relay_queue_push(&conn->queue, out + sent, out_len - sent) < 0) return STEP_DONE;
+        }
+        relay_input_done(loop, conn);
+    }
+}
+
+/**
+ * @brief Flushes a complete response to the client.
+ *
+ * A cache entry is queued a segment at a time. One that is still being
+ * filled is sent as far as it has arrived; the connection then waits for
+ * the filler to hand it back with more. An object from the disk tier goes
+ * out with sendfile(), straight from its segment file.
+ */
+static step_result_t step_write_client(EventLoop *loop, Connection *conn) {
+    #ifdef ENABLE_CACHE
+    if (conn->callback_pending) return STEP_WAIT; // Caught up with the fill
+    #endif
+    for (;;) {
+        int rc = flush_pending(conn, conn->client_fd);
+        if (rc < 0) {
+            log_errno("send (client)");
+            return STEP_DONE;
+        }
+        if (rc == 0) return STEP_WAIT;
+
+        #ifdef ENABLE_CACHE
+        if (conn->on_disk) {
+            rc = flush_disk_hit(conn);
+            if (rc < 0) {
+                log_errno("sendfile (client)");
+                return STEP_DONE;
+            }
+            if (rc == 0) return STEP_WAIT;
+            conn->keep_open = conn->client_keep_alive && conn->disk_hit.persistent;
+            drop_hit(conn);
+        }
+        if (conn->hit) {
+            // The state is read first: once it is final, so is the size
+            cache_fill_state_t state = cache_entry_state(conn->hit);
+            const char *data;
+            size_t len = cache_entry_read(conn->hit, conn->hit_offset, &data);
+            if (len > 0) {
+                conn->pending = (char *)data;
+                conn->pending_len = len;
+                conn->pending_off = 0;
+                conn->hit_offset += len;
+                if (conn->resp.state != RESPONSE_ERROR &&
+                    http_response_feed(&conn->resp, data, len) != (ssize_t)len) {
+                    conn->resp.keep_alive = 0; // Trailing bytes past the response
+                }
+                continue;
+            }
+            if (state == CACHE_FILLING) {
+                conn->fill_waiter.callback = hand_back;
+                conn->fill_waiter.arg = conn;
+                if (cache_entry_wait(conn->hit, conn->hit_offset, &conn->fill_waiter) == 0) {
+                    conn->callback_pending = 1;
+                    return STEP_WAIT;
+                }
+                continue;
+            }
+            // An abandoned fill leaves the client with a cut-off response
+            if (state == CACHE_ABORTED) return STEP_DONE;
+            conn->keep_open = conn->client_keep_alive && http_response_reusable(&conn->resp);
+            drop_hit(conn);
+        }
+        #endif
+        return conn->keep_open ? next_request(loop, conn) : STEP_DONE;
+    }
+}
+
+/**
+ * @brief Closes a connection's sockets and defers freeing it to the end of
+ * the current event batch (other events may still reference it).
+ */
+static void conn_close(EventLoop *loop, Connection *conn) {
+    if (conn->state == CONN_CLOSED) return;
+    #ifdef ENABLE_CACHE
+    if (conn->state == CONN_COALESCING && conn->callback_pending &&
+        coalesce_cancel(conn->url_string, &conn->coalesce_waiter) == 0) {
+        conn->callback_pending = 0;
+    }
+    if (conn->state == CONN_WRITE_CLIENT && conn->callback_pending &&
+        cache_entry_cancel_wait(conn->hit, &conn->fill_waiter) == 0) {
+        conn->callback_pending = 0;
+    }
+    waiting_list_remove(loop, conn);
+    drop_fill(conn);
+    end_coalescing(conn);
+    #endif
+    end_request(conn);
+    release_guard(conn, UPSTREAM_ABANDONED);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    conn->state = CONN_CLOSED;
+    idle_list_remove(loop, conn);
+    timer_remove(loop, conn);
+    if (conn->ring_send != RING_SEND_NONE) ring_relay_cancel(loop, conn, 1, conn->client_fd);
+    close_watched(loop, conn->client_fd, &conn->client_tag);
+    if (conn->origin_fd >= 0) {
+        drop_ring_recv(loop, conn);
+        close_watched(loop, conn->origin_fd, &conn->origin_tag);
+    }
+    conn->next_closed = loop->closed;
+    loop->closed = conn;
+}
+
+/**
+ * @brief Whether the kernel or another thread may still touch a closed
+ * connection, so it cannot be freed yet.
+ */
+static int conn_in_use(Connection *conn) {
+    return conn->callback_pending || conn->ring_recv || conn->ring_send != RING_SEND_NONE;
+}
+
+/**
+ * @brief Frees a connection and everything it owns.
+ */
+static void conn_free(Connection *conn) {
+    put_pipe(conn->loop, conn);
+    free(conn->request_buffer);
+    free(conn->upstream_request);
+    clear_pending(conn);
+    relay_queue_clear(&conn->queue);
+    http_response_free(&conn->resp);
+    http_response_free(&conn->body);
+    #ifdef ENABLE_CACHE
+    drop_hit(conn);
+    drop_fill(conn);
+    free(conn->held);
+    cache_release(conn->stale);
+    cache_release(conn->coalesce_waiter.stream);
+    #endif
+    put_request(conn->loop, conn);
+    conn->loop->open_connections--;
+    free(conn);
+}
+
+/**
+ * @brief Drives a connection's state machine until it would block.
+ */
+static void conn_drive(EventLoop *loop, Connection *conn) {
+    step_result_t result = STEP_CONTINUE;
+    while (result == STEP_CONTINUE) {
+        switch (conn->state) {
+            case CONN_READ_REQUEST: result = step_read_request(loop, conn); break;
+            #ifdef ENABLE_CACHE
+            case CONN_COALESCING:   result = step_coalescing(loop, conn); break;
+            #endif
+            case CONN_RESOLVING:    result = step_resolving(loop, conn); break;
+            case CONN_CONNECTING:   result = step_connecting(loop, conn); break;
+            case CONN_SEND_REQUEST: result = step_send_request(loop, conn); break;
+            case CONN_SEND_BODY:    result = step_send_body(loop, conn); break;
+            case CONN_RELAY:        result = step_relay(loop, conn); break;
+            case CONN_WRITE_CLIENT: result = step_write_client(loop, conn); break;
+            case CONN_CLOSED:       return;
+        }
+    }
+    if (result == STEP_DONE) conn_close(loop, conn);
+    else update_timer(loop, conn);
+}
+
+/**
+ * @brief Starts serving a newly accepted, non-blocking client socket.
+ */
+static void add_connection(EventLoop *loop, int client_socket_fd) {
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (!conn) {
+        log_errno("calloc for connection");
+        close(client_socket_fd);
+        return;
+    }
+    conn->state = CONN_READ_REQUEST;
+    conn->loop = loop;
+    conn->client_fd = client_socket_fd;
+    conn->origin_fd = -1;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    relay_queue_init(&conn->queue);
+    conn->client_tag.conn = conn;
+    conn->client_tag.is_origin = 0;
+    conn->origin_tag.conn = conn;
+    conn->origin_tag.is_origin = 1;
+
+    if (watch_fd(loop, client_socket_fd, &conn->client_tag) < 0) {
+        log_errno("epoll_ctl (client)");
+        close(client_socket_fd);
+        free(conn);
+        return;
+    }
+    loop->open_connections++;
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    // The client's address is only looked up when there is an access log to put it in
+    if (log_access_enabled()) {
+        socklen_t client_len = sizeof(conn->access.client);
+        getpeername(client_socket_fd, &conn->access.client.sa, &client_len);
+    }
+    idle_list_add(loop, conn);
+    // Data may already be queued; edge-triggered epoll will not report it again
+    conn_drive(loop, conn);
+}
+
+/**
+ * @brief Accepts every pending connection on the listening socket.
+ */
+static void accept_connections(EventLoop *loop) {
+    for (;;) {
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket_fd = accept4(loop->listen_fd, (struct sockaddr *)&client_addr,
+                                       &client_len, SOCK_NONBLOCK);
+        if (client_socket_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_errno("accept");
+            return;
+        }
+        add_connection(loop, client_socket_fd);
+    }
+}
+
+/**
+ * @brief Resumes connections whose origin lookup or awaited fetch has completed.
+ */
+static void drain_handed_back(EventLoop *loop) {
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) log_errno("read (eventfd)");
+
+    pthread_mutex_lock(&loop->handback_lock);
+    Connection *list = loop->handed_back;
+    loop->handed_back = NULL;
+    pthread_mutex_unlock(&loop->handback_lock);
+
+    while (list) {
+        Connection *conn = list;
+        list = conn->next_handed_back;
+        conn->callback_pending = 0;
+        if (!conn->callback_orphaned) conn_drive(loop, conn);
+        else if (!conn_in_use(conn)) conn_free(conn); // Else the ring's last completion frees it
+    }
+}
+
+/**
+ * @brief Ends an exchange whose origin ran out of time.
+ *
+ * A connect that times out moves on to the origin's next address, unless
+ * the request's deadline has passed too. Anything later fails the request
+ * with a 504, or cuts the response short if some of it already went out.
+ * A relay held up by a slow client, rather than by the origin, is still
+ * ended but not counted against the origin.
+ */
+static void time_out_origin(EventLoop *loop, Connection *conn) {
+    step_result_t result;
+    if (conn->state == CONN_CONNECTING) {
+        if (conn->deadline && metrics_now() >= conn->deadline) conn->addr_index = conn->addrs.count;
+        errno = ETIMEDOUT;
+        log_errno("connect (destination)");
+        close_watched(loop, conn->origin_fd, &conn->origin_tag);
+        conn->origin_fd = -1;
+        conn->origin_timed_out = 1;
+        result = connect_origin(loop, conn);
+    } else {
+        int client_blocked = conn->state == CONN_RELAY &&
+                             (conn->pending || conn->queue.len || conn->pipe_len || conn->ring_send != RING_SEND_NONE);
+        int answered = conn->state == CONN_RELAY && (conn->access.bytes > 0 || client_blocked);
+        if (client_blocked) {
+            log_message(LOG_LEVEL_WARN, "Timed out waiting for the client to take a response from %s.", conn->req->host);
+        } else {
+            log_message(LOG_LEVEL_WARN, "Timed out waiting for %s.", conn->req->host);
+            metrics_add(METRIC_UPSTREAM_TIMEOUTS, 1);
+            metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+        }
+        release_guard(conn, client_blocked ? UPSTREAM_ABANDONED : UPSTREAM_FAILED);
+        finish_response(loop, conn);
+        result = answered ? STEP_DONE : queue_error(conn, 504, "Gateway Timeout");
+    }
+    if (result == STEP_DONE) conn_close(loop, conn);
+    else conn_drive(loop, conn);
+}
+
+/**
+ * @brief Times out the exchanges whose timers have come up.
+ *
+ * A key may be behind the connection's real expiry, since progress does
+ * not move it; such an entry is re-keyed and goes back down the heap.
+ */
+static void check_timers(EventLoop *loop) {
+    uint64_t now = metrics_now();
+    while (loop->timer_count > 0 && loop->timers[0]->timer_expiry <= now) {
+        Connection *conn = loop->timers[0];
+        uint64_t expiry = origin_expiry(conn);
+        if (expiry > now) {
+            conn->timer_expiry = expiry;
+            timer_sift_down(loop, 0);
+            continue;
+        }
+        timer_remove(loop, conn);
+        if (expiry) time_out_origin(loop, conn);
+    }
+}
+
+/**
+ * @brief Milliseconds until the first timer in the heap comes up, or -1.
+ */
+static int next_timer_ms(EventLoop *loop) {
+    if (loop->timer_count == 0) return -1;
+    uint64_t now = metrics_now();
+    uint64_t expiry = loop->timers[0]->timer_expiry;
+    if (expiry <= now) return 0;
+    uint64_t ms = (expiry - now + 999) / 1000;
+    return ms > 1000 ? 1000 : (int)ms;
+}
+
+/**
+ * @brief Acts on readiness reported for a watched socket.
+ * @param tag The socket's tag; NULL stands for the listener (epoll only).
+ * @param events The epoll/poll events reported.
+ */
+static void dispatch_event(EventLoop *loop, EventTag *tag, uint32_t events) {
+    if (tag == NULL) {
+        if (!loop->draining) accept_connections(loop);
+        return;
+    }
+    if (tag == &loop->wake_tag) {
+        drain_handed_back(loop);
+        return;
+    }
+    Connection *conn = tag->conn;
+    if (tag->is_origin && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        conn->origin_ready = 1;
+    }
+    conn_drive(loop, conn);
+}
+
+/**
+ * @brief Waits for one batch of epoll events and acts on them.
+ * @return 0 on success, -1 if the loop cannot go on.
+ */
+static int wait_epoll(EventLoop *loop, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) dispatch_event(loop, (EventTag *)events[i].data.ptr, events[i].events);
+    return 0;
+}
+
+/**
+ * @brief Acts on the completion of a connection's relay receive or send.
+ *
+ * A closed connection only waits for its last operation to end; if it is
+ * no longer in the loop's deferred-free list, it is freed here.
+ */
+static void ring_relay_completion(EventLoop *loop, const struct io_uring_cqe *cqe) {
+    Connection *conn = (Connection *)(uintptr_t)(cqe->user_data & ~(URING_DATA_RELAY | URING_DATA_SEND));
+    int send = (cqe->user_data & URING_DATA_SEND) != 0;
+    if (conn->state == CONN_CLOSED) {
+        if (send) {
+            if (conn->ring_send == RING_SEND_BUFFER) uring_buffer_recycle(&loop->relay_buffers, conn->ring_buffer);
+            conn->ring_send = RING_SEND_NONE;
+        } else {
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                uring_buffer_recycle(&loop->relay_buffers, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            conn->ring_recv = 0;
+        }
+        if (conn->callback_orphaned && !conn_in_use(conn)) conn_free(conn);
+        return;
+    }
+    step_result_t result = send ? ring_sent(loop, conn, cqe) : ring_received(loop, conn, cqe);
+    if (result == STEP_DONE) conn_close(loop, conn);
+    else conn_drive(loop, conn);
+}
+
+/**
+ * @brief Acts on one completion from the ring.
+ *
+ * A poll that ended on its own (it completes without IORING_CQE_F_MORE, as
+ * when the completion queue overflowed) is armed again if its socket is
+ * still watched; one that ended after being let go frees its slot.
+ */
+static void ring_completion(EventLoop *loop, const struct io_uring_cqe *cqe) {
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (cqe->user_data == URING_DATA_IGNORE) return;
+    if (cqe->user_data & URING_DATA_RELAY) {
+        ring_relay_completion(loop, cqe);
+        return;
+    }
+    if (cqe->user_data == URING_DATA_ACCEPT) {
+        if (cqe->res >= 0 && loop->draining) {
+            close(cqe->res); // Taken before the cancel went in
+        } else if (cqe->res >= 0) {
+            add_connection(loop, cqe->res);
+        } else if (cqe->res == -EINVAL && loop->accept_multishot) {
+            loop->accept_multishot = 0; // Kernel without multishot accept: one at a time
+        } else if (cqe->res != -EAGAIN && cqe->res != -EINTR && !(cqe->res == -ECANCELED && loop->draining)) {
+            errno = -cqe->res;
+            log_errno("accept");
+        }
+        // The ring may be full just when the accept ended, as on a completion queue overflow
+        if (!more && !loop->draining && ring_accept(loop) < 0) loop->accept_pending = 1;
+        return;
+    }
+
+    unsigned slot = (unsigned)cqe->user_data;
+    if (slot >= loop->watch_cap || loop->watches[slot].generation != (uint32_t)(cqe->user_data >> 32)) return;
+    WatchSlot *watch = &loop->watches[slot];
+    if (!more) watch->armed = 0;
+    EventTag *tag = watch->tag;
+    if (tag) {
+        // A failed poll is passed on as an error, which the state machine meets on its next call
+        dispatch_event(loop, tag, cqe->res >= 0 ? (uint32_t)cqe->res : (uint32_t)(POLLERR | POLLHUP));
+    }
+    // Acting on the event may have let the socket go
+    watch = &loop->watches[slot];
+    if (watch->armed) return;
+    if (!watch->tag) {
+        if (!watch->pending) ring_free_slot(loop, slot); // Else the flush frees it
+    } else if (cqe->res >= 0 && ring_arm(loop, slot, watch->tag == &loop->wake_tag ? POLLIN : WATCH_EVENTS) < 0) {
+        ring_defer(loop, slot); // Armed by the flush before the next wait
+    }
+}
+
+/**
+ * @brief Submits what the last batch queued on the ring, waits for the
+ * next completions and acts on them.
+ * @return 0 on success, -1 if the loop cannot go on.
+ */
+static int wait_uring(EventLoop *loop, int timeout_ms) {
+    ring_flush_pending(loop);
+    if (uring_wait(&loop->ring, timeout_ms) < 0) {
+        if (errno == EINTR) return 0;
+        perror("io_uring_enter");
+        return -1;
+    }
+    struct io_uring_cqe *cqe;
+    for (int i = 0; i < MAX_EVENTS && (cqe = uring_peek_cqe(&loop->ring)) != NULL; i++) {
+        struct io_uring_cqe done = *cqe;
+        uring_cqe_seen(&loop->ring);
+        ring_completion(loop, &done);
+    }
+    return 0;
+}
+
+/**
+ * @brief Starts a loop's shutdown: it takes no more connections, and
+ * those between requests are closed as they become idle. The rest finish
+ * their exchanges, bounded by the usual timeouts.
+ */
+static void begin_drain(EventLoop *loop) {
+    loop->draining = 1;
+    if (loop->use_uring) loop->accept_cancel = 1; // Queued with the next wait
+    else epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+}
+
+/**
+ * @brief Entry point of an event loop thread.
+ */
+static void *event_loop_main(void *args) {
+    EventLoop *loop = (EventLoop *)args;
+
+    if (loop->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc != 0) fprintf(stderr, "pthread_setaffinity_np (cpu %d): %s\n", loop->cpu, strerror(rc));
+    }
+
+    while (1) {
+        // Wake up once a second while connections are waiting to time out
+        int timers = loop->idle_head != NULL;
+        #ifdef ENABLE_CACHE
+        timers = timers || loop->waiting_head;
+        #endif
+        int timeout_ms = timers ? 1000 : -1;
+        int timer_ms = next_timer_ms(loop);
+        if (timer_ms >= 0 && (timeout_ms < 0 || timer_ms < timeout_ms)) timeout_ms = timer_ms;
+        if ((loop->use_uring ? wait_uring(loop, timeout_ms) : wait_epoll(loop, timeout_ms)) < 0) break;
+        if (!loop->draining && atomic_load(&stop_requested)) begin_drain(loop);
+
+        // Time out exchanges with origins that stopped making progress
+        check_timers(loop);
+
+        // Close connections that sat idle for too long
+        if (loop->idle_head) {
+            time_t now = now_seconds();
+            while (loop->idle_head &&
+                   (loop->draining || now - loop->idle_head->idle_since >= loop->client_idle_timeout)) {
+                conn_close(loop, loop->idle_head);
+            }
+        }
+
+        #ifdef ENABLE_CACHE
+        // Stop waiting on fetches that take too long and fetch independently
+        if (loop->waiting_head) {
+            time_t now = now_seconds();
+            while (loop->waiting_head && now - loop->waiting_head->wait_since >= loop->coalesce_timeout) {
+                Connection *conn = loop->waiting_head;
+                waiting_list_remove(loop, conn);
+                // If the fetch just ended, the handover is already on its way
+                if (coalesce_cancel(conn->url_string, &conn->coalesce_waiter) == 0) {
+                    log_message(LOG_LEVEL_DEBUG, "Cache WAIT timed out for: %s", conn->url_string);
+                    conn->callback_pending = 0;
+                    conn_drive(loop, conn);
+                }
+            }
+        }
+        #endif
+
+        while (loop->closed) {
+            Connection *conn = loop->closed;
+            loop->closed = conn->next_closed;
+            if (conn_in_use(conn)) {
+                // Another thread or the ring still holds a pointer; drain_handed_back or ring_relay_completion frees it
+                conn->callback_orphaned = 1;
+                continue;
+            }
+            conn_free(conn);
+        }
+
+        // Nothing can call back into a drained loop once its connections are freed
+        if (loop->draining && loop->open_connections == 0) break;
+    }
+
+    relay_queue_thread_exit();
+    return NULL;
+}
+
+/**
+ * @brief Creates a loop's epoll instance and registers the listener and
+ * the eventfd on it.
+ * @return 0 on success, -1 on failure.
+ */
+static int setup_epoll(EventLoop *loop) {
+    if (socket_set_nonblocking(loop->listen_fd) < 0) {
+        perror("fcntl (listener)");
+        return -1;
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    // Exclusive wakeup: one loop per incoming connection, no thundering herd
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if (!loop->owns_listener) ev.events |= EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) < 0) {
+        perror("epoll_ctl (listener)");
+        close(loop->epoll_fd);
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->wake_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        perror("epoll_ctl (eventfd)");
+        close(loop->epoll_fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates a loop's ring and queues the accept on the listener and
+ * the poll on the eventfd.
+ *
+ * The listener is left blocking: the ring waits for connections itself,
+ * and would give up at once on a non-blocking socket. Only one loop takes
+ * each connection, as with EPOLLEXCLUSIVE.
+ *
+ * Responses are relayed on the ring too where the kernel has registered
+ * buffer rings and its receives wait on non-blocking sockets; otherwise
+ * the relay works on readiness, as with epoll.
+ * @return 0 on success, -1 on failure.
+ */
+static int setup_uring(EventLoop *loop) {
+    if (uring_init(&loop->ring, MAX_EVENTS) < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    unsigned buffers = 1;
+    while (buffers < 1024 && buffers * 2 * loop->relay_size <= RING_RELAY_MEMORY) buffers *= 2;
+    if (buffers < 8) buffers = 8;
+    if (uring_recv_waits(&loop->ring) &&
+        uring_buffers_init(&loop->ring, &loop->relay_buffers, buffers, loop->relay_size, 0) < 0) {
+        loop->relay_buffers.ring = NULL;
+    }
+    loop->accept_multishot = 1;
+    if (ring_accept(loop) < 0 || ring_watch(loop, loop->wake_fd, &loop->wake_tag, POLLIN) < 0) {
+        fprintf(stderr, "Failed to queue the event loop's first operations.\n");
+        uring_buffers_destroy(&loop->ring, &loop->relay_buffers);
+        uring_destroy(&loop->ring);
+        free(loop->watches);
+        loop->watches = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Prepares a loop's event source, listening socket and relay buffer.
+ * @return 0 on success, -1 on failure.
+ */
+static int event_loop_setup(EventLoop *loop, int listen_fd, const event_loop_config_t *config) {
+    loop->relay_size = config->relay_buffer_size > 0 ? config->relay_buffer_size : DEFAULT_RELAY_BUFFER_SIZE;
+    loop->relay_buffer = malloc(loop->relay_size);
+    if (!loop->relay_buffer) {
+        perror("malloc for relay buffer");
+        return -1;
+    }
+
+    if (config->reuse_port) {
+        listen_fd = socket_listen_tcp(config->port, config->backlog, 1);
+        if (listen_fd < 0) {
+            free(loop->relay_buffer);
+            return -1;
+        }
+        loop->owns_listener = 1;
+
+        // Prefer this listener for connections whose packets arrive on our CPU
+        if (loop->cpu >= 0 &&
+            setsockopt(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &loop->cpu, sizeof(loop->cpu)) < 0) {
+            perror("setsockopt (SO_INCOMING_CPU)");
+        }
+    }
+    loop->listen_fd = listen_fd;
+
+    // Resolver threads hand finished lookups back through an eventfd
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        perror("eventfd");
+        goto fail;
+    }
+    pthread_mutex_init(&loop->handback_lock, NULL);
+
+    if ((loop->use_uring ? setup_uring(loop) : setup_epoll(loop)) < 0) {
+        pthread_mutex_destroy(&loop->handback_lock);
+        close(loop->wake_fd);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    free(loop->relay_buffer);
+    if (loop->owns_listener) close(listen_fd);
+    return -1;
+}
+
+/**
+ * @brief Releases a loop's event source, private listener and buffers.
+ */
+static void event_loop_teardown(EventLoop *loop) {
+    if (loop->use_uring) {
+        uring_buffers_destroy(&loop->ring, &loop->relay_buffers);
+        uring_destroy(&loop->ring);
+        free(loop->watches);
+    } else {
+        close(loop->epoll_fd);
+    }
+    close(loop->wake_fd);
+    pthread_mutex_destroy(&loop->handback_lock);
+    for (int i = 0; i < loop->spare_pipe_count; i++) {
+        close(loop->spare_pipes[i][0]);
+        close(loop->spare_pipes[i][1]);
+    }
+    for (int i = 0; i < loop->spare_request_count; i++) ParsedRequest_destroy(loop->spare_requests[i]);
+    free(loop->relay_buffer);
+    free(loop->timers);
+    if (loop->owns_listener) close(loop->listen_fd);
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Starts the event loops and waits for them to exit.
+ */
+int event_loop_run(int listen_fd, const event_loop_config_t *config) {
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online_cpus < 1) online_cpus = 1;
+
+    int num_loops = config->num_loops > 0 ? config->num_loops : (int)online_cpus;
+
+    // Fall back to epoll where io_uring is missing, disabled or too old
+    int use_uring = config->use_uring;
+    if (use_uring) {
+        Uring probe;
+        if (uring_init(&probe, 1) < 0) {
+            fprintf(stderr, "io_uring is not available (%s); using epoll.\n", strerror(errno));
+            use_uring = 0;
+        } else {
+            uring_destroy(&probe);
+        }
+    }
+
+    EventLoop *loops = calloc(num_loops, sizeof(EventLoop));
+    pthread_t *threads = calloc(num_loops, sizeof(pthread_t));
+    if (!loops || !threads) {
+        perror("calloc for event loops");
+        free(loops); free(threads);
+        return -1;
+    }
+
+    pthread_mutex_lock(&running_lock);
+    running_loops = loops;
+    pthread_mutex_unlock(&running_lock);
+
+    int started = 0;
+    for (int i = 0; i < num_loops; i++) {
+        loops[i].cpu = config->pin_cpus ? (int)(i % online_cpus) : -1;
+        loops[i].client_idle_timeout = config->client_idle_timeout;
+        loops[i].use_uring = use_uring;
+        #ifdef ENABLE_CACHE
+        loops[i].coalesce_timeout = config->coalesce_timeout;
+        #endif
+        if (event_loop_setup(&loops[i], listen_fd, config) < 0) break;
+
+        if (pthread_create(&threads[i], NULL, event_loop_main, &loops[i]) != 0) {
+            perror("pthread_create");
+            event_loop_teardown(&loops[i]);
+            break;
+        }
+        pthread_mutex_lock(&running_lock);
+        running_count = ++started;
+        // A stop that came before this loop existed did not wake it
+        if (atomic_load(&stop_requested)) wake_loop(&loops[i]);
+        pthread_mutex_unlock(&running_lock);
+    }
+
+    if (started == 0) {
+        pthread_mutex_lock(&running_lock);
+        running_loops = NULL;
+        pthread_mutex_unlock(&running_lock);
+        free(loops); free(threads);
+        return -1;
+    }
+
+    printf("Event-driven engine running %d %s loop(s)%s%s%s.\n", started, use_uring ? "io_uring" : "epoll",
+           loops[0].relay_buffers.ring ? ", relaying on the ring" : "",
+           config->reuse_port ? ", one SO_REUSEPORT listener each" : "",
+           config->pin_cpus ? ", pinned to CPUs" : "");
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    // Only now may a loop's eventfd go: a stop wakes all of them
+    pthread_mutex_lock(&running_lock);
+    running_loops = NULL;
+    running_count = 0;
+    pthread_mutex_unlock(&running_lock);
+    for (int i = 0; i < started; i++) event_loop_teardown(&loops[i]);
+
+    free(loops);
+    free(threads);
+    return 0;
+}
+
+/**
+ * @brief Asks every loop to drain and exit.
+ */
+void event_loop_stop(void) {
+    atomic_store(&stop_requested, 1);
+    pthread_mutex_lock(&running_lock);
+    for (int i = 0; i < running_count; i++) wake_loop(&running_loops[i]);
+    pthread_mutex_unlock(&running_lock);
+}
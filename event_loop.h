@@ -0,0 +1,69 @@
+/**
+ * @file event_loop.h
+ * @author Shubham More
+ * @brief Interface for the epoll-based, event-driven proxy engine.
+ *
+ * Instead of dedicating a thread to every client, a small number of event
+ * loops multiplex all client and origin sockets using edge-triggered epoll.
+ * Each connection is driven through a non-blocking state machine
+ * (read request -> parse -> cache lookup -> resolve -> connect -> relay), so thousands
+ * of concurrent connections cost a few kilobytes of heap each rather than a
+ * thread and its stack.
+ *
+ * Loops take their readiness events from epoll, or from an io_uring with
+ * multishot polls and accepts when use_uring is set and the kernel has
+ * it, so that one system call per batch both submits every change the
+ * batch made and waits for the next events.
+ *
+ * In multi-reactor mode every loop binds its own SO_REUSEPORT listener, so
+ * the kernel spreads connections across loops and there is no shared accept
+ * queue. Loops can additionally be pinned to CPUs, with SO_INCOMING_CPU
+ * steering each connection to the loop on the core that received it.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+
+/**
+ * @struct event_loop_config_t
+ * @brief Startup options for the event-driven engine.
+ */
+typedef struct {
+    int num_loops;   // Event loop threads; 0 means one per online CPU
+    int reuse_port;  // Give each loop its own SO_REUSEPORT listener
+    int pin_cpus;    // Pin loop i to CPU i (and set SO_INCOMING_CPU)
+    int port;        // Port for per-loop listeners (reuse_port only)
+    int backlog;     // listen() backlog for per-loop listeners
+    int client_idle_timeout; // Seconds a keep-alive client may idle; 0 disables keep-alive
+    int coalesce_timeout;    // Seconds a cache miss waits for an identical fetch; 0 disables
+    size_t relay_buffer_size; // Bytes a loop reads from an origin at once; 0 means the default
+    int use_uring;           // Take events from io_uring instead of epoll, where the kernel allows
+} event_loop_config_t;
+
+/**
+ * @brief Runs the event-driven engine.
+ *
+ * Spawns the configured number of event loop threads and blocks until they
+ * exit, which they do once event_loop_stop() has drained them. Without
+ * reuse_port all loops wait on listen_fd; with it, listen_fd is ignored
+ * and every loop binds its own listener. listen_fd stays open.
+ * @param listen_fd A bound, listening TCP socket, or -1 with reuse_port.
+ * @param config The engine options.
+ * @return 0 on success, -1 if the engine could not be started.
+ */
+int event_loop_run(int listen_fd, const event_loop_config_t *config);
+
+/**
+ * @brief Shuts the engine down gracefully.
+ *
+ * Every loop stops accepting, closes its clients as they go idle between
+ * requests, lets the exchanges in progress finish, and exits once its
+ * last connection is gone; then event_loop_run() returns. May be called
+ * from any thread, also before the engine has started, but not from a
+ * signal handler.
+ */
+void event_loop_stop(void);
+
+#endif
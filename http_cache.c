@@ -0,0 +1,350 @@
+/**
+ * @file http_cache.c
+ * @author Shubham More
+ * @brief Implementation of the HTTP caching rules applied by the proxy's cache.
+ *
+ * Response heads are scanned field by field straight from the bytes the
+ * origin sent; request headers come from the parsed request. Freshness is
+ * computed as in RFC 9111 section 4.2: the lifetime from s-maxage, max-age,
+ * Expires minus Date, or a Last-Modified heuristic, less the age the
+ * response already had on arrival (the larger of its Age header and how far
+ * its Date lies in the past).
+ */
+
+#define _GNU_SOURCE
+#include "http_cache.h"
+#include "proxy_parse.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HEURISTIC_FRACTION 10           // Heuristic lifetime: 1/10 of the time since Last-Modified
+#define HEURISTIC_MAX_LIFETIME 86400    // Heuristic lifetimes are capped at a day
+#define MAX_DELTA_SECONDS 2147483648LL  // Larger max-age/Age values are clamped (RFC 9111 1.2.2)
+#define MAX_VALIDATOR_LEN 256           // Longer ETag/Last-Modified values are not used
+
+// One header field line of a response head
+typedef struct {
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+} HeaderField;
+
+// The Cache-Control directives the proxy acts on
+typedef struct {
+    int no_store;
+    int no_cache;
+    int is_private;
+    long long max_age;      // -1 if absent
+    long long s_maxage;     // -1 if absent
+} CacheControl;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Reads the header field line at *cursor and advances past it.
+ * @return 1 if a field was read, 0 at the blank line that ends the head.
+ */
+static int next_field(const char **cursor, const char *end, HeaderField *field) {
+    while (*cursor < end) {
+        const char *line = *cursor;
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) return 0;
+        *cursor = eol + 1;
+
+        size_t line_len = eol - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        if (line_len == 0) return 0;
+
+        const char *colon = memchr(line, ':', line_len);
+        if (!colon) continue;
+        field->key = line;
+        field->key_len = colon - line;
+        field->value = colon + 1;
+        field->value_len = line_len - field->key_len - 1;
+        while (field->value_len > 0 && (*field->value == ' ' || *field->value == '\t')) {
+            field->value++;
+            field->value_len--;
+        }
+        while (field->value_len > 0 && (field->value[field->value_len - 1] == ' ' ||
+                                        field->value[field->value_len - 1] == '\t')) {
+            field->value_len--;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief The first header field line of a response head (past the status line).
+ */
+static const char *first_field(const char *head, size_t len) {
+    const char *status_end = memchr(head, '\n', len);
+    return status_end ? status_end + 1 : head + len;
+}
+
+/**
+ * @brief Case-insensitively compares a field name.
+ */
+static int key_is(const HeaderField *field, const char *name) {
+    size_t name_len = strlen(name);
+    return field->key_len == name_len && strncasecmp(field->key, name, name_len) == 0;
+}
+
+/**
+ * @brief Parses a delta-seconds value, clamping large ones.
+ * @return The number of seconds, or -1 if the value is not a number.
+ */
+static long long parse_seconds(const char *value, size_t len) {
+    if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+        value++;
+        len -= 2;
+    }
+    if (len == 0) return -1;
+    long long seconds = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') return -1;
+        if (seconds < MAX_DELTA_SECONDS) seconds = seconds * 10 + (value[i] - '0');
+    }
+    return seconds < MAX_DELTA_SECONDS ? seconds : MAX_DELTA_SECONDS;
+}
+
+/**
+ * @brief Adds the directives of one Cache-Control (or Pragma) value.
+ *
+ * Field-qualified no-cache and private (e.g. no-cache="Set-Cookie") are
+ * treated as applying to the whole response.
+ */
+static void parse_cache_control(const char *value, size_t len, CacheControl *cc) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+        size_t start = i;
+        int quoted = 0;
+        while (i < len && (quoted || value[i] != ',')) {
+            if (value[i] == '"') quoted = !quoted;
+            i++;
+        }
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) end--;
+        if (end == start) continue;
+
+        const char *name = value + start;
+        const char *equals = memchr(name, '=', end - start);
+        size_t name_len = equals ? (size_t)(equals - name) : end - start;
+        const char *arg = equals ? equals + 1 : NULL;
+        size_t arg_len = equals ? (size_t)(value + end - arg) : 0;
+
+        if (name_len == 8 && strncasecmp(name, "no-store", 8) == 0) {
+            cc->no_store = 1;
+        } else if (name_len == 8 && strncasecmp(name, "no-cache", 8) == 0) {
+            cc->no_cache = 1;
+        } else if (name_len == 7 && strncasecmp(name, "private", 7) == 0) {
+            cc->is_private = 1;
+        } else if (name_len == 7 && strncasecmp(name, "max-age", 7) == 0 && arg) {
+            cc->max_age = parse_seconds(arg, arg_len);
+        } else if (name_len == 8 && strncasecmp(name, "s-maxage", 8) == 0 && arg) {
+            cc->s_maxage = parse_seconds(arg, arg_len);
+        }
+    }
+}
+
+/**
+ * @brief Whether a Vary value names no request header but Accept-Encoding.
+ */
+static int varies_by_coding_only(const char *value, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && value[i] != ',') i++;
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) end--;
+        if (end > start && !(end - start == 15 && strncasecmp(value + start, "Accept-Encoding", 15) == 0)) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Parses an HTTP date in any of the three formats RFC 9110 allows.
+ * @return 0 on success, -1 if the value is not a valid date.
+ */
+static int parse_http_date(const char *value, size_t len, time_t *out) {
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    // IMF-fixdate
+        "%A, %d-%b-%y %H:%M:%S GMT",    // Obsolete RFC 850 format
+        "%a %b %e %H:%M:%S %Y"          // Obsolete asctime() format
+    };
+    char buf[64];
+    if (len >= sizeof(buf)) return -1;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(buf, formats[i], &tm);
+        if (end && *end == '\0') {
+            *out = timegm(&tm);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Copies a header value into a NUL-terminated buffer.
+ * @return 0 on success, -1 if it does not fit.
+ */
+static int copy_value(const HeaderField *field, char *buf, size_t size) {
+    if (field->value_len == 0 || field->value_len >= size) return -1;
+    memcpy(buf, field->value, field->value_len);
+    buf[field->value_len] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Whether a status code is cacheable by default (RFC 9110 15.1),
+ * leaving out the ones this cache cannot handle (206) or does not want
+ * to hold on to (the 5xx range).
+ */
+static int status_cacheable(int status) {
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308: case 404: case 405: case 410: case 414:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Decides how the cache may answer a request.
+ */
+http_cache_mode_t http_cache_request_mode(struct ParsedRequest *req) {
+    if (strcmp(req->method, "GET") != 0) return HTTP_CACHE_BYPASS;
+    // A body has to reach the origin, and may change what it answers
+    size_t body_length;
+    if (ParsedRequest_bodyFraming(req, &body_length) != REQUEST_BODY_NONE) return HTTP_CACHE_BYPASS;
+    // A shared cache must not hand one user's authorized response to another
+    if (ParsedHeader_get(req, "Authorization")) return HTTP_CACHE_BYPASS;
+
+    CacheControl cc = { 0, 0, 0, -1, -1 };
+    struct ParsedHeader *header = ParsedHeader_get(req, "Cache-Control");
+    if (header) parse_cache_control(header->value, strlen(header->value), &cc);
+    header = ParsedHeader_get(req, "Pragma");
+    if (header) parse_cache_control(header->value, strlen(header->value), &cc);
+
+    if (cc.no_store) return HTTP_CACHE_BYPASS;
+    if (cc.no_cache || cc.max_age == 0) return HTTP_CACHE_REVALIDATE;
+    return HTTP_CACHE_LOOKUP;
+}
+
+/**
+ * @brief Whether the request's method is unsafe.
+ */
+int http_cache_request_invalidates(struct ParsedRequest *req) {
+    return strcmp(req->method, "GET") != 0 && strcmp(req->method, "HEAD") != 0 &&
+           strcmp(req->method, "OPTIONS") != 0 && strcmp(req->method, "TRACE") != 0;
+}
+
+/**
+ * @brief Computes the response's freshness from its headers.
+ */
+int http_cache_freshness(const char *head, size_t head_len, time_t now, time_t *fresh_until) {
+    CacheControl cc = { 0, 0, 0, -1, -1 };
+    int has_date = 0, has_expires = 0, has_last_modified = 0, has_etag = 0;
+    time_t date = 0, expires = 0, last_modified = 0;
+    long long age = 0;
+
+    const char *cursor = first_field(head, head_len);
+    HeaderField field;
+    while (next_field(&cursor, head + head_len, &field)) {
+        if (key_is(&field, "Cache-Control")) {
+            parse_cache_control(field.value, field.value_len, &cc);
+        } else if (key_is(&field, "Set-Cookie")) {
+            return -1; // Cookies are per user
+        } else if (key_is(&field, "Vary") && !varies_by_coding_only(field.value, field.value_len)) {
+            // The cache keys on the URL and the content coding alone (see http_compress.h)
+            return -1;
+        } else if (key_is(&field, "Date")) {
+            has_date = parse_http_date(field.value, field.value_len, &date) == 0;
+        } else if (key_is(&field, "Expires")) {
+            // An invalid Expires (e.g. "0") means already expired
+            has_expires = 1;
+            if (parse_http_date(field.value, field.value_len, &expires) < 0) expires = 0;
+        } else if (key_is(&field, "Last-Modified")) {
+            has_last_modified = parse_http_date(field.value, field.value_len, &last_modified) == 0;
+        } else if (key_is(&field, "ETag")) {
+            has_etag = field.value_len > 0;
+        } else if (key_is(&field, "Age")) {
+            long long seconds = parse_seconds(field.value, field.value_len);
+            if (seconds > age) age = seconds;
+        }
+    }
+    if (cc.no_store || cc.is_private) return -1;
+
+    time_t base = has_date ? date : now;
+    long long lifetime;
+    if (cc.s_maxage >= 0) {
+        lifetime = cc.s_maxage;
+    } else if (cc.max_age >= 0) {
+        lifetime = cc.max_age;
+    } else if (has_expires) {
+        lifetime = (long long)expires - base;
+    } else if (has_last_modified && last_modified < base) {
+        lifetime = ((long long)base - last_modified) / HEURISTIC_FRACTION;
+        if (lifetime > HEURISTIC_MAX_LIFETIME) lifetime = HEURISTIC_MAX_LIFETIME;
+    } else {
+        lifetime = 0;
+    }
+    if (cc.no_cache) lifetime = 0;
+
+    // The response may already have spent part of its lifetime elsewhere
+    long long apparent_age = has_date && now > date ? (long long)now - date : 0;
+    if (apparent_age > age) age = apparent_age;
+    long long remaining = lifetime - age;
+
+    // Without freshness or a validator a stored copy could never be used
+    if (remaining <= 0 && !has_etag && !has_last_modified) return -1;
+    *fresh_until = remaining > 0 ? now + (time_t)remaining : now;
+    return 0;
+}
+
+/**
+ * @brief Decides whether a response may be stored.
+ */
+int http_cache_storable(const HttpResponse *resp, time_t now, time_t *fresh_until) {
+    const char *head = http_response_head(resp);
+    if (!head || resp->state == RESPONSE_ERROR || !status_cacheable(resp->status_code)) return 0;
+    return http_cache_freshness(head, resp->head_len, now, fresh_until) == 0;
+}
+
+/**
+ * @brief Makes the request conditional on the stored response's validators.
+ */
+int http_cache_add_validators(struct ParsedRequest *req, const char *data, size_t len) {
+    char etag[MAX_VALIDATOR_LEN] = "";
+    char last_modified[MAX_VALIDATOR_LEN] = "";
+
+    const char *head_end = memmem(data, len, "\r\n\r\n", 4);
+    if (!head_end) return -1;
+    const char *cursor = first_field(data, head_end + 4 - data);
+    HeaderField field;
+    while (next_field(&cursor, head_end + 4, &field)) {
+        if (key_is(&field, "ETag")) copy_value(&field, etag, sizeof(etag));
+        else if (key_is(&field, "Last-Modified")) copy_value(&field, last_modified, sizeof(last_modified));
+    }
+    if (!etag[0] && !last_modified[0]) return -1;
+
+    // The client's own validators describe its copy, not ours
+    ParsedHeader_remove(req, "If-None-Match");
+    ParsedHeader_remove(req, "If-Modified-Since");
+    if (etag[0] && ParsedHeader_set(req, "If-None-Match", etag) < 0) return -1;
+    if (last_modified[0] && ParsedHeader_set(req, "If-Modified-Since", last_modified) < 0) return -1;
+    return 0;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file http_cache.h
+ * @author Shubham More
+ * @brief Interface for the HTTP caching rules applied by the proxy's cache.
+ *
+ * The cache is shared by every client, so it follows the rules HTTP sets
+ * for shared caches (RFC 9111): only GET responses with a cacheable status
+ * are stored, never ones marked no-store or private, ones that set cookies,
+ * or ones that vary by request headers other than Accept-Encoding, the only
+ * one the cache keys on (see http_compress.h). A stored response is served
+ * as-is only while fresh, as given by s-maxage, max-age or Expires (or,
+ * failing those, a tenth of its age since Last-Modified). Once stale, it
+ * is revalidated with a conditional request built from its ETag and
+ * Last-Modified, so an unchanged object costs the origin a 304 instead of
+ * the whole body.
+ */
+
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include "http_response.h"
+#include <stddef.h>
+#include <time.h>
+
+struct ParsedRequest;
+
+// How the cache may take part in answering a request
+typedef enum {
+    HTTP_CACHE_BYPASS,      // Neither served from nor stored in the cache
+    HTTP_CACHE_LOOKUP,      // A fresh stored response may be served
+    HTTP_CACHE_REVALIDATE   // A stored response must be confirmed by the origin first
+} http_cache_mode_t;
+
+/**
+ * @brief Decides how the cache may answer a request.
+ *
+ * Only GET requests without credentials or a body use the cache;
+ * Cache-Control: no-store bypasses it, and no-cache or max-age=0 (or
+ * Pragma: no-cache) forces revalidation of a stored response.
+ * @param req The parsed request.
+ * @return The mode.
+ */
+http_cache_mode_t http_cache_request_mode(struct ParsedRequest *req);
+
+/**
+ * @brief Whether a request may change the resource it names.
+ *
+ * Any method other than GET, HEAD, OPTIONS or TRACE makes a stored
+ * response for the same URL untrustworthy.
+ * @param req The parsed request.
+ * @return Non-zero if a stored response for the URL should be dropped.
+ */
+int http_cache_request_invalidates(struct ParsedRequest *req);
+
+/**
+ * @brief Computes how long a response stays fresh from its headers.
+ *
+ * Also used on a 304, whose headers update the stored response's freshness.
+ * @param head The response's status line and headers.
+ * @param head_len The number of bytes in head.
+ * @param now The current wall-clock time.
+ * @param fresh_until Set to the time from which the response is stale
+ * (possibly now, if it must be revalidated on every use).
+ * @return 0 if the headers allow the response to be stored, -1 if not.
+ */
+int http_cache_freshness(const char *head, size_t head_len, time_t now, time_t *fresh_until);
+
+/**
+ * @brief Decides whether a response to a cacheable request may be stored.
+ *
+ * Checks the status code as well as the headers (see http_cache_freshness()).
+ * @param resp A tracker whose head is complete.
+ * @param now The current wall-clock time.
+ * @param fresh_until Set to the time from which the response is stale.
+ * @return Non-zero if the response may be stored.
+ */
+int http_cache_storable(const HttpResponse *resp, time_t now, time_t *fresh_until);
+
+/**
+ * @brief Turns a request into a revalidation of a stored response.
+ *
+ * Replaces any conditional headers of the client's with If-None-Match and
+ * If-Modified-Since built from the stored response's ETag and
+ * Last-Modified, so that a 304 answer confirms the stored copy.
+ * @param req The request to rewrite.
+ * @param data The stored response.
+ * @param len The number of bytes in data.
+ * @return 0 if the request was made conditional, -1 if the stored response
+ * has no validator (the request is left untouched).
+ */
+int http_cache_add_validators(struct ParsedRequest *req, const char *data, size_t len);
+
+#endif
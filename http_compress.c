@@ -0,0 +1,809 @@
+/**
+ * @file http_compress.c
+ * @author Shubham More
+ * @brief Implementation of the compressed variants of cached responses.
+ *
+ * A variant is made from a complete stored response. Its head is checked
+ * first (status, Content-Type, Content-Encoding, no-transform), then the
+ * whole response is run through a response tracker whose payload sink
+ * feeds the compressor, which takes any chunked framing off on the way.
+ * The compressed body goes into a buffer the size of the body it replaces:
+ * a body that does not fit there does not shrink, and is not worth a
+ * variant. The head is rewritten around the new body (Content-Encoding,
+ * Content-Length, Vary, a weak ETag) and head and body go into a new entry
+ * of the exact size under the variant key.
+ *
+ * None of this runs on the request path. A request that stores a response,
+ * or is served a copy as sent that has no variant yet, queues a job for
+ * the compressor thread and goes on with the copy as sent, which answers
+ * every client until the variant is in. Each job is marked in a small
+ * table under its variant key and the copy's size and freshness, so a
+ * variant is made once however many requests ask for it meanwhile, and one
+ * that came out no smaller is not tried again for the same copy.
+ */
+
+#define _GNU_SOURCE
+#include "http_compress.h"
+#include "proxy_parse.h"
+#include "metrics.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef ENABLE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define DEFAULT_GZIP_LEVEL 6      // zlib's own default: most of the gain at a fraction of level 9's cost
+#define DEFAULT_BROTLI_QUALITY 5  // Smaller than gzip at 6, and about as fast
+#define MIN_COMPRESS_SIZE 256     // Smaller bodies gain less than their framing costs
+#define MAX_ADDED_HEAD 128        // Room for the fields a variant's head gains
+#define COMPRESS_QUEUE_SLOTS 256  // Variants waiting for the compressor thread; more are not asked for
+#define COMPRESS_MARK_SLOTS 4096  // Variants marked as queued or not worth making; a power of 2
+
+// A header field line of a stored response head
+typedef struct {
+    const char *line;       // Start of the line
+    const char *value;
+    size_t value_len;
+    size_t key_len;
+} HeadLine;
+
+// A compression of one response in progress
+typedef struct {
+    content_coding_t coding;
+    z_stream zlib;
+    #ifdef ENABLE_BROTLI
+    BrotliEncoderState *brotli;
+    #endif
+    char *out;              // Compressed body
+    size_t out_cap;
+    size_t out_len;
+    size_t in_len;          // Payload bytes taken
+    int failed;             // The output did not fit, or the compressor failed
+} Compressor;
+
+// A variant for the compressor thread to make
+typedef struct {
+    CacheEntry *source;     // The copy as sent, held
+    char *key;              // The variant key
+    content_coding_t coding;
+} CompressJob;
+
+// What is known of a variant that is not in the cache, by the copy it is made from
+typedef enum {
+    MARK_NONE,              // Nothing: the slot is free
+    MARK_QUEUED,            // A job is queued or running
+    MARK_FAILED             // It came out no smaller, or could not be made
+} mark_state_t;
+
+typedef struct {
+    uint64_t hash;          // Of the variant key
+    size_t size;            // Of the copy it is made from,
+    time_t fresh_until;     // and that copy's freshness
+    mark_state_t state;
+} VariantMark;
+
+// Names of the codings, in variant keys and Content-Encoding
+static const char *coding_names[CODING_COUNT] = {
+    [CODING_IDENTITY] = "identity",
+    [CODING_GZIP] = "gzip",
+    [CODING_BROTLI] = "br"
+};
+
+// --- Global Compression State ---
+static http_compress_config_t compress_config;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the queue, the marks and stopping
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;   // The compressor thread waits for jobs
+static pthread_t compressor;
+static int compressor_running = 0;
+static int stopping = 0;
+static CompressJob queue[COMPRESS_QUEUE_SLOTS];
+static size_t queue_head = 0, queue_count = 0;
+static VariantMark marks[COMPRESS_MARK_SLOTS];
+static const char *compressing_key; // Variant key of the job the compressor thread is running
+static int compressing_cancelled;   // Its URL was invalidated meanwhile
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Reads the header field line at *cursor and advances past it.
+ * @return 1 if a field was read, 0 at the blank line that ends the head.
+ */
+static int next_line(const char **cursor, const char *end, HeadLine *field) {
+    while (*cursor < end) {
+        const char *line = *cursor;
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) return 0;
+        *cursor = eol + 1;
+
+        size_t line_len = eol - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        if (line_len == 0) return 0;
+
+        const char *colon = memchr(line, ':', line_len);
+        if (!colon) continue;
+        field->line = line;
+        field->key_len = colon - line;
+        field->value = colon + 1;
+        field->value_len = line_len - field->key_len - 1;
+        while (field->value_len > 0 && (*field->value == ' ' || *field->value == '\t')) {
+            field->value++;
+            field->value_len--;
+        }
+        while (field->value_len > 0 && (field->value[field->value_len - 1] == ' ' ||
+                                        field->value[field->value_len - 1] == '\t')) {
+            field->value_len--;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Case-insensitively compares a field name.
+ */
+static int key_is(const HeadLine *field, const char *name) {
+    size_t name_len = strlen(name);
+    return field->key_len == name_len && strncasecmp(field->line, name, name_len) == 0;
+}
+
+/**
+ * @brief Whether a comma-separated value contains a token.
+ */
+static int has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && value[i] != ',' && value[i] != ';' && value[i] != '=') i++;
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) end--;
+        if (end - start == token_len && strncasecmp(value + start, token, token_len) == 0) return 1;
+        while (i < len && value[i] != ',') i++;
+    }
+    return 0;
+}
+
+/**
+ * @brief The coding a Content-Encoding value names.
+ * @return The coding, or CODING_COUNT for one the proxy does not know
+ * (or a stack of several).
+ */
+static content_coding_t coding_named(const char *value, size_t len) {
+    if (len == 0 || (len == 8 && strncasecmp(value, "identity", 8) == 0)) return CODING_IDENTITY;
+    if ((len == 4 && strncasecmp(value, "gzip", 4) == 0) ||
+        (len == 6 && strncasecmp(value, "x-gzip", 6) == 0)) return CODING_GZIP;
+    if (len == 2 && strncasecmp(value, "br", 2) == 0) return CODING_BROTLI;
+    return CODING_COUNT;
+}
+
+/**
+ * @brief Whether variants in a coding are made and looked up.
+ */
+static int coding_enabled(content_coding_t coding) {
+    switch (coding) {
+        case CODING_GZIP: return compress_config.gzip_level > 0;
+        case CODING_BROTLI: return compress_config.brotli_quality > 0;
+        default: return 0;
+    }
+}
+
+/**
+ * @brief Parses the quality value of one Accept-Encoding member, the part
+ * after its coding.
+ * @return The weight, 0 to 1000.
+ */
+static int parse_quality(const char *param, const char *end) {
+    const char *q = NULL;
+    for (const char *p = param; p + 1 < end; p++) {
+        if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+            q = p + 2;
+            break;
+        }
+    }
+    if (!q) return 1000;
+    if (q >= end || (*q != '0' && *q != '1')) return 0;
+    int weight = (*q++ - '0') * 1000;
+    if (q < end && *q == '.') {
+        q++;
+        for (int scale = 100; scale > 0 && q < end && *q >= '0' && *q <= '9'; scale /= 10) {
+            weight += (*q++ - '0') * scale;
+        }
+    }
+    return weight > 1000 ? 1000 : weight;
+}
+
+/**
+ * @brief Lists the enabled codings a request accepts, most preferred first.
+ * @return How many were written to order.
+ */
+static int accepted_codings(struct ParsedRequest *req, content_coding_t order[CODING_COUNT]) {
+    if (!coding_enabled(CODING_GZIP) && !coding_enabled(CODING_BROTLI)) return 0;
+    struct ParsedHeader *header = ParsedHeader_get(req, "Accept-Encoding");
+    if (!header) return 0;
+    // A client that asks for no transformation gets the response as sent
+    struct ParsedHeader *cc = ParsedHeader_get(req, "Cache-Control");
+    if (cc && has_token(cc->value, strlen(cc->value), "no-transform")) return 0;
+
+    int weight[CODING_COUNT] = { 0 };
+    int listed[CODING_COUNT] = { 0 };
+    int any = -1; // The weight of "*", if given
+    const char *p = header->value;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *start = p;
+        while (*p && *p != ',') p++;
+        const char *end = p;
+        const char *name_end = memchr(start, ';', end - start);
+        if (!name_end) name_end = end;
+        while (name_end > start && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+        if (name_end == start) continue;
+
+        int w = parse_quality(name_end, end);
+        if (name_end - start == 1 && *start == '*') {
+            any = w;
+            continue;
+        }
+        content_coding_t coding = coding_named(start, name_end - start);
+        if (coding != CODING_COUNT) {
+            weight[coding] = w;
+            listed[coding] = 1;
+        }
+    }
+
+    // Ties go to brotli, the smaller of the two
+    int count = 0;
+    content_coding_t preference[] = { CODING_BROTLI, CODING_GZIP };
+    for (int i = 0; i < 2; i++) {
+        content_coding_t coding = preference[i];
+        int w = listed[coding] ? weight[coding] : any > 0 ? any : 0;
+        if (!coding_enabled(coding) || w <= 0) continue;
+        weight[coding] = w;
+        int j = count++;
+        while (j > 0 && weight[order[j - 1]] < w) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = coding;
+    }
+    return count;
+}
+
+/**
+ * @brief Whether a Content-Type is worth compressing: text, JSON,
+ * JavaScript and XML, but not event streams, which never end.
+ */
+static int compressible_type(const char *value, size_t len) {
+    const char *semicolon = memchr(value, ';', len);
+    if (semicolon) len = semicolon - value;
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) len--;
+
+    static const char *types[] = {
+        "application/json", "application/javascript", "application/x-javascript",
+        "application/ecmascript", "application/xml"
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (len == strlen(types[i]) && strncasecmp(value, types[i], len) == 0) return 1;
+    }
+    if (len >= 5 && (strncasecmp(value + len - 5, "+json", 5) == 0)) return 1;
+    if (len >= 4 && (strncasecmp(value + len - 4, "+xml", 4) == 0)) return 1;
+    if (len == 17 && strncasecmp(value, "text/event-stream", 17) == 0) return 0;
+    return len > 5 && strncasecmp(value, "text/", 5) == 0;
+}
+
+/**
+ * @brief Whether a stored response may be compressed, from its head.
+ */
+static int compressible(const char *head, size_t head_len, size_t size) {
+    // 200 only: the other cacheable statuses are small, or describe the lack of a body
+    if (head_len < 12 || strncmp(head + 8, " 200", 4) != 0) return 0;
+    if (size - head_len < MIN_COMPRESS_SIZE) return 0;
+
+    int type_ok = 0;
+    const char *cursor = memchr(head, '\n', head_len);
+    if (!cursor) return 0;
+    cursor++;
+    HeadLine field;
+    while (next_line(&cursor, head + head_len, &field)) {
+        if (key_is(&field, "Content-Type")) {
+            type_ok = compressible_type(field.value, field.value_len);
+        } else if (key_is(&field, "Content-Encoding")) {
+            if (coding_named(field.value, field.value_len) != CODING_IDENTITY) return 0;
+        } else if (key_is(&field, "Content-Range")) {
+            return 0;
+        } else if (key_is(&field, "Cache-Control")) {
+            if (has_token(field.value, field.value_len, "no-transform")) return 0;
+        }
+    }
+    return type_ok;
+}
+
+/**
+ * @brief Sets up a compressor whose output may take up to out_cap bytes.
+ * @return 0 on success, -1 if no memory could be had.
+ */
+static int compressor_init(Compressor *c, content_coding_t coding, size_t out_cap, size_t size_hint) {
+    memset(c, 0, sizeof(*c));
+    c->coding = coding;
+    c->out = malloc(out_cap ? out_cap : 1);
+    if (!c->out) return -1;
+    c->out_cap = out_cap;
+
+    if (coding == CODING_GZIP) {
+        // 16 over the window bits asks zlib for the gzip wrapper
+        if (deflateInit2(&c->zlib, compress_config.gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+            return 0;
+        }
+    }
+    #ifdef ENABLE_BROTLI
+    if (coding == CODING_BROTLI) {
+        c->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+        if (c->brotli) {
+            BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_QUALITY, compress_config.brotli_quality);
+            BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+            if (size_hint <= (1u << 30)) BrotliEncoderSetParameter(c->brotli, BROTLI_PARAM_SIZE_HINT, size_hint);
+            return 0;
+        }
+    }
+    #else
+    (void)size_hint;
+    #endif
+    free(c->out);
+    return -1;
+}
+
+/**
+ * @brief Runs bytes through the compressor, finishing the stream if asked.
+ */
+static void compressor_run(Compressor *c, const char *data, size_t len, int finish) {
+    if (c->failed) return;
+    if (c->coding == CODING_GZIP) {
+        c->zlib.next_in = (Bytef *)data;
+        c->zlib.avail_in = len;
+        for (;;) {
+            c->zlib.next_out = (Bytef *)c->out + c->out_len;
+            c->zlib.avail_out = c->out_cap - c->out_len;
+            int rc = deflate(&c->zlib, finish ? Z_FINISH : Z_NO_FLUSH);
+            c->out_len = c->out_cap - c->zlib.avail_out;
+            if (rc == Z_STREAM_END || (!finish && c->zlib.avail_in == 0)) return;
+            if ((rc != Z_OK && rc != Z_BUF_ERROR) || c->zlib.avail_out == 0) break;
+        }
+    }
+    #ifdef ENABLE_BROTLI
+    if (c->coding == CODING_BROTLI) {
+        const uint8_t *next_in = (const uint8_t *)data;
+        size_t avail_in = len;
+        for (;;) {
+            uint8_t *next_out = (uint8_t *)c->out + c->out_len;
+            size_t avail_out = c->out_cap - c->out_len;
+            if (!BrotliEncoderCompressStream(c->brotli, finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                                             &avail_in, &next_in, &avail_out, &next_out, NULL)) break;
+            c->out_len = c->out_cap - avail_out;
+            if (finish ? BrotliEncoderIsFinished(c->brotli)
+                       : avail_in == 0 && !BrotliEncoderHasMoreOutput(c->brotli)) return;
+            if (avail_out == 0) break;
+        }
+    }
+    #endif
+    c->failed = 1;
+}
+
+/**
+ * @brief Takes a run of payload bytes (response tracker sink).
+ */
+static void compressor_take(void *arg, const char *data, size_t len) {
+    Compressor *c = (Compressor *)arg;
+    c->in_len += len;
+    compressor_run(c, data, len, 0);
+}
+
+/**
+ * @brief Frees a compressor's state and output.
+ */
+static void compressor_free(Compressor *c) {
+    if (c->coding == CODING_GZIP) deflateEnd(&c->zlib);
+    #ifdef ENABLE_BROTLI
+    if (c->brotli) BrotliEncoderDestroyInstance(c->brotli);
+    #endif
+    free(c->out);
+}
+
+/**
+ * @brief Writes the head of a variant: the stored head without the fields
+ * that described the body as sent, and with ones for the new body.
+ * @return The head's length.
+ */
+static size_t write_variant_head(char *out, const char *head, size_t head_len, content_coding_t coding,
+                                 size_t body_len) {
+    const char *status_end = memchr(head, '\n', head_len) + 1;
+    size_t len = status_end - head;
+    memcpy(out, head, len);
+
+    const char *etag = NULL;
+    size_t etag_len = 0;
+    const char *cursor = status_end;
+    HeadLine field;
+    while (next_line(&cursor, head + head_len, &field)) {
+        if (key_is(&field, "ETag")) {
+            etag = field.value;
+            etag_len = field.value_len;
+            continue;
+        }
+        if (key_is(&field, "Content-Length") || key_is(&field, "Transfer-Encoding") ||
+            key_is(&field, "Content-Encoding") || key_is(&field, "Vary") ||
+            key_is(&field, "Accept-Ranges") || key_is(&field, "Content-MD5")) continue;
+        // Copied with its own line ending, so the head cannot grow but by what is added
+        memcpy(out + len, field.line, cursor - field.line);
+        len += cursor - field.line;
+    }
+    if (etag) {
+        // The same resource in another coding: equivalent, not byte-identical
+        int weak = etag_len >= 2 && etag[0] == 'W' && etag[1] == '/';
+        len += sprintf(out + len, "ETag: %s%.*s\r\n", weak ? "" : "W/", (int)etag_len, etag);
+    }
+    len += sprintf(out + len, "Content-Encoding: %s\r\nContent-Length: %zu\r\nVary: Accept-Encoding\r\n\r\n",
+                   coding_names[coding], body_len);
+    return len;
+}
+
+/**
+ * @brief Finds the head of a complete stored response.
+ * @return 1 if it is there and the response may be compressed, 0 if not.
+ */
+static int compressible_entry(CacheEntry *entry, const char **head, size_t *head_len) {
+    size_t first = cache_entry_read(entry, 0, head); // The first piece holds the whole head
+    const char *head_end = first ? memmem(*head, first, "\r\n\r\n", 4) : NULL;
+    if (!head_end) return 0;
+    *head_len = head_end + 4 - *head;
+    return compressible(*head, *head_len, cache_entry_size(entry));
+}
+
+/**
+ * @brief Compresses a complete stored response and publishes the result
+ * under a variant key (compressor thread only).
+ * @return The variant, held, or NULL if the response is not compressible,
+ * does not shrink, or no memory could be had.
+ */
+static CacheEntry *make_variant(CacheEntry *entry, const char *key, content_coding_t coding,
+                                unsigned int fetch_ms, time_t fresh_until) {
+    const char *stored_head;
+    size_t head_len;
+    size_t size = cache_entry_size(entry);
+    if (!compressible_entry(entry, &stored_head, &head_len)) return NULL;
+
+    uint64_t started = metrics_now();
+    Compressor c;
+    if (compressor_init(&c, coding, size - head_len, size - head_len) != 0) return NULL;
+    HttpResponse resp;
+    http_response_init(&resp, 0);
+    http_response_set_sink(&resp, compressor_take, &c);
+    for (size_t offset = 0; offset < size && !c.failed; ) {
+        const char *data;
+        size_t len = cache_entry_read(entry, offset, &data);
+        if (http_response_feed(&resp, data, len) < 0) c.failed = 1;
+        offset += len;
+    }
+    if (resp.state == RESPONSE_BODY) http_response_eof(&resp);
+    if (resp.state != RESPONSE_DONE) c.failed = 1;
+    compressor_run(&c, NULL, 0, 1);
+
+    CacheEntry *variant = NULL;
+    char *head = NULL;
+    if (!c.failed && c.out_len < c.in_len && (head = malloc(head_len + MAX_ADDED_HEAD))) {
+        size_t len = write_variant_head(head, stored_head, head_len, coding, c.out_len);
+        variant = cache_fill_begin(key, len + c.out_len);
+        int filled = variant && cache_fill_append(variant, head, len) == 0 &&
+                     cache_fill_append(variant, c.out, c.out_len) == 0;
+        if (filled) {
+            // An invalidation either cancels the variant here or removes it once it is in
+            pthread_mutex_lock(&queue_lock);
+            filled = !compressing_cancelled;
+            if (filled) cache_fill_commit(variant, fetch_ms, fresh_until);
+            pthread_mutex_unlock(&queue_lock);
+        }
+        if (filled) {
+            metrics_add(METRIC_COMPRESS_IN, c.in_len);
+            metrics_add(METRIC_COMPRESS_OUT, c.out_len);
+            log_message(LOG_LEVEL_DEBUG, "Cache Compress: %s, %zu -> %zu bytes in %llu us", key, c.in_len,
+                        c.out_len, (unsigned long long)(metrics_now() - started));
+        } else if (variant) {
+            cache_fill_abort(variant);
+            cache_release(variant);
+            variant = NULL;
+        }
+    }
+    free(head);
+    http_response_free(&resp);
+    compressor_free(&c);
+    return variant;
+}
+
+/**
+ * @brief Hashes a variant key (FNV-1a).
+ */
+static uint64_t key_hash(const char *key) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *key; key++) h = (h ^ (unsigned char)*key) * 1099511628211ull;
+    return h;
+}
+
+/**
+ * @brief The mark of a variant made from a given copy, if there is one.
+ * Caller must hold the queue lock.
+ */
+static VariantMark *find_mark(uint64_t hash, size_t size, time_t fresh_until) {
+    VariantMark *mark = &marks[hash & (COMPRESS_MARK_SLOTS - 1)];
+    if (mark->state == MARK_NONE || mark->hash != hash || mark->size != size || mark->fresh_until != fresh_until) {
+        return NULL;
+    }
+    return mark;
+}
+
+/**
+ * @brief Asks the compressor thread for a variant of a copy as sent,
+ * unless it is already queued or known not to be worth making.
+ *
+ * Never waits: with the queue full nothing is asked for, and a later
+ * request for the object asks again.
+ */
+static void queue_variant(CacheEntry *source, const char *key, content_coding_t coding) {
+    const char *head;
+    size_t head_len;
+    if (!key || !compressible_entry(source, &head, &head_len)) return;
+    uint64_t hash = key_hash(key);
+    size_t size = cache_entry_size(source);
+    time_t fresh_until = cache_entry_fresh_until(source);
+
+    pthread_mutex_lock(&queue_lock);
+    if (!compressor_running || stopping || queue_count == COMPRESS_QUEUE_SLOTS ||
+        find_mark(hash, size, fresh_until)) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    char *copy = strdup(key);
+    if (copy) {
+        cache_retain(source);
+        queue[(queue_head + queue_count++) % COMPRESS_QUEUE_SLOTS] = (CompressJob){ source, copy, coding };
+        // Replaces whatever other variant had the slot: at worst that one is made twice
+        marks[hash & (COMPRESS_MARK_SLOTS - 1)] = (VariantMark){ hash, size, fresh_until, MARK_QUEUED };
+        pthread_cond_signal(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * @brief Forgets a variant whose URL was invalidated: drops its queued
+ * jobs, cancels the one being made and clears its mark, so the next copy
+ * stored is compressed afresh. Caller must hold the queue lock.
+ */
+static void cancel_variant(const char *key) {
+    size_t kept = 0;
+    for (size_t i = 0; i < queue_count; i++) {
+        CompressJob *job = &queue[(queue_head + i) % COMPRESS_QUEUE_SLOTS];
+        if (strcmp(job->key, key) == 0) {
+            cache_release(job->source);
+            free(job->key);
+        } else {
+            queue[(queue_head + kept++) % COMPRESS_QUEUE_SLOTS] = *job;
+        }
+    }
+    queue_count = kept;
+    if (compressing_key && strcmp(compressing_key, key) == 0) compressing_cancelled = 1;
+
+    uint64_t hash = key_hash(key);
+    VariantMark *mark = &marks[hash & (COMPRESS_MARK_SLOTS - 1)];
+    if (mark->hash == hash) mark->state = MARK_NONE;
+}
+
+/**
+ * @brief Makes queued variants until compression is shut down.
+ */
+static void *compressor_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_count && !stopping) pthread_cond_wait(&queue_cond, &queue_lock);
+        if (stopping) {
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        CompressJob job = queue[queue_head];
+        queue_head = (queue_head + 1) % COMPRESS_QUEUE_SLOTS;
+        queue_count--;
+        compressing_key = job.key;
+        compressing_cancelled = 0;
+        pthread_mutex_unlock(&queue_lock);
+
+        CacheEntry *variant = make_variant(job.source, job.key, job.coding, cache_entry_fetch_ms(job.source),
+                                           cache_entry_fresh_until(job.source));
+
+        // Lookups find a variant once it is in; a failed one is not tried again for this copy
+        pthread_mutex_lock(&queue_lock);
+        VariantMark *mark = compressing_cancelled ? NULL : find_mark(key_hash(job.key), cache_entry_size(job.source),
+                                                                     cache_entry_fresh_until(job.source));
+        if (mark) mark->state = variant ? MARK_NONE : MARK_FAILED;
+        compressing_key = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        cache_release(variant);
+        cache_release(job.source);
+        free(job.key);
+    }
+    return NULL;
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Parses the list of codings to offer.
+ */
+int http_compress_parse_codings(const char *list, http_compress_config_t *config) {
+    config->gzip_level = config->brotli_quality = 0;
+    if (strcmp(list, "off") == 0) return 0;
+
+    const char *p = list;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        if (len == 4 && strncmp(p, "gzip", 4) == 0) {
+            config->gzip_level = DEFAULT_GZIP_LEVEL;
+        } else if (len == 2 && strncmp(p, "br", 2) == 0) {
+            #ifdef ENABLE_BROTLI
+            config->brotli_quality = DEFAULT_BROTLI_QUALITY;
+            #else
+            return -1;
+            #endif
+        } else {
+            return -1;
+        }
+        p += len;
+        if (*p == ',') p++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets which variants are made and looked up.
+ */
+int http_compress_init(const http_compress_config_t *config) {
+    if (config->gzip_level < 0 || config->gzip_level > 9) return -1;
+    if (config->brotli_quality < 0 || config->brotli_quality > 11) return -1;
+    #ifndef ENABLE_BROTLI
+    if (config->brotli_quality) return -1;
+    #endif
+    compress_config = *config;
+    if (!config->gzip_level && !config->brotli_quality) return 0;
+
+    stopping = 0;
+    if (pthread_create(&compressor, NULL, compressor_main, NULL) != 0) {
+        perror("pthread_create for compressor thread");
+        return -1;
+    }
+    compressor_running = 1;
+    return 0;
+}
+
+/**
+ * @brief Stops the compressor thread and drops the variants still queued.
+ */
+void http_compress_destroy() {
+    if (!compressor_running) return;
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(compressor, NULL);
+    compressor_running = 0;
+
+    for (; queue_count > 0; queue_count--) {
+        cache_release(queue[queue_head].source);
+        free(queue[queue_head].key);
+        queue_head = (queue_head + 1) % COMPRESS_QUEUE_SLOTS;
+    }
+    memset(marks, 0, sizeof(marks));
+}
+
+/**
+ * @brief Looks up the stored response to answer a request with, variants first.
+ */
+CacheEntry *http_compress_lookup(struct ParsedRequest *req) {
+    content_coding_t order[CODING_COUNT];
+    int count = accepted_codings(req, order);
+    time_t now = time(NULL);
+
+    CacheEntry *stale = NULL;
+    for (int i = 0; i < count; i++) {
+        const char *key = ParsedRequest_variantUrl(req, coding_names[order[i]]);
+        CacheEntry *entry = key ? cache_acquire(key) : NULL;
+        if (!entry) continue;
+        if (now < cache_entry_fresh_until(entry)) {
+            cache_release(stale);
+            return entry;
+        }
+        if (stale) cache_release(entry);
+        else stale = entry;
+    }
+
+    CacheEntry *entry = cache_acquire(ParsedRequest_url(req));
+    if (!entry) return stale;
+    if (now >= cache_entry_fresh_until(entry)) {
+        // Both stale: revalidate what the client would rather have
+        if (!stale) return entry;
+        cache_release(entry);
+        return stale;
+    }
+    cache_release(stale);
+    // The copy as sent answers this request; the variant is made for later ones
+    if (count > 0) queue_variant(entry, ParsedRequest_variantUrl(req, coding_names[order[0]]), order[0]);
+    return entry;
+}
+
+/**
+ * @brief Looks up the disk tier, variants first.
+ */
+int http_compress_disk_lookup(struct ParsedRequest *req, time_t now, DiskHit *hit) {
+    content_coding_t order[CODING_COUNT];
+    int count = accepted_codings(req, order);
+    for (int i = 0; i < count; i++) {
+        const char *key = ParsedRequest_variantUrl(req, coding_names[order[i]]);
+        if (key && disk_cache_lookup(key, now, hit) == 0) return 0;
+    }
+    const char *url = ParsedRequest_url(req);
+    return url ? disk_cache_lookup(url, now, hit) : -1;
+}
+
+/**
+ * @brief The key a response to a request is stored under.
+ */
+const char *http_compress_fill_key(struct ParsedRequest *req, const HttpResponse *resp) {
+    const char *head = http_response_head(resp);
+    if (!head) return NULL;
+
+    content_coding_t coding = CODING_IDENTITY;
+    int varies = 0;
+    const char *status_end = memchr(head, '\n', resp->head_len);
+    const char *cursor = status_end ? status_end + 1 : head + resp->head_len;
+    HeadLine field;
+    while (next_line(&cursor, head + resp->head_len, &field)) {
+        if (key_is(&field, "Content-Encoding")) coding = coding_named(field.value, field.value_len);
+        else if (key_is(&field, "Vary")) varies = has_token(field.value, field.value_len, "Accept-Encoding");
+    }
+
+    // An encoding the origin chose regardless of the request suits every client, as it always did
+    if (coding == CODING_IDENTITY || !varies) return ParsedRequest_url(req);
+    return coding != CODING_COUNT && coding_enabled(coding) ? ParsedRequest_variantUrl(req, coding_names[coding])
+                                                            : NULL;
+}
+
+/**
+ * @brief Completes a fill, and asks for its variant if the client takes a coding.
+ */
+void http_compress_commit(CacheEntry *fill, struct ParsedRequest *req, unsigned int fetch_ms, time_t fresh_until) {
+    content_coding_t order[CODING_COUNT];
+    int count = accepted_codings(req, order);
+    cache_fill_commit(fill, fetch_ms, fresh_until);
+    if (count > 0) queue_variant(fill, ParsedRequest_variantUrl(req, coding_names[order[0]]), order[0]);
+}
+
+/**
+ * @brief Drops the URL's stored response and its variants.
+ */
+void http_compress_invalidate(struct ParsedRequest *req) {
+    const char *url = ParsedRequest_url(req);
+    if (url) cache_remove(url);
+    for (int coding = CODING_GZIP; coding < CODING_COUNT; coding++) {
+        const char *key = ParsedRequest_variantUrl(req, coding_names[coding]);
+        if (!key) continue;
+        // Cancelled first, so a variant of the removed copy cannot be committed after the removal
+        pthread_mutex_lock(&queue_lock);
+        cancel_variant(key);
+        pthread_mutex_unlock(&queue_lock);
+        cache_remove(key);
+    }
+}
@@ -0,0 +1,127 @@
+/**
+ * @file http_compress.h
+ * @author Shubham More
+ * @brief Interface for the compressed variants of cached responses.
+ *
+ * Many origins send text and JSON uncompressed. For a client that accepts
+ * a content coding the proxy offers (gzip, and brotli where it was built
+ * in), a cacheable response of a compressible type is compressed once, by
+ * a background thread, and the compressed copy is kept under a variant key:
+ * the URL extended with the coding's name ("http://host:80/path gzip").
+ * Nothing is compressed on the request path: until the variant exists,
+ * requests are answered with the response as sent. Later requests that
+ * accept the coding are answered from the variant without compressing
+ * anything, and clients that take no coding from the copy as sent.
+ *
+ * The cache key is thereby Vary-aware for Accept-Encoding, so responses
+ * that vary by it are cacheable (see http_cache.h): one the origin already
+ * encoded is stored under the variant key of its coding, one it did not
+ * under the URL. A compressed variant says Vary: Accept-Encoding and has a
+ * weak ETag, which the origin still matches when the variant is
+ * revalidated. Responses marked no-transform are left alone.
+ */
+
+#ifndef HTTP_COMPRESS_H
+#define HTTP_COMPRESS_H
+
+#include "cache.h"
+#include "disk_cache.h"
+#include "http_response.h"
+#include <time.h>
+
+struct ParsedRequest;
+
+// The content codings responses are stored in
+typedef enum {
+    CODING_IDENTITY,    // As the origin sent it
+    CODING_GZIP,
+    CODING_BROTLI,
+    CODING_COUNT
+} content_coding_t;
+
+/**
+ * @struct http_compress_config_t
+ * @brief Startup options for compression.
+ */
+typedef struct {
+    int gzip_level;     // zlib level (1-9) of gzip variants; 0 makes none
+    int brotli_quality; // Brotli quality (1-11) of br variants; 0 makes none
+} http_compress_config_t;
+
+/**
+ * @brief Parses a comma-separated list of codings to offer ("gzip", "br",
+ * or "off" for none), with their default levels.
+ * @param list The list.
+ * @param config Set to the options.
+ * @return 0 on success, -1 if a coding is unknown or was not built in.
+ */
+int http_compress_parse_codings(const char *list, http_compress_config_t *config);
+
+/**
+ * @brief Sets which variants are made and looked up, and starts the
+ * compressor thread if any are.
+ * @param config The options.
+ * @return 0 on success, -1 on invalid options or if the thread could not
+ * be started.
+ */
+int http_compress_init(const http_compress_config_t *config);
+
+/**
+ * @brief Stops the compressor thread. Variants still queued are not made.
+ * Call before the cache is destroyed.
+ */
+void http_compress_destroy();
+
+/**
+ * @brief Looks up the stored response to answer a request with.
+ *
+ * A fresh variant in a coding the client accepts comes first, then the
+ * response as sent. A fresh copy as sent that has no such variant yet is
+ * returned as it is, and the variant queued for the compressor thread,
+ * unless it already is or was found not to shrink. Failing a
+ * fresh copy, a stale one is returned for revalidation, a variant before
+ * the copy as sent.
+ * @param req The parsed request.
+ * @return The entry, held (release with cache_release()), or NULL on a miss.
+ */
+CacheEntry *http_compress_lookup(struct ParsedRequest *req);
+
+/**
+ * @brief Looks up the disk tier the same way, variants first.
+ * @param req The parsed request.
+ * @param now The current wall-clock time.
+ * @param hit Set to the stored response on success.
+ * @return 0 if a fresh response was found, -1 otherwise.
+ */
+int http_compress_disk_lookup(struct ParsedRequest *req, time_t now, DiskHit *hit);
+
+/**
+ * @brief The key a response to a request is stored under.
+ * @param req The parsed request.
+ * @param resp A tracker whose head is complete.
+ * @return The URL for a response as sent (or one whose coding does not
+ * depend on the request), the variant key for one the origin encoded by
+ * Accept-Encoding, or NULL if it is in a coding that is not looked up.
+ */
+const char *http_compress_fill_key(struct ParsedRequest *req, const HttpResponse *resp);
+
+/**
+ * @brief Completes a fill, and queues its compressed variant for the
+ * compressor thread if the client accepts a coding the response can be
+ * compressed with.
+ * @param fill An entry from cache_fill_begin() holding the complete response.
+ * @param req The request it answers.
+ * @param fetch_ms How long the origin took to deliver it, in milliseconds.
+ * @param fresh_until The wall-clock time from which it must be revalidated.
+ */
+void http_compress_commit(CacheEntry *fill, struct ParsedRequest *req, unsigned int fetch_ms, time_t fresh_until);
+
+/**
+ * @brief Drops the response stored for a request's URL and every variant
+ * of it, here and in the lower tier. Variants still queued or being made
+ * from the removed copy are cancelled.
+ * @param req The parsed request.
+ */
+void http_compress_invalidate(struct ParsedRequest *req);
+
+#endif
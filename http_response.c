@@ -0,0 +1,387 @@
+/**
+ * @file http_response.c
+ * @author Shubham More
+ * @brief Implementation of incremental HTTP response framing.
+ *
+ * The head is collected into a small private buffer until the blank line
+ * that ends it has arrived, then parsed for the status code, HTTP version,
+ * Content-Length, Transfer-Encoding and Connection. The body is tracked
+ * without copying: a byte counter for Content-Length bodies and a small
+ * state machine for the chunked transfer coding. A tracker given a sink
+ * also hands it the payload as it goes past, which is how a stored
+ * response is taken apart for compression.
+ */
+
+#define _GNU_SOURCE
+#include "http_response.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+// States of the chunked transfer-coding decoder
+enum {
+    CHUNK_SIZE,         // Reading the hex chunk size
+    CHUNK_EXT,          // Skipping a chunk extension up to LF
+    CHUNK_SIZE_LF,      // Expecting LF after the size line's CR
+    CHUNK_DATA,         // Inside chunk data
+    CHUNK_DATA_CR,      // Expecting CR after chunk data
+    CHUNK_DATA_LF,      // Expecting LF after chunk data
+    CHUNK_TRAILER,      // At the start of a trailer line (or the final CRLF)
+    CHUNK_TRAILER_LINE, // Inside a trailer field line
+    CHUNK_TRAILER_LF    // Expecting LF of the final CRLF
+};
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Checks whether a comma-separated header value contains a token.
+ */
+static int header_has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && value[i] != ',') i++;
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) end--;
+        if (end - start == token_len && strncasecmp(value + start, token, token_len) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a complete response head and decides the body framing.
+ * @return 0 on success, -1 if the head is malformed.
+ */
+static int parse_head(HttpResponse *resp, const char *head, size_t len) {
+    // Status line: HTTP/1.x SSS Reason
+    if (len < 12 || strncmp(head, "HTTP/1.", 7) != 0) return -1;
+    if (head[7] != '0' && head[7] != '1') return -1;
+    resp->http_minor = head[7] - '0';
+    if (head[8] != ' ') return -1;
+    int status = 0;
+    for (int i = 9; i < 12; i++) {
+        if (head[i] < '0' || head[i] > '9') return -1;
+        status = status * 10 + (head[i] - '0');
+    }
+    resp->status_code = status;
+
+    int has_length = 0, chunked = 0, conn_close = 0, conn_keep_alive = 0;
+    size_t content_length = 0;
+
+    const char *line = memchr(head, '\n', len);
+    const char *end = head + len;
+    while (line && ++line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) break;
+        size_t line_len = eol - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        if (line_len == 0) break; // Blank line: end of headers
+
+        const char *colon = memchr(line, ':', line_len);
+        if (colon) {
+            size_t key_len = colon - line;
+            const char *value = colon + 1;
+            size_t value_len = line_len - key_len - 1;
+            while (value_len > 0 && (*value == ' ' || *value == '\t')) { value++; value_len--; }
+
+            if (key_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+                size_t n = 0;
+                size_t i = 0;
+                for (; i < value_len && value[i] >= '0' && value[i] <= '9'; i++) {
+                    if (n > (SIZE_MAX - 9) / 10) return -1;
+                    n = n * 10 + (value[i] - '0');
+                }
+                if (i == 0) return -1;
+                if (has_length && n != content_length) return -1; // Conflicting lengths
+                content_length = n;
+                has_length = 1;
+            } else if (key_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+                chunked = header_has_token(value, value_len, "chunked");
+            } else if (key_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+                if (header_has_token(value, value_len, "close")) conn_close = 1;
+                if (header_has_token(value, value_len, "keep-alive")) conn_keep_alive = 1;
+            }
+        }
+        line = eol;
+    }
+
+    resp->head_len = len;
+    resp->keep_alive = resp->http_minor >= 1 ? !conn_close : (conn_keep_alive && !conn_close);
+
+    if (resp->is_head_request || (status >= 100 && status < 200) || status == 204 || status == 304) {
+        resp->framing = BODY_NONE;
+    } else if (chunked) {
+        resp->framing = BODY_CHUNKED;
+        resp->chunk_state = CHUNK_SIZE;
+        resp->body_remaining = 0;
+    } else if (has_length) {
+        resp->framing = BODY_LENGTH;
+        resp->content_length = content_length;
+        resp->body_remaining = content_length;
+    } else {
+        resp->framing = BODY_UNTIL_CLOSE;
+        resp->keep_alive = 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Collects head bytes; parses the head once the blank line arrives.
+ * @return Bytes consumed, or -1 on error.
+ */
+static ssize_t feed_head(HttpResponse *resp, const char *data, size_t len) {
+    if (!resp->head_buf) {
+        resp->head_buf = malloc(MAX_RESPONSE_HEAD_SIZE);
+        if (!resp->head_buf) return -1;
+    }
+
+    size_t old_len = resp->head_buf_len;
+    size_t take = len;
+    if (take > MAX_RESPONSE_HEAD_SIZE - old_len) take = MAX_RESPONSE_HEAD_SIZE - old_len;
+    memcpy(resp->head_buf + old_len, data, take);
+
+    // The terminator may straddle the previous feed
+    size_t search_from = old_len >= 3 ? old_len - 3 : 0;
+    char *terminator = memmem(resp->head_buf + search_from, old_len + take - search_from, "\r\n\r\n", 4);
+    if (!terminator) {
+        resp->head_buf_len += take;
+        if (resp->head_buf_len == MAX_RESPONSE_HEAD_SIZE) return -1; // Head too large
+        return take;
+    }
+
+    size_t head_len = (terminator + 4) - resp->head_buf;
+    if (parse_head(resp, resp->head_buf, head_len) < 0) return -1;
+    resp->head_buf_len = 0;
+
+    if (resp->status_code >= 100 && resp->status_code < 200 && resp->status_code != 101) {
+        // Interim response (e.g. 100 Continue); the final response follows
+        resp->state = RESPONSE_HEAD;
+    } else if (resp->framing == BODY_NONE ||
+               (resp->framing == BODY_LENGTH && resp->body_remaining == 0)) {
+        resp->state = RESPONSE_DONE;
+    } else {
+        resp->state = RESPONSE_BODY;
+    }
+    return head_len - old_len;
+}
+
+/**
+ * @brief Follows a chunked body.
+ * @return Bytes consumed, or -1 on error.
+ */
+static ssize_t feed_chunked(HttpResponse *resp, const char *data, size_t len) {
+    size_t i = 0;
+    while (i < len && resp->state == RESPONSE_BODY) {
+        char c = data[i];
+        switch (resp->chunk_state) {
+            case CHUNK_SIZE: {
+                int digit;
+                if (c >= '0' && c <= '9') digit = c - '0';
+                else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+                else digit = -1;
+
+                if (digit >= 0) {
+                    if (resp->body_remaining > (SIZE_MAX >> 4)) return -1;
+                    resp->body_remaining = (resp->body_remaining << 4) | digit;
+                } else if (c == '\r') {
+                    resp->chunk_state = CHUNK_SIZE_LF;
+                } else if (c == '\n') {
+                    resp->chunk_state = resp->body_remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                } else {
+                    resp->chunk_state = CHUNK_EXT;
+                }
+                i++;
+                break;
+            }
+            case CHUNK_EXT:
+                if (c == '\n') resp->chunk_state = resp->body_remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                i++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') return -1;
+                resp->chunk_state = resp->body_remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                i++;
+                break;
+            case CHUNK_DATA: {
+                size_t n = len - i;
+                if (n > resp->body_remaining) n = resp->body_remaining;
+                if (resp->sink && n > 0) resp->sink(resp->sink_arg, data + i, n);
+                resp->body_remaining -= n;
+                i += n;
+                if (resp->body_remaining == 0) resp->chunk_state = CHUNK_DATA_CR;
+                break;
+            }
+            case CHUNK_DATA_CR:
+                if (c == '\r') resp->chunk_state = CHUNK_DATA_LF;
+                else if (c == '\n') resp->chunk_state = CHUNK_SIZE;
+                else return -1;
+                i++;
+                break;
+            case CHUNK_DATA_LF:
+                if (c != '\n') return -1;
+                resp->chunk_state = CHUNK_SIZE;
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\r') resp->chunk_state = CHUNK_TRAILER_LF;
+                else if (c == '\n') resp->state = RESPONSE_DONE;
+                else resp->chunk_state = CHUNK_TRAILER_LINE;
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') resp->chunk_state = CHUNK_TRAILER;
+                i++;
+                break;
+            case CHUNK_TRAILER_LF:
+                if (c != '\n') return -1;
+                resp->state = RESPONSE_DONE;
+                i++;
+                break;
+        }
+    }
+    return i;
+}
+
+/**
+ * @brief Follows the body according to its framing.
+ * @return Bytes consumed, or -1 on error.
+ */
+static ssize_t feed_body(HttpResponse *resp, const char *data, size_t len) {
+    switch (resp->framing) {
+        case BODY_LENGTH: {
+            size_t n = len < resp->body_remaining ? len : resp->body_remaining;
+            if (resp->sink && n > 0) resp->sink(resp->sink_arg, data, n);
+            resp->body_remaining -= n;
+            if (resp->body_remaining == 0) resp->state = RESPONSE_DONE;
+            return n;
+        }
+        case BODY_CHUNKED:
+            return feed_chunked(resp, data, len);
+        case BODY_UNTIL_CLOSE:
+            if (resp->sink) resp->sink(resp->sink_arg, data, len);
+            return len;
+        case BODY_NONE:
+            resp->state = RESPONSE_DONE;
+            return 0;
+    }
+    return -1;
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Prepares a tracker for a new response.
+ */
+void http_response_init(HttpResponse *resp, int is_head_request) {
+    memset(resp, 0, sizeof(*resp));
+    resp->state = RESPONSE_HEAD;
+    resp->is_head_request = is_head_request;
+}
+
+/**
+ * @brief Prepares a tracker that starts in the body.
+ */
+void http_body_init(HttpResponse *resp, body_framing_t framing, size_t content_length) {
+    memset(resp, 0, sizeof(*resp));
+    resp->keep_alive = 1;
+    resp->framing = framing;
+    resp->chunk_state = CHUNK_SIZE;
+    if (framing == BODY_LENGTH) {
+        resp->content_length = content_length;
+        resp->body_remaining = content_length;
+    }
+    resp->state = framing == BODY_NONE || (framing == BODY_LENGTH && content_length == 0)
+                  ? RESPONSE_DONE : RESPONSE_BODY;
+}
+
+/**
+ * @brief Sets where the body's payload goes.
+ */
+void http_response_set_sink(HttpResponse *resp, http_payload_sink_t sink, void *arg) {
+    resp->sink = sink;
+    resp->sink_arg = arg;
+}
+
+/**
+ * @brief Frees the tracker's head buffer.
+ */
+void http_response_free(HttpResponse *resp) {
+    free(resp->head_buf);
+    resp->head_buf = NULL;
+}
+
+/**
+ * @brief Feeds origin bytes into the tracker.
+ */
+ssize_t http_response_feed(HttpResponse *resp, const char *data, size_t len) {
+    size_t used = 0;
+    while (used < len) {
+        ssize_t n;
+        if (resp->state == RESPONSE_HEAD) n = feed_head(resp, data + used, len - used);
+        else if (resp->state == RESPONSE_BODY) n = feed_body(resp, data + used, len - used);
+        else break;
+
+        if (n < 0) {
+            resp->state = RESPONSE_ERROR;
+            return -1;
+        }
+        used += n;
+    }
+    return used;
+}
+
+/**
+ * @brief The parsed head, still held in the head buffer.
+ */
+const char *http_response_head(const HttpResponse *resp) {
+    if (resp->state == RESPONSE_HEAD || !resp->head_buf || resp->head_len == 0) return NULL;
+    return resp->head_buf;
+}
+
+/**
+ * @brief Whether the remaining body is delimited by a byte count only.
+ */
+int http_response_spliceable(const HttpResponse *resp) {
+    return resp->state == RESPONSE_BODY &&
+           (resp->framing == BODY_LENGTH || resp->framing == BODY_UNTIL_CLOSE);
+}
+
+/**
+ * @brief Counts body bytes moved past the tracker.
+ */
+void http_response_skip(HttpResponse *resp, size_t len) {
+    if (resp->framing != BODY_LENGTH) return;
+    resp->body_remaining -= len < resp->body_remaining ? len : resp->body_remaining;
+    if (resp->body_remaining == 0) resp->state = RESPONSE_DONE;
+}
+
+/**
+ * @brief Handles the origin closing the connection.
+ */
+int http_response_eof(HttpResponse *resp) {
+    if (resp->state == RESPONSE_BODY && resp->framing == BODY_UNTIL_CLOSE) {
+        resp->state = RESPONSE_DONE;
+    }
+    return resp->state == RESPONSE_DONE ? 0 : -1;
+}
+
+/**
+ * @brief Whether the origin connection can be reused after this response.
+ */
+int http_response_reusable(const HttpResponse *resp) {
+    return resp->state == RESPONSE_DONE && resp->keep_alive && resp->framing != BODY_UNTIL_CLOSE;
+}
+
+/**
+ * @brief The full size of a response whose framing gives it in advance.
+ */
+size_t http_response_expected_size(const HttpResponse *resp, size_t seen) {
+    if (resp->state == RESPONSE_DONE) return seen;
+    if (resp->state == RESPONSE_BODY && resp->framing == BODY_LENGTH) return seen + resp->body_remaining;
+    return 0;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file http_response.h
+ * @author Shubham More
+ * @brief Interface for incremental HTTP response framing.
+ *
+ * To reuse an origin connection the proxy has to know exactly where each
+ * response ends instead of waiting for the origin to close. An HttpResponse
+ * tracker is fed the bytes read from the origin as they arrive; it parses
+ * the status line and headers, then follows the body according to its
+ * framing (Content-Length, chunked transfer coding, or read-until-close)
+ * and reports how many of the fed bytes belong to the response.
+ *
+ * The same tracker follows a request body on its way to the origin: set
+ * up with http_body_init() from the framing the request head announced, it
+ * starts in the body and finds where the body ends in what the client
+ * sends.
+ */
+
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define MAX_RESPONSE_HEAD_SIZE 16384 // Max size of a response status line + headers
+#define RESPONSE_HOLD_READ_SIZE 16384 // Max bytes read at once while a head is held back,
+                                      // so MAX_RESPONSE_HEAD_SIZE plus this always holds it
+
+// How the end of a response body is determined
+typedef enum {
+    BODY_NONE,          // No body (HEAD request, 1xx, 204, 304)
+    BODY_LENGTH,        // Content-Length bytes
+    BODY_CHUNKED,       // Transfer-Encoding: chunked
+    BODY_UNTIL_CLOSE    // Body ends when the origin closes the connection
+} body_framing_t;
+
+// Parsing progress of a response
+typedef enum {
+    RESPONSE_HEAD,      // Still reading the status line and headers
+    RESPONSE_BODY,      // Reading the body
+    RESPONSE_DONE,      // The complete response has been seen
+    RESPONSE_ERROR      // The response is malformed
+} response_state_t;
+
+/**
+ * @brief Receives the payload of a tracked body: its bytes with any chunked
+ * framing taken off.
+ */
+typedef void (*http_payload_sink_t)(void *arg, const char *data, size_t len);
+
+/**
+ * @struct HttpResponse
+ * @brief Tracks one response as it streams in from the origin.
+ */
+typedef struct {
+    response_state_t state;
+    int is_head_request;      // Response to HEAD never has a body
+
+    // Filled in once the head is complete
+    int status_code;
+    int http_minor;           // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int keep_alive;           // Origin allows the connection to be reused
+    body_framing_t framing;
+    size_t content_length;
+    size_t head_len;          // Bytes in the status line and headers
+
+    // Internal parsing state
+    char *head_buf;
+    size_t head_buf_len;
+    size_t body_remaining;    // Bytes left in the body or current chunk
+    int chunk_state;
+    http_payload_sink_t sink; // Set with http_response_set_sink()
+    void *sink_arg;
+} HttpResponse;
+
+/**
+ * @brief Prepares a tracker for a new response.
+ * @param resp The tracker to initialize.
+ * @param is_head_request Non-zero if the request method was HEAD.
+ */
+void http_response_init(HttpResponse *resp, int is_head_request);
+
+/**
+ * @brief Prepares a tracker for a body with no head in front of it, such
+ * as a request body.
+ * @param resp The tracker to initialize; feed it the body bytes.
+ * @param framing BODY_LENGTH or BODY_CHUNKED.
+ * @param content_length The body length for BODY_LENGTH.
+ */
+void http_body_init(HttpResponse *resp, body_framing_t framing, size_t content_length);
+
+/**
+ * @brief Has the tracker pass on the payload of the body it follows.
+ * @param resp A tracker that has not been fed yet.
+ * @param sink Called with each run of payload bytes, in order.
+ * @param arg Passed to sink.
+ */
+void http_response_set_sink(HttpResponse *resp, http_payload_sink_t sink, void *arg);
+
+/**
+ * @brief Frees memory held by a tracker.
+ * @param resp The tracker to clean up.
+ */
+void http_response_free(HttpResponse *resp);
+
+/**
+ * @brief Feeds bytes read from the origin into the tracker.
+ * @param resp The tracker.
+ * @param data The bytes received.
+ * @param len The number of bytes received.
+ * @return The number of leading bytes that belong to this response (less
+ * than len only once it is complete), or -1 if the response is malformed.
+ */
+ssize_t http_response_feed(HttpResponse *resp, const char *data, size_t len);
+
+/**
+ * @brief The final response head, once it has been parsed.
+ * @param resp The tracker.
+ * @return The status line and headers (resp->head_len bytes, not
+ * NUL-terminated), valid until the tracker is freed; NULL while the head is
+ * still being read.
+ */
+const char *http_response_head(const HttpResponse *resp);
+
+/**
+ * @brief Whether the rest of the body can be relayed without being parsed.
+ *
+ * True for Content-Length and read-until-close bodies once the head is
+ * complete: their end is found by counting bytes, so they can be moved
+ * kernel-side (e.g. with splice) and reported with http_response_skip().
+ * @param resp The tracker.
+ * @return Non-zero if the body may be relayed blind.
+ */
+int http_response_spliceable(const HttpResponse *resp);
+
+/**
+ * @brief Accounts for body bytes that were relayed without being fed.
+ * @param resp A tracker for which http_response_spliceable() holds.
+ * @param len The number of body bytes relayed (at most body_remaining for
+ * a Content-Length body).
+ */
+void http_response_skip(HttpResponse *resp, size_t len);
+
+/**
+ * @brief Tells the tracker that the origin closed the connection.
+ * @param resp The tracker.
+ * @return 0 if the response is complete, -1 if it was cut short.
+ */
+int http_response_eof(HttpResponse *resp);
+
+/**
+ * @brief Whether the origin connection can carry another request.
+ * @param resp A tracker whose response is complete.
+ * @return Non-zero if the connection may be returned to the pool.
+ */
+int http_response_reusable(const HttpResponse *resp);
+
+/**
+ * @brief The full size of a response whose framing gives it in advance.
+ * @param resp A tracker whose head is complete.
+ * @param seen The number of response bytes fed to it so far.
+ * @return The size the response will have once complete, or 0 if it is only
+ * known at the end (chunked or read-until-close bodies).
+ */
+size_t http_response_expected_size(const HttpResponse *resp, size_t seen);
+
+#endif
@@ -0,0 +1,582 @@
+/**
+ * @file logger.c
+ * @author Shubham More
+ * @brief Implementation of the asynchronous access and diagnostic log.
+ *
+ * Each logging thread owns a ring of records, registered on first use and
+ * recycled when the thread exits, the way metrics shards are. The owning
+ * thread is the ring's only producer and the writer thread its only
+ * consumer, so a record is published with a release store of the tail and
+ * consumed with a release store of the head; neither side ever waits for
+ * the other. Formatting is left to the writer: the request path only
+ * copies the record's fields and, for messages, runs vsnprintf.
+ *
+ * The writer wakes every few milliseconds, or as soon as a ring is half
+ * full, drains every ring into one output buffer per destination, and
+ * writes each buffer out with as few write() calls as it takes.
+ */
+
+#define _GNU_SOURCE
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+#define RING_SLOTS 128              // Records a thread may have queued; a power of 2
+#define TEXT_SIZE 400               // Message, or URL, bytes kept per record
+#define METHOD_SIZE 16              // Request method bytes kept per record
+#define OUTPUT_SIZE 65536           // Writer's output buffer per destination
+#define RECORD_MAX_OUTPUT 4096      // Most a single formatted record can take
+#define WRITER_INTERVAL_MS 20       // Longest a record waits before being written
+#define DROP_REPORT_INTERVAL 1      // Seconds between reports of dropped records
+
+// Kinds of records
+typedef enum {
+    RECORD_MESSAGE,
+    RECORD_ACCESS
+} record_kind_t;
+
+// --- Structs ---
+
+// One queued log record; the request path only copies fields into it
+typedef struct {
+    int64_t when_us;            // Wall-clock time it was logged
+    uint8_t kind;               // record_kind_t
+    uint8_t level;              // log_level_t, for messages
+    uint16_t text_len;
+    char method[METHOD_SIZE];   // For access records
+    AccessInfo access;          // For access records
+    char text[TEXT_SIZE];       // The message, or the URL; not terminated
+} LogRecord;
+
+// A thread's records on their way to the writer
+typedef struct LogRing {
+    unsigned head __attribute__((aligned(64))); // Advanced by the writer
+    unsigned tail __attribute__((aligned(64))); // Advanced by the owning thread
+    uint64_t dropped;           // Records the owning thread could not queue
+    unsigned sample_seq;        // Access records seen, for sampling
+    time_t rate_second;         // Second the rate limit is counting
+    int rate_count;             // Records logged in it
+    int in_use;                 // Owned by a live thread
+    struct LogRing *next;       // Link in the append-only registry
+    LogRecord records[RING_SLOTS];
+} LogRing;
+
+// Formatted output waiting to be written to one destination
+typedef struct {
+    int fd;
+    size_t len;
+    char data[OUTPUT_SIZE];
+} LogOutput;
+
+static const char *const level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+static const char *const cache_names[] = { NULL, "BYPASS", "HIT", "DISK_HIT", "STREAM", "MISS", "STALE",
+                                           "REVALIDATED" };
+
+// --- Global Logging State ---
+static int current_level = LOG_LEVEL_INFO;
+static int configured_level = LOG_LEVEL_INFO;
+static int running = 0;             // The writer thread is draining the rings
+static int stopping = 0;            // The writer thread should drain once more and exit
+static int access_fd = -1;          // Destination of access records, or -1 for none
+static int sample_every = 1;
+static int rate_limit = 0;
+static LogRing *registry = NULL;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread LogRing *self = NULL;
+static pthread_t writer;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake;
+static LogOutput *access_out;
+static LogOutput *message_out;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Thread-exit destructor: hands the thread's ring back for reuse.
+ * Records still in it are written out as usual.
+ */
+static void release_ring(void *arg) {
+    LogRing *ring = (LogRing *)arg;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Creates the key whose destructor recycles rings.
+ */
+static void make_key() {
+    pthread_key_create(&thread_key, release_ring);
+}
+
+/**
+ * @brief Returns the calling thread's ring, registering one if needed.
+ * @return The ring, or NULL if none could be allocated (nothing is logged then).
+ */
+static LogRing *get_self() {
+    if (self) return self;
+    pthread_once(&key_once, make_key);
+
+    // Recycle the ring of a thread that has exited
+    LogRing *ring;
+    for (ring = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+    }
+
+    if (!ring) {
+        void *mem;
+        if (posix_memalign(&mem, 64, sizeof(LogRing)) != 0) return NULL;
+        ring = mem;
+        memset(ring, 0, sizeof(*ring));
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&registry, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&registry, &ring->next, ring, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(thread_key, ring);
+    self = ring;
+    return ring;
+}
+
+/**
+ * @brief Counts a record the calling thread could not queue.
+ */
+static void count_drop(LogRing *ring) {
+    __atomic_store_n(&ring->dropped, __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Takes the next free record of the calling thread's ring.
+ * @param limited Whether the record counts against the rate limit, as
+ * access records do; messages are only ever dropped for want of room.
+ * @return The record, to be filled in and published with ring_publish(),
+ * or NULL if the record is dropped.
+ */
+static LogRecord *ring_reserve(LogRing **out, int limited) {
+    LogRing *ring = get_self();
+    *out = ring;
+    if (!ring) return NULL;
+
+    if (limited && rate_limit > 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        if (ts.tv_sec != ring->rate_second) {
+            ring->rate_second = ts.tv_sec;
+            ring->rate_count = 0;
+        }
+        if (ring->rate_count >= rate_limit) {
+            count_drop(ring);
+            return NULL;
+        }
+        ring->rate_count++;
+    }
+
+    unsigned tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= RING_SLOTS) {
+        count_drop(ring);
+        return NULL;
+    }
+    LogRecord *record = &ring->records[tail & (RING_SLOTS - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->when_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    return record;
+}
+
+/**
+ * @brief Hands the record taken by ring_reserve() to the writer, waking it
+ * early once the ring is half full.
+ */
+static void ring_publish(LogRing *ring) {
+    unsigned tail = ring->tail + 1;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SLOTS / 2) pthread_cond_signal(&wake);
+}
+
+/**
+ * @brief Writes a whole buffer to a descriptor.
+ */
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return; // Nowhere left to report it
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+/**
+ * @brief Writes out a destination's buffered output.
+ */
+static void output_flush(LogOutput *out) {
+    if (out->len == 0) return;
+    write_all(out->fd, out->data, out->len);
+    out->len = 0;
+}
+
+/**
+ * @brief Appends formatted text to a destination's buffer. Callers make
+ * sure RECORD_MAX_OUTPUT bytes are free before formatting a record.
+ */
+static void output_printf(LogOutput *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void output_printf(LogOutput *out, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(out->data + out->len, OUTPUT_SIZE - out->len, format, args);
+    va_end(args);
+    if (len < 0) return;
+    out->len += (size_t)len < OUTPUT_SIZE - out->len ? (size_t)len : OUTPUT_SIZE - out->len - 1;
+}
+
+/**
+ * @brief Appends a string as the contents of a JSON string literal.
+ */
+static void output_json(LogOutput *out, const char *text, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            out->data[out->len++] = '\\';
+            out->data[out->len++] = c;
+        } else if (c < 0x20) {
+            memcpy(out->data + out->len, "\\u00", 4);
+            out->data[out->len + 4] = hex[c >> 4];
+            out->data[out->len + 5] = hex[c & 15];
+            out->len += 6;
+        } else {
+            out->data[out->len++] = c;
+        }
+    }
+}
+
+/**
+ * @brief Formats a record's time as ISO 8601 UTC, with milliseconds.
+ */
+static void format_time(int64_t when_us, char *buf, size_t size) {
+    time_t seconds = (time_t)(when_us / 1000000);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    size_t len = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%03dZ", (int)(when_us / 1000 % 1000));
+}
+
+/**
+ * @brief Formats one access record as a line of JSON.
+ */
+static void format_access(LogOutput *out, const LogRecord *record) {
+    const AccessInfo *info = &record->access;
+    char when[40];
+    format_time(record->when_us, when, sizeof(when));
+
+    char client[INET6_ADDRSTRLEN + 8] = "";
+    char addr[INET6_ADDRSTRLEN];
+    if (info->client.sa.sa_family == AF_INET &&
+        inet_ntop(AF_INET, &info->client.in.sin_addr, addr, sizeof(addr))) {
+        snprintf(client, sizeof(client), "%s:%u", addr, ntohs(info->client.in.sin_port));
+    } else if (info->client.sa.sa_family == AF_INET6 &&
+               inet_ntop(AF_INET6, &info->client.in6.sin6_addr, addr, sizeof(addr))) {
+        snprintf(client, sizeof(client), "[%s]:%u", addr, ntohs(info->client.in6.sin6_port));
+    }
+
+    output_printf(out, "{\"time\":\"%s\"", when);
+    if (client[0]) output_printf(out, ",\"client\":\"%s\"", client);
+    output_printf(out, ",\"method\":\"");
+    output_json(out, record->method, strnlen(record->method, METHOD_SIZE));
+    output_printf(out, "\",\"url\":\"");
+    output_json(out, record->text, record->text_len);
+    output_printf(out, "\"");
+    if (info->status) output_printf(out, ",\"status\":%d", info->status);
+    output_printf(out, ",\"bytes\":%llu", (unsigned long long)info->bytes);
+    if (info->cache != LOG_CACHE_NONE) output_printf(out, ",\"cache\":\"%s\"", cache_names[info->cache]);
+    output_printf(out, ",\"total_us\":%llu", (unsigned long long)info->total_us);
+    if (info->connect_us) output_printf(out, ",\"connect_us\":%llu", (unsigned long long)info->connect_us);
+    if (info->ttfb_us) output_printf(out, ",\"ttfb_us\":%llu", (unsigned long long)info->ttfb_us);
+    output_printf(out, "}\n");
+}
+
+/**
+ * @brief Formats one message as a timestamped line.
+ */
+static void format_message(LogOutput *out, const LogRecord *record) {
+    char when[40];
+    format_time(record->when_us, when, sizeof(when));
+    size_t len = record->text_len;
+    if (len > 0 && record->text[len - 1] == '\n') len--;
+    output_printf(out, "%s %s %.*s\n", when, level_names[record->level], (int)len, record->text);
+}
+
+/**
+ * @brief Formats every queued record and writes the output.
+ * @return Records dropped so far, over every ring.
+ */
+static uint64_t drain_rings() {
+    uint64_t dropped = 0;
+    for (LogRing *ring = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        unsigned head = ring->head;
+        unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const LogRecord *record = &ring->records[head & (RING_SLOTS - 1)];
+            LogOutput *out = record->kind == RECORD_ACCESS ? access_out : message_out;
+            if (record->kind == RECORD_ACCESS && !out) continue;
+            if (OUTPUT_SIZE - out->len < RECORD_MAX_OUTPUT) output_flush(out);
+            if (record->kind == RECORD_ACCESS) format_access(out, record);
+            else format_message(out, record);
+        }
+        // Slots are reused as soon as the head passes them
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    if (access_out) output_flush(access_out);
+    output_flush(message_out);
+    return dropped;
+}
+
+/**
+ * @brief Writer thread: drains the rings until asked to stop, then once more.
+ */
+static void *writer_thread(void *arg) {
+    (void)arg;
+    uint64_t reported = 0;
+    time_t last_report = 0;
+    for (;;) {
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        uint64_t dropped = drain_rings();
+        if (stop) break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (dropped > reported && now.tv_sec - last_report >= DROP_REPORT_INTERVAL) {
+            struct timespec wall;
+            clock_gettime(CLOCK_REALTIME, &wall);
+            char when[40];
+            format_time((int64_t)wall.tv_sec * 1000000 + wall.tv_nsec / 1000, when, sizeof(when));
+            output_printf(message_out, "%s WARN Log dropped %llu record(s): a ring was full or over the rate limit.\n",
+                          when, (unsigned long long)(dropped - reported));
+            output_flush(message_out);
+            reported = dropped;
+            last_report = now.tv_sec;
+        }
+
+        struct timespec deadline = now;
+        deadline.tv_nsec += WRITER_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&wake_lock);
+        if (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) pthread_cond_timedwait(&wake, &wake_lock, &deadline);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copies at most size - 1 bytes of a string, always terminated.
+ * @return The bytes copied.
+ */
+static size_t copy_text(char *dst, const char *src, size_t size) {
+    size_t len = src ? strnlen(src, size - 1) : 0;
+    if (len) memcpy(dst, src, len);
+    dst[len] = '\0';
+    return len;
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Opens the access log and starts the writer thread.
+ */
+int log_init(const log_config_t *config) {
+    log_set_level(config->level);
+    sample_every = config->sample > 1 ? config->sample : 1;
+    rate_limit = config->rate > 0 ? config->rate : 0;
+
+    const char *path = config->access_log;
+    if (path && strcmp(path, "off") == 0) {
+        access_fd = -1;
+    } else if (!path || strcmp(path, "-") == 0) {
+        access_fd = STDOUT_FILENO;
+    } else {
+        access_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (access_fd < 0) {
+            perror("open (access log)");
+            return -1;
+        }
+    }
+
+    message_out = malloc(sizeof(LogOutput));
+    access_out = access_fd >= 0 ? malloc(sizeof(LogOutput)) : NULL;
+    if (!message_out || (access_fd >= 0 && !access_out)) {
+        perror("malloc for log output");
+        free(message_out);
+        free(access_out);
+        message_out = access_out = NULL;
+        return -1;
+    }
+    message_out->fd = STDERR_FILENO;
+    message_out->len = 0;
+    if (access_out) {
+        access_out->fd = access_fd;
+        access_out->len = 0;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // The writer never takes signals: a handler may be waiting for it to finish
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&writer, NULL, writer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create for log writer: %s\n", strerror(rc));
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Writes out everything queued and stops the writer thread.
+ */
+void log_shutdown() {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&wake_lock);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_join(writer, NULL);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Parses a level name.
+ */
+int log_parse_level(const char *name, log_level_t *level) {
+    for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            *level = (log_level_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Changes the level messages must reach to be logged.
+ */
+void log_set_level(log_level_t level) {
+    __atomic_store_n(&configured_level, level, __ATOMIC_RELAXED);
+    __atomic_store_n(&current_level, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Switches debug output on, or back off to the configured level.
+ */
+void log_toggle_debug() {
+    int level = __atomic_load_n(&current_level, __ATOMIC_RELAXED) == LOG_LEVEL_DEBUG
+                    ? __atomic_load_n(&configured_level, __ATOMIC_RELAXED) : LOG_LEVEL_DEBUG;
+    __atomic_store_n(&current_level, level, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Whether messages of a level are currently logged.
+ */
+int log_enabled(log_level_t level) {
+    return (int)level <= __atomic_load_n(&current_level, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Logs a diagnostic message.
+ */
+void log_message(log_level_t level, const char *format, ...) {
+    if (!log_enabled(level)) return;
+    va_list args;
+    va_start(args, format);
+    log_vmessage(level, format, args);
+    va_end(args);
+}
+
+/**
+ * @brief Logs a diagnostic message, from a va_list.
+ */
+void log_vmessage(log_level_t level, const char *format, va_list args) {
+    if (!log_enabled(level)) return;
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        // No writer yet (or any more): straight to stderr
+        vfprintf(stderr, format, args);
+        size_t len = strlen(format);
+        if (len == 0 || format[len - 1] != '\n') fputc('\n', stderr);
+        return;
+    }
+
+    LogRing *ring;
+    LogRecord *record = ring_reserve(&ring, 0);
+    if (!record) return;
+    int len = vsnprintf(record->text, TEXT_SIZE, format, args);
+    if (len < 0) len = 0;
+    record->kind = RECORD_MESSAGE;
+    record->level = level;
+    record->text_len = len < TEXT_SIZE ? len : TEXT_SIZE - 1;
+    ring_publish(ring);
+}
+
+/**
+ * @brief Logs a warning naming a failed operation and errno's description.
+ */
+void log_errno(const char *what) {
+    int err = errno;
+    if (!log_enabled(LOG_LEVEL_WARN)) return;
+    char buf[128];
+    log_message(LOG_LEVEL_WARN, "%s: %s", what, strerror_r(err, buf, sizeof(buf)));
+    errno = err;
+}
+
+/**
+ * @brief Whether access records are being kept.
+ */
+int log_access_enabled() {
+    return access_fd >= 0 && __atomic_load_n(&running, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Queues an access record for a finished request.
+ */
+void log_access(const char *method, const char *url, const AccessInfo *info) {
+    if (!log_access_enabled()) return;
+    // Server errors are always kept; everything else is sampled
+    if (sample_every > 1 && info->status < 500) {
+        LogRing *ring = get_self();
+        if (!ring || ring->sample_seq++ % sample_every != 0) return;
+    }
+
+    LogRing *ring;
+    LogRecord *record = ring_reserve(&ring, 1);
+    if (!record) return;
+    record->kind = RECORD_ACCESS;
+    copy_text(record->method, method, METHOD_SIZE);
+    record->access = *info;
+    record->text_len = copy_text(record->text, url, TEXT_SIZE);
+    ring_publish(ring);
+}
@@ -0,0 +1,154 @@
+/**
+ * @file logger.h
+ * @author Shubham More
+ * @brief Interface for the asynchronous access and diagnostic log.
+ *
+ * Threads serving requests never write log output themselves. Each one
+ * gets a private ring of fixed-size records, filled without locks, which a
+ * background writer thread drains and formats: access records as one JSON
+ * object per line, diagnostic messages as timestamped lines. Output is
+ * batched into a few large writes. A record that finds its thread's ring
+ * full, or an access record that finds its thread over the per-second
+ * rate limit, is dropped and counted rather than waited for, and the
+ * writer reports how many were lost. Messages are never rate limited, so
+ * errors and warnings are not lost to a flood of requests.
+ *
+ * Messages below the current level are discarded before anything is
+ * formatted. The level can be changed at runtime, and debug output toggled
+ * from a signal handler.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include "dns_cache.h"      // dns_sockaddr_t
+#include <stdarg.h>
+#include <stdint.h>
+
+// Message severities, most severe first
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} log_level_t;
+
+// How the cache took part in answering a request
+typedef enum {
+    LOG_CACHE_NONE,         // Not consulted (cache disabled, or the request failed first)
+    LOG_CACHE_BYPASS,       // The request may not be answered from the cache
+    LOG_CACHE_HIT,          // A fresh copy in memory
+    LOG_CACHE_DISK_HIT,     // A fresh copy in the disk tier
+    LOG_CACHE_STREAM,       // Sent along with an identical fetch in flight
+    LOG_CACHE_MISS,         // Fetched from the origin
+    LOG_CACHE_STALE,        // A stale copy that the origin replaced
+    LOG_CACHE_REVALIDATED   // A stale copy that the origin confirmed with 304
+} log_cache_t;
+
+/**
+ * @struct log_config_t
+ * @brief Logging settings.
+ */
+typedef struct {
+    log_level_t level;      // Messages less severe than this are discarded
+    const char *access_log; // File to append access records to; NULL or "-" for stdout, "off" for none
+    int sample;             // Keep one access record in this many (1 keeps all); errors are always kept
+    int rate;               // Access records a thread may log per second, 0 for no limit
+} log_config_t;
+
+/**
+ * @struct AccessInfo
+ * @brief What an access record says about a finished request, besides its
+ * method and URL.
+ */
+typedef struct {
+    dns_sockaddr_t client;  // Client address; family AF_UNSPEC if unknown
+    int status;             // Status sent to the client, or 0 if unknown
+    uint64_t bytes;         // Bytes sent to the client
+    log_cache_t cache;
+    uint64_t total_us;      // From the request head to the end of the response
+    uint64_t connect_us;    // Connecting to the origin, or 0 if no new connection was made
+    uint64_t ttfb_us;       // From the request being sent to the origin to its first byte, or 0
+} AccessInfo;
+
+/**
+ * @brief Opens the access log and starts the writer thread.
+ *
+ * Until this is called, messages are written to stderr synchronously and
+ * access records are discarded.
+ * @param config Logging settings.
+ * @return 0 on success, -1 on failure.
+ */
+int log_init(const log_config_t *config);
+
+/**
+ * @brief Writes out everything still queued and stops the writer thread.
+ * Later messages go to stderr synchronously again.
+ */
+void log_shutdown();
+
+/**
+ * @brief Parses a level name (error, warn, info or debug).
+ * @param name The name.
+ * @param level Set to the level on success.
+ * @return 0 on success, -1 if the name is not a level.
+ */
+int log_parse_level(const char *name, log_level_t *level);
+
+/**
+ * @brief Changes the level messages must reach to be logged.
+ * @param level The new level.
+ */
+void log_set_level(log_level_t level);
+
+/**
+ * @brief Switches debug output on, or back off to the configured level.
+ * Async-signal-safe.
+ */
+void log_toggle_debug();
+
+/**
+ * @brief Whether messages of a level are currently logged.
+ * @param level The level.
+ * @return Non-zero if they are.
+ */
+int log_enabled(log_level_t level);
+
+/**
+ * @brief Logs a diagnostic message.
+ * @param level The message's severity.
+ * @param format printf-style format; a trailing newline is optional.
+ */
+void log_message(log_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Logs a diagnostic message, from a va_list.
+ * @param level The message's severity.
+ * @param format printf-style format.
+ * @param args The arguments.
+ */
+void log_vmessage(log_level_t level, const char *format, va_list args);
+
+/**
+ * @brief Logs a warning naming a failed operation and errno's description,
+ * like perror().
+ * @param what The operation that failed.
+ */
+void log_errno(const char *what);
+
+/**
+ * @brief Whether access records are being kept; a caller may skip
+ * gathering what only the access log would use.
+ * @return Non-zero if they are.
+ */
+int log_access_enabled();
+
+/**
+ * @brief Queues an access record for a finished request.
+ * @param method The request method.
+ * @param url The request URL; cut short if very long.
+ * @param info The rest of the record.
+ */
+void log_access(const char *method, const char *url, const AccessInfo *info);
+
+#endif
@@ -0,0 +1,368 @@
+/**
+ * @file metrics.c
+ * @author Shubham More
+ * @brief Implementation of the per-thread counters and latency histograms.
+ *
+ * Each thread registers a shard on first use, the way threads register
+ * with the epoch reclamation scheme: shards live on an append-only list,
+ * are never freed, and are recycled when their thread exits, so what a
+ * thread counted stays in the totals. A shard has a single writer at any
+ * time, so values are updated with a relaxed load and store; readers load
+ * them relaxed too, and at worst see an update a moment late.
+ *
+ * A latency of v microseconds goes into one of four buckets below 4 us,
+ * or else into one of four equal sub-buckets of the power of two holding
+ * v - 1. Bucket bounds are therefore whole microseconds (1 2 3 4 5 6 7 8
+ * 10 12 14 16 20 ...), and a bucket counts the values up to and including
+ * its bound, as Prometheus expects.
+ */
+
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "socket_util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#define SUB_BUCKETS 4               // Buckets per power of two
+#define OCTAVES 25                  // Powers of two covered above the first SUB_BUCKETS microseconds
+#define FINITE_BUCKETS (SUB_BUCKETS + SUB_BUCKETS * OCTAVES) // Bounds up to 8 << 24 us (~134 s)
+#define HISTOGRAM_BUCKETS (FINITE_BUCKETS + 1) // The last one is +Inf
+#define SHARD_ALIGNMENT 64          // Shards start on their own cache line
+#define ADMIN_BACKLOG 16            // Pending scrapes on the admin port
+#define ADMIN_REQUEST_SIZE 4096     // Longest admin request head read
+#define ADMIN_TIMEOUT 5             // Seconds a scraper may take to send its request
+
+// --- Structs ---
+
+// One thread's counters and histograms
+typedef struct MetricsShard {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    uint64_t buckets[METRIC_HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+    uint64_t sums[METRIC_HISTOGRAM_COUNT];  // Microseconds
+    int in_use;                             // Owned by a live thread
+    struct MetricsShard *next;              // Link in the append-only registry
+} MetricsShard;
+
+// How each metric is exposed
+typedef struct {
+    const char *name;
+    const char *help;
+} MetricInfo;
+
+static const MetricInfo counter_info[METRIC_COUNTER_COUNT] = {
+    [METRIC_CONNECTIONS_OPENED] = { "proxy_connections_total", "Client connections accepted." },
+    [METRIC_CONNECTIONS_CLOSED] = { NULL, NULL }, // Only exposed through the active gauge
+    [METRIC_REQUESTS] = { "proxy_requests_total", "Requests received from clients." },
+    [METRIC_CACHE_HITS] = { "proxy_cache_hits_total", "Requests answered from the cache." },
+    [METRIC_CACHE_MISSES] = { "proxy_cache_misses_total", "Cacheable requests fetched from the origin." },
+    [METRIC_CACHE_EVICTIONS] = { "proxy_cache_evictions_total", "Objects evicted from the memory cache." },
+    [METRIC_BYTES_IN] = { "proxy_bytes_in_total", "Response bytes read from origins." },
+    [METRIC_BYTES_OUT] = { "proxy_bytes_out_total", "Bytes written to clients." },
+    [METRIC_UPSTREAM_ERRORS] = { "proxy_upstream_errors_total", "Origins unreachable or failing mid-response." },
+    [METRIC_UPSTREAM_TIMEOUTS] = { "proxy_upstream_timeouts_total", "Origin exchanges that timed out (also counted as errors)." },
+    [METRIC_UPSTREAM_REJECTED] = { "proxy_upstream_rejected_total", "Requests refused by an origin limit or open circuit." },
+    [METRIC_RELAY_QUEUED] = { "proxy_relay_queued_bytes_total", "Response bytes queued for clients slower than their origin." },
+    [METRIC_RELAY_DRAINED] = { NULL, NULL }, // Only exposed through the queued gauge
+    [METRIC_COMPRESS_IN] = { "proxy_compress_in_bytes_total", "Response bytes compressed into cached variants." },
+    [METRIC_COMPRESS_OUT] = { "proxy_compress_out_bytes_total", "Bytes compressed cached variants came to." },
+};
+
+static const MetricInfo histogram_info[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_REQUEST_LATENCY] = { "proxy_request_duration_seconds", "Time from request head to response sent." },
+    [METRIC_CONNECT_LATENCY] = { "proxy_upstream_connect_seconds", "Time to connect to an origin." },
+    [METRIC_TTFB_LATENCY] = { "proxy_upstream_ttfb_seconds", "Time from request sent to first response byte." },
+    [METRIC_LOOKUP_LATENCY] = { "proxy_cache_lookup_seconds", "Time to look a request up in the cache." },
+};
+
+// --- Global Metrics State ---
+static MetricsShard *registry = NULL;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread MetricsShard *self = NULL;
+static int admin_fd = -1;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Thread-exit destructor: hands the thread's shard back for reuse.
+ */
+static void release_shard(void *arg) {
+    MetricsShard *shard = (MetricsShard *)arg;
+    __atomic_store_n(&shard->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Creates the key whose destructor recycles shards.
+ */
+static void make_key() {
+    pthread_key_create(&thread_key, release_shard);
+}
+
+/**
+ * @brief Returns the calling thread's shard, registering one if needed.
+ * @return The shard, or NULL if none could be allocated (nothing is counted then).
+ */
+static MetricsShard *get_self() {
+    if (self) return self;
+    pthread_once(&key_once, make_key);
+
+    // Recycle the shard of a thread that has exited
+    MetricsShard *shard;
+    for (shard = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&shard->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+    }
+
+    if (!shard) {
+        void *mem;
+        if (posix_memalign(&mem, SHARD_ALIGNMENT, sizeof(MetricsShard)) != 0) return NULL;
+        shard = mem;
+        memset(shard, 0, sizeof(*shard));
+        shard->in_use = 1;
+        shard->next = __atomic_load_n(&registry, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&registry, &shard->next, shard, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(thread_key, shard);
+    self = shard;
+    return shard;
+}
+
+/**
+ * @brief Adds to a value only the calling thread writes.
+ */
+static inline void bump(uint64_t *value, uint64_t n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief The bucket counting a latency.
+ */
+static int bucket_index(uint64_t usec) {
+    uint64_t v = usec > 0 ? usec - 1 : 0;
+    if (v < SUB_BUCKETS) return (int)v;
+    int octave = 63 - __builtin_clzll(v) - 2; // SUB_BUCKETS is 1 << 2
+    if (octave >= OCTAVES) return FINITE_BUCKETS;
+    return SUB_BUCKETS + octave * SUB_BUCKETS + (int)((v >> octave) & (SUB_BUCKETS - 1));
+}
+
+/**
+ * @brief The inclusive upper bound of a finite bucket, in microseconds.
+ */
+static uint64_t bucket_bound(int index) {
+    if (index < SUB_BUCKETS) return (uint64_t)index + 1;
+    int octave = (index - SUB_BUCKETS) / SUB_BUCKETS;
+    int sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+    return (uint64_t)(SUB_BUCKETS + sub + 1) << octave;
+}
+
+/**
+ * @brief Sums a counter over every shard.
+ */
+static uint64_t total_counter(metric_counter_t counter) {
+    uint64_t total = 0;
+    for (MetricsShard *shard = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+        total += __atomic_load_n(&shard->counters[counter], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/**
+ * @brief Writes one histogram, summed over every shard, with cumulative buckets.
+ */
+static void write_histogram(FILE *out, metric_histogram_t histogram) {
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {0};
+    uint64_t sum = 0;
+    for (MetricsShard *shard = __atomic_load_n(&registry, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            buckets[i] += __atomic_load_n(&shard->buckets[histogram][i], __ATOMIC_RELAXED);
+        }
+        sum += __atomic_load_n(&shard->sums[histogram], __ATOMIC_RELAXED);
+    }
+
+    const MetricInfo *info = &histogram_info[histogram];
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+    uint64_t count = 0;
+    for (int i = 0; i < FINITE_BUCKETS; i++) {
+        count += buckets[i];
+        fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", info->name, bucket_bound(i) / 1e6,
+                (unsigned long long)count);
+    }
+    count += buckets[FINITE_BUCKETS];
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", info->name, (unsigned long long)count);
+    fprintf(out, "%s_sum %.6f\n", info->name, sum / 1e6);
+    fprintf(out, "%s_count %llu\n", info->name, (unsigned long long)count);
+}
+
+/**
+ * @brief Sends a whole buffer on a blocking socket.
+ */
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Answers one admin request.
+ */
+static void serve_admin(int client_fd) {
+    struct timeval timeout = { ADMIN_TIMEOUT, 0 };
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters, but the whole head is read before answering
+    char request[ADMIN_REQUEST_SIZE + 1];
+    size_t len = 0;
+    while (len < ADMIN_REQUEST_SIZE) {
+        ssize_t bytes_read = recv(client_fd, request + len, ADMIN_REQUEST_SIZE - len, 0);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) return;
+        len += bytes_read;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    request[len] = '\0';
+
+    static const char path[] = "GET /metrics";
+    char next = len >= sizeof(path) - 1 ? request[sizeof(path) - 1] : '\0';
+    if (strncmp(request, path, sizeof(path) - 1) != 0 || (next != ' ' && next != '?')) {
+        static const char not_found[] =
+            "HTTP/1.1 404 Not Found\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n";
+        send_all(client_fd, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out) return;
+    metrics_write(out);
+    if (fclose(out) != 0) {
+        free(body);
+        return;
+    }
+
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n",
+        body_len);
+    if (send_all(client_fd, head, head_len) == 0) send_all(client_fd, body, body_len);
+    free(body);
+}
+
+/**
+ * @brief Admin thread: serves scrapes one at a time, for as long as the process runs.
+ */
+static void *admin_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        int client_fd = accept(admin_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept (metrics)");
+            return NULL;
+        }
+        serve_admin(client_fd);
+        close(client_fd);
+    }
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Adds to a counter of the calling thread's shard.
+ */
+void metrics_add(metric_counter_t counter, uint64_t n) {
+    MetricsShard *shard = get_self();
+    if (shard) bump(&shard->counters[counter], n);
+}
+
+/**
+ * @brief Microseconds on the monotonic clock.
+ */
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + 1;
+}
+
+/**
+ * @brief Records the latency of an operation that started at since.
+ */
+uint64_t metrics_observe(metric_histogram_t histogram, uint64_t since) {
+    uint64_t now = metrics_now();
+    uint64_t usec = now > since ? now - since : 0;
+    MetricsShard *shard = get_self();
+    if (!shard) return usec;
+    bump(&shard->buckets[histogram][bucket_index(usec)], 1);
+    bump(&shard->sums[histogram], usec);
+    return usec;
+}
+
+/**
+ * @brief Writes every metric in the Prometheus text format.
+ */
+void metrics_write(FILE *out) {
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        const MetricInfo *info = &counter_info[i];
+        if (!info->name) continue;
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", info->name, info->help, info->name,
+                info->name, (unsigned long long)total_counter(i));
+    }
+
+    // Closes are read first, so a connection closing meanwhile is not counted as closed but not opened
+    uint64_t closed = total_counter(METRIC_CONNECTIONS_CLOSED);
+    uint64_t opened = total_counter(METRIC_CONNECTIONS_OPENED);
+    fprintf(out, "# HELP proxy_connections_active Client connections open.\n"
+                 "# TYPE proxy_connections_active gauge\nproxy_connections_active %llu\n",
+            (unsigned long long)(opened > closed ? opened - closed : 0));
+
+    uint64_t drained = total_counter(METRIC_RELAY_DRAINED);
+    uint64_t queued = total_counter(METRIC_RELAY_QUEUED);
+    fprintf(out, "# HELP proxy_relay_queued_bytes Response bytes waiting for slow clients.\n"
+                 "# TYPE proxy_relay_queued_bytes gauge\nproxy_relay_queued_bytes %llu\n",
+            (unsigned long long)(queued > drained ? queued - drained : 0));
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) write_histogram(out, i);
+}
+
+/**
+ * @brief Starts the admin endpoint on a background thread.
+ */
+int metrics_serve(int port) {
+    admin_fd = socket_listen_tcp(port, ADMIN_BACKLOG, 0);
+    if (admin_fd < 0) return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, admin_thread, NULL) != 0) {
+        perror("pthread_create for metrics thread");
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file metrics.h
+ * @author Shubham More
+ * @brief Interface for the proxy's counters and latency histograms.
+ *
+ * Every thread that records a metric gets its own shard of counters and
+ * histogram buckets, so recording is an uncontended load and store on a
+ * cache line no other thread writes: no locks, no atomic read-modify-write.
+ * Shards are only added together when the metrics are read, which happens
+ * when an admin endpoint is scraped (see metrics_serve()).
+ *
+ * Latencies are kept in log-linear buckets in the manner of an HDR
+ * histogram: four buckets per power of two from 1 microsecond up to about
+ * two minutes, so every observation lands in a bucket at most 25% wider
+ * than the value itself, whatever its magnitude.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Monotonic counters
+typedef enum {
+    METRIC_CONNECTIONS_OPENED,  // Client connections accepted
+    METRIC_CONNECTIONS_CLOSED,  // Client connections closed
+    METRIC_REQUESTS,            // Request heads received from clients
+    METRIC_CACHE_HITS,          // Requests answered from the cache (memory, disk or a fetch joined)
+    METRIC_CACHE_MISSES,        // Cacheable requests that went to the origin, stale copies included
+    METRIC_CACHE_EVICTIONS,     // Objects evicted from the memory cache
+    METRIC_BYTES_IN,            // Response bytes read from origins
+    METRIC_BYTES_OUT,           // Bytes written to clients
+    METRIC_UPSTREAM_ERRORS,     // Origins that could not be reached or that failed mid-response
+    METRIC_UPSTREAM_TIMEOUTS,   // Of those, exchanges that ran out of time
+    METRIC_UPSTREAM_REJECTED,   // Requests refused by an origin's concurrency limit or open circuit
+    METRIC_RELAY_QUEUED,        // Response bytes queued for clients slower than their origin
+    METRIC_RELAY_DRAINED,       // Of those, bytes since sent or discarded
+    METRIC_COMPRESS_IN,         // Response bytes compressed into cached variants
+    METRIC_COMPRESS_OUT,        // Bytes those compressed to
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+// Latency histograms
+typedef enum {
+    METRIC_REQUEST_LATENCY,     // From a request head being parsed to its response being sent
+    METRIC_CONNECT_LATENCY,     // Connecting to an origin (new connections only)
+    METRIC_TTFB_LATENCY,        // From sending a request to an origin to its first response byte
+    METRIC_LOOKUP_LATENCY,      // Looking a request up in the cache
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+/**
+ * @brief Adds to a counter of the calling thread's shard.
+ * @param counter The counter.
+ * @param n The amount.
+ */
+void metrics_add(metric_counter_t counter, uint64_t n);
+
+/**
+ * @brief Microseconds on the monotonic clock; the time base of metrics_observe().
+ * @return The current time; never 0.
+ */
+uint64_t metrics_now();
+
+/**
+ * @brief Records a latency in a histogram of the calling thread's shard.
+ * @param histogram The histogram.
+ * @param since When the measured operation started, from metrics_now().
+ * @return The latency recorded, in microseconds.
+ */
+uint64_t metrics_observe(metric_histogram_t histogram, uint64_t since);
+
+/**
+ * @brief Writes the totals over every thread in the Prometheus text
+ * exposition format.
+ * @param out The stream to write to.
+ */
+void metrics_write(FILE *out);
+
+/**
+ * @brief Starts the admin endpoint on a background thread.
+ *
+ * A GET of /metrics on the port answers with metrics_write()'s report;
+ * anything else is answered with 404. Every connection carries a single
+ * request.
+ * @param port The TCP port to listen on.
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_serve(int port);
+
+#endif
@@ -7,180 +7,339 @@
  * proxy_parse.h. It handles memory management, string manipulation, and
  * header processing.
  *
+ * The parser makes one pass over a private copy of the request head,
+ * ending every token with a NUL written over its delimiter, so fields and
+ * headers are views into the copy instead of strings of their own. The
+ * copy, and strings added later by ParsedHeader_set(), are carved from
+ * storage inside the ParsedRequest; only a head too large for it, or more
+ * than PARSE_INLINE_HEADERS headers, goes to the heap. Delimiters are found
+ * 16 bytes at a time with SSE2 where available. Repeated headers are
+ * caught with a 64-bit mask of key hashes, so only a key whose hash was
+ * already seen is compared against the earlier ones.
+ *
+ * ParsedRequest_feed() keeps how far it has searched for the end of the
+ * head in the ParsedRequest, so a head trickling in over many reads is not
+ * searched again from the start after each one.
+ *
  * Based on the original proxy_parse.c.
  */
 
+#define _GNU_SOURCE
 #include "proxy_parse.h"
+#include "logger.h"
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define DEFAULT_NHDRS 8
-#define MAX_REQ_LEN 65535
 #define MIN_REQ_LEN 4
 
+// A heap block holding what did not fit in a request's inline storage
+typedef struct SpillBlock {
+    struct SpillBlock *next;
+    char data[];
+} SpillBlock;
+
 // Private function declarations
 static int ParsedRequest_printRequestLine(struct ParsedRequest *pr, char *buf, size_t buflen, size_t *tmp);
 
 /**
- * @brief Prints debugging information to stderr if DEBUG is enabled.
+ * @brief Logs debugging information, when the log level is debug.
  */
 void debug(const char *format, ...) {
     va_list args;
-    if (DEBUG) {
-        va_start(args, format);
-        vfprintf(stderr, format, args);
-        va_end(args);
+    va_start(args, format);
+    log_vmessage(LOG_LEVEL_DEBUG, format, args);
+    va_end(args);
+}
+
+/**
+ * @brief Takes len bytes of string storage from a request, from its inline
+ * storage while it lasts. (Private)
+ * @return The bytes, or NULL on allocation failure.
+ */
+static char *parse_alloc(struct ParsedRequest *pr, size_t len) {
+    if (len <= PARSE_INLINE_STORAGE - pr->storage_used) {
+        char *p = pr->storage + pr->storage_used;
+        pr->storage_used += len;
+        return p;
+    }
+    SpillBlock *block = (SpillBlock *) malloc(sizeof(SpillBlock) + len);
+    if (block == NULL) return NULL;
+    block->next = (SpillBlock *) pr->spill;
+    pr->spill = block;
+    return block->data;
+}
+
+/**
+ * @brief Copies a string of known length into a request's storage. (Private)
+ */
+static char *parse_strndup(struct ParsedRequest *pr, const char *s, size_t len) {
+    char *copy = parse_alloc(pr, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/**
+ * @brief Makes room for one more header, moving the array to the heap once
+ * it outgrows the inline one. (Private)
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int reserve_header(struct ParsedRequest *pr) {
+    if (pr->headers_used < pr->headers_len) return 0;
+
+    size_t new_len = pr->headers_len * 2;
+    struct ParsedHeader *new_headers;
+    if (pr->headers == pr->inline_headers) {
+        new_headers = (struct ParsedHeader *) malloc(new_len * sizeof(struct ParsedHeader));
+        if (new_headers != NULL) memcpy(new_headers, pr->headers, pr->headers_used * sizeof(struct ParsedHeader));
+    } else {
+        new_headers = (struct ParsedHeader *) realloc(pr->headers, new_len * sizeof(struct ParsedHeader));
+    }
+    if (new_headers == NULL) return -1;
+    pr->headers = new_headers;
+    pr->headers_len = new_len;
+    return 0;
+}
+
+/**
+ * @brief Picks a header key's bit in the duplicate mask; equal keys in any
+ * case get the same bit. (Private)
+ */
+static unsigned long long key_bit(const char *key, size_t keylen) {
+    unsigned int h = (unsigned int)keylen * 31;
+    if (keylen > 0) h += (unsigned int)(tolower((unsigned char)key[0]) ^ (tolower((unsigned char)key[keylen - 1]) << 2));
+    return 1ULL << (h & 63);
+}
+
+/**
+ * @brief Finds the first of two delimiter bytes in [p, end). (Private)
+ * @return A pointer to it, or end if neither occurs.
+ */
+static char *find_delim(char *p, const char *end, char a, char b) {
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != a && *p != b) p++;
+    return p;
+}
+
+/**
+ * @brief Finds the CRLF ending the line that starts at p. (Private)
+ * @return A pointer to its CR, or NULL if the line is not terminated.
+ */
+static char *find_line_end(char *p, const char *end) {
+    for (;;) {
+        p = find_delim(p, end, '\r', '\r');
+        if (end - p < 2) return NULL;
+        if (p[1] == '\n') return p;
+        p++;
     }
 }
 
+/**
+ * @brief Puts a request into the empty state. (Private)
+ */
+static void init_request(struct ParsedRequest *pr) {
+    pr->method = NULL;
+    pr->protocol = NULL;
+    pr->host = NULL;
+    pr->port = NULL;
+    pr->path = NULL;
+    pr->version = NULL;
+    pr->buf = NULL;
+    pr->buflen = 0;
+    pr->headers = pr->inline_headers;
+    pr->headers_used = 0;
+    pr->headers_len = PARSE_INLINE_HEADERS;
+    pr->header_keys = 0;
+    pr->head_scanned = 0;
+    pr->length_conflict = 0;
+    pr->url = NULL;
+    pr->spill = NULL;
+    pr->storage_used = 0;
+}
+
 /**
  * @brief Creates a new ParsedRequest object.
  */
 struct ParsedRequest* ParsedRequest_create() {
     struct ParsedRequest *pr = (struct ParsedRequest *) malloc(sizeof(struct ParsedRequest));
-    if (pr != NULL) {
-        pr->method = NULL;
-        pr->protocol = NULL;
-        pr->host = NULL;
-        pr->port = NULL;
-        pr->path = NULL;
-        pr->version = NULL;
-        pr->buf = NULL;
-        pr->buflen = 0;
-        pr->headers = (struct ParsedHeader *) malloc(sizeof(struct ParsedHeader) * DEFAULT_NHDRS);
-        if (pr->headers == NULL) {
-            free(pr);
-            return NULL;
-        }
-        pr->headers_used = 0;
-        pr->headers_len = DEFAULT_NHDRS;
-    }
+    if (pr != NULL) init_request(pr);
     return pr;
 }
 
+/**
+ * @brief Frees what a request spilled to the heap and empties it.
+ */
+void ParsedRequest_reset(struct ParsedRequest *pr) {
+    if (pr == NULL) return;
+    while (pr->spill != NULL) {
+        SpillBlock *block = (SpillBlock *) pr->spill;
+        pr->spill = block->next;
+        free(block);
+    }
+    if (pr->headers != pr->inline_headers) free(pr->headers);
+    init_request(pr);
+}
+
 /**
  * @brief Destroys a ParsedRequest object, freeing all associated memory.
  */
 void ParsedRequest_destroy(struct ParsedRequest *pr) {
     if (pr == NULL) return;
-    if (pr->buf != NULL) free(pr->buf);
-
-    for (size_t i = 0; i < pr->headers_used; i++) {
-        free(pr->headers[i].key);
-        free(pr->headers[i].value);
-    }
-    free(pr->headers);
+    ParsedRequest_reset(pr);
     free(pr);
 }
 
 /**
- * @brief Parses the request line of an HTTP request.
+ * @brief Parses the request line of an HTTP request, in place.
+ * @param line The request line, NUL-terminated where its CRLF was.
+ * @param line_end The terminating NUL.
  * @return 0 on success, -1 on failure.
  */
-static int parse_request_line(struct ParsedRequest *pr, const char *request_line) {
-    char *method, *uri, *version;
-    char *uri_ptr;
-    char *host_port;
-    char *port_ptr;
-
+static int parse_request_line(struct ParsedRequest *pr, char *line, char *line_end) {
     // Method
-    method = strstr(request_line, " ");
-    if (method == NULL) return -1;
-    pr->method = strndup(request_line, method - request_line);
-    
-    // URI
-    uri = method + 1;
-    version = strstr(uri, " ");
-    if (version == NULL) { free(pr->method); pr->method = NULL; return -1; }
-    pr->version = strndup(version + 1, strlen(version + 1));
-
-    uri_ptr = strndup(uri, version - uri);
+    char *method_end = find_delim(line, line_end, ' ', ' ');
+    if (method_end == line_end) return -1;
+    *method_end = '\0';
+    pr->method = line;
+
+    // URI and version
+    char *uri = method_end + 1;
+    char *uri_end = find_delim(uri, line_end, ' ', ' ');
+    if (uri_end == line_end) return -1;
+    *uri_end = '\0';
+    pr->version = uri_end + 1;
 
     // Protocol
-    if (strstr(uri_ptr, "://") != NULL) {
-        pr->protocol = strndup(uri_ptr, strstr(uri_ptr, "://") - uri_ptr);
-        host_port = strstr(uri_ptr, "://") + 3;
+    char *host_port = uri;
+    char *scheme_end = strstr(uri, "://");
+    if (scheme_end != NULL) {
+        *scheme_end = '\0';
+        pr->protocol = uri;
+        host_port = scheme_end + 3;
     } else {
-        pr->protocol = strdup("http");
-        host_port = uri_ptr;
+        pr->protocol = "http";
     }
 
-    // Path
-    pr->path = strstr(host_port, "/");
-    if (pr->path != NULL) {
-        pr->path = strdup(pr->path);
-    } else {
-        pr->path = strdup("/");
-    }
-    
+    // Path; the host and port are copied out, since the path starts right after them
+    char *path = find_delim(host_port, uri_end, '/', '/');
+    pr->path = path < uri_end ? path : "/";
+    char *host = parse_strndup(pr, host_port, (size_t)(path - host_port));
+    if (host == NULL) return -1;
+
     // Host and Port
-    host_port = strndup(host_port, strlen(host_port) - strlen(pr->path));
-    port_ptr = strstr(host_port, ":");
-    if (port_ptr != NULL) {
-        pr->port = strdup(port_ptr + 1);
-        pr->host = strndup(host_port, port_ptr - host_port);
+    char *port = strchr(host, ':');
+    if (port != NULL) {
+        *port = '\0';
+        pr->port = port + 1;
     } else {
-        pr->port = strdup("80");
-        pr->host = strdup(host_port);
+        pr->port = "80";
     }
+    pr->host = host;
+    return 0;
+}
 
-    free(uri_ptr);
-    free(host_port);
+/**
+ * @brief Adds a header found while parsing; a repeated key keeps its first
+ * position and takes the new value. (Private)
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int parse_add_header(struct ParsedRequest *pr, const char *key, size_t keylen, const char *value) {
+    unsigned long long bit = key_bit(key, keylen);
+    if (pr->header_keys & bit) {
+        for (size_t i = 0; i < pr->headers_used; i++) {
+            if (strcasecmp(pr->headers[i].key, key) == 0) {
+                if (strcasecmp(key, "Content-Length") == 0 && strcmp(pr->headers[i].value, value) != 0) {
+                    pr->length_conflict = 1;
+                }
+                pr->headers[i].value = value;
+                return 0;
+            }
+        }
+    }
+    pr->header_keys |= bit;
 
+    if (reserve_header(pr) < 0) return -1;
+    pr->headers[pr->headers_used].key = key;
+    pr->headers[pr->headers_used].value = value;
+    pr->headers_used++;
     return 0;
 }
 
+/**
+ * @brief Takes an origin-form request's host and port from its Host
+ * header, or leaves it without a host if there is none. (Private)
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int host_from_header(struct ParsedRequest *pr) {
+    struct ParsedHeader *h = ParsedHeader_get(pr, "Host");
+    size_t len = h ? strlen(h->value) : 0;
+    while (len > 0 && (h->value[len - 1] == ' ' || h->value[len - 1] == '\t')) len--;
+    if (len == 0) {
+        pr->host = NULL;
+        return 0;
+    }
+    char *host = parse_strndup(pr, h->value, len);
+    if (host == NULL) return -1;
+    char *port = strchr(host, ':');
+    if (port != NULL) {
+        *port = '\0';
+        pr->port = port + 1;
+    } else {
+        pr->port = "80";
+    }
+    pr->host = host;
+    return 0;
+}
 
 /**
  * @brief Main parsing function for an entire HTTP request buffer.
  */
 int ParsedRequest_parse(struct ParsedRequest *pr, const char *buf, size_t buflen) {
-    if (pr == NULL || buf == NULL || buflen < MIN_REQ_LEN) return -1;
+    if (pr == NULL || buf == NULL || buflen < MIN_REQ_LEN || buflen > MAX_REQUEST_HEAD_SIZE) return -1;
 
-    // Create a mutable copy of the buffer
-    pr->buf = (char *) malloc(buflen + 1);
+    // The one copy; everything else points into it
+    pr->buf = parse_strndup(pr, buf, buflen);
     if (pr->buf == NULL) return -1;
-    memcpy(pr->buf, buf, buflen);
-    pr->buf[buflen] = '\0';
     pr->buflen = buflen;
+    char *end = pr->buf + buflen;
 
-    char *request_line_end = strstr(pr->buf, "\r\n");
-    if (request_line_end == NULL) {
-        free(pr->buf);
-        pr->buf = NULL;
-        return -1;
-    }
-
-    *request_line_end = '\0'; // Null-terminate the request line
-    if (parse_request_line(pr, pr->buf) < 0) {
-        free(pr->buf);
-        pr->buf = NULL;
-        return -1;
-    }
-    *request_line_end = '\r'; // Restore for header parsing
+    char *request_line_end = find_line_end(pr->buf, end);
+    if (request_line_end == NULL) return -1;
+    *request_line_end = '\0';
+    if (parse_request_line(pr, pr->buf, request_line_end) < 0) return -1;
 
     // Parse headers
     char *current_header_line = request_line_end + 2;
-    while (current_header_line < pr->buf + pr->buflen && *current_header_line != '\r') {
-        char *header_end = strstr(current_header_line, "\r\n");
+    while (current_header_line < end && *current_header_line != '\r') {
+        char *header_end = find_line_end(current_header_line, end);
         if (header_end == NULL) break;
-        
-        char *colon = strstr(current_header_line, ":");
-        if (colon == NULL || colon > header_end) {
-            current_header_line = header_end + 2;
-            continue;
+        *header_end = '\0';
+
+        char *colon = find_delim(current_header_line, header_end, ':', ':');
+        if (colon < header_end) {
+            *colon = '\0';
+            char *value = colon + 1;
+            while (*value == ' ') value++; // Skip leading spaces in value
+            if (parse_add_header(pr, current_header_line, (size_t)(colon - current_header_line), value) < 0) {
+                return -1;
+            }
         }
-
-        char *key = strndup(current_header_line, colon - current_header_line);
-        char *value = colon + 1;
-        while (*value == ' ') value++; // Skip leading spaces in value
-        value = strndup(value, header_end - value);
-
-        ParsedHeader_set(pr, key, value);
-        free(key);
-        free(value);
-
         current_header_line = header_end + 2;
     }
 
+    if (pr->host[0] == '\0') return host_from_header(pr);
     return 0;
 }
 
@@ -257,36 +416,22 @@ size_t ParsedHeader_headersLen(struct ParsedRequest *pr) {
 int ParsedHeader_set(struct ParsedRequest *pr, const char *key, const char *value) {
     if (!pr || !key || !value) return -1;
 
+    char *value_copy = parse_strndup(pr, value, strlen(value));
+    if (value_copy == NULL) return -1;
+
     // First, try to find and update existing header
     for (size_t i = 0; i < pr->headers_used; i++) {
         if (strcasecmp(pr->headers[i].key, key) == 0) {
-            free(pr->headers[i].value);
-            pr->headers[i].value = strdup(value);
-            return pr->headers[i].value == NULL ? -1 : 0;
+            pr->headers[i].value = value_copy;
+            return 0;
         }
     }
 
     // If not found, add a new one
-    if (pr->headers_used >= pr->headers_len) {
-        pr->headers_len *= 2;
-        struct ParsedHeader *new_headers = (struct ParsedHeader *) realloc(pr->headers, pr->headers_len * sizeof(struct ParsedHeader));
-        if (new_headers == NULL) {
-            pr->headers_len /= 2; // Revert on failure
-            return -1;
-        }
-        pr->headers = new_headers;
-    }
-
-    pr->headers[pr->headers_used].key = strdup(key);
-    pr->headers[pr->headers_used].value = strdup(value);
-
-    if (pr->headers[pr->headers_used].key == NULL || pr->headers[pr->headers_used].value == NULL) {
-        // Cleanup on allocation failure
-        free(pr->headers[pr->headers_used].key);
-        free(pr->headers[pr->headers_used].value);
-        return -1;
-    }
-    
+    char *key_copy = parse_strndup(pr, key, strlen(key));
+    if (key_copy == NULL || reserve_header(pr) < 0) return -1;
+    pr->headers[pr->headers_used].key = key_copy;
+    pr->headers[pr->headers_used].value = value_copy;
     pr->headers_used++;
     return 0;
 }
@@ -304,6 +449,138 @@ struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, const char *key)
     return NULL;
 }
 
+/**
+ * @brief Checks whether a header's comma-separated value contains a token. (Private)
+ */
+static int header_has_token(struct ParsedRequest *pr, const char *key, const char *token) {
+    struct ParsedHeader *h = ParsedHeader_get(pr, key);
+    if (!h) return 0;
+
+    size_t token_len = strlen(token);
+    const char *p = h->value;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *start = p;
+        while (*p && *p != ',') p++;
+        const char *end = p;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        if ((size_t)(end - start) == token_len && strncasecmp(start, token, token_len) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Builds the cache key in the request's own storage, once.
+ */
+const char *ParsedRequest_url(struct ParsedRequest *pr) {
+    if (pr == NULL || pr->host == NULL) return NULL;
+    if (pr->url != NULL) return pr->url;
+
+    size_t protocol_len = strlen(pr->protocol), host_len = strlen(pr->host);
+    size_t port_len = strlen(pr->port), path_len = strlen(pr->path);
+    char *url = parse_alloc(pr, protocol_len + host_len + port_len + path_len + 5);
+    if (url == NULL) return NULL;
+
+    char *p = url;
+    memcpy(p, pr->protocol, protocol_len);
+    p += protocol_len;
+    memcpy(p, "://", 3);
+    p += 3;
+    memcpy(p, pr->host, host_len);
+    p += host_len;
+    *p++ = ':';
+    memcpy(p, pr->port, port_len);
+    p += port_len;
+    memcpy(p, pr->path, path_len + 1);
+    pr->url = url;
+    return url;
+}
+
+/**
+ * @brief Builds the key of a variant of the request's URL in its storage.
+ */
+const char *ParsedRequest_variantUrl(struct ParsedRequest *pr, const char *variant) {
+    const char *url = ParsedRequest_url(pr);
+    if (url == NULL) return NULL;
+
+    size_t url_len = strlen(url), variant_len = strlen(variant);
+    char *key = parse_alloc(pr, url_len + variant_len + 2);
+    if (key == NULL) return NULL;
+    memcpy(key, url, url_len);
+    key[url_len] = ' ';
+    memcpy(key + url_len + 1, variant, variant_len + 1);
+    return key;
+}
+
+/**
+ * @brief Whether the client connection may be kept open after this request.
+ */
+int ParsedRequest_keepAlive(struct ParsedRequest *pr) {
+    if (!pr || !pr->version || strcmp(pr->version, "HTTP/1.1") != 0) return 0;
+    if (header_has_token(pr, "Connection", "close")) return 0;
+    if (header_has_token(pr, "Proxy-Connection", "close")) return 0;
+    return 1;
+}
+
+/**
+ * @brief Finds the end of a head arriving in pieces and parses it.
+ */
+ssize_t ParsedRequest_feed(struct ParsedRequest *pr, const char *buf, size_t len) {
+    if (pr == NULL || buf == NULL) return -1;
+
+    // The blank line may straddle the previous call's end
+    size_t from = pr->head_scanned >= 3 ? pr->head_scanned - 3 : 0;
+    const char *blank = len > from ? memmem(buf + from, len - from, "\r\n\r\n", 4) : NULL;
+    if (blank == NULL) {
+        pr->head_scanned = len;
+        return len > MAX_REQUEST_HEAD_SIZE ? -1 : 0;
+    }
+
+    size_t head_len = blank + 4 - buf;
+    if (ParsedRequest_parse(pr, buf, head_len) < 0) return -1;
+    return head_len;
+}
+
+/**
+ * @brief Works out the body framing from Transfer-Encoding and Content-Length.
+ */
+request_body_t ParsedRequest_bodyFraming(struct ParsedRequest *pr, size_t *length) {
+    *length = 0;
+    struct ParsedHeader *h = ParsedHeader_get(pr, "Transfer-Encoding");
+    if (h) {
+        // Only a final chunked coding says where the body ends
+        const char *end = h->value + strlen(h->value);
+        while (end > h->value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        const char *start = end;
+        while (start > h->value && start[-1] != ',' && start[-1] != ' ' && start[-1] != '\t') start--;
+        if (end - start != 7 || strncasecmp(start, "chunked", 7) != 0) return REQUEST_BODY_INVALID;
+        // The origin might go by the length instead, and read the body differently
+        return ParsedHeader_get(pr, "Content-Length") ? REQUEST_BODY_INVALID : REQUEST_BODY_CHUNKED;
+    }
+
+    h = ParsedHeader_get(pr, "Content-Length");
+    if (!h) return REQUEST_BODY_NONE;
+    if (pr->length_conflict) return REQUEST_BODY_INVALID;
+    const char *p = h->value;
+    size_t n = 0;
+    if (*p < '0' || *p > '9') return REQUEST_BODY_INVALID;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (n > (SIZE_MAX - 9) / 10) return REQUEST_BODY_INVALID;
+        n = n * 10 + (*p - '0');
+    }
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p != '\0') return REQUEST_BODY_INVALID;
+    *length = n;
+    return n > 0 ? REQUEST_BODY_LENGTH : REQUEST_BODY_NONE;
+}
+
+/**
+ * @brief Whether the request carries Expect: 100-continue.
+ */
+int ParsedRequest_expectsContinue(struct ParsedRequest *pr) {
+    return header_has_token(pr, "Expect", "100-continue");
+}
+
 /**
  * @brief Removes a header by its key.
  */
@@ -311,8 +588,6 @@ int ParsedHeader_remove(struct ParsedRequest *pr, const char *key) {
     if (!pr || !key) return -1;
     for (size_t i = 0; i < pr->headers_used; i++) {
         if (strcasecmp(pr->headers[i].key, key) == 0) {
-            free(pr->headers[i].key);
-            free(pr->headers[i].value);
             // Shift remaining headers left
             if (i < pr->headers_used - 1) {
                 memmove(&pr->headers[i], &pr->headers[i + 1], (pr->headers_used - 1 - i) * sizeof(struct ParsedHeader));
@@ -355,6 +630,9 @@ static int ParsedRequest_printRequestLine(struct ParsedRequest *pr, char *buf, s
     
     memcpy(current, pr->version, strlen(pr->version));
     current += strlen(pr->version);
+
+    memcpy(current, "\r\n", 2);
+    current += 2;
     
     *tmp = (size_t)(current - buf);
     return 0;
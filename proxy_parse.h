@@ -7,6 +7,16 @@
  * It is designed to extract key information from a request line and manage
  * HTTP headers. The implementation is in proxy_parse.c.
  *
+ * Parsing allocates nothing in the common case: the request head is copied
+ * once into storage inside the ParsedRequest and split up in place, so
+ * every field and header points into that copy. Strings are owned by the
+ * ParsedRequest and stay valid until it is destroyed; fields may also be
+ * pointed at strings the caller keeps alive (e.g. literals).
+ *
+ * A head that arrives in pieces is fed with ParsedRequest_feed() after
+ * every read; it is parsed as soon as its blank line is in, and
+ * ParsedRequest_bodyFraming() then tells the caller how to find the end of
+ * the body that follows it.
  */
 
 #ifndef PROXY_PARSE_H
@@ -18,19 +28,30 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <ctype.h>
+#include <sys/types.h>
+
+#define PARSE_INLINE_HEADERS 32    // Headers held without allocating
+#define PARSE_INLINE_STORAGE 4096  // Bytes of request head and strings held without allocating
+#define MAX_REQUEST_HEAD_SIZE 65535 // Longest request line + headers accepted
 
-// Set to 1 to enable debug prints to stderr, 0 to disable.
-#define DEBUG 1
+// How the end of a request body is found
+typedef enum {
+    REQUEST_BODY_NONE,      // No body follows the head
+    REQUEST_BODY_LENGTH,    // Content-Length bytes
+    REQUEST_BODY_CHUNKED,   // Transfer-Encoding ending in chunked
+    REQUEST_BODY_INVALID    // Framing that cannot be followed (answer 400)
+} request_body_t;
 
 /**
  * @struct ParsedHeader
  * @brief Represents a single HTTP header (key-value pair).
  *
- * Headers are stored as a dynamically-sized array within ParsedRequest.
+ * Headers are stored as an array within ParsedRequest, inline until it
+ * outgrows PARSE_INLINE_HEADERS.
  */
 struct ParsedHeader {
-    char *key;
-    char *value;
+    const char *key;
+    const char *value;
 };
 
 /**
@@ -41,17 +62,26 @@ struct ParsedHeader {
  * and a list of headers.
  */
 struct ParsedRequest {
-    char *method;
-    char *protocol;
-    char *host;
-    char *port;
-    char *path;
-    char *version;
-    char *buf; // Original request buffer
+    const char *method;
+    const char *protocol;
+    const char *host;
+    const char *port;
+    const char *path;
+    const char *version;
+    char *buf; // Copy of the request head, split up in place
     size_t buflen;
     struct ParsedHeader *headers;
     size_t headers_used;
     size_t headers_len;
+    // Internal
+    unsigned long long header_keys; // Hashes of the keys parsed so far
+    size_t head_scanned;            // Bytes ParsedRequest_feed() has searched for the blank line
+    int length_conflict;            // Content-Length was repeated with a different value
+    const char *url;                // Built by ParsedRequest_url()
+    void *spill;                    // Heap blocks for what did not fit in storage
+    size_t storage_used;
+    struct ParsedHeader inline_headers[PARSE_INLINE_HEADERS];
+    char storage[PARSE_INLINE_STORAGE];
 };
 
 /**
@@ -67,15 +97,64 @@ struct ParsedRequest* ParsedRequest_create();
  */
 void ParsedRequest_destroy(struct ParsedRequest *pr);
 
+/**
+ * @brief Empties a ParsedRequest so it can parse the next request.
+ *
+ * Cheaper than destroying it and creating a new one: only what spilled to
+ * the heap is freed, and the object itself is kept.
+ * @param pr The ParsedRequest object to reset.
+ */
+void ParsedRequest_reset(struct ParsedRequest *pr);
+
 /**
  * @brief Parses a raw HTTP request string into a ParsedRequest structure.
- * @param pr The ParsedRequest object to populate.
- * @param buf The raw request string.
+ *
+ * Works in a single pass over a copy of the request head. When a header
+ * repeats, the last value is kept in the first one's place. An
+ * origin-form request (a path, no scheme and authority) takes its host and
+ * port from the Host header; without one the host is NULL.
+ * @param pr The ParsedRequest object to populate (freshly created).
+ * @param buf The raw request string; not referenced after the call.
  * @param buflen The length of the request string.
  * @return 0 on success, -1 on failure.
  */
 int ParsedRequest_parse(struct ParsedRequest *pr, const char *buf, size_t buflen);
 
+/**
+ * @brief Feeds a request head that arrives in pieces, parsing it once complete.
+ *
+ * Call again with the whole buffer each time more bytes have been read
+ * into it. The search for the blank line resumes where the previous call
+ * stopped, so every byte is scanned once however the head is split.
+ * @param pr The ParsedRequest object to populate (freshly created).
+ * @param buf Everything read so far, starting with the request line.
+ * @param len The number of bytes in buf.
+ * @return The length of the head once it is complete and parsed (bytes
+ * after it are the body or the next request), 0 if more bytes are needed,
+ * or -1 if the head is malformed or longer than MAX_REQUEST_HEAD_SIZE.
+ */
+ssize_t ParsedRequest_feed(struct ParsedRequest *pr, const char *buf, size_t len);
+
+/**
+ * @brief Determines how the body following a parsed head is delimited.
+ *
+ * A transfer coding that does not end in chunked, a Content-Length that is
+ * not a number or was repeated with another value, and a request with
+ * both Transfer-Encoding and Content-Length cannot be delimited safely
+ * (an origin might pick the other one).
+ * @param pr The ParsedRequest object.
+ * @param length Set to the Content-Length for REQUEST_BODY_LENGTH, else 0.
+ * @return The body's framing; a zero Content-Length counts as no body.
+ */
+request_body_t ParsedRequest_bodyFraming(struct ParsedRequest *pr, size_t *length);
+
+/**
+ * @brief Whether the client waits for a 100 Continue before sending the body.
+ * @param pr The ParsedRequest object.
+ * @return Non-zero if the request carries Expect: 100-continue.
+ */
+int ParsedRequest_expectsContinue(struct ParsedRequest *pr);
+
 /**
  * @brief Calculates the length of the unparsed request line.
  * @param pr The ParsedRequest object.
@@ -110,6 +189,8 @@ size_t ParsedHeader_headersLen(struct ParsedRequest *pr);
 
 /**
  * @brief Sets a header value, overwriting if the key already exists.
+ *
+ * The key and value are copied into the ParsedRequest.
  * @param pr The ParsedRequest object.
  * @param key The header key (e.g., "Host").
  * @param value The header value.
@@ -126,6 +207,41 @@ int ParsedHeader_set(struct ParsedRequest *pr, const char *key, const char *valu
  */
 struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, const char *key);
 
+/**
+ * @brief The request's absolute URL, protocol://host:port/path, used as its cache key.
+ *
+ * Built on the first call in the request's own storage, so it costs no
+ * allocation in the common case; later calls return the same string.
+ * @param pr A parsed request.
+ * @return The URL, valid until the request is reset or destroyed; NULL if
+ * the request has no host or storage ran out.
+ */
+const char *ParsedRequest_url(struct ParsedRequest *pr);
+
+/**
+ * @brief The cache key of a variant of the request's URL: the URL, a space
+ * and the variant's name.
+ *
+ * A URL never contains a space, so variant keys cannot collide with plain
+ * URLs. Built in the request's own storage on every call.
+ * @param pr A parsed request.
+ * @param variant The variant's name, e.g. a content coding.
+ * @return The key, valid until the request is reset or destroyed; NULL if
+ * the request has no host or storage ran out.
+ */
+const char *ParsedRequest_variantUrl(struct ParsedRequest *pr, const char *variant);
+
+/**
+ * @brief Whether the client connection can carry another request after this one.
+ *
+ * True for HTTP/1.1 requests that do not ask to close (via Connection or
+ * Proxy-Connection). A body has to be read to its end before the next
+ * request head; that is up to the caller.
+ * @param pr The ParsedRequest object.
+ * @return Non-zero if the connection may be kept open.
+ */
+int ParsedRequest_keepAlive(struct ParsedRequest *pr);
+
 /**
  * @brief Removes a header by its key.
  * @param pr The ParsedRequest object.
@@ -10,55 +10,268 @@
  * Caching can be enabled by compiling with the -DENABLE_CACHE flag. When
  * enabled, it uses an LRU cache to store and serve responses for repeated
  * requests, reducing latency and network traffic.
+ *
+ * Two engines are available and selected at startup: the default pool of
+ * blocking worker threads fed by a lock-free handoff queue (see
+ * thread_pool.h), and an epoll-based event-driven engine (see event_loop.h)
+ * for very high connection counts.
+ *
+ * Options come from the command line and, with -F, a configuration file
+ * (see config_file.h) that SIGHUP reloads to resize the cache in place
+ * and change the origin limits and timeouts.
+ * SIGINT shuts down gracefully: no new connections are taken, those in
+ * progress are drained, and the cache is saved and torn down once nothing
+ * uses it any more. A second SIGINT exits at once.
  */
 
+#define _GNU_SOURCE
 #include "proxy_parse.h"
+#include "event_loop.h"
+#include "socket_util.h"
+#include "thread_pool.h"
+#include "upstream_pool.h"
+#include "upstream_guard.h"
+#include "http_response.h"
+#include "dns_cache.h"
+#include "metrics.h"
+#include "logger.h"
+#include "relay_queue.h"
+#include "config_file.h"
+#include "cache.h"          // Option types; the cache itself is linked with ENABLE_CACHE
+#ifdef ENABLE_CACHE
+#include "http_cache.h"
+#include "coalesce.h"
+#include "disk_cache.h"
+#include "http_compress.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <errno.h>
 
-#ifdef ENABLE_CACHE
-#include "cache.h"
-#endif
-
 // --- Constants ---
-#define MAX_REQUEST_SIZE 8192      // Max size of an HTTP request
-#define MAX_CLIENTS 100            // Max concurrent clients
+#define REQUEST_BUFFER_SIZE 8192   // Initial client read buffer; grows for longer request heads
+#define DEFAULT_RELAY_BUFFER_KB 64 // Bytes relayed per read from the origin, in KB
+#define DEFAULT_CLIENT_QUEUE_KB 1024 // Response bytes read ahead of one slow client, in KB
+#define DEFAULT_TOTAL_QUEUE_MB 256 // The same for all clients together, in MB
+#define WORKER_STACK_SIZE (256 * 1024) // Workers keep their buffers on the heap, so small stacks do
+#define DEFAULT_BACKLOG 1024       // Default listen() backlog
 #define DEFAULT_PORT 8080          // Default port to listen on
+#define DEFAULT_WORKERS 64         // Worker threads for the thread engine
+#define DEFAULT_QUEUE_DEPTH 1024   // Accepted connections waiting for a worker
+#define DEFAULT_MAX_IDLE_UPSTREAM 32 // Idle keep-alive connections kept per origin
+#define DEFAULT_UPSTREAM_IDLE_TIMEOUT 30 // Seconds before an idle origin connection is closed
+#define DEFAULT_CLIENT_IDLE_TIMEOUT 15 // Seconds a keep-alive client may sit idle
+#define SHUTDOWN_CHECK_MS 1000     // How often a worker waiting for a client's next request checks for a shutdown
+#define DEFAULT_RESOLVERS 4        // Resolver threads behind the DNS cache
+#define DEFAULT_DNS_MAX_TTL 300    // Cap on how long a DNS answer is used
+#define DEFAULT_DNS_NEGATIVE_TTL 5 // Seconds a failed lookup is remembered
+#define DEFAULT_DNS_STALE_TTL 30   // Seconds an expired answer is served while refreshing
+#define DEFAULT_LOG_RATE 10000     // Access records a thread may queue per second
+#define DEFAULT_CONNECT_TIMEOUT 5000     // Milliseconds to connect to one origin address
+#define DEFAULT_FIRST_BYTE_TIMEOUT 30000 // Milliseconds from request sent to first response byte
+#define DEFAULT_ORIGIN_IDLE_TIMEOUT 30000 // Longest pause, in milliseconds, while talking to an origin
+#define DEFAULT_CIRCUIT_FAILURES 5       // Consecutive failures that open an origin's circuit
+#define DEFAULT_CIRCUIT_OPEN_TIME 5000   // Milliseconds an open circuit refuses requests
 
 // --- Cache Configuration ---
-#define MAX_CACHE_SIZE (200 * 1024 * 1024)    // 200 MB total cache size
-#define MAX_ELEMENT_SIZE (10 * 1024 * 1024)   // 10 MB max size for a single cached item
+#define DEFAULT_CACHE_SIZE_MB 200             // Total cache size, in MB
+#define DEFAULT_MAX_OBJECT_KB 10240           // Largest single cached item, in KB
+#define DEFAULT_CACHE_SHARDS 16               // Independently locked cache shards
+#define DEFAULT_COALESCE_TIMEOUT 5            // Seconds a miss waits for an identical fetch in flight
+#define DEFAULT_DISK_CACHE_SIZE 10240         // Megabytes of disk tier, when a directory is given
 
 // --- Structs ---
 
-// Arguments for the connection handler thread
+// Connection handling engine, selected at startup
+typedef enum {
+    ENGINE_THREAD,  // Pool of worker threads (blocking I/O)
+    ENGINE_EPOLL,   // Event loops multiplexing non-blocking sockets
+    ENGINE_URING    // The same event loops, with io_uring as their event source
+} engine_t;
+
+// Bytes read from a client but not used yet, at the front of the buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;     // Grows up to MAX_REQUEST_HEAD_SIZE + 1 for long heads
+} ClientBuffer;
+
+// I/O buffers of a worker thread, reused for every connection it serves
+typedef struct {
+    char *relay;                // relay_buffer_size bytes for reads from the origin
+    ClientBuffer in;            // Client reads; shrinks back after a long head
+    struct ParsedRequest *req;  // Reset for every request rather than reallocated
+    AccessInfo access;          // The request being served, for the access log
+    uint64_t deadline;          // metrics_now() by which its origin exchange must end, or 0
+} WorkerBuffers;
+
+// Timeouts currently set on an origin socket, so they are only changed when they must be
+typedef struct {
+    int fd;
+    int recv_ms;    // SO_RCVTIMEO in milliseconds (0: none), or -1 until set
+    int send_ms;    // SO_SNDTIMEO likewise
+} OriginTimer;
+
+// A request body on its way from the client to the origin
 typedef struct {
-    int client_socket_fd;
-} thread_args_t;
+    HttpResponse framing;   // Finds the end of the body in what the client sends
+    int client_fd;
+    ClientBuffer *in;       // The body's next bytes are at its front
+    size_t buffered;        // How many of those belong to the body
+    int replayable;         // The whole body came with the head, so it can be sent again
+    int expect_continue;    // The client waits for 100 Continue before sending the rest
+    int failed;             // The client stopped sending, or sent a malformed body
+} RequestBody;
+
+// Everything the options set, from the configuration file and the command line
+typedef struct {
+    engine_t engine;
+    int port;
+    int backlog;
+    int num_workers;
+    int queue_depth;
+    int max_idle_upstream;
+    int upstream_idle_timeout;
+    int client_idle_timeout;
+    upstream_timeouts_t origin_timeouts;
+    upstream_guard_config_t guard_config;
+    int num_resolvers;
+    int dns_max_ttl;
+    long cache_mb;
+    long max_object_kb;
+    int cache_shards;
+    cache_policy_t cache_policy;
+    cache_objective_t cache_objective;
+    int cache_tinylfu;
+    int coalesce_timeout;
+    const char *disk_cache_dir;
+    long disk_cache_mb;
+    const char *cache_snapshot_path;
+    const char *compress_codings;
+    size_t relay_buffer_size;
+    relay_queue_config_t queue_config;
+    int metrics_port;
+    log_config_t log_config;
+    event_loop_config_t loop_config;
+} ProxyOptions;
+
+// An option given on the command line; the port counts as option 'p'
+typedef struct {
+    int opt;
+    const char *arg;
+} CliOption;
+
+// A configuration file key and the option it sets
+typedef struct {
+    const char *key;
+    int opt;
+} SettingKey;
+
+static const SettingKey setting_keys[] = {
+    { "port", 'p' }, { "engine", 'e' }, { "workers", 'w' }, { "queue_depth", 'q' },
+    { "event_loops", 'l' }, { "reuse_port", 'r' }, { "pin_cpus", 'c' }, { "backlog", 'b' },
+    { "client_idle_timeout", 't' }, { "upstream_idle", 'i' }, { "upstream_idle_timeout", 'I' },
+    { "connect_timeout_ms", 'k' }, { "first_byte_timeout_ms", 'f' }, { "origin_idle_timeout_ms", 'u' },
+    { "request_deadline_ms", 'g' }, { "origin_max_requests", 'm' }, { "circuit_failures", 'E' },
+    { "circuit_open_ms", 'o' }, { "resolvers", 'R' }, { "dns_max_ttl", 'T' },
+    { "cache_size_mb", 'Z' }, { "max_object_kb", 'Y' }, { "cache_shards", 'S' },
+    { "cache_policy", 'P' }, { "cache_objective", 'O' }, { "cache_admission", 'A' },
+    { "coalesce_timeout", 'C' }, { "disk_cache_dir", 'd' }, { "disk_cache_mb", 'D' },
+    { "snapshot_file", 's' }, { "compress", 'z' }, { "relay_buffer_kb", 'B' },
+    { "client_queue_kb", 'W' }, { "total_queue_mb", 'U' }, { "metrics_port", 'M' },
+    { "access_log", 'a' }, { "log_level", 'L' }, { "log_sample", 'n' }, { "log_rate", 'x' },
+};
+
+// Options SIGHUP applies to the running proxy; the rest wait for a restart
+#ifdef ENABLE_CACHE
+#define RELOADABLE_OPTIONS "kfugmEoLZY"
+#else
+#define RELOADABLE_OPTIONS "kfugmEoL"
+#endif
+
+// --- Global State ---
+static const char *config_path = NULL;                        // Configuration file, read again on SIGHUP
+static ProxyOptions running_options;                          // The startup options, with what reloads applied
+static char *config_text;                                     // The startup file's text, which their strings point into
+static CliOption *cli_options;                                // The command line, applied over the file
+static int num_cli_options;
+static int client_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT; // 0 disables client keep-alive
+static int coalesce_timeout = DEFAULT_COALESCE_TIMEOUT;       // 0 disables request coalescing
+static const char *cache_snapshot_path = NULL;                // Cache saved at shutdown, restored at startup
+static size_t relay_buffer_size = DEFAULT_RELAY_BUFFER_KB * 1024; // Bytes read from the origin at once
+static __thread WorkerBuffers worker_buffers;                 // The calling worker's buffers
+static __thread int relay_pipe[2] = {-1, -1};                 // The worker's splice() pipe, reused for every response
+static __thread size_t relay_piped;                           // Bytes in it the client has not taken yet
+static atomic_int shutting_down;                              // SIGINT came; the engine is draining
+static atomic_int listen_socket_fd = -1;                      // The thread engine's listener, to stop accepting
+static pthread_key_t worker_exit_key;                         // Frees a worker's buffers when it exits
 
 // --- Function Prototypes ---
-void *handle_connection(void *args);
-void forward_request_and_get_response(int client_socket_fd, struct ParsedRequest *req, const char *url_string);
+void handle_connection(int client_socket_fd);
+int forward_request_and_get_response(int client_socket_fd, struct ParsedRequest *req, const char *url_string,
+                                     int store, CacheEntry *stale, RequestBody *body);
 int send_error_to_client(int client_socket_fd, int status_code, const char *status_message);
 void signal_handler(int signum);
+static void print_usage(const char *prog);
+static int load_options(ProxyOptions *opts, char **text);
+static void *reload_signal_thread(void *arg);
+static void *shutdown_signal_thread(void *arg);
+static void shut_down_services(int server_socket_fd);
+static void free_worker_buffers(void *arg);
+#ifdef ENABLE_CACHE
+static void *stats_signal_thread(void *arg);
+#endif
 
 // --- Main Function ---
 int main(int argc, char *argv[]) {
-    int port = (argc > 1) ? atoi(argv[1]) : DEFAULT_PORT;
-    if (port <= 0 || port > 65535) {
-        fprintf(stderr, "Invalid port number. Using default %d.\n", DEFAULT_PORT);
-        port = DEFAULT_PORT;
+    // --- Options ---
+    // The command line is kept, since it overrides the configuration file on every reload
+    cli_options = calloc(argc, sizeof(CliOption));
+    if (!cli_options) {
+        perror("calloc for options");
+        exit(EXIT_FAILURE);
+    }
+    int opt;
+    while ((opt = getopt(argc, argv, "e:l:b:rcw:q:i:I:t:k:f:u:g:m:E:o:R:T:S:Z:Y:P:O:A:C:d:D:s:z:B:W:U:M:a:L:n:x:F:h")) != -1) {
+        if (opt == 'h') {
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        if (opt == '?') {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        if (opt == 'F') config_path = optarg;
+        else cli_options[num_cli_options++] = (CliOption){ opt, optarg };
+    }
+    if (optind < argc) cli_options[num_cli_options++] = (CliOption){ 'p', argv[optind] };
+
+    // Strings from the file point into its text, which stays for good
+    ProxyOptions opts;
+    if (load_options(&opts, &config_text) != 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
     }
+    running_options = opts;
+    client_idle_timeout = opts.client_idle_timeout;
+    coalesce_timeout = opts.coalesce_timeout;
+    cache_snapshot_path = opts.cache_snapshot_path;
+    relay_buffer_size = opts.relay_buffer_size;
+    upstream_guard_set_timeouts(&opts.origin_timeouts);
 
     // --- Signal Handling Setup ---
     signal(SIGPIPE, SIG_IGN); // Ignore broken pipe signals
@@ -66,283 +279,1285 @@ int main(int argc, char *argv[]) {
     sa.sa_handler = signal_handler;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
-    sigaction(SIGINT, &sa, NULL); // Handle Ctrl+C
+    sigaction(SIGUSR2, &sa, NULL); // Toggle debug logging
+
+    // SIGINT shuts down, SIGHUP reloads the configuration, and SIGUSR1 dumps
+    // cache memory stats. They are blocked here, before any other thread
+    // exists, so only the threads waiting for them ever receive them.
+    sigset_t waited_signals;
+    sigemptyset(&waited_signals);
+    sigaddset(&waited_signals, SIGINT);
+    sigaddset(&waited_signals, SIGHUP);
+    #ifdef ENABLE_CACHE
+    sigaddset(&waited_signals, SIGUSR1);
+    #endif
+    pthread_sigmask(SIG_BLOCK, &waited_signals, NULL);
+
+    // --- Logging ---
+    // Status lines share stdout with the access log, so they go out whole and in order
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (log_init(&opts.log_config) != 0) {
+        fprintf(stderr, "Failed to start logging. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
 
     // --- Cache Initialization ---
     #ifdef ENABLE_CACHE
-    if (cache_init(MAX_CACHE_SIZE, MAX_ELEMENT_SIZE) != 0) {
+    http_compress_config_t compress_config;
+    if (http_compress_parse_codings(opts.compress_codings, &compress_config) != 0) {
+        fprintf(stderr, "Unknown or unsupported codings '%s'.\n", opts.compress_codings);
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (http_compress_init(&compress_config) != 0) {
+        fprintf(stderr, "Failed to start compression. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    // Objects evicted from memory move down to the disk tier, if there is one
+    static const cache_tier_t disk_tier = { disk_cache_store, disk_cache_remove };
+    if (opts.disk_cache_dir && disk_cache_init(opts.disk_cache_dir, (size_t)opts.disk_cache_mb << 20) != 0) {
+        fprintf(stderr, "Failed to initialize disk cache. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    cache_config_t cache_config = { (size_t)opts.cache_mb << 20, (size_t)opts.max_object_kb * 1024,
+                                    opts.cache_shards,
+                                    opts.cache_policy, opts.cache_tinylfu ? CACHE_ADMIT_TINYLFU : CACHE_ADMIT_ALL,
+                                    opts.cache_objective, opts.disk_cache_dir ? &disk_tier : NULL };
+    if (cache_init(&cache_config) != 0) {
         fprintf(stderr, "Failed to initialize cache. Exiting.\n");
         exit(EXIT_FAILURE);
     }
+    if (coalesce_init() != 0) {
+        fprintf(stderr, "Failed to initialize request coalescing. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    // Loads in the background; requests are served from the start
+    if (cache_snapshot_path) cache_snapshot_load(cache_snapshot_path);
     printf("Cache enabled.\n");
+    pthread_t stats_thread;
+    if (pthread_create(&stats_thread, NULL, stats_signal_thread, NULL) == 0) {
+        pthread_detach(stats_thread);
+    } else {
+        perror("pthread_create for stats thread");
+    }
     #else
+    (void)opts.cache_shards; (void)opts.cache_policy; (void)opts.cache_objective; (void)opts.cache_tinylfu;
+    (void)opts.disk_cache_dir; (void)opts.disk_cache_mb; (void)cache_snapshot_path;
+    (void)opts.compress_codings;
     printf("Cache disabled.\n");
     #endif
+    pthread_t shutdown_thread;
+    if (pthread_create(&shutdown_thread, NULL, shutdown_signal_thread, NULL) == 0) {
+        pthread_detach(shutdown_thread);
+    } else {
+        perror("pthread_create for shutdown thread");
+    }
 
-    // --- Socket Setup ---
-    int server_socket_fd;
-    struct sockaddr_in server_addr;
-    
-    server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket_fd < 0) {
-        perror("socket");
+    // --- Upstream Connection Pool ---
+    if (upstream_pool_init(opts.max_idle_upstream, opts.upstream_idle_timeout) != 0) {
+        fprintf(stderr, "Failed to initialize upstream pool. Exiting.\n");
         exit(EXIT_FAILURE);
     }
-    
-    // Allow address reuse
-    int optval = 1;
-    setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (upstream_guard_init(&opts.guard_config) != 0) {
+        fprintf(stderr, "Failed to initialize origin limits. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    relay_queue_configure(&opts.queue_config);
+    // A reload changes the limits, so it may only come once they are set
+    pthread_t reload_thread;
+    if (pthread_create(&reload_thread, NULL, reload_signal_thread, NULL) == 0) {
+        pthread_detach(reload_thread);
+    } else {
+        perror("pthread_create for reload thread");
+    }
+
+    // --- Resolver Cache ---
+    if (dns_cache_init(opts.num_resolvers, opts.dns_max_ttl, DEFAULT_DNS_NEGATIVE_TTL, DEFAULT_DNS_STALE_TTL) != 0) {
+        fprintf(stderr, "Failed to initialize resolver cache. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // --- Metrics Endpoint ---
+    if (opts.metrics_port > 0) {
+        if (metrics_serve(opts.metrics_port) != 0) {
+            fprintf(stderr, "Failed to start metrics endpoint. Exiting.\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("Metrics served on port %d at /metrics.\n", opts.metrics_port);
+    }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
+    // --- Socket Setup ---
+    // In multi-reactor mode every event loop binds its own listener instead
+    int server_socket_fd = -1;
+    if (opts.engine == ENGINE_THREAD || !opts.loop_config.reuse_port) {
+        server_socket_fd = socket_listen_tcp(opts.port, opts.backlog, 0);
+        if (server_socket_fd < 0) exit(EXIT_FAILURE);
+    }
 
-    if (bind(server_socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
+    printf("Proxy server listening on port %d...\n", opts.port);
+
+    // --- Event-Driven Engine ---
+    if (opts.engine != ENGINE_THREAD) {
+        opts.loop_config.use_uring = opts.engine == ENGINE_URING;
+        opts.loop_config.port = opts.port;
+        opts.loop_config.backlog = opts.backlog;
+        opts.loop_config.client_idle_timeout = client_idle_timeout;
+        opts.loop_config.coalesce_timeout = coalesce_timeout;
+        opts.loop_config.relay_buffer_size = relay_buffer_size;
+        if (event_loop_run(server_socket_fd, &opts.loop_config) != 0) {
+            fprintf(stderr, "Failed to start event-driven engine. Exiting.\n");
+            if (server_socket_fd >= 0) close(server_socket_fd);
+            exit(EXIT_FAILURE);
+        }
+        shut_down_services(server_socket_fd);
+        return 0;
+    }
+
+    // --- Worker Pool ---
+    if (pthread_key_create(&worker_exit_key, free_worker_buffers) != 0) {
+        fprintf(stderr, "Failed to start worker pool. Exiting.\n");
         close(server_socket_fd);
         exit(EXIT_FAILURE);
     }
-
-    if (listen(server_socket_fd, MAX_CLIENTS) < 0) {
-        perror("listen");
+    ThreadPool *pool = thread_pool_create(opts.num_workers, opts.queue_depth, WORKER_STACK_SIZE, handle_connection);
+    if (!pool) {
+        fprintf(stderr, "Failed to start worker pool. Exiting.\n");
         close(server_socket_fd);
         exit(EXIT_FAILURE);
     }
-
-    printf("Proxy server listening on port %d...\n", port);
+    printf("Worker pool running %d thread(s), queue depth %d.\n", opts.num_workers, opts.queue_depth);
+    atomic_store(&listen_socket_fd, server_socket_fd);
 
     // --- Main Accept Loop ---
-    while (1) {
+    // Runs until a shutdown, which wakes accept() by shutting the listener down
+    while (!atomic_load(&shutting_down)) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         int client_socket_fd = accept(server_socket_fd, (struct sockaddr *)&client_addr, &client_len);
 
         if (client_socket_fd < 0) {
+            if (atomic_load(&shutting_down)) break;
             if (errno == EINTR) continue; // Interrupted by a signal, continue loop
-            perror("accept");
-            continue;
-        }
-        
-        // Prepare arguments for the new thread
-        thread_args_t *args = malloc(sizeof(thread_args_t));
-        if (!args) {
-            perror("malloc for thread args");
-            close(client_socket_fd);
+            log_errno("accept");
             continue;
         }
-        args->client_socket_fd = client_socket_fd;
-        
-        // Create a new thread to handle the connection
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_connection, (void *)args) != 0) {
-            perror("pthread_create");
-            free(args);
+
+        // Hand the connection to a worker; shed load when all are busy
+        if (thread_pool_submit(pool, client_socket_fd) != 0) {
+            send_error_to_client(client_socket_fd, 503, "Service Unavailable");
             close(client_socket_fd);
         }
-        
-        // Detach the thread so its resources are automatically released
-        pthread_detach(thread_id);
     }
 
-    // Cleanup (should not be reached in normal operation)
-    close(server_socket_fd);
+    // Workers finish what is queued and in progress before they are joined
+    thread_pool_destroy(pool);
+    shut_down_services(server_socket_fd);
+    return 0;
+}
+
+/**
+ * @brief Tears everything down once the engine has drained: the listener,
+ * the origin side, and then the cache, which is saved first.
+ *
+ * Runs in the main thread after the last connection is done, so nothing
+ * is using the cache while it is snapshotted and destroyed.
+ */
+static void shut_down_services(int server_socket_fd) {
+    if (server_socket_fd >= 0) close(server_socket_fd);
+    upstream_pool_destroy();
+    upstream_guard_destroy();
+    dns_cache_destroy();
     #ifdef ENABLE_CACHE
+    http_compress_destroy();
+    if (cache_snapshot_path) cache_snapshot_save(cache_snapshot_path);
+    coalesce_destroy();
+    disk_cache_destroy();
     cache_destroy();
+    printf("Cache cleaned up.\n");
     #endif
+    log_shutdown();
+}
 
-    return 0;
+/**
+ * @brief Frees the buffers and relay pipe of a worker that is exiting.
+ */
+static void free_worker_buffers(void *arg) {
+    WorkerBuffers *worker = (WorkerBuffers *)arg;
+    free(worker->in.data);
+    free(worker->relay);
+    if (worker->req) ParsedRequest_destroy(worker->req);
+    memset(worker, 0, sizeof(*worker));
+    relay_queue_thread_exit();
+    if (relay_pipe[0] >= 0) {
+        close(relay_pipe[0]);
+        close(relay_pipe[1]);
+        relay_pipe[0] = relay_pipe[1] = -1;
+    }
 }
 
 
 /**
- * @brief Handles a single client connection from start to finish.
- * This function is the entry point for each new thread.
- */
-void *handle_connection(void *args) {
-    thread_args_t *thread_args = (thread_args_t *)args;
-    int client_socket_fd = thread_args->client_socket_fd;
-    free(thread_args);
-
-    char request_buffer[MAX_REQUEST_SIZE];
-    
-    // Read the client's request
-    ssize_t bytes_read = recv(client_socket_fd, request_buffer, sizeof(request_buffer) - 1, 0);
-    if (bytes_read <= 0) {
-        if (bytes_read < 0) perror("recv");
-        close(client_socket_fd);
-        return NULL;
+ * @brief Counts bytes sent to the client, for the metrics and the access log.
+ */
+static void count_sent(size_t n) {
+    metrics_add(METRIC_BYTES_OUT, n);
+    worker_buffers.access.bytes += n;
+}
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Sends a cached response straight from cache memory, segment by
+ * segment; the caller's reference keeps it alive meanwhile.
+ *
+ * An entry that is still being filled is sent as it arrives, blocking for
+ * more whenever the sender catches up with the fill.
+ * @return Non-zero if the whole response was sent and the client
+ * connection can carry another request.
+ */
+static int send_cached_response(int client_socket_fd, CacheEntry *entry) {
+    HttpResponse resp; // Finds out whether the stored response is self-delimiting
+    http_response_init(&resp, 0);
+    size_t offset = 0;
+    int complete = 0;
+
+    for (;;) {
+        // The state is read first: once it is final, so is the size
+        cache_fill_state_t state = cache_entry_state(entry);
+        const char *data;
+        size_t len = cache_entry_read(entry, offset, &data);
+        if (len == 0) {
+            if (state != CACHE_FILLING) {
+                complete = state == CACHE_COMPLETE;
+                break;
+            }
+            cache_entry_await(entry, offset);
+            continue;
+        }
+
+        if (resp.state != RESPONSE_ERROR && http_response_feed(&resp, data, len) != (ssize_t)len) {
+            resp.keep_alive = 0; // Trailing bytes past the response
+        }
+        size_t sent_total = 0;
+        while (sent_total < len) {
+            ssize_t sent = send(client_socket_fd, data + sent_total, len - sent_total, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                http_response_free(&resp);
+                return 0;
+            }
+            sent_total += sent;
+            count_sent(sent);
+        }
+        offset += len;
     }
-    request_buffer[bytes_read] = '\0';
 
-    // Parse the request
-    struct ParsedRequest *req = ParsedRequest_create();
-    if (ParsedRequest_parse(req, request_buffer, bytes_read) < 0) {
-        fprintf(stderr, "Failed to parse request.\n");
-        send_error_to_client(client_socket_fd, 400, "Bad Request");
-        ParsedRequest_destroy(req);
-        close(client_socket_fd);
-        return NULL;
+    if (resp.status_code) worker_buffers.access.status = resp.status_code;
+    int keep_alive = complete && http_response_reusable(&resp);
+    http_response_free(&resp);
+    return keep_alive;
+}
+#endif
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Sends a response stored on disk with sendfile(), straight from
+ * the page cache.
+ * @return Non-zero if the whole response was sent and the client
+ * connection can carry another request.
+ */
+static int send_disk_response(int client_socket_fd, DiskHit *hit) {
+    while (hit->length > 0) {
+        ssize_t sent = sendfile(client_socket_fd, hit->fd, &hit->offset, hit->length);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return 0;
+        hit->length -= sent;
+        count_sent(sent);
     }
-    
+    return hit->persistent;
+}
+
+/**
+ * @brief Lets go of a cache fill, abandoning it unless it was committed.
+ */
+static void drop_fill(CacheEntry **fill) {
+    if (!*fill) return;
+    cache_fill_abort(*fill);
+    cache_release(*fill);
+    *fill = NULL;
+}
+#endif
+
+/**
+ * @brief Serves one request whose head has been parsed.
+ *
+ * A request body is forwarded to the origin as the client sends it; its
+ * first bytes may already be in the client's buffer, and whatever follows
+ * its end there (a pipelined request) stays for the next request.
+ * @param req The parsed request head.
+ * @param in The client's buffered bytes following the head.
+ * @return Non-zero if the client connection can carry another request.
+ */
+static int serve_request(int client_socket_fd, struct ParsedRequest *req, ClientBuffer *in) {
+    metrics_add(METRIC_REQUESTS, 1);
+
     // Ensure we have a host to connect to
     if (!req->host) {
-        fprintf(stderr, "Request is missing Host header or absolute URI.\n");
+        log_message(LOG_LEVEL_WARN, "Request is missing Host header or absolute URI.");
         send_error_to_client(client_socket_fd, 400, "Bad Request");
-        ParsedRequest_destroy(req);
-        close(client_socket_fd);
-        return NULL;
+        return 0;
     }
 
-    // Form the full URL to use as the cache key
-    char url_string[MAX_REQUEST_SIZE];
-    snprintf(url_string, sizeof(url_string), "%s://%s:%s%s", req->protocol, req->host, req->port, req->path);
+    RequestBody body;
+    RequestBody *has_body = NULL;
+    size_t body_length;
+    request_body_t framing = ParsedRequest_bodyFraming(req, &body_length);
+    switch (framing) {
+        case REQUEST_BODY_NONE:
+            break;
+        case REQUEST_BODY_LENGTH:
+        case REQUEST_BODY_CHUNKED: {
+            http_body_init(&body.framing, framing == REQUEST_BODY_LENGTH ? BODY_LENGTH : BODY_CHUNKED, body_length);
+            ssize_t used = http_response_feed(&body.framing, in->data, in->len);
+            if (used < 0) {
+                log_message(LOG_LEVEL_WARN, "Malformed request body.");
+                send_error_to_client(client_socket_fd, 400, "Bad Request");
+                return 0;
+            }
+            body.client_fd = client_socket_fd;
+            body.in = in;
+            body.buffered = used;
+            body.replayable = body.framing.state == RESPONSE_DONE;
+            body.expect_continue = ParsedRequest_expectsContinue(req);
+            body.failed = 0;
+            has_body = &body;
+            break;
+        }
+        case REQUEST_BODY_INVALID:
+            log_message(LOG_LEVEL_WARN, "Request body framing is not supported.");
+            send_error_to_client(client_socket_fd, 400, "Bad Request");
+            return 0;
+    }
 
-    printf("Received request for: %s\n", url_string);
+    int keep_alive = client_idle_timeout > 0 && ParsedRequest_keepAlive(req);
+
+    // The full URL is the cache key; it is built in the request's own storage
+    const char *url_string = ParsedRequest_url(req);
+    if (!url_string) {
+        send_error_to_client(client_socket_fd, 500, "Internal Server Error");
+        return 0;
+    }
 
     #ifdef ENABLE_CACHE
-    int cache_data_size = 0;
-    char *cached_data = cache_get(url_string, &cache_data_size);
-
-    if (cached_data) {
-        printf("Cache HIT for: %s\n", url_string);
-        // Send cached data back to the client
-        send(client_socket_fd, cached_data, cache_data_size, 0);
-        free(cached_data);
+    // Requests with a body always bypass the cache, so their body is always forwarded
+    http_cache_mode_t mode = http_cache_request_mode(req);
+    // An unsafe method may change what the URL returns
+    if (http_cache_request_invalidates(req)) http_compress_invalidate(req);
+    uint64_t lookup_started = metrics_now();
+    CacheEntry *hit = mode != HTTP_CACHE_BYPASS ? http_compress_lookup(req) : NULL;
+    // An object evicted from memory may still be on disk
+    DiskHit disk_hit;
+    int on_disk = !hit && mode == HTTP_CACHE_LOOKUP && http_compress_disk_lookup(req, time(NULL), &disk_hit) == 0;
+    if (mode != HTTP_CACHE_BYPASS) metrics_observe(METRIC_LOOKUP_LATENCY, lookup_started);
+
+    int leader = 0;
+    CacheEntry *stream = NULL;
+    if (mode == HTTP_CACHE_LOOKUP && coalesce_timeout > 0 && !on_disk &&
+        !(hit && time(NULL) < cache_entry_fresh_until(hit))) {
+        // Wait for an identical fetch already in flight instead of repeating it
+        switch (coalesce_wait(url_string, coalesce_timeout * 1000, &stream)) {
+            case COALESCE_LEADER:
+                leader = 1;
+                break;
+            case COALESCE_STREAMING:
+                break;
+            case COALESCE_DONE:
+                cache_release(hit);
+                hit = http_compress_lookup(req);
+                break;
+            default:
+                log_message(LOG_LEVEL_DEBUG, "Cache WAIT timed out for: %s", url_string);
+                break;
+        }
+    }
+
+    if (stream) {
+        // Sent along with the fetch it joined, as the response arrives
+        worker_buffers.access.cache = LOG_CACHE_STREAM;
+        metrics_add(METRIC_CACHE_HITS, 1);
+        keep_alive = send_cached_response(client_socket_fd, stream) && keep_alive;
+        cache_release(stream);
+    } else if (hit && mode == HTTP_CACHE_LOOKUP && time(NULL) < cache_entry_fresh_until(hit)) {
+        worker_buffers.access.cache = LOG_CACHE_HIT;
+        metrics_add(METRIC_CACHE_HITS, 1);
+        keep_alive = send_cached_response(client_socket_fd, hit) && keep_alive;
+    } else if (on_disk) {
+        worker_buffers.access.cache = LOG_CACHE_DISK_HIT;
+        metrics_add(METRIC_CACHE_HITS, 1);
+        keep_alive = send_disk_response(client_socket_fd, &disk_hit) && keep_alive;
+        disk_cache_release(&disk_hit);
     } else {
-        printf("Cache MISS for: %s\n", url_string);
-        // Forward request to origin server
-        forward_request_and_get_response(client_socket_fd, req, url_string);
+        worker_buffers.access.cache = mode == HTTP_CACHE_BYPASS ? LOG_CACHE_BYPASS
+                                      : hit ? LOG_CACHE_STALE : LOG_CACHE_MISS;
+        if (mode != HTTP_CACHE_BYPASS) metrics_add(METRIC_CACHE_MISSES, 1);
+        // Forward request to origin server, conditionally if a stored copy exists
+        keep_alive = forward_request_and_get_response(client_socket_fd, req, url_string,
+                                                      mode != HTTP_CACHE_BYPASS, hit, has_body) && keep_alive;
     }
+    if (leader) coalesce_finish(url_string);
+    cache_release(hit);
     #else
     // Without cache, always forward the request
-    forward_request_and_get_response(client_socket_fd, req, url_string);
+    keep_alive = forward_request_and_get_response(client_socket_fd, req, url_string, 0, NULL, has_body) && keep_alive;
     #endif
 
-    ParsedRequest_destroy(req);
-    close(client_socket_fd);
-    return NULL;
+    if (has_body) {
+        // The next request starts where the body ended
+        if (body.framing.state == RESPONSE_DONE) {
+            in->len -= body.buffered;
+            memmove(in->data, in->data + body.buffered, in->len);
+        } else {
+            keep_alive = 0;
+        }
+        http_response_free(&body.framing);
+    }
+    return keep_alive;
 }
 
+/**
+ * @brief Waits for a client to start its next request, waking up now and
+ * then to see whether the proxy is shutting down.
+ *
+ * A request the client has already sent is always read, shutdown or not;
+ * only a client that sends nothing for a whole check is given up on.
+ * @return 1 once there is something to read (or the wait failed, which
+ * the read reports), 0 on a shutdown or when the client sat idle too long.
+ */
+static int await_request(int client_socket_fd) {
+    uint64_t since = metrics_now();
+    for (;;) {
+        struct pollfd pfd = { client_socket_fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, SHUTDOWN_CHECK_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready != 0) return 1;
+        if (atomic_load(&shutting_down)) return 0;
+        if (client_idle_timeout > 0 && metrics_now() - since >= (uint64_t)client_idle_timeout * 1000000) return 0;
+    }
+}
 
 /**
- * @brief Connects to the destination server, forwards the request, reads the
- * response, and relays it back to the client.
+ * @brief Handles a single client connection from start to finish.
+ * Worker threads run this for every connection they dequeue.
+ *
+ * Persistent HTTP/1.1 connections are served in a loop: each request head
+ * is fed to the parser as it arrives, however it is split across reads,
+ * and any bytes after the request (a pipelined next request) stay in the
+ * buffer for the next iteration. The connection is closed when the client
+ * asks for it, a response cannot be delimited, or no new request arrives
+ * within the idle timeout.
+ *
+ * The read buffer and the parsed request belong to the worker and are
+ * reused for every connection it serves. The buffer grows only for long
+ * heads, and shrinks back once such a connection is done, so each worker
+ * holds about the same memory whatever it served last.
  */
-void forward_request_and_get_response(int client_socket_fd, struct ParsedRequest *req, const char *url_string) {
-    // --- Connect to Destination Server ---
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC; // IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM;
-    
-    if (getaddrinfo(req->host, req->port, &hints, &res) != 0) {
-        perror("getaddrinfo");
-        send_error_to_client(client_socket_fd, 502, "Bad Gateway");
+void handle_connection(int client_socket_fd) {
+    WorkerBuffers *worker = &worker_buffers;
+    if (!worker->in.data) {
+        pthread_setspecific(worker_exit_key, worker);
+        worker->in.data = malloc(REQUEST_BUFFER_SIZE);
+        worker->in.cap = REQUEST_BUFFER_SIZE;
+    }
+    if (!worker->relay) worker->relay = malloc(relay_buffer_size);
+    if (!worker->req) worker->req = ParsedRequest_create();
+    if (!worker->in.data || !worker->relay || !worker->req) {
+        perror("malloc for worker buffers");
+        close(client_socket_fd);
         return;
     }
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    ClientBuffer *in = &worker->in;
+    struct ParsedRequest *req = worker->req;
+    in->len = 0;
 
-    int dest_socket_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (dest_socket_fd < 0) {
-        perror("socket (destination)");
-        freeaddrinfo(res);
-        send_error_to_client(client_socket_fd, 502, "Bad Gateway");
-        return;
+    // The client's address is only looked up when there is an access log to put it in
+    dns_sockaddr_t client;
+    socklen_t client_len = sizeof(client);
+    client.sa.sa_family = AF_UNSPEC;
+    if (log_access_enabled()) getpeername(client_socket_fd, &client.sa, &client_len);
+
+    if (client_idle_timeout > 0) {
+        struct timeval idle = { client_idle_timeout, 0 };
+        setsockopt(client_socket_fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    }
+
+    int keep_alive = 1;
+    while (keep_alive) {
+        ParsedRequest_reset(req);
+
+        // Read until a complete request head is buffered and parsed
+        ssize_t head_len;
+        while ((head_len = ParsedRequest_feed(req, in->data, in->len)) == 0) {
+            if (in->len == 0 && !await_request(client_socket_fd)) break;
+            if (in->len == in->cap) {
+                size_t cap = in->cap * 2 < MAX_REQUEST_HEAD_SIZE + 1 ? in->cap * 2 : MAX_REQUEST_HEAD_SIZE + 1;
+                char *grown = realloc(in->data, cap);
+                if (!grown) break;
+                in->data = grown;
+                in->cap = cap;
+            }
+            ssize_t bytes_read = recv(client_socket_fd, in->data + in->len, in->cap - in->len, 0);
+            if (bytes_read <= 0) {
+                // Closed by the client, idle timeout, or error
+                if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) log_errno("recv");
+                break;
+            }
+            in->len += bytes_read;
+        }
+        if (head_len < 0) {
+            if (in->len > MAX_REQUEST_HEAD_SIZE) {
+                log_message(LOG_LEVEL_WARN, "Request head exceeds %d bytes.", MAX_REQUEST_HEAD_SIZE);
+            } else {
+                log_message(LOG_LEVEL_WARN, "Failed to parse request.");
+            }
+            send_error_to_client(client_socket_fd, 400, "Bad Request");
+        }
+        if (head_len <= 0) break;
+
+        // The parser kept its own copy; the buffer moves on to the body
+        in->len -= head_len;
+        memmove(in->data, in->data + head_len, in->len);
+        uint64_t request_started = metrics_now();
+        memset(&worker->access, 0, sizeof(worker->access));
+        worker->access.client = client;
+        int deadline_ms = upstream_guard_timeouts().deadline_ms;
+        worker->deadline = deadline_ms ? request_started + (uint64_t)deadline_ms * 1000 : 0;
+        keep_alive = serve_request(client_socket_fd, req, in);
+        // A shutdown closes the connection between requests, never before the first
+        if (atomic_load(&shutting_down)) keep_alive = 0;
+        worker->access.total_us = metrics_observe(METRIC_REQUEST_LATENCY, request_started);
+        log_access(req->method, ParsedRequest_url(req), &worker->access);
+    }
+
+    // Leave the worker's memory as it was before a long head
+    ParsedRequest_reset(req);
+    if (in->cap > REQUEST_BUFFER_SIZE) {
+        char *shrunk = realloc(in->data, REQUEST_BUFFER_SIZE);
+        if (shrunk) {
+            in->data = shrunk;
+            in->cap = REQUEST_BUFFER_SIZE;
+        }
+    }
+    close(client_socket_fd);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+}
+
+/**
+ * @brief How long the next wait on the origin may last: the stage's
+ * timeout, or what is left of the request's deadline if that is less.
+ * @param timeout_ms The stage's timeout; 0 for none.
+ * @return Milliseconds (0 for no limit), or -1 once the deadline has passed.
+ */
+static int origin_budget(int timeout_ms) {
+    uint64_t deadline = worker_buffers.deadline;
+    if (!deadline) return timeout_ms;
+    uint64_t now = metrics_now();
+    if (now >= deadline) return -1;
+    uint64_t left_ms = (deadline - now + 999) / 1000;
+    return timeout_ms > 0 && (uint64_t)timeout_ms < left_ms ? timeout_ms : (int)left_ms;
+}
+
+/**
+ * @brief Bounds the next blocking receive or send on an origin socket by
+ * the stage's timeout and the request's deadline.
+ * @param option SO_RCVTIMEO or SO_SNDTIMEO.
+ * @param timeout_ms The stage's timeout; 0 for none.
+ * @return 0 on success, -1 once the deadline has passed (errno is ETIMEDOUT).
+ */
+static int arm_origin_timer(OriginTimer *timer, int option, int timeout_ms) {
+    int wait_ms = origin_budget(timeout_ms);
+    if (wait_ms < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    int *armed = option == SO_RCVTIMEO ? &timer->recv_ms : &timer->send_ms;
+    if (wait_ms != *armed) {
+        struct timeval tv = { wait_ms / 1000, (wait_ms % 1000) * 1000 };
+        setsockopt(timer->fd, SOL_SOCKET, option, &tv, sizeof(tv));
+        *armed = wait_ms;
     }
+    return 0;
+}
+
+/**
+ * @brief Sends a whole buffer to the origin, waiting no longer than the
+ * idle timeout for it to take each part.
+ * @return 0 on success, -1 on failure (errno is ETIMEDOUT if the origin stalled).
+ */
+static int send_to_origin(OriginTimer *timer, const char *data, size_t len) {
+    while (len > 0) {
+        if (arm_origin_timer(timer, SO_SNDTIMEO, upstream_guard_timeouts().idle_ms) < 0) return -1;
+        ssize_t sent = send(timer->fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) errno = ETIMEDOUT;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives from the origin, waiting no longer than the stage allows.
+ * @param timeout_ms The stage's timeout; 0 for none.
+ * @return As recv(); a timeout fails with errno ETIMEDOUT.
+ */
+static ssize_t recv_from_origin(OriginTimer *timer, char *buffer, size_t len, int timeout_ms) {
+    for (;;) {
+        if (arm_origin_timer(timer, SO_RCVTIMEO, timeout_ms) < 0) return -1;
+        ssize_t n = recv(timer->fd, buffer, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) errno = ETIMEDOUT;
+        return n;
+    }
+}
 
-    if (connect(dest_socket_fd, res->ai_addr, res->ai_addrlen) < 0) {
-        perror("connect (destination)");
-        freeaddrinfo(res);
-        close(dest_socket_fd);
+/**
+ * @brief Answers a request whose origin failed before anything was
+ * relayed: 504 if it ran out of time, 502 otherwise.
+ */
+static void send_origin_error(int client_socket_fd, int timed_out) {
+    metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+    if (timed_out) {
+        metrics_add(METRIC_UPSTREAM_TIMEOUTS, 1);
+        send_error_to_client(client_socket_fd, 504, "Gateway Timeout");
+    } else {
         send_error_to_client(client_socket_fd, 502, "Bad Gateway");
-        return;
     }
-    freeaddrinfo(res);
-    
-    // --- Forward Request ---
-    // Modify request for proxying (HTTP/1.0, remove proxy-specific headers)
-    ParsedHeader_set(req, "Host", req->host);
-    ParsedHeader_set(req, "Connection", "close");
-    req->version = "HTTP/1.0"; // Use HTTP/1.0 for simplicity with origin servers
+}
 
-    size_t req_line_len = ParsedRequest_requestLineLen(req);
-    size_t headers_len = ParsedHeader_headersLen(req);
-    size_t total_req_len = req_line_len + headers_len;
+/**
+ * @brief Drops the worker's relay pipe along with anything stranded in it.
+ */
+static void discard_relay_pipe() {
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+    relay_pipe[0] = relay_pipe[1] = -1;
+    relay_piped = 0;
+}
 
-    char *request_to_send = malloc(total_req_len + 1);
-    if (!request_to_send) {
-        close(dest_socket_fd);
-        send_error_to_client(client_socket_fd, 500, "Internal Server Error");
-        return;
+/**
+ * @brief Moves the oldest bytes in the relay pipe to the end of the queue,
+ * making room in the pipe while the client is behind.
+ *
+ * Everything queued is older than everything piped, so order is kept.
+ * @return 0 on success, -1 on failure (the bytes are lost).
+ */
+static int spill_pipe(RelayQueue *queue) {
+    size_t want = relay_piped < relay_buffer_size ? relay_piped : relay_buffer_size;
+    ssize_t n;
+    do {
+        n = read(relay_pipe[0], worker_buffers.relay, want);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        log_errno("read (relay pipe)");
+        discard_relay_pipe();
+        return -1;
     }
+    relay_piped -= n;
+    return relay_queue_push(queue, worker_buffers.relay, n);
+}
 
-    int written_line_len = ParsedRequest_unparse(req, request_to_send, total_req_len);
-    if (written_line_len < 0) {
-        fprintf(stderr, "Failed to unparse request line.\n");
-        free(request_to_send);
-        close(dest_socket_fd);
-        return;
+/**
+ * @brief Sends the client as much of what was read ahead of it as it
+ * takes without blocking: the queue first, then the pipe.
+ *
+ * The client socket is non-blocking whenever the pipe holds anything (see
+ * splice_body()), except once the origin is done with, when blocking on
+ * the client is all that is left to do.
+ * @return 0 once nothing is left, 1 if the client is still behind, -1 if
+ * it failed.
+ */
+static int feed_client(int client_fd, RelayQueue *queue) {
+    if (queue->len > 0) {
+        ssize_t sent = relay_queue_send(queue, client_fd, MSG_DONTWAIT);
+        if (sent < 0) {
+            log_errno("send (client)");
+            return -1;
+        }
+        count_sent(sent);
+        if (queue->len > 0) return 1;
     }
+    while (relay_piped > 0) {
+        ssize_t sent = splice(relay_pipe[0], NULL, client_fd, NULL, relay_piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            log_errno("splice (client)");
+            discard_relay_pipe();
+            return -1;
+        }
+        relay_piped -= sent;
+        count_sent(sent);
+    }
+    return 0;
+}
 
-    ParsedRequest_unparse_headers(req, request_to_send + written_line_len, total_req_len - written_line_len);
-    
-    if (send(dest_socket_fd, request_to_send, total_req_len, 0) < 0) {
-        perror("send (destination)");
-        free(request_to_send);
-        close(dest_socket_fd);
-        return;
+/**
+ * @brief Feeds a client that fell behind until the origin has more to
+ * read, or the client has caught up.
+ *
+ * The origin is only waited on while there is room to read ahead of the
+ * client, and then for no longer than the stage allows; while there is
+ * none, the client alone is waited on, as a blocking send would.
+ * @param read_ahead Non-zero if there is room for more from the origin.
+ * @param timeout_ms The stage's timeout; 0 for none.
+ * @return 0 when the origin can be read, 1 if it ran out of time (errno is
+ * ETIMEDOUT), -1 if the client failed.
+ */
+static int await_origin(OriginTimer *origin, int client_fd, RelayQueue *queue, int read_ahead, int timeout_ms) {
+    for (;;) {
+        int behind = feed_client(client_fd, queue);
+        if (behind <= 0) return behind;
+
+        int wait_ms = -1;
+        if (read_ahead) {
+            wait_ms = origin_budget(timeout_ms);
+            if (wait_ms < 0) {
+                errno = ETIMEDOUT;
+                return 1;
+            }
+            if (wait_ms == 0) wait_ms = -1;
+        }
+        struct pollfd fds[2] = { { client_fd, POLLOUT, 0 }, { read_ahead ? origin->fd : -1, POLLIN, 0 } };
+        int ready = poll(fds, 2, wait_ms);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            log_errno("poll (relay)");
+            return -1;
+        }
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return 1;
+        }
+        if (fds[1].revents) return 0;
     }
-    free(request_to_send);
+}
+
+/**
+ * @brief Sends the client everything still read ahead of it, once the
+ * origin is done with.
+ * @return 0 on success, -1 if the client failed.
+ */
+static int drain_client(int client_fd, RelayQueue *queue) {
+    for (;;) {
+        int behind = feed_client(client_fd, queue);
+        if (behind <= 0) return behind;
+        struct pollfd fd = { client_fd, POLLOUT, 0 };
+        if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+            log_errno("poll (client)");
+            return -1;
+        }
+    }
+}
 
-    // --- Relay Response to Client ---
-    char response_buffer[MAX_REQUEST_SIZE];
-    ssize_t bytes_read;
+/**
+ * @brief Relays the rest of a Content-Length or read-until-close body from
+ * the origin to the client through this worker's pipe, so the bytes never
+ * enter user space.
+ *
+ * The pipe doubles as the read-ahead buffer for a client slower than its
+ * origin: the origin is spliced in as fast as it sends while the client
+ * takes what it can. Once the pipe is full its oldest bytes spill into the
+ * queue, as far as the queue has room, so the body may be complete (and
+ * the origin connection free) with part of it still queued or piped for
+ * drain_client(). Queued bytes always go out before piped ones. The pipe
+ * is reused for every response the worker relays; it is only recreated
+ * when a failed client write leaves bytes stranded in it.
+ * Every read from the origin is bounded by the idle timeout.
+ * @return 1 once the body is complete or the origin stopped sending, 2 if
+ * the origin timed out, 0 if no pipe is available (the caller keeps
+ * copying), -1 if the client failed.
+ */
+static int splice_body(OriginTimer *origin, int client_fd, RelayQueue *queue, HttpResponse *resp,
+                       size_t *bytes_relayed) {
+    if (relay_pipe[0] < 0) {
+        if (socket_make_pipe(relay_pipe, 0) < 0) return 0;
+        relay_piped = 0;
+    }
+    socket_set_nonblocking(client_fd); // Tells when the client falls behind
+    size_t pipe_cap = RELAY_PIPE_SIZE; // Lowered if the pipe fills up before its byte count says
+    int rc = 1;
+
+    while (resp->state == RESPONSE_BODY) {
+        if (relay_piped >= pipe_cap && relay_queue_room(queue) > 0) {
+            // The client is behind and the pipe full: move on to copying rather than wait for it
+            if (spill_pipe(queue) < 0) {
+                rc = -1;
+                break;
+            }
+            pipe_cap = RELAY_PIPE_SIZE;
+        }
+        int idle_ms = upstream_guard_timeouts().idle_ms;
+        int waited = 0;
+        if (queue->len > 0 || relay_piped > 0) {
+            int read_ahead = relay_piped < pipe_cap && relay_queue_room(queue) > 0;
+            waited = await_origin(origin, client_fd, queue, read_ahead, idle_ms);
+            if (waited < 0) {
+                rc = -1;
+                break;
+            }
+        }
+
+        size_t want = RELAY_PIPE_SIZE - relay_piped;
+        if (resp->framing == BODY_LENGTH && resp->body_remaining < want) want = resp->body_remaining;
+        ssize_t in = -1;
+        if (waited == 0 && arm_origin_timer(origin, SO_RCVTIMEO, idle_ms) == 0) {
+            // The origin said it is readable before a splice into a non-empty pipe
+            in = splice(origin->fd, NULL, relay_pipe[1], NULL, want,
+                        SPLICE_F_MOVE | (relay_piped > 0 ? SPLICE_F_NONBLOCK : 0));
+            if (in < 0 && errno == EINTR) continue;
+            if (in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (relay_piped > 0) {
+                    pipe_cap = relay_piped; // Full after all
+                    continue;
+                }
+                errno = ETIMEDOUT;
+            }
+        }
+        if (in < 0) {
+            log_errno("splice (destination)");
+            metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+            if (errno == ETIMEDOUT) {
+                metrics_add(METRIC_UPSTREAM_TIMEOUTS, 1);
+                rc = 2;
+            }
+            break;
+        }
+        if (in == 0) {
+            http_response_eof(resp);
+            break;
+        }
 
+        http_response_skip(resp, in);
+        metrics_add(METRIC_BYTES_IN, in);
+        relay_piped += in;
+        *bytes_relayed += in;
+        if (feed_client(client_fd, queue) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    socket_set_blocking(client_fd);
+    return rc;
+}
+
+/**
+ * @brief Sends a request body to the origin as the client sends it.
+ *
+ * What is buffered goes first; then the client is read straight into its
+ * buffer, so no more than one buffer of the body is held at a time, and
+ * bytes past the body's end stay where the next request will look for
+ * them. A client waiting on Expect: 100-continue is told to go ahead
+ * before the first read.
+ * @return 0 once the whole body is sent, -1 if the origin failed (errno is
+ * ETIMEDOUT if it stalled) or the client did (body->failed is set then).
+ */
+static int forward_body(OriginTimer *origin, RequestBody *body) {
+    ClientBuffer *in = body->in;
+    for (;;) {
+        if (send_to_origin(origin, in->data, body->buffered) < 0) return -1;
+        if (body->framing.state == RESPONSE_DONE) return 0;
+
+        // Everything buffered was body, and has been sent; read the next part in its place
+        in->len = body->buffered = 0;
+        if (body->expect_continue) {
+            static const char go_ahead[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            body->expect_continue = 0;
+            if (send(body->client_fd, go_ahead, sizeof(go_ahead) - 1, MSG_NOSIGNAL) < 0) {
+                body->failed = 1;
+                return -1;
+            }
+        }
+        ssize_t bytes_read = recv(body->client_fd, in->data, in->cap, 0);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        ssize_t used = bytes_read > 0 ? http_response_feed(&body->framing, in->data, bytes_read) : -1;
+        if (used < 0) {
+            if (bytes_read > 0) log_message(LOG_LEVEL_WARN, "Malformed request body.");
+            body->failed = 1;
+            return -1;
+        }
+        in->len = bytes_read;
+        body->buffered = used;
+    }
+}
+
+/**
+ * @brief Connects to the destination server, forwards the request, reads the
+ * response, and relays it back to the client.
+ *
+ * HTTP/1.1 requests reuse a pooled keep-alive connection to the origin when
+ * one is available. The response is framed as it streams in, so the
+ * connection can be returned to the pool as soon as the response ends. A
+ * reused connection that the origin closed while it sat idle is retried
+ * once on a fresh connection, provided nothing was relayed yet.
+ *
+ * A request body is streamed to the origin after the head (see
+ * forward_body()). One that did not arrive whole with the head cannot be
+ * sent a second time, so such a request never starts on a pooled
+ * connection that might turn out stale.
+ *
+ * Bodies that will not be cached (cache disabled, a response HTTP does not
+ * let the cache store, or larger than the cache's object limit) are spliced
+ * from the origin socket to the client socket through a per-worker pipe
+ * instead of being copied through user space, as long as their framing is
+ * a plain byte count.
+ *
+ * A client slower than its origin does not hold the origin connection:
+ * what it cannot take right away is queued (see relay_queue.h), or left in
+ * the pipe, while the origin is read on at its own pace. Once the response
+ * is in, the origin connection goes back to the pool and its guard is
+ * released, and only then is the rest sent to the client. When the queue
+ * is full the origin waits for the client, as it always did.
+ *
+ * A storable response is written into a cache entry as it is relayed, and
+ * the entry is published once the response is complete. If the head gives
+ * the full length, requests waiting on this URL's fetch are handed the
+ * entry and send it along as it fills; a response of unknown length that
+ * outgrows the object limit midway is dropped from the cache on the spot.
+ *
+ * A stale stored copy with a validator turns the request into a
+ * conditional one. The origin's answer is held back until its head shows
+ * whether it is a 304: if so, the stored copy is refreshed and sent
+ * instead; anything else is relayed and replaces it.
+ *
+ * The origin must first admit the request (see upstream_guard.h). Every
+ * wait on it is bounded: the connect by the connect timeout, the first
+ * response byte by the first byte timeout, and any later pause by the idle
+ * timeout, each cut short by the request's deadline. An origin that runs
+ * out of time before anything was relayed is answered for with a 504.
+ * @param store Non-zero if the request allows the response to be cached.
+ * @param stale The stale stored copy, or NULL.
+ * @param body The request body to forward, or NULL.
+ * @return Non-zero if a complete, self-delimiting response was relayed, so
+ * the client connection can carry another request.
+ */
+int forward_request_and_get_response(int client_socket_fd, struct ParsedRequest *req, const char *url_string,
+                                     int store, CacheEntry *stale, RequestBody *body) {
+    int keep_alive = upstream_should_keep_alive(req);
+    int is_head_request = strcmp(req->method, "HEAD") == 0;
+    int client_reusable = 0;
     #ifdef ENABLE_CACHE
-    // Buffer to hold the entire response for caching
-    char *full_response = NULL;
-    size_t total_response_size = 0;
-    size_t current_buffer_capacity = 0;
+    struct timespec fetch_started; // Origin time weighs the entry in the cache
+    clock_gettime(CLOCK_MONOTONIC, &fetch_started);
+    const char *stale_head = NULL;
+    size_t stale_head_len = stale ? cache_entry_read(stale, 0, &stale_head) : 0;
+    int revalidating = stale && http_cache_add_validators(req, stale_head, stale_head_len) == 0;
+    #else
+    (void)store;
+    (void)stale;
     #endif
 
-    while ((bytes_read = recv(dest_socket_fd, response_buffer, sizeof(response_buffer), 0)) > 0) {
-        // Send chunk to client immediately
-        if (send(client_socket_fd, response_buffer, bytes_read, 0) < 0) {
-            perror("send (client)");
+    // --- Origin Admission ---
+    upstream_admission_t admission;
+    int trial;
+    UpstreamGuard *guard = upstream_guard_acquire(req->host, req->port, &admission, &trial);
+    if (admission != UPSTREAM_ADMITTED) {
+        metrics_add(METRIC_UPSTREAM_REJECTED, 1);
+        send_error_to_client(client_socket_fd, 503, "Service Unavailable");
+        return 0;
+    }
+    upstream_outcome_t outcome = UPSTREAM_FAILED;
+    RelayQueue queue; // What the client has not taken yet
+    relay_queue_init(&queue);
+
+    // --- Build Request ---
+    size_t total_req_len;
+    char *request_to_send = upstream_build_request(req, keep_alive, &total_req_len);
+    if (!request_to_send) {
+        upstream_guard_release(guard, trial, UPSTREAM_ABANDONED);
+        send_error_to_client(client_socket_fd, 500, "Internal Server Error");
+        return 0;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // --- Connect to Destination Server ---
+        int reused = 0;
+        int may_reuse = keep_alive && attempt == 0 && (!body || body->replayable);
+        int dest_socket_fd = may_reuse ? upstream_pool_get(req->host, req->port) : -1;
+        if (dest_socket_fd >= 0) {
+            reused = 1;
+            socket_set_blocking(dest_socket_fd);
+        } else {
+            uint64_t connect_started = metrics_now();
+            int connect_ms = origin_budget(upstream_guard_timeouts().connect_ms);
+            errno = 0;
+            dest_socket_fd = connect_ms >= 0 ? socket_connect_tcp(req->host, req->port, connect_ms) : -1;
+            if (dest_socket_fd < 0) {
+                send_origin_error(client_socket_fd, connect_ms < 0 || errno == ETIMEDOUT);
+                break;
+            }
+            worker_buffers.access.connect_us = metrics_observe(METRIC_CONNECT_LATENCY, connect_started);
+        }
+        // A pooled socket still has the timeouts its last request left on it
+        OriginTimer timer = { dest_socket_fd, -1, -1 };
+
+        // --- Forward Request ---
+        uint64_t request_sent = metrics_now(); // Until the first response byte
+        int sent = send_to_origin(&timer, request_to_send, total_req_len);
+        if (sent == 0 && body) sent = forward_body(&timer, body);
+        if (sent < 0) {
+            int err = errno;
+            close(dest_socket_fd);
+            if (body && body->failed) {
+                // A client that gave up gets no answer; one that broke the framing does
+                if (body->framing.state == RESPONSE_ERROR) send_error_to_client(client_socket_fd, 400, "Bad Request");
+                outcome = UPSTREAM_ABANDONED;
+                break;
+            }
+            if (reused && err != ETIMEDOUT) continue; // Stale pooled connection
+            errno = err;
+            log_errno("send (destination)");
+            send_origin_error(client_socket_fd, err == ETIMEDOUT);
             break;
         }
 
+        // --- Relay Response to Client ---
+        char *response_buffer = worker_buffers.relay;
+        ssize_t bytes_read = 0;
+        size_t bytes_relayed = 0;
+        int client_failed = 0;
+        int spliced = 0;
+        int splice_unavailable = 0;
+        int timed_out = 0;
+        HttpResponse resp;
+        http_response_init(&resp, is_head_request);
+
         #ifdef ENABLE_CACHE
-        // Append chunk to our full response buffer for caching
-        if (total_response_size + bytes_read > current_buffer_capacity) {
-             current_buffer_capacity = (total_response_size + bytes_read) * 2;
-             char *new_buffer = realloc(full_response, current_buffer_capacity);
-             if (!new_buffer) {
-                 free(full_response);
-                 full_response = NULL; // Stop trying to cache
-             } else {
-                 full_response = new_buffer;
-             }
-        }
-        if (full_response) {
-            memcpy(full_response + total_response_size, response_buffer, bytes_read);
-            total_response_size += bytes_read;
+        int cacheable = store;  // The response may still go into the cache
+        char *held = NULL;      // Bytes that arrived before the head was complete
+        size_t held_len = 0;
+        CacheEntry *fill = NULL; // Entry being filled with the response
+        int not_modified = 0;   // The origin answered the revalidation with 304
+        time_t fresh_until = 0;
+        #else
+        int cacheable = 0;
+        #endif
+
+        while (resp.state != RESPONSE_DONE) {
+            // A body that will not be cached is moved kernel-side once its framing allows
+            if (!cacheable && !splice_unavailable && http_response_spliceable(&resp)) {
+                int rc = splice_body(&timer, client_socket_fd, &queue, &resp, &bytes_relayed);
+                if (rc != 0) {
+                    spliced = 1;
+                    client_failed = rc < 0;
+                    timed_out = rc == 2;
+                    break;
+                }
+                splice_unavailable = 1;
+            }
+
+            // Until the head is in, a response that may be stored is held back in small reads
+            size_t want = relay_buffer_size;
+            #ifdef ENABLE_CACHE
+            if (cacheable && !fill && want > RESPONSE_HOLD_READ_SIZE) want = RESPONSE_HOLD_READ_SIZE;
+            #endif
+            upstream_timeouts_t timeouts = upstream_guard_timeouts();
+            int stage_ms = request_sent ? timeouts.first_byte_ms : timeouts.idle_ms;
+            if (queue.len > 0) {
+                // The client fell behind: keep it fed, and read ahead only as far as its queue has room
+                int waited = await_origin(&timer, client_socket_fd, &queue, relay_queue_room(&queue) > 0, stage_ms);
+                if (waited != 0) {
+                    bytes_read = -1;
+                    client_failed = waited < 0;
+                    timed_out = waited > 0;
+                    break;
+                }
+                size_t room = relay_queue_room(&queue);
+                if (queue.len > 0 && room > 0 && room < want) want = room;
+            }
+            bytes_read = recv_from_origin(&timer, response_buffer, want, stage_ms);
+            if (bytes_read <= 0) {
+                timed_out = bytes_read < 0 && errno == ETIMEDOUT;
+                break;
+            }
+            if (request_sent) {
+                worker_buffers.access.ttfb_us = metrics_observe(METRIC_TTFB_LATENCY, request_sent);
+                request_sent = 0;
+            }
+            metrics_add(METRIC_BYTES_IN, bytes_read);
+
+            ssize_t used = bytes_read;
+            if (resp.state != RESPONSE_ERROR) {
+                used = http_response_feed(&resp, response_buffer, bytes_read);
+            }
+            if (used < 0) {
+                // Relay until the origin closes, but never cache or reuse
+                log_message(LOG_LEVEL_WARN, "Malformed response from %s.", req->host);
+                metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+                used = bytes_read;
+            } else if ((size_t)used < (size_t)bytes_read) {
+                resp.keep_alive = 0; // Origin sent more than one response
+            }
+
+            const char *out = response_buffer;
+            size_t out_len = used;
+
+            #ifdef ENABLE_CACHE
+            if (cacheable && !fill) {
+                // Whether the response may be stored is only known once its head is in;
+                // a head is bounded, so this buffer never has to grow
+                if (!held) held = malloc(MAX_RESPONSE_HEAD_SIZE + RESPONSE_HOLD_READ_SIZE);
+                if (held && held_len + used <= MAX_RESPONSE_HEAD_SIZE + RESPONSE_HOLD_READ_SIZE) {
+                    memcpy(held + held_len, response_buffer, used);
+                    held_len += used;
+                } else {
+                    cacheable = 0;
+                }
+            } else if (fill && cache_fill_append(fill, response_buffer, used) < 0) {
+                // Outgrew the object limit (or cache memory): drop it from the cache now
+                drop_fill(&fill);
+                cacheable = 0;
+            }
+
+            if (revalidating) {
+                if (!cacheable) {
+                    send_error_to_client(client_socket_fd, 502, "Bad Gateway");
+                    client_failed = 1;
+                    break;
+                }
+                if (resp.state == RESPONSE_HEAD) continue; // Hold back until the status is known
+                revalidating = 0;
+                if (resp.status_code == 304) {
+                    not_modified = 1;
+                    break;
+                }
+                // Anything else replaces the stored copy; relay what was held back
+                out = held;
+                out_len = held_len;
+            }
+
+            // Once the head is in, HTTP decides whether the response may be stored
+            if (cacheable && !fill && resp.state != RESPONSE_HEAD) {
+                size_t expected = http_response_expected_size(&resp, held_len);
+                const char *fill_key = http_compress_fill_key(req, &resp);
+                if (fill_key && http_cache_storable(&resp, time(NULL), &fresh_until)) {
+                    fill = cache_fill_begin(fill_key, expected);
+                }
+                if (fill && cache_fill_append(fill, held, held_len) == 0) {
+                    // A known length cannot outgrow the cache midway, so waiters may read along;
+                    // they asked for the URL, so only a response as sent is theirs
+                    if (expected && strcmp(fill_key, url_string) == 0) coalesce_stream(url_string, fill);
+                } else {
+                    drop_fill(&fill);
+                    cacheable = 0;
+                }
+            }
+            #endif
+
+            // Send the client what it takes right away; the rest is queued while the origin is read on
+            size_t sent = 0;
+            if (queue.len == 0) {
+                // What the queue has no room for is sent blocking, so the client paces the origin
+                int wait = relay_queue_room(&queue) < out_len;
+                ssize_t n = send(client_socket_fd, out, out_len, MSG_NOSIGNAL | (wait ? 0 : MSG_DONTWAIT));
+                if (n < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) n = 0;
+                if (n < 0) {
+                    log_errno("send (client)");
+                    client_failed = 1;
+                    break;
+                }
+                sent = n;
+                count_sent(sent);
+            }
+            if (sent < out_len && relay_queue_push(&queue, out + sent, out_len - sent) < 0) {
+                log_errno("malloc for relay queue");
+                client_failed = 1;
+                break;
+            }
+            bytes_relayed += out_len;
+
+            #ifdef ENABLE_CACHE
+            if (held && resp.state != RESPONSE_HEAD) {
+                free(held);
+                held = NULL;
+            }
+            #endif
+        }
+
+        if (!spliced && resp.state != RESPONSE_DONE && !client_failed && resp.state != RESPONSE_ERROR) {
+            if (bytes_read < 0) log_errno("recv (destination)");
+            else http_response_eof(&resp);
+        }
+
+        if (reused && bytes_relayed == 0 && resp.state != RESPONSE_DONE && !client_failed && !timed_out) {
+            // The origin closed the idle connection before answering; retry once
+            http_response_free(&resp);
+            #ifdef ENABLE_CACHE
+            free(held);
+            drop_fill(&fill);
+            #endif
+            close(dest_socket_fd);
+            continue;
+        }
+        if (!spliced && bytes_read < 0 && !client_failed) {
+            metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+            if (timed_out) metrics_add(METRIC_UPSTREAM_TIMEOUTS, 1);
+        }
+        // Nothing has reached the client yet, so it can be told why
+        if (timed_out && bytes_relayed == 0) send_error_to_client(client_socket_fd, 504, "Gateway Timeout");
+
+        // A framed response that did not ask to close lets both sides persist
+        int origin_reusable = !client_failed && http_response_reusable(&resp);
+        client_reusable = origin_reusable;
+        if (resp.status_code && !client_failed && (bytes_relayed > 0 || !timed_out)) {
+            worker_buffers.access.status = resp.status_code;
         }
+        outcome = client_failed ? UPSTREAM_ABANDONED : resp.state == RESPONSE_DONE ? UPSTREAM_OK : UPSTREAM_FAILED;
+
+        #ifdef ENABLE_CACHE
+        if (not_modified) {
+            // The 304's headers say how long the stored copy is good for now
+            time_t refreshed;
+            if (http_cache_freshness(http_response_head(&resp), resp.head_len, time(NULL), &refreshed) == 0) {
+                cache_entry_refresh(stale, refreshed);
+            }
+            worker_buffers.access.cache = LOG_CACHE_REVALIDATED;
+            client_reusable = send_cached_response(client_socket_fd, stale);
+        } else if (fill && resp.state == RESPONSE_DONE) {
+            struct timespec fetch_done;
+            clock_gettime(CLOCK_MONOTONIC, &fetch_done);
+            unsigned int fetch_ms = (fetch_done.tv_sec - fetch_started.tv_sec) * 1000 +
+                                    (fetch_done.tv_nsec - fetch_started.tv_nsec) / 1000000;
+            http_compress_commit(fill, req, fetch_ms, fresh_until);
+        } else if (stale) {
+            // The stored copy is outdated and this response cannot replace it
+            cache_remove(cache_entry_url(stale));
+        }
+        free(held);
+        drop_fill(&fill);
+        #else
+        (void)url_string;
         #endif
-    }
-    
-    if (bytes_read < 0) {
-        perror("recv (destination)");
-    }
 
-    #ifdef ENABLE_CACHE
-    if (full_response && total_response_size > 0) {
-        cache_put(url_string, full_response, total_response_size);
-        free(full_response);
+        if (keep_alive && origin_reusable) {
+            upstream_pool_put(req->host, req->port, dest_socket_fd);
+        } else {
+            close(dest_socket_fd);
+        }
+        http_response_free(&resp);
+        break;
     }
-    #endif
 
-    close(dest_socket_fd);
+    upstream_guard_release(guard, trial, outcome);
+    free(request_to_send);
+
+    // The origin is done with; the client gets what was read ahead of it at its own pace
+    if ((queue.len > 0 || relay_piped > 0) && drain_client(client_socket_fd, &queue) < 0) client_reusable = 0;
+    relay_queue_clear(&queue);
+    if (relay_piped > 0) discard_relay_pipe();
+    return client_reusable;
 }
 
 /**
@@ -355,22 +1570,600 @@ int send_error_to_client(int client_socket_fd, int status_code, const char *stat
         "Content-Length: 0\r\n"
         "Connection: close\r\n\r\n",
         status_code, status_message);
-    
-    return send(client_socket_fd, response, len, 0);
+
+    int sent = send(client_socket_fd, response, len, 0);
+    if (sent > 0) count_sent(sent);
+    worker_buffers.access.status = status_code;
+    return sent;
 }
 
 
 /**
- * @brief Handles signals for graceful shutdown.
+ * @brief Sets every option to its default.
  */
-void signal_handler(int signum) {
-    if (signum == SIGINT) {
+static void default_options(ProxyOptions *o) {
+    *o = (ProxyOptions){
+        .engine = ENGINE_THREAD,
+        .port = DEFAULT_PORT,
+        .backlog = DEFAULT_BACKLOG,
+        .num_workers = DEFAULT_WORKERS,
+        .queue_depth = DEFAULT_QUEUE_DEPTH,
+        .max_idle_upstream = DEFAULT_MAX_IDLE_UPSTREAM,
+        .upstream_idle_timeout = DEFAULT_UPSTREAM_IDLE_TIMEOUT,
+        .client_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT,
+        .origin_timeouts = { DEFAULT_CONNECT_TIMEOUT, DEFAULT_FIRST_BYTE_TIMEOUT, DEFAULT_ORIGIN_IDLE_TIMEOUT, 0 },
+        .guard_config = { 0, DEFAULT_CIRCUIT_FAILURES, DEFAULT_CIRCUIT_OPEN_TIME },
+        .num_resolvers = DEFAULT_RESOLVERS,
+        .dns_max_ttl = DEFAULT_DNS_MAX_TTL,
+        .cache_mb = DEFAULT_CACHE_SIZE_MB,
+        .max_object_kb = DEFAULT_MAX_OBJECT_KB,
+        .cache_shards = DEFAULT_CACHE_SHARDS,
+        .cache_policy = CACHE_POLICY_LRU,
+        .cache_objective = CACHE_OBJECTIVE_OBJECTS,
+        .cache_tinylfu = 1,
+        .coalesce_timeout = DEFAULT_COALESCE_TIMEOUT,
+        .disk_cache_mb = DEFAULT_DISK_CACHE_SIZE,
+        .compress_codings = "off",
+        .relay_buffer_size = DEFAULT_RELAY_BUFFER_KB * 1024,
+        .queue_config = { (size_t)DEFAULT_CLIENT_QUEUE_KB * 1024, (size_t)DEFAULT_TOTAL_QUEUE_MB << 20 },
+        .log_config = { LOG_LEVEL_INFO, "-", 1, DEFAULT_LOG_RATE },
+    };
+}
+
+/**
+ * @brief Applies one option, from the command line or the configuration file.
+ *
+ * Out-of-range numbers fall back to their default with a warning, as they
+ * always have; only names that mean nothing are errors.
+ * @param opt The option's letter.
+ * @param arg Its argument; NULL for a flag given on the command line.
+ * @return 0 on success, -1 on an invalid option.
+ */
+static int apply_option(ProxyOptions *o, int opt, const char *arg) {
+    switch (opt) {
+        case 'p':
+            o->port = atoi(arg);
+            if (o->port <= 0 || o->port > 65535) {
+                fprintf(stderr, "Invalid port number. Using default %d.\n", DEFAULT_PORT);
+                o->port = DEFAULT_PORT;
+            }
+            break;
+        case 'e':
+            if (strcmp(arg, "thread") == 0) o->engine = ENGINE_THREAD;
+            else if (strcmp(arg, "epoll") == 0) o->engine = ENGINE_EPOLL;
+            else if (strcmp(arg, "uring") == 0) o->engine = ENGINE_URING;
+            else {
+                fprintf(stderr, "Unknown engine '%s'.\n", arg);
+                return -1;
+            }
+            break;
+        case 'l':
+            o->loop_config.num_loops = atoi(arg);
+            if (o->loop_config.num_loops < 0) {
+                fprintf(stderr, "Invalid event loop count. Using one per CPU.\n");
+                o->loop_config.num_loops = 0;
+            }
+            break;
+        case 'b':
+            o->backlog = atoi(arg);
+            if (o->backlog <= 0) {
+                fprintf(stderr, "Invalid backlog. Using default %d.\n", DEFAULT_BACKLOG);
+                o->backlog = DEFAULT_BACKLOG;
+            }
+            break;
+        case 'w':
+            o->num_workers = atoi(arg);
+            if (o->num_workers < 1) {
+                fprintf(stderr, "Invalid worker count. Using default %d.\n", DEFAULT_WORKERS);
+                o->num_workers = DEFAULT_WORKERS;
+            }
+            break;
+        case 'q':
+            o->queue_depth = atoi(arg);
+            if (o->queue_depth < 1) {
+                fprintf(stderr, "Invalid queue depth. Using default %d.\n", DEFAULT_QUEUE_DEPTH);
+                o->queue_depth = DEFAULT_QUEUE_DEPTH;
+            }
+            break;
+        case 'i':
+            o->max_idle_upstream = atoi(arg);
+            if (o->max_idle_upstream < 0) {
+                fprintf(stderr, "Invalid idle connection limit. Using default %d.\n", DEFAULT_MAX_IDLE_UPSTREAM);
+                o->max_idle_upstream = DEFAULT_MAX_IDLE_UPSTREAM;
+            }
+            break;
+        case 'I':
+            o->upstream_idle_timeout = atoi(arg);
+            if (o->upstream_idle_timeout < 1) {
+                fprintf(stderr, "Invalid idle timeout. Using default %d.\n", DEFAULT_UPSTREAM_IDLE_TIMEOUT);
+                o->upstream_idle_timeout = DEFAULT_UPSTREAM_IDLE_TIMEOUT;
+            }
+            break;
+        case 't':
+            o->client_idle_timeout = atoi(arg);
+            if (o->client_idle_timeout < 0) {
+                fprintf(stderr, "Invalid client idle timeout. Using default %d.\n", DEFAULT_CLIENT_IDLE_TIMEOUT);
+                o->client_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT;
+            }
+            break;
+        case 'k':
+            o->origin_timeouts.connect_ms = atoi(arg);
+            if (o->origin_timeouts.connect_ms < 0) {
+                fprintf(stderr, "Invalid connect timeout. Using default %d.\n", DEFAULT_CONNECT_TIMEOUT);
+                o->origin_timeouts.connect_ms = DEFAULT_CONNECT_TIMEOUT;
+            }
+            break;
+        case 'f':
+            o->origin_timeouts.first_byte_ms = atoi(arg);
+            if (o->origin_timeouts.first_byte_ms < 0) {
+                fprintf(stderr, "Invalid first byte timeout. Using default %d.\n", DEFAULT_FIRST_BYTE_TIMEOUT);
+                o->origin_timeouts.first_byte_ms = DEFAULT_FIRST_BYTE_TIMEOUT;
+            }
+            break;
+        case 'u':
+            o->origin_timeouts.idle_ms = atoi(arg);
+            if (o->origin_timeouts.idle_ms < 0) {
+                fprintf(stderr, "Invalid origin idle timeout. Using default %d.\n", DEFAULT_ORIGIN_IDLE_TIMEOUT);
+                o->origin_timeouts.idle_ms = DEFAULT_ORIGIN_IDLE_TIMEOUT;
+            }
+            break;
+        case 'g':
+            o->origin_timeouts.deadline_ms = atoi(arg);
+            if (o->origin_timeouts.deadline_ms < 0) {
+                fprintf(stderr, "Invalid request deadline. Using none.\n");
+                o->origin_timeouts.deadline_ms = 0;
+            }
+            break;
+        case 'm':
+            o->guard_config.max_active = atoi(arg);
+            if (o->guard_config.max_active < 0) {
+                fprintf(stderr, "Invalid per-origin request limit. Using none.\n");
+                o->guard_config.max_active = 0;
+            }
+            break;
+        case 'E':
+            o->guard_config.failure_threshold = atoi(arg);
+            if (o->guard_config.failure_threshold < 0) {
+                fprintf(stderr, "Invalid circuit breaker threshold. Using default %d.\n", DEFAULT_CIRCUIT_FAILURES);
+                o->guard_config.failure_threshold = DEFAULT_CIRCUIT_FAILURES;
+            }
+            break;
+        case 'o':
+            o->guard_config.open_ms = atoi(arg);
+            if (o->guard_config.open_ms < 1) {
+                fprintf(stderr, "Invalid circuit open time. Using default %d.\n", DEFAULT_CIRCUIT_OPEN_TIME);
+                o->guard_config.open_ms = DEFAULT_CIRCUIT_OPEN_TIME;
+            }
+            break;
+        case 'R':
+            o->num_resolvers = atoi(arg);
+            if (o->num_resolvers <= 0) {
+                fprintf(stderr, "Invalid resolver count. Using default %d.\n", DEFAULT_RESOLVERS);
+                o->num_resolvers = DEFAULT_RESOLVERS;
+            }
+            break;
+        case 'T':
+            o->dns_max_ttl = atoi(arg);
+            if (o->dns_max_ttl <= 0) {
+                fprintf(stderr, "Invalid DNS TTL cap. Using default %d.\n", DEFAULT_DNS_MAX_TTL);
+                o->dns_max_ttl = DEFAULT_DNS_MAX_TTL;
+            }
+            break;
+        case 'S':
+            o->cache_shards = atoi(arg);
+            if (o->cache_shards <= 0) {
+                fprintf(stderr, "Invalid cache shard count. Using default %d.\n", DEFAULT_CACHE_SHARDS);
+                o->cache_shards = DEFAULT_CACHE_SHARDS;
+            }
+            break;
+        case 'Z':
+            o->cache_mb = atol(arg);
+            if (o->cache_mb <= 0) {
+                fprintf(stderr, "Invalid cache size. Using default %d.\n", DEFAULT_CACHE_SIZE_MB);
+                o->cache_mb = DEFAULT_CACHE_SIZE_MB;
+            }
+            break;
+        case 'Y':
+            o->max_object_kb = atol(arg);
+            if (o->max_object_kb <= 0) {
+                fprintf(stderr, "Invalid object size limit. Using default %d.\n", DEFAULT_MAX_OBJECT_KB);
+                o->max_object_kb = DEFAULT_MAX_OBJECT_KB;
+            }
+            break;
+        case 'P':
+            if (strcmp(arg, "clock") == 0) o->cache_policy = CACHE_POLICY_CLOCK;
+            else if (strcmp(arg, "lru") == 0) o->cache_policy = CACHE_POLICY_LRU;
+            else if (strcmp(arg, "gdsf") == 0) o->cache_policy = CACHE_POLICY_GDSF;
+            else {
+                fprintf(stderr, "Unknown eviction policy '%s'.\n", arg);
+                return -1;
+            }
+            break;
+        case 'O':
+            if (strcmp(arg, "objects") == 0) o->cache_objective = CACHE_OBJECTIVE_OBJECTS;
+            else if (strcmp(arg, "bytes") == 0) o->cache_objective = CACHE_OBJECTIVE_BYTES;
+            else if (strcmp(arg, "latency") == 0) o->cache_objective = CACHE_OBJECTIVE_LATENCY;
+            else {
+                fprintf(stderr, "Unknown cache objective '%s'.\n", arg);
+                return -1;
+            }
+            break;
+        case 'A':
+            if (strcmp(arg, "tinylfu") == 0) o->cache_tinylfu = 1;
+            else if (strcmp(arg, "all") == 0) o->cache_tinylfu = 0;
+            else {
+                fprintf(stderr, "Unknown admission policy '%s'.\n", arg);
+                return -1;
+            }
+            break;
+        case 'C':
+            o->coalesce_timeout = atoi(arg);
+            if (o->coalesce_timeout < 0) {
+                fprintf(stderr, "Invalid coalescing timeout. Using default %d.\n", DEFAULT_COALESCE_TIMEOUT);
+                o->coalesce_timeout = DEFAULT_COALESCE_TIMEOUT;
+            }
+            break;
+        case 'd':
+            o->disk_cache_dir = arg;
+            break;
+        case 'D':
+            o->disk_cache_mb = atol(arg);
+            if (o->disk_cache_mb <= 0) {
+                fprintf(stderr, "Invalid disk cache size. Using default %d.\n", DEFAULT_DISK_CACHE_SIZE);
+                o->disk_cache_mb = DEFAULT_DISK_CACHE_SIZE;
+            }
+            break;
+        case 's':
+            o->cache_snapshot_path = arg;
+            break;
+        case 'z':
+            o->compress_codings = arg;
+            break;
+        case 'B': {
+            long kb = atol(arg);
+            if (kb < 4 || kb > 1024) {
+                fprintf(stderr, "Invalid relay buffer size. Using default %d.\n", DEFAULT_RELAY_BUFFER_KB);
+                kb = DEFAULT_RELAY_BUFFER_KB;
+            }
+            o->relay_buffer_size = (size_t)kb * 1024;
+            break;
+        }
+        case 'W': {
+            long kb = atol(arg);
+            if (kb < 0) {
+                fprintf(stderr, "Invalid client queue size. Using default %d.\n", DEFAULT_CLIENT_QUEUE_KB);
+                kb = DEFAULT_CLIENT_QUEUE_KB;
+            }
+            o->queue_config.per_connection = (size_t)kb * 1024;
+            break;
+        }
+        case 'U': {
+            long mb = atol(arg);
+            if (mb < 0) {
+                fprintf(stderr, "Invalid total queue size. Using default %d.\n", DEFAULT_TOTAL_QUEUE_MB);
+                mb = DEFAULT_TOTAL_QUEUE_MB;
+            }
+            o->queue_config.total = (size_t)mb << 20;
+            break;
+        }
+        case 'M':
+            o->metrics_port = atoi(arg);
+            if (o->metrics_port <= 0 || o->metrics_port > 65535) {
+                fprintf(stderr, "Invalid metrics port. Metrics endpoint disabled.\n");
+                o->metrics_port = 0;
+            }
+            break;
+        case 'a':
+            o->log_config.access_log = arg;
+            break;
+        case 'L':
+            if (log_parse_level(arg, &o->log_config.level) != 0) {
+                fprintf(stderr, "Unknown log level '%s'.\n", arg);
+                return -1;
+            }
+            break;
+        case 'n':
+            o->log_config.sample = atoi(arg);
+            if (o->log_config.sample <= 0) {
+                fprintf(stderr, "Invalid access log sampling. Logging every request.\n");
+                o->log_config.sample = 1;
+            }
+            break;
+        case 'x':
+            o->log_config.rate = atoi(arg);
+            if (o->log_config.rate < 0) {
+                fprintf(stderr, "Invalid log rate limit. Using default %d.\n", DEFAULT_LOG_RATE);
+                o->log_config.rate = DEFAULT_LOG_RATE;
+            }
+            break;
+        case 'r':
+        case 'c': {
+            // Flags on the command line, "yes" or "no" in the file
+            int on = 1;
+            if (arg) {
+                if (strcmp(arg, "yes") == 0) on = 1;
+                else if (strcmp(arg, "no") == 0) on = 0;
+                else {
+                    fprintf(stderr, "Expected yes or no, not '%s'.\n", arg);
+                    return -1;
+                }
+            }
+            if (opt == 'r') o->loop_config.reuse_port = on;
+            else o->loop_config.pin_cpus = on;
+            break;
+        }
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Applies a configuration file setting (config_file_load() callback).
+ */
+static int apply_setting(void *arg, const char *key, const char *value) {
+    ProxyOptions *o = (ProxyOptions *)arg;
+    for (size_t i = 0; i < sizeof(setting_keys) / sizeof(setting_keys[0]); i++) {
+        if (strcmp(key, setting_keys[i].key) == 0) return apply_option(o, setting_keys[i].opt, value);
+    }
+    return -1;
+}
+
+/**
+ * @brief Builds the options: the defaults, overridden by the configuration
+ * file if there is one, overridden in turn by the command line.
+ * @param text Set to the file's text, which strings in the options point
+ * into (free with free()), or NULL without a file.
+ * @return 0 on success, -1 on an invalid option.
+ */
+static int load_options(ProxyOptions *opts, char **text) {
+    default_options(opts);
+    *text = NULL;
+    if (config_path) {
+        *text = config_file_load(config_path, apply_setting, opts);
+        if (!*text) return -1;
+    }
+    for (int i = 0; i < num_cli_options; i++) {
+        if (apply_option(opts, cli_options[i].opt, cli_options[i].arg) != 0) {
+            free(*text);
+            *text = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Prints command-line usage.
+ */
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-e thread|epoll|uring] [-w workers] [-q depth] [-i idle] [-I secs] [-t secs] [-k ms] [-f ms] [-u ms] [-g ms] [-m requests] [-E failures] [-o ms] [-R resolvers] [-T secs] [-S shards] [-Z megabytes] [-Y kilobytes] [-P lru|clock|gdsf] [-O objects|bytes|latency] [-A tinylfu|all] [-C secs] [-d dir] [-D megabytes] [-s file] [-z codings] [-B kilobytes] [-W kilobytes] [-U megabytes] [-M port] [-a file] [-L level] [-n N] [-x rate] [-l loops] [-r] [-c] [-b backlog] [-F file] [port]\n"
+        "  -e  Connection engine; uring falls back to epoll where unsupported (default: thread)\n"
+        "  -w  Worker threads for the thread engine (default: %d)\n"
+        "  -q  Accept queue depth for the thread engine (default: %d)\n"
+        "  -i  Idle keep-alive connections kept per origin, 0 disables (default: %d)\n"
+        "  -I  Seconds an idle origin connection is kept (default: %d)\n"
+        "  -t  Seconds a keep-alive client may idle, 0 disables keep-alive (default: %d)\n"
+        "  -k  Milliseconds to connect to an origin address, 0 for no limit (default: %d)\n"
+        "  -f  Milliseconds an origin may take to start answering, 0 for no limit (default: %d)\n"
+        "  -u  Longest pause in milliseconds while talking to an origin, 0 for no limit (default: %d)\n"
+        "  -g  Milliseconds a request may spend until its origin exchange is over, 0 for no limit (default: 0)\n"
+        "  -m  Requests in flight to one origin at once, 0 for no limit (default: 0)\n"
+        "  -E  Consecutive failures that open an origin's circuit, 0 disables (default: %d)\n"
+        "  -o  Milliseconds an open circuit refuses requests before trying the origin (default: %d)\n"
+        "  -R  Resolver threads behind the DNS cache (default: %d)\n"
+        "  -T  Maximum seconds a DNS answer is cached (default: %d)\n"
+        "  -S  Cache shards, rounded up to a power of 2 (default: %d)\n"
+        "  -Z  Megabytes of memory cache; SIGHUP applies a new value from -F (default: %d)\n"
+        "  -Y  Kilobytes a single cached object may take; likewise reloaded (default: %d)\n"
+        "  -P  Cache eviction policy; clock makes hits lock-free, gdsf weighs size and cost (default: lru)\n"
+        "  -O  What gdsf maximizes: object hits, byte hits, or origin latency saved (default: objects)\n"
+        "  -A  Cache admission; tinylfu only keeps objects more popular than what they evict (default: tinylfu)\n"
+        "  -C  Seconds a cache miss waits for an identical fetch in flight, 0 disables (default: %d)\n"
+        "  -d  Directory for a persistent disk tier that keeps objects evicted from memory (default: none)\n"
+        "  -D  Megabytes of disk the disk tier may use (default: %d)\n"
+        "  -s  Snapshot file: the memory cache is saved to it on shutdown and restored from it at startup (default: none)\n"
+        "  -z  Codings cached text responses are compressed in for clients that accept them, from gzip,br, or off (default: off)\n"
+        "  -B  Kilobytes read from the origin at once, 4 to 1024 (default: %d)\n"
+        "  -W  Kilobytes of response read ahead of a slow client, 0 disables (default: %d)\n"
+        "  -U  Megabytes read ahead of all slow clients together, 0 for no limit (default: %d)\n"
+        "  -M  Port for the Prometheus metrics endpoint, GET /metrics (default: none)\n"
+        "  -a  Access log file, - for stdout, off to disable (default: -)\n"
+        "  -L  Log level: error, warn, info or debug; SIGUSR2 toggles debug (default: info)\n"
+        "  -n  Keep one access record in N; server errors are always kept (default: 1)\n"
+        "  -x  Access records a thread may queue per second, 0 for no limit (default: %d)\n"
+        "  -l  Number of event loops for the epoll engine (default: one per CPU)\n"
+        "  -r  Multi-reactor mode: one SO_REUSEPORT listener per event loop\n"
+        "  -c  Pin each event loop to a CPU (with -r, also sets SO_INCOMING_CPU)\n"
+        "  -b  listen() backlog (default: %d)\n"
+        "  -F  Configuration file of 'key = value' lines, overridden by the command line; SIGHUP reloads it\n",
+        prog, DEFAULT_WORKERS, DEFAULT_QUEUE_DEPTH, DEFAULT_MAX_IDLE_UPSTREAM,
+        DEFAULT_UPSTREAM_IDLE_TIMEOUT, DEFAULT_CLIENT_IDLE_TIMEOUT, DEFAULT_CONNECT_TIMEOUT,
+        DEFAULT_FIRST_BYTE_TIMEOUT, DEFAULT_ORIGIN_IDLE_TIMEOUT, DEFAULT_CIRCUIT_FAILURES,
+        DEFAULT_CIRCUIT_OPEN_TIME, DEFAULT_RESOLVERS,
+        DEFAULT_DNS_MAX_TTL, DEFAULT_CACHE_SHARDS, DEFAULT_CACHE_SIZE_MB, DEFAULT_MAX_OBJECT_KB, DEFAULT_COALESCE_TIMEOUT, DEFAULT_DISK_CACHE_SIZE,
+        DEFAULT_RELAY_BUFFER_KB, DEFAULT_CLIENT_QUEUE_KB, DEFAULT_TOTAL_QUEUE_MB, DEFAULT_LOG_RATE, DEFAULT_BACKLOG);
+}
+
+#ifdef ENABLE_CACHE
+/**
+ * @brief Waits for SIGUSR1 and writes the cache memory stats to stdout.
+ *
+ * Running in its own thread keeps the reporting out of signal context, where
+ * taking locks or using stdio is unsafe.
+ */
+static void *stats_signal_thread(void *arg) {
+    (void)arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    while (1) {
+        int signum;
+        if (sigwait(&signals, &signum) != 0) continue;
+        cache_dump_stats(stdout);
+        disk_cache_dump_stats(stdout);
+        fflush(stdout);
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Whether two option strings differ; NULL is a value of its own.
+ */
+static int string_changed(const char *a, const char *b) {
+    if (!a || !b) return a != b;
+    return strcmp(a, b) != 0;
+}
+
+/**
+ * @brief Whether the option with the given letter differs between two sets
+ * of options.
+ */
+static int option_changed(const ProxyOptions *a, const ProxyOptions *b, int opt) {
+    switch (opt) {
+        case 'p': return a->port != b->port;
+        case 'e': return a->engine != b->engine;
+        case 'w': return a->num_workers != b->num_workers;
+        case 'q': return a->queue_depth != b->queue_depth;
+        case 'l': return a->loop_config.num_loops != b->loop_config.num_loops;
+        case 'r': return a->loop_config.reuse_port != b->loop_config.reuse_port;
+        case 'c': return a->loop_config.pin_cpus != b->loop_config.pin_cpus;
+        case 'b': return a->backlog != b->backlog;
+        case 't': return a->client_idle_timeout != b->client_idle_timeout;
+        case 'i': return a->max_idle_upstream != b->max_idle_upstream;
+        case 'I': return a->upstream_idle_timeout != b->upstream_idle_timeout;
+        case 'k': return a->origin_timeouts.connect_ms != b->origin_timeouts.connect_ms;
+        case 'f': return a->origin_timeouts.first_byte_ms != b->origin_timeouts.first_byte_ms;
+        case 'u': return a->origin_timeouts.idle_ms != b->origin_timeouts.idle_ms;
+        case 'g': return a->origin_timeouts.deadline_ms != b->origin_timeouts.deadline_ms;
+        case 'm': return a->guard_config.max_active != b->guard_config.max_active;
+        case 'E': return a->guard_config.failure_threshold != b->guard_config.failure_threshold;
+        case 'o': return a->guard_config.open_ms != b->guard_config.open_ms;
+        case 'R': return a->num_resolvers != b->num_resolvers;
+        case 'T': return a->dns_max_ttl != b->dns_max_ttl;
+        case 'Z': return a->cache_mb != b->cache_mb;
+        case 'Y': return a->max_object_kb != b->max_object_kb;
+        case 'S': return a->cache_shards != b->cache_shards;
+        case 'P': return a->cache_policy != b->cache_policy;
+        case 'O': return a->cache_objective != b->cache_objective;
+        case 'A': return a->cache_tinylfu != b->cache_tinylfu;
+        case 'C': return a->coalesce_timeout != b->coalesce_timeout;
+        case 'd': return string_changed(a->disk_cache_dir, b->disk_cache_dir);
+        case 'D': return a->disk_cache_mb != b->disk_cache_mb;
+        case 's': return string_changed(a->cache_snapshot_path, b->cache_snapshot_path);
+        case 'z': return string_changed(a->compress_codings, b->compress_codings);
+        case 'B': return a->relay_buffer_size != b->relay_buffer_size;
+        case 'W': return a->queue_config.per_connection != b->queue_config.per_connection;
+        case 'U': return a->queue_config.total != b->queue_config.total;
+        case 'M': return a->metrics_port != b->metrics_port;
+        case 'a': return string_changed(a->log_config.access_log, b->log_config.access_log);
+        case 'L': return a->log_config.level != b->log_config.level;
+        case 'n': return a->log_config.sample != b->log_config.sample;
+        case 'x': return a->log_config.rate != b->log_config.rate;
+        default: return 0;
+    }
+}
+
+/**
+ * @brief Reads the configuration again and applies what can change while
+ * the proxy runs.
+ *
+ * The command line still overrides the file. The cache is resized to the
+ * new budget, evicting incrementally if it shrank; the log level, the
+ * per-origin limits and the origin timeouts are set for the requests that
+ * come next. Every changed setting is logged, and those that keep their
+ * startup value until a restart are logged as such. An invalid file
+ * changes nothing.
+ */
+static void reload_options() {
+    ProxyOptions opts;
+    char *text;
+    if (load_options(&opts, &text) != 0) {
+        log_message(LOG_LEVEL_ERROR, "Configuration not reloaded; keeping the running one.");
+        return;
+    }
+    int changes = 0;
+    for (size_t i = 0; i < sizeof(setting_keys) / sizeof(setting_keys[0]); i++) {
+        int opt = setting_keys[i].opt;
+        if (!option_changed(&running_options, &opts, opt)) continue;
+        changes++;
+        if (strchr(RELOADABLE_OPTIONS, opt)) {
+            log_message(LOG_LEVEL_INFO, "Reloaded %s.", setting_keys[i].key);
+        } else {
+            log_message(LOG_LEVEL_WARN, "%s changed, but keeps its startup value until a restart.",
+                        setting_keys[i].key);
+        }
+    }
+    if (changes == 0) {
+        log_message(LOG_LEVEL_INFO, "Configuration in %s unchanged.", config_path ? config_path : "the command line");
+    }
+
+    log_set_level(opts.log_config.level);
+    upstream_guard_configure(&opts.guard_config);
+    upstream_guard_set_timeouts(&opts.origin_timeouts);
+    #ifdef ENABLE_CACHE
+    cache_resize((size_t)opts.cache_mb << 20, (size_t)opts.max_object_kb * 1024);
+    #endif
+    // The strings stay the startup ones, since the new text is freed
+    running_options.log_config.level = opts.log_config.level;
+    running_options.guard_config = opts.guard_config;
+    running_options.origin_timeouts = opts.origin_timeouts;
+    running_options.cache_mb = opts.cache_mb;
+    running_options.max_object_kb = opts.max_object_kb;
+    free(text);
+}
+
+/**
+ * @brief Waits for SIGHUP and reloads the configuration, outside signal
+ * context like the stats thread.
+ */
+static void *reload_signal_thread(void *arg) {
+    (void)arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    while (1) {
+        int signum;
+        if (sigwait(&signals, &signum) != 0) continue;
+        reload_options();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Waits for SIGINT and starts a graceful shutdown, outside signal
+ * context like the stats thread; a second SIGINT exits without draining.
+ *
+ * The engine stops accepting and drains, after which main() tears the
+ * services down in order.
+ */
+static void *shutdown_signal_thread(void *arg) {
+    (void)arg;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    while (1) {
+        int signum;
+        if (sigwait(&signals, &signum) != 0) continue;
+        if (atomic_exchange(&shutting_down, 1)) {
+            printf("\nCaught SIGINT again. Exiting without draining.\n");
+            _exit(EXIT_FAILURE);
+        }
         printf("\nCaught SIGINT. Shutting down gracefully...\n");
-        #ifdef ENABLE_CACHE
-        cache_destroy();
-        printf("Cache cleaned up.\n");
-        #endif
-        exit(0);
+        event_loop_stop();
+        // Wakes an accept() blocked on it; the descriptor itself is closed later
+        int fd = atomic_load(&listen_socket_fd);
+        if (fd >= 0) shutdown(fd, SHUT_RDWR);
     }
+    return NULL;
+}
+
+/**
+ * @brief Handles the debug logging toggle (SIGUSR2).
+ */
+void signal_handler(int signum) {
+    if (signum == SIGUSR2) log_toggle_debug();
 }
 
@@ -0,0 +1,267 @@
+/**
+ * @file relay_queue.c
+ * @author Shubham More
+ * @brief Implementation of the relay queues for slow clients.
+ *
+ * A queue is a singly linked list of 16 KB chunks, appended to at the tail
+ * and sent from the head with one sendmsg() over several chunks at a time
+ * (or peeked at and consumed around a send the caller makes itself).
+ * Queues are only touched by the thread serving their connection, so each
+ * thread keeps a few spare chunks instead of going back to malloc() for
+ * every one. The only shared state is the count of bytes queued across all
+ * connections, which is kept with relaxed atomics; it bounds memory, not
+ * correctness, so an approximate view is enough.
+ */
+
+#define _GNU_SOURCE
+#include "relay_queue.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#define RELAY_CHUNK_SIZE (16 * 1024)
+#define MAX_SPARE_CHUNKS 16     // Kept per thread for the next queue
+#define MAX_SEND_CHUNKS 16      // Chunks sent by one sendmsg()
+
+// A piece of a queue
+struct RelayChunk {
+    struct RelayChunk *next;
+    size_t start;               // First byte not sent yet
+    size_t end;                 // One past the last byte written
+    char data[RELAY_CHUNK_SIZE];
+};
+
+// --- Global Queue State ---
+static relay_queue_config_t queue_config;
+static size_t queued_total;     // Bytes in all queues
+
+static __thread RelayChunk *spare_chunks;
+static __thread int spare_chunk_count;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Takes a chunk from the calling thread's spares, or allocates one.
+ */
+static RelayChunk *take_chunk() {
+    RelayChunk *chunk = spare_chunks;
+    if (chunk) {
+        spare_chunks = chunk->next;
+        spare_chunk_count--;
+    } else {
+        chunk = malloc(sizeof(RelayChunk));
+        if (!chunk) return NULL;
+    }
+    chunk->next = NULL;
+    chunk->start = chunk->end = 0;
+    return chunk;
+}
+
+/**
+ * @brief Keeps a chunk as a spare, or frees it if there are enough.
+ */
+static void put_chunk(RelayChunk *chunk) {
+    if (spare_chunk_count >= MAX_SPARE_CHUNKS) {
+        free(chunk);
+        return;
+    }
+    chunk->next = spare_chunks;
+    spare_chunks = chunk;
+    spare_chunk_count++;
+}
+
+/**
+ * @brief Accounts for bytes entering a queue.
+ */
+static void charge(size_t n) {
+    __atomic_add_fetch(&queued_total, n, __ATOMIC_RELAXED);
+    metrics_add(METRIC_RELAY_QUEUED, n);
+}
+
+/**
+ * @brief Accounts for bytes leaving a queue, sent or discarded.
+ */
+static void uncharge(size_t n) {
+    __atomic_sub_fetch(&queued_total, n, __ATOMIC_RELAXED);
+    metrics_add(METRIC_RELAY_DRAINED, n);
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Sets the limits every queue gets.
+ */
+void relay_queue_configure(const relay_queue_config_t *config) {
+    queue_config = *config;
+}
+
+/**
+ * @brief Initializes an empty queue.
+ */
+void relay_queue_init(RelayQueue *queue) {
+    queue->head = queue->tail = NULL;
+    queue->len = 0;
+}
+
+/**
+ * @brief How many more bytes the queue should take.
+ */
+size_t relay_queue_room(const RelayQueue *queue) {
+    if (queue->len >= queue_config.per_connection) return 0;
+    size_t room = queue_config.per_connection - queue->len;
+    if (queue_config.total) {
+        size_t queued = __atomic_load_n(&queued_total, __ATOMIC_RELAXED);
+        size_t left = queued < queue_config.total ? queue_config.total - queued : 0;
+        if (left < room) room = left;
+    }
+    return room;
+}
+
+/**
+ * @brief Appends a copy of some bytes to the queue.
+ */
+int relay_queue_push(RelayQueue *queue, const char *data, size_t len) {
+    size_t pushed = 0;
+    while (pushed < len) {
+        RelayChunk *tail = queue->tail;
+        if (!tail || tail->end == RELAY_CHUNK_SIZE) {
+            RelayChunk *chunk = take_chunk();
+            if (!chunk) break;
+            if (tail) tail->next = chunk;
+            else queue->head = chunk;
+            queue->tail = tail = chunk;
+        }
+        size_t n = RELAY_CHUNK_SIZE - tail->end;
+        if (n > len - pushed) n = len - pushed;
+        memcpy(tail->data + tail->end, data + pushed, n);
+        tail->end += n;
+        pushed += n;
+    }
+    // Whatever made it in counts, so a failed push leaves the books straight
+    queue->len += pushed;
+    charge(pushed);
+    return pushed == len ? 0 : -1;
+}
+
+/**
+ * @brief Puts a copy of some bytes in front of what is queued.
+ */
+int relay_queue_push_front(RelayQueue *queue, const char *data, size_t len) {
+    RelayChunk *first = NULL, *last = NULL;
+    for (size_t pushed = 0; pushed < len;) {
+        RelayChunk *chunk = take_chunk();
+        if (!chunk) {
+            while (first) {
+                RelayChunk *next = first->next;
+                put_chunk(first);
+                first = next;
+            }
+            return -1;
+        }
+        size_t n = len - pushed < RELAY_CHUNK_SIZE ? len - pushed : RELAY_CHUNK_SIZE;
+        memcpy(chunk->data, data + pushed, n);
+        chunk->end = n;
+        pushed += n;
+        if (last) last->next = chunk;
+        else first = chunk;
+        last = chunk;
+    }
+    if (!first) return 0;
+    last->next = queue->head;
+    queue->head = first;
+    if (!queue->tail) queue->tail = last;
+    queue->len += len;
+    charge(len);
+    return 0;
+}
+
+/**
+ * @brief Points iovecs at the oldest queued bytes.
+ */
+int relay_queue_peek(const RelayQueue *queue, struct iovec *iov, int max) {
+    int count = 0;
+    for (RelayChunk *chunk = queue->head; chunk && count < max; chunk = chunk->next) {
+        iov[count].iov_base = chunk->data + chunk->start;
+        iov[count++].iov_len = chunk->end - chunk->start;
+    }
+    return count;
+}
+
+/**
+ * @brief Drops the oldest bytes, once sent.
+ */
+void relay_queue_consume(RelayQueue *queue, size_t n) {
+    // Give back the chunks that went out in full, the tail among them if
+    // it did; a chunk sent in part stays at the head, its start moved on
+    size_t left = n;
+    while (left > 0 && queue->head) {
+        RelayChunk *chunk = queue->head;
+        size_t len = chunk->end - chunk->start;
+        if (left < len) {
+            chunk->start += left;
+            left = 0;
+            break;
+        }
+        left -= len;
+        queue->head = chunk->next;
+        if (!queue->head) queue->tail = NULL;
+        put_chunk(chunk);
+    }
+    n -= left;
+    queue->len -= n;
+    if (n) uncharge(n);
+}
+
+/**
+ * @brief Sends queued bytes to a socket, oldest first.
+ */
+ssize_t relay_queue_send(RelayQueue *queue, int fd, int flags) {
+    size_t total = 0;
+    while (queue->head) {
+        struct iovec iov[MAX_SEND_CHUNKS];
+        int count = relay_queue_peek(queue, iov, MAX_SEND_CHUNKS);
+        size_t want = 0;
+        for (int i = 0; i < count; i++) want += iov[i].iov_len;
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        relay_queue_consume(queue, sent);
+        total += sent;
+        if ((size_t)sent < want) break; // The socket is full
+    }
+    return total;
+}
+
+/**
+ * @brief Discards everything queued.
+ */
+void relay_queue_clear(RelayQueue *queue) {
+    while (queue->head) {
+        RelayChunk *chunk = queue->head;
+        queue->head = chunk->next;
+        put_chunk(chunk);
+    }
+    queue->tail = NULL;
+    if (queue->len) uncharge(queue->len);
+    queue->len = 0;
+}
+
+/**
+ * @brief Frees the calling thread's spare chunks.
+ */
+void relay_queue_thread_exit() {
+    while (spare_chunks) {
+        RelayChunk *chunk = spare_chunks;
+        spare_chunks = chunk->next;
+        free(chunk);
+    }
+    spare_chunk_count = 0;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file relay_queue.h
+ * @author Shubham More
+ * @brief Interface for the bounded queues that hold response bytes a client
+ * is not ready for yet.
+ *
+ * A client that reads more slowly than its origin sends would otherwise
+ * hold the origin connection for as long as it takes to drain the
+ * response. Instead, the relay keeps reading from the origin at the
+ * origin's pace and queues whatever the client cannot take right away, so
+ * the origin connection goes back to the pool as soon as the response is
+ * in, and the client is fed at its own pace afterwards.
+ *
+ * Each queue may hold up to a per-connection limit, and all queues
+ * together up to a global one. Once either is reached the relay stops
+ * reading from the origin until the client catches up, so a slow client
+ * is back to pacing its origin rather than growing the proxy's memory.
+ */
+
+#ifndef RELAY_QUEUE_H
+#define RELAY_QUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * @struct relay_queue_config_t
+ * @brief Startup options for the relay queues.
+ */
+typedef struct {
+    size_t per_connection;  // Bytes one queue may hold; 0 disables queueing
+    size_t total;           // Bytes all queues together may hold; 0 for no limit
+} relay_queue_config_t;
+
+typedef struct RelayChunk RelayChunk;
+
+/**
+ * @struct RelayQueue
+ * @brief Bytes waiting for one client, in order, in fixed-size chunks.
+ */
+typedef struct {
+    RelayChunk *head;   // Next bytes to send
+    RelayChunk *tail;   // Where new bytes are appended
+    size_t len;         // Bytes queued
+} RelayQueue;
+
+/**
+ * @brief Sets the limits every queue gets.
+ * @param config The options.
+ */
+void relay_queue_configure(const relay_queue_config_t *config);
+
+/**
+ * @brief Initializes an empty queue.
+ * @param queue The queue.
+ */
+void relay_queue_init(RelayQueue *queue);
+
+/**
+ * @brief How many more bytes the queue should take before the relay stops
+ * reading from the origin.
+ *
+ * The global limit is checked without a lock, so concurrent relays may
+ * overshoot it by about one read each.
+ * @param queue The queue.
+ * @return Bytes, 0 once the queue or all queues together are full.
+ */
+size_t relay_queue_room(const RelayQueue *queue);
+
+/**
+ * @brief Appends a copy of some bytes to the queue.
+ *
+ * The limits are not enforced here, only reported by relay_queue_room(),
+ * so bytes that were already read always have a place to go.
+ * @param queue The queue.
+ * @param data The bytes.
+ * @param len How many.
+ * @return 0 on success, -1 if out of memory.
+ */
+int relay_queue_push(RelayQueue *queue, const char *data, size_t len);
+
+/**
+ * @brief Puts a copy of some bytes in front of everything queued, for
+ * bytes a send left over that must go out before what was queued since.
+ * @param queue The queue.
+ * @param data The bytes.
+ * @param len How many.
+ * @return 0 on success, -1 if out of memory (nothing is added).
+ */
+int relay_queue_push_front(RelayQueue *queue, const char *data, size_t len);
+
+/**
+ * @brief Points iovecs at the oldest queued bytes, for a send made
+ * elsewhere (an io_uring submission).
+ *
+ * The bytes stay put until consumed, and pushing more leaves them alone,
+ * so the iovecs may be handed to the kernel; push_front and clear must
+ * wait until it is done with them.
+ * @param queue The queue.
+ * @param iov Filled in, one per chunk.
+ * @param max How many iovecs there are.
+ * @return How many were filled in, 0 if the queue is empty.
+ */
+int relay_queue_peek(const RelayQueue *queue, struct iovec *iov, int max);
+
+/**
+ * @brief Drops the oldest bytes once a send made from relay_queue_peek()
+ * got them out.
+ * @param queue The queue.
+ * @param n How many were sent.
+ */
+void relay_queue_consume(RelayQueue *queue, size_t n);
+
+/**
+ * @brief Sends queued bytes to a socket, oldest first.
+ * @param queue The queue.
+ * @param fd The socket.
+ * @param flags Extra send() flags, e.g. MSG_DONTWAIT on a blocking socket.
+ * @return Bytes sent (0 if the socket would block), or -1 on error.
+ */
+ssize_t relay_queue_send(RelayQueue *queue, int fd, int flags);
+
+/**
+ * @brief Discards everything queued.
+ * @param queue The queue.
+ */
+void relay_queue_clear(RelayQueue *queue);
+
+/**
+ * @brief Frees the calling thread's spare chunks.
+ *
+ * Spares are kept per thread for its next queues; a thread that used
+ * queues calls this as it exits, once its own queues are cleared.
+ */
+void relay_queue_thread_exit();
+
+#endif
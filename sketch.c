@@ -0,0 +1,127 @@
+/**
+ * @file sketch.c
+ * @author Shubham More
+ * @brief Implementation of the count-min frequency sketch.
+ *
+ * SKETCH_DEPTH rows of byte counters are indexed by independent functions
+ * of the key's hash (derived from its two halves), and a key's estimate is
+ * the smallest of its counters. Increments are conservative: only counters
+ * equal to the current minimum are raised, which keeps collisions from
+ * inflating estimates more than necessary.
+ *
+ * After SKETCH_SAMPLE_FACTOR increments per counter column every counter
+ * is halved. The increment that reaches the threshold does the halving, so
+ * aging needs no background thread and no lock.
+ */
+
+#include "sketch.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SKETCH_DEPTH 4          // Rows, each indexed by a different hash function
+#define SKETCH_MAX_COUNT 15     // Counters saturate here
+#define SKETCH_SAMPLE_FACTOR 10 // Increments per column between agings
+
+struct FrequencySketch {
+    size_t mask;                // Counters per row, minus one
+    size_t samples;             // Increments since the last aging (atomic)
+    size_t sample_limit;        // Increments that trigger aging
+    unsigned char *counters;    // SKETCH_DEPTH rows, each mask + 1 wide (atomic)
+};
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief The counter for a key in one row.
+ */
+static unsigned char *counter_for(const FrequencySketch *sketch, uint64_t hash, int row) {
+    // Kirsch-Mitzenmacher: h1 + row * h2 behaves like independent hashes
+    uint64_t h1 = hash, h2 = (hash >> 32) | (hash << 32) | 1;
+    size_t index = (size_t)(h1 + (uint64_t)row * h2) & sketch->mask;
+    return &sketch->counters[(size_t)row * (sketch->mask + 1) + index];
+}
+
+/**
+ * @brief Halves every counter so old popularity fades.
+ */
+static void age(FrequencySketch *sketch) {
+    size_t total = SKETCH_DEPTH * (sketch->mask + 1);
+    for (size_t i = 0; i < total; i++) {
+        unsigned char count = __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED);
+        if (count) __atomic_store_n(&sketch->counters[i], count >> 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Creates a sketch.
+ */
+FrequencySketch *sketch_create(size_t width) {
+    size_t columns = 64;
+    while (columns < width) columns <<= 1;
+
+    FrequencySketch *sketch = malloc(sizeof(FrequencySketch));
+    if (!sketch) {
+        perror("malloc for frequency sketch");
+        return NULL;
+    }
+    sketch->counters = calloc(SKETCH_DEPTH * columns, 1);
+    if (!sketch->counters) {
+        perror("calloc for frequency sketch counters");
+        free(sketch);
+        return NULL;
+    }
+    sketch->mask = columns - 1;
+    sketch->samples = 0;
+    sketch->sample_limit = SKETCH_SAMPLE_FACTOR * columns;
+    return sketch;
+}
+
+/**
+ * @brief Frees a sketch.
+ */
+void sketch_destroy(FrequencySketch *sketch) {
+    if (!sketch) return;
+    free(sketch->counters);
+    free(sketch);
+}
+
+/**
+ * @brief Records one occurrence of a key.
+ */
+void sketch_increment(FrequencySketch *sketch, uint64_t hash) {
+    unsigned char *counters[SKETCH_DEPTH];
+    unsigned int min = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        counters[row] = counter_for(sketch, hash, row);
+        unsigned int count = __atomic_load_n(counters[row], __ATOMIC_RELAXED);
+        if (count < min) min = count;
+    }
+    if (min == SKETCH_MAX_COUNT) return;
+
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        if (__atomic_load_n(counters[row], __ATOMIC_RELAXED) == min) {
+            __atomic_store_n(counters[row], (unsigned char)(min + 1), __ATOMIC_RELAXED);
+        }
+    }
+
+    // Exactly one increment sees the limit, and that one ages the sketch
+    if (__atomic_add_fetch(&sketch->samples, 1, __ATOMIC_RELAXED) == sketch->sample_limit) {
+        age(sketch);
+        __atomic_sub_fetch(&sketch->samples, sketch->sample_limit / 2, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Estimates how often a key has occurred recently.
+ */
+unsigned int sketch_estimate(const FrequencySketch *sketch, uint64_t hash) {
+    unsigned int min = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned int count = __atomic_load_n(counter_for(sketch, hash, row), __ATOMIC_RELAXED);
+        if (count < min) min = count;
+    }
+    return min;
+}
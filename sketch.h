@@ -0,0 +1,56 @@
+/**
+ * @file sketch.h
+ * @author Shubham More
+ * @brief Interface for a count-min frequency sketch with aging.
+ *
+ * Estimates how often each key has been seen recently, in a fixed amount of
+ * memory and without storing keys. The cache uses it to decide whether a new
+ * object is worth more than the one it would displace (TinyLFU admission).
+ *
+ * Counters saturate at 15 and are all halved after a fixed number of
+ * increments, so the estimates track recent popularity rather than all-time
+ * totals. Estimates can only overstate a key's frequency, never understate it.
+ *
+ * All operations are safe to call concurrently without a lock; increments
+ * racing with each other or with aging may occasionally be lost, which the
+ * sketch tolerates by design.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct FrequencySketch FrequencySketch;
+
+/**
+ * @brief Creates a sketch.
+ * @param width Counters per row; rounded up to a power of 2. Roughly the
+ * number of distinct keys the sketch can tell apart.
+ * @return The sketch, or NULL on failure.
+ */
+FrequencySketch *sketch_create(size_t width);
+
+/**
+ * @brief Frees a sketch.
+ * @param sketch The sketch (NULL is ignored).
+ */
+void sketch_destroy(FrequencySketch *sketch);
+
+/**
+ * @brief Records one occurrence of a key.
+ * @param sketch The sketch.
+ * @param hash A well-mixed 64-bit hash of the key.
+ */
+void sketch_increment(FrequencySketch *sketch, uint64_t hash);
+
+/**
+ * @brief Estimates how often a key has occurred recently.
+ * @param sketch The sketch.
+ * @param hash A well-mixed 64-bit hash of the key.
+ * @return The estimate, from 0 to 15.
+ */
+unsigned int sketch_estimate(const FrequencySketch *sketch, uint64_t hash);
+
+#endif
@@ -0,0 +1,433 @@
+/**
+ * @file slab.c
+ * @author Shubham More
+ * @brief Implementation of the size-class slab allocator.
+ *
+ * Size classes grow geometrically from SLAB_MIN_CHUNK up to half a slab
+ * page, so the rounding waste of any allocation is bounded by the growth
+ * factor. Each class owns whole pages; a page starts with a small header
+ * and hands out chunks first from its free list and then by bumping into
+ * memory it has never touched, so a fresh page only costs RSS as it fills.
+ * Pages are aligned to SLAB_PAGE_SIZE, which lets a free find the page of
+ * a chunk by masking its address.
+ *
+ * Every class has its own lock and a list of pages with free chunks. A
+ * page whose last chunk is freed is handed back to a small shared spare
+ * pool, and beyond that unmapped, so memory is never stranded in a class
+ * that no longer needs it.
+ *
+ * The cache charges objects by chunk size against the same limit, but each
+ * class in use also carries one partly filled page it cannot be charged
+ * for. Slab pages may therefore exceed the limit by one page per class that
+ * owns pages; without that allowance page rounding, not the cache's own
+ * eviction policy, would decide what gets evicted.
+ */
+
+#include "slab.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define SLAB_MIN_CHUNK 64       // Smallest size class
+#define SLAB_GROWTH_FACTOR 1.25 // Ratio between neighbouring size classes
+#define MAX_SLAB_CLASSES 64
+#define SLAB_SPARE_PAGES 2      // Empty pages kept mapped for reuse
+#define CHUNK_ALIGN 16
+
+// Header at the start of every slab page
+typedef struct SlabPage {
+    struct SlabClass *cls;
+    struct SlabPage *prev;      // Links in the class's partial list
+    struct SlabPage *next;
+    void *free_list;            // Freed chunks, linked through their first word
+    char *bump;                 // First chunk never handed out
+    unsigned int used;
+    unsigned int capacity;
+} SlabPage;
+
+#define PAGE_HEADER_SIZE ((sizeof(SlabPage) + 63) & ~(size_t)63)
+
+// One size class
+typedef struct SlabClass {
+    pthread_mutex_t lock;
+    size_t chunk_size;
+    SlabPage *partial;          // Pages with at least one free chunk
+    // Counters, updated under the lock and read without it (atomic)
+    size_t pages;
+    size_t chunks_used;
+    size_t chunks_total;
+    size_t bytes_requested;
+} __attribute__((aligned(64))) SlabClass;
+
+// --- Global Allocator State ---
+static SlabClass classes[MAX_SLAB_CLASSES];
+static int num_classes = 0;
+static size_t max_chunk = 0;    // Larger requests are mapped on their own
+static size_t system_page = 4096;
+static size_t limit = 0;        // (atomic)
+static size_t bytes_mapped = 0; // (atomic)
+static size_t large_objects = 0; // (atomic)
+static size_t large_bytes = 0;  // (atomic)
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static SlabPage *spare_pages = NULL;
+static size_t spare_count = 0;  // (atomic)
+static size_t active_classes = 0; // Classes owning at least one page (atomic)
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Charges bytes against the limit.
+ * @param bytes The bytes to map.
+ * @param allowance Bytes the limit may be exceeded by.
+ * @return 0 on success, -1 if they do not fit.
+ */
+static int reserve(size_t bytes, size_t allowance) {
+    size_t mapped = __atomic_load_n(&bytes_mapped, __ATOMIC_RELAXED);
+    do {
+        if (mapped + bytes > __atomic_load_n(&limit, __ATOMIC_RELAXED) + allowance) return -1;
+    } while (!__atomic_compare_exchange_n(&bytes_mapped, &mapped, mapped + bytes, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/**
+ * @brief Returns bytes to the limit.
+ */
+static void unreserve(size_t bytes) {
+    __atomic_sub_fetch(&bytes_mapped, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Maps one slab page aligned to its own size.
+ */
+static SlabPage *map_page() {
+    // Over-map and trim so the page starts on a SLAB_PAGE_SIZE boundary
+    char *raw = mmap(NULL, 2 * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("mmap for slab page");
+        return NULL;
+    }
+    char *page = (char *)(((uintptr_t)raw + SLAB_PAGE_SIZE - 1) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    if (page > raw) munmap(raw, page - raw);
+    munmap(page + SLAB_PAGE_SIZE, raw + SLAB_PAGE_SIZE - page);
+    return (SlabPage *)page;
+}
+
+/**
+ * @brief Takes an empty page from the spare pool, or maps a new one if the
+ * limit allows.
+ * @param first_in_class Non-zero if the page will be its class's first.
+ */
+static SlabPage *get_page(int first_in_class) {
+    pthread_mutex_lock(&spare_lock);
+    SlabPage *page = spare_pages;
+    if (page) {
+        spare_pages = page->next;
+        __atomic_sub_fetch(&spare_count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&spare_lock);
+    if (page) return page;
+
+    // Room for one partly filled page per class, counting the caller's
+    size_t partial_pages = __atomic_load_n(&active_classes, __ATOMIC_RELAXED) + (first_in_class ? 1 : 0);
+    size_t allowance = partial_pages * SLAB_PAGE_SIZE;
+    if (reserve(SLAB_PAGE_SIZE, allowance) != 0) return NULL;
+    page = map_page();
+    if (!page) unreserve(SLAB_PAGE_SIZE);
+    return page;
+}
+
+/**
+ * @brief Hands an empty page back to the spare pool, or unmaps it.
+ */
+static void put_page(SlabPage *page) {
+    pthread_mutex_lock(&spare_lock);
+    // Above a lowered limit, freed pages go straight back to the system
+    if (spare_count < SLAB_SPARE_PAGES &&
+        __atomic_load_n(&bytes_mapped, __ATOMIC_RELAXED) <= __atomic_load_n(&limit, __ATOMIC_RELAXED)) {
+        page->next = spare_pages;
+        spare_pages = page;
+        __atomic_add_fetch(&spare_count, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&spare_lock);
+        return;
+    }
+    pthread_mutex_unlock(&spare_lock);
+    munmap(page, SLAB_PAGE_SIZE);
+    unreserve(SLAB_PAGE_SIZE);
+}
+
+/**
+ * @brief Adds a page to the front of its class's partial list.
+ */
+static void partial_push(SlabClass *cls, SlabPage *page) {
+    page->prev = NULL;
+    page->next = cls->partial;
+    if (cls->partial) cls->partial->prev = page;
+    cls->partial = page;
+}
+
+/**
+ * @brief Removes a page from its class's partial list.
+ */
+static void partial_remove(SlabClass *cls, SlabPage *page) {
+    if (page->prev) page->prev->next = page->next;
+    else cls->partial = page->next;
+    if (page->next) page->next->prev = page->prev;
+}
+
+/**
+ * @brief Finds the smallest class that fits a request.
+ */
+static SlabClass *class_for(size_t size) {
+    int lo = 0, hi = num_classes - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (classes[mid].chunk_size >= size) hi = mid;
+        else lo = mid + 1;
+    }
+    return &classes[lo];
+}
+
+/**
+ * @brief Rounds a large object up to whole system pages.
+ */
+static size_t large_size(size_t size) {
+    return (size + system_page - 1) & ~(system_page - 1);
+}
+
+/**
+ * @brief Maps an object too large for a slab page.
+ */
+static void *large_alloc(size_t size) {
+    size_t bytes = large_size(size);
+    if (reserve(bytes, 0) != 0) return NULL;
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap for large object");
+        unreserve(bytes);
+        return NULL;
+    }
+    __atomic_add_fetch(&large_objects, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&large_bytes, bytes, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+/**
+ * @brief Unmaps an object from large_alloc().
+ */
+static void large_free(void *ptr, size_t size) {
+    size_t bytes = large_size(size);
+    munmap(ptr, bytes);
+    unreserve(bytes);
+    __atomic_sub_fetch(&large_objects, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&large_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Adds to a counter that is read without the class lock.
+ */
+static void count(size_t *counter, long delta) {
+    __atomic_add_fetch(counter, (size_t)delta, __ATOMIC_RELAXED);
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Initializes the allocator.
+ */
+int slab_init(size_t new_limit) {
+    if (num_classes == 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        if (page > 0) system_page = page;
+
+        // Every class holds at least two chunks per page
+        max_chunk = ((SLAB_PAGE_SIZE - PAGE_HEADER_SIZE) / 2) & ~(size_t)(CHUNK_ALIGN - 1);
+        size_t size = SLAB_MIN_CHUNK;
+        while (num_classes < MAX_SLAB_CLASSES) {
+            if (size >= max_chunk || num_classes == MAX_SLAB_CLASSES - 1) size = max_chunk;
+            SlabClass *cls = &classes[num_classes++];
+            if (pthread_mutex_init(&cls->lock, NULL) != 0) {
+                perror("Failed to initialize slab class lock");
+                num_classes--;
+                return -1;
+            }
+            cls->chunk_size = size;
+            if (size == max_chunk) break;
+            size = ((size_t)(size * SLAB_GROWTH_FACTOR) + CHUNK_ALIGN - 1) & ~(size_t)(CHUNK_ALIGN - 1);
+        }
+    }
+    limit = new_limit;
+    printf("Slab allocator: %d size classes up to %zu bytes, %zu byte limit.\n",
+           num_classes, max_chunk, limit);
+    return 0;
+}
+
+/**
+ * @brief Changes the byte limit while the allocator is in use.
+ */
+void slab_set_limit(size_t new_limit) {
+    __atomic_store_n(&limit, new_limit, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the spare pages to the system.
+ *
+ * Pages that still hold chunks stay mapped, so an object released after
+ * shutdown began can still be freed; the page goes when its last chunk does.
+ */
+void slab_destroy() {
+    pthread_mutex_lock(&spare_lock);
+    while (spare_pages) {
+        SlabPage *page = spare_pages;
+        spare_pages = page->next;
+        munmap(page, SLAB_PAGE_SIZE);
+        unreserve(SLAB_PAGE_SIZE);
+    }
+    __atomic_store_n(&spare_count, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&spare_lock);
+}
+
+/**
+ * @brief Allocates memory from the size class that fits the request.
+ */
+void *slab_alloc(size_t size) {
+    if (size > max_chunk) return large_alloc(size);
+
+    SlabClass *cls = class_for(size);
+    pthread_mutex_lock(&cls->lock);
+
+    SlabPage *page = cls->partial;
+    if (!page) {
+        page = get_page(__atomic_load_n(&cls->pages, __ATOMIC_RELAXED) == 0);
+        if (!page) {
+            pthread_mutex_unlock(&cls->lock);
+            return NULL;
+        }
+        page->cls = cls;
+        page->free_list = NULL;
+        page->bump = (char *)page + PAGE_HEADER_SIZE;
+        page->used = 0;
+        page->capacity = (SLAB_PAGE_SIZE - PAGE_HEADER_SIZE) / cls->chunk_size;
+        partial_push(cls, page);
+        if (__atomic_load_n(&cls->pages, __ATOMIC_RELAXED) == 0) count(&active_classes, 1);
+        count(&cls->pages, 1);
+        count(&cls->chunks_total, page->capacity);
+    }
+
+    void *chunk;
+    if (page->free_list) {
+        chunk = page->free_list;
+        page->free_list = *(void **)chunk;
+    } else {
+        chunk = page->bump;
+        page->bump += cls->chunk_size;
+    }
+    if (++page->used == page->capacity) partial_remove(cls, page);
+
+    count(&cls->chunks_used, 1);
+    count(&cls->bytes_requested, size);
+    pthread_mutex_unlock(&cls->lock);
+    return chunk;
+}
+
+/**
+ * @brief Frees memory from slab_alloc().
+ */
+void slab_free(void *ptr, size_t size) {
+    if (!ptr) return;
+    if (size > max_chunk) {
+        large_free(ptr, size);
+        return;
+    }
+
+    SlabPage *page = (SlabPage *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    SlabClass *cls = page->cls;
+    pthread_mutex_lock(&cls->lock);
+
+    *(void **)ptr = page->free_list;
+    page->free_list = ptr;
+    int was_full = page->used == page->capacity;
+    page->used--;
+    count(&cls->chunks_used, -1);
+    count(&cls->bytes_requested, -(long)size);
+
+    if (page->used == 0) {
+        // Give the page up so any class can use it
+        if (!was_full) partial_remove(cls, page);
+        count(&cls->pages, -1);
+        if (__atomic_load_n(&cls->pages, __ATOMIC_RELAXED) == 0) count(&active_classes, -1);
+        count(&cls->chunks_total, -(long)page->capacity);
+        pthread_mutex_unlock(&cls->lock);
+        put_page(page);
+        return;
+    }
+    if (was_full) partial_push(cls, page);
+    pthread_mutex_unlock(&cls->lock);
+}
+
+/**
+ * @brief The number of bytes an allocation of the given size really uses.
+ */
+size_t slab_chunk_size(size_t size) {
+    if (size > max_chunk) return large_size(size);
+    return class_for(size)->chunk_size;
+}
+
+/**
+ * @brief The number of size classes.
+ */
+int slab_num_classes() {
+    return num_classes;
+}
+
+/**
+ * @brief Reads the occupancy of one size class.
+ */
+int slab_class_stats(int index, slab_class_stats_t *out) {
+    if (index < 0 || index >= num_classes) return -1;
+    SlabClass *cls = &classes[index];
+    out->chunk_size = cls->chunk_size;
+    out->pages = __atomic_load_n(&cls->pages, __ATOMIC_RELAXED);
+    out->chunks_used = __atomic_load_n(&cls->chunks_used, __ATOMIC_RELAXED);
+    out->chunks_total = __atomic_load_n(&cls->chunks_total, __ATOMIC_RELAXED);
+    out->bytes_requested = __atomic_load_n(&cls->bytes_requested, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Reads the allocator-wide totals.
+ */
+void slab_stats(slab_stats_t *out) {
+    out->limit = __atomic_load_n(&limit, __ATOMIC_RELAXED);
+    out->bytes_mapped = __atomic_load_n(&bytes_mapped, __ATOMIC_RELAXED);
+    out->spare_pages = __atomic_load_n(&spare_count, __ATOMIC_RELAXED);
+    out->large_objects = __atomic_load_n(&large_objects, __ATOMIC_RELAXED);
+    out->large_bytes = __atomic_load_n(&large_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Writes a per-class occupancy and fragmentation table.
+ */
+void slab_dump_stats(FILE *out) {
+    slab_stats_t totals;
+    slab_stats(&totals);
+    fprintf(out, "Slab memory: %zu of %zu bytes mapped, %zu spare page(s), %zu large object(s) in %zu bytes\n",
+            totals.bytes_mapped, totals.limit, totals.spare_pages, totals.large_objects, totals.large_bytes);
+    fprintf(out, "%8s %6s %10s %10s %14s %7s %6s\n",
+            "chunk", "pages", "used", "capacity", "requested", "occ%", "frag%");
+
+    for (int i = 0; i < num_classes; i++) {
+        slab_class_stats_t s;
+        slab_class_stats(i, &s);
+        if (s.pages == 0) continue;
+        // Occupancy: chunks in use. Fragmentation: page bytes not holding data.
+        double page_bytes = (double)s.pages * SLAB_PAGE_SIZE;
+        fprintf(out, "%8zu %6zu %10zu %10zu %14zu %6.1f%% %5.1f%%\n",
+                s.chunk_size, s.pages, s.chunks_used, s.chunks_total, s.bytes_requested,
+                s.chunks_total ? 100.0 * s.chunks_used / s.chunks_total : 0.0,
+                100.0 * (1.0 - s.bytes_requested / page_bytes));
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * @file slab.h
+ * @author Shubham More
+ * @brief Interface for the size-class slab allocator behind the cache.
+ *
+ * Cached objects come in every size and churn constantly, which leaves a
+ * general-purpose heap badly fragmented after long uptimes. This allocator
+ * rounds every request up to one of a fixed set of size classes and carves
+ * chunks of a class out of dedicated, page-aligned slab pages. A page that
+ * becomes empty goes back to a shared pool (and eventually the system), so
+ * memory freed in one class can be reused by any other. Objects too large
+ * for a slab page are mapped on their own.
+ *
+ * All memory is drawn against a single byte limit, so the limit bounds
+ * what the cache actually holds from the system, page overhead included.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define SLAB_PAGE_SIZE (1024 * 1024) // Bytes per slab page; also its alignment
+
+/**
+ * @struct slab_class_stats_t
+ * @brief Occupancy of one size class.
+ */
+typedef struct {
+    size_t chunk_size;      // Bytes per chunk
+    size_t pages;           // Slab pages owned by the class
+    size_t chunks_used;     // Chunks handed out
+    size_t chunks_total;    // Chunks the owned pages can hold
+    size_t bytes_requested; // Sum of the sizes asked for by live allocations
+} slab_class_stats_t;
+
+/**
+ * @struct slab_stats_t
+ * @brief Allocator-wide totals.
+ */
+typedef struct {
+    size_t limit;           // Configured byte limit
+    size_t bytes_mapped;    // Slab pages and large objects held from the system
+    size_t spare_pages;     // Empty pages kept for reuse
+    size_t large_objects;   // Objects mapped on their own
+    size_t large_bytes;     // Bytes mapped for them
+} slab_stats_t;
+
+/**
+ * @brief Initializes the allocator.
+ * @param limit Maximum number of bytes to hold from the system.
+ * @return 0 on success, -1 on failure.
+ */
+int slab_init(size_t limit);
+
+/**
+ * @brief Changes the byte limit while the allocator is in use.
+ *
+ * Memory already held above a lower limit is not taken back; allocations
+ * fail until enough of it has been freed, which makes the cache evict.
+ * @param limit The new maximum number of bytes to hold from the system.
+ */
+void slab_set_limit(size_t limit);
+
+/**
+ * @brief Returns all memory to the system. Every allocation must have been
+ * freed, or must not be used again.
+ */
+void slab_destroy();
+
+/**
+ * @brief Allocates memory from the size class that fits the request.
+ * @param size The number of bytes needed.
+ * @return The memory, or NULL if the limit would be exceeded.
+ */
+void *slab_alloc(size_t size);
+
+/**
+ * @brief Frees memory from slab_alloc().
+ * @param ptr The memory (NULL is ignored).
+ * @param size The size passed to slab_alloc().
+ */
+void slab_free(void *ptr, size_t size);
+
+/**
+ * @brief The number of bytes an allocation of the given size really uses.
+ */
+size_t slab_chunk_size(size_t size);
+
+/**
+ * @brief The number of size classes.
+ */
+int slab_num_classes();
+
+/**
+ * @brief Reads the occupancy of one size class.
+ * @param cls The class index, from 0 to slab_num_classes() - 1.
+ * @param out Filled with the class's counters.
+ * @return 0 on success, -1 if the index is out of range.
+ */
+int slab_class_stats(int cls, slab_class_stats_t *out);
+
+/**
+ * @brief Reads the allocator-wide totals.
+ */
+void slab_stats(slab_stats_t *out);
+
+/**
+ * @brief Writes a per-class occupancy and fragmentation table.
+ *
+ * Counters are read without locks, so the figures may be a moment apart.
+ * @param out The stream to write to.
+ */
+void slab_dump_stats(FILE *out);
+
+#endif
@@ -0,0 +1,154 @@
+/**
+ * @file socket_util.c
+ * @author Shubham More
+ * @brief Implementation of the shared socket helpers.
+ */
+
+#define _GNU_SOURCE
+#include "socket_util.h"
+#include "dns_cache.h"
+#include "logger.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+
+/**
+ * @brief Puts a file descriptor into non-blocking mode.
+ */
+int socket_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * @brief Puts a file descriptor back into blocking mode.
+ */
+int socket_set_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+/**
+ * @brief Opens a TCP connection to one resolved address.
+ */
+int socket_connect_addr(const dns_sockaddr_t *addr, int nonblocking) {
+    socklen_t addr_len = addr->sa.sa_family == AF_INET6 ? sizeof(addr->in6) : sizeof(addr->in);
+    int fd = socket(addr->sa.sa_family, SOCK_STREAM | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0) {
+        log_errno("socket (destination)");
+        return -1;
+    }
+
+    if (connect(fd, &addr->sa, addr_len) < 0 && !(nonblocking && errno == EINPROGRESS)) {
+        log_errno("connect (destination)");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Waits for a non-blocking connect with poll() and reads its result.
+ */
+int socket_wait_connected(int fd, int timeout_ms) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int rc;
+    while ((rc = poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1)) < 0 && errno == EINTR) {
+    }
+    if (rc == 0) errno = ETIMEDOUT;
+    if (rc <= 0) return -1;
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) return -1;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Resolves a host through the resolver cache and connects to the
+ * first of its addresses that accepts in time.
+ *
+ * Each connect is started non-blocking and waited on with poll(), so a
+ * black-holed address costs no more than the timeout.
+ */
+int socket_connect_tcp(const char *host, const char *port, int timeout_ms) {
+    DnsAddrs addrs;
+    if (dns_cache_resolve(host, port, &addrs) < 0) return -1;
+
+    for (int i = 0; i < addrs.count; i++) {
+        int fd = socket_connect_addr(&addrs.addrs[i], 1);
+        if (fd < 0) continue;
+        if (socket_wait_connected(fd, timeout_ms) == 0 && socket_set_blocking(fd) == 0) return fd;
+        int err = errno;
+        log_errno("connect (destination)");
+        close(fd);
+        errno = err;
+    }
+    return -1;
+}
+
+/**
+ * @brief Creates a (large) pipe for splice() relays.
+ */
+int socket_make_pipe(int pipe_fds[2], int nonblocking) {
+    if (pipe2(pipe_fds, O_CLOEXEC | (nonblocking ? O_NONBLOCK : 0)) < 0) {
+        perror("pipe2");
+        return -1;
+    }
+    // Best effort: the default 64 KB still works, just with more syscalls
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    return 0;
+}
+
+/**
+ * @brief Creates, binds and listens on a TCP socket.
+ */
+int socket_listen_tcp(int port, int backlog, int reuse_port) {
+    struct sockaddr_in server_addr;
+
+    int server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Allow address reuse
+    int optval = 1;
+    setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (reuse_port && setsockopt(server_socket_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt (SO_REUSEPORT)");
+        close(server_socket_fd);
+        return -1;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    if (bind(server_socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind");
+        close(server_socket_fd);
+        return -1;
+    }
+
+    if (listen(server_socket_fd, backlog) < 0) {
+        perror("listen");
+        close(server_socket_fd);
+        return -1;
+    }
+
+    return server_socket_fd;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file socket_util.h
+ * @author Shubham More
+ * @brief Small socket helpers shared by the proxy's engines.
+ */
+
+#ifndef SOCKET_UTIL_H
+#define SOCKET_UTIL_H
+
+#include "dns_cache.h"
+
+#define RELAY_PIPE_SIZE (256 * 1024) // Requested capacity of splice() relay pipes
+
+/**
+ * @brief Puts a file descriptor into non-blocking mode.
+ * @param fd The file descriptor.
+ * @return 0 on success, -1 on failure.
+ */
+int socket_set_nonblocking(int fd);
+
+/**
+ * @brief Puts a file descriptor back into blocking mode.
+ * @param fd The file descriptor.
+ * @return 0 on success, -1 on failure.
+ */
+int socket_set_blocking(int fd);
+
+/**
+ * @brief Opens a TCP connection to a single address.
+ * @param addr The address (with port) to connect to.
+ * @param nonblocking Non-zero to return a non-blocking socket whose connect
+ * may still be in progress (completion is signalled by writability).
+ * @return The connected (or connecting) socket, or -1 on failure.
+ */
+int socket_connect_addr(const dns_sockaddr_t *addr, int nonblocking);
+
+/**
+ * @brief Waits for a non-blocking connect to complete.
+ * @param fd The connecting socket.
+ * @param timeout_ms How long to wait; 0 waits as long as it takes.
+ * @return 0 once connected, -1 if the connect failed or did not complete in
+ * time (errno is ETIMEDOUT then).
+ */
+int socket_wait_connected(int fd, int timeout_ms);
+
+/**
+ * @brief Resolves a host and opens a blocking TCP connection to it.
+ *
+ * The name is looked up through the resolver cache (waiting for it if
+ * needed) and every returned address is tried in order until one connects.
+ * @param host The host name or address.
+ * @param port The port (numeric string or service name).
+ * @param timeout_ms How long each address may take to connect; 0 for the
+ * kernel's own limit.
+ * @return The connected socket, or -1 on failure (errno is ETIMEDOUT if the
+ * last address tried timed out).
+ */
+int socket_connect_tcp(const char *host, const char *port, int timeout_ms);
+
+/**
+ * @brief Creates a pipe for relaying socket data with splice().
+ *
+ * The pipe is grown to RELAY_PIPE_SIZE where the system allows it, so each
+ * splice() call can move a large run of bytes.
+ * @param pipe_fds Filled with the read and write ends.
+ * @param nonblocking Non-zero to make both ends non-blocking.
+ * @return 0 on success, -1 on failure.
+ */
+int socket_make_pipe(int pipe_fds[2], int nonblocking);
+
+/**
+ * @brief Creates a TCP socket listening on all interfaces.
+ * @param port The port to bind.
+ * @param backlog The listen() backlog.
+ * @param reuse_port Non-zero to set SO_REUSEPORT so several sockets can
+ * bind the same port and have the kernel balance connections between them.
+ * @return The listening socket on success, -1 on failure.
+ */
+int socket_listen_tcp(int port, int backlog, int reuse_port);
+
+#endif
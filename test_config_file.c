@@ -0,0 +1,118 @@
+/**
+ * @file test_config_file.c
+ * @author Shubham More
+ * @brief Checks of the configuration file reader.
+ *
+ * Each case writes a small file, loads it with config_file_load() and
+ * compares the settings handed over with what is expected. Run with
+ * 'make test'; exits non-zero if a case fails.
+ */
+
+#include "config_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SETTINGS 16
+
+// --- Structs ---
+
+// The settings a load handed over, in order
+typedef struct {
+    const char *keys[MAX_SETTINGS];
+    const char *values[MAX_SETTINGS];
+    int count;
+} Settings;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Records a setting.
+ */
+static int record_setting(void *arg, const char *key, const char *value) {
+    Settings *settings = (Settings *)arg;
+    if (settings->count == MAX_SETTINGS) return -1;
+    settings->keys[settings->count] = key;
+    settings->values[settings->count] = value;
+    settings->count++;
+    return 0;
+}
+
+/**
+ * @brief Loads a file with the given contents.
+ * @return The file's text (free with free()), or NULL if it did not load.
+ */
+static char *load_text(const char *contents, Settings *settings) {
+    char path[] = "/tmp/test_config_file.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+    if (write(fd, contents, strlen(contents)) != (ssize_t)strlen(contents)) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    memset(settings, 0, sizeof(*settings));
+    char *text = config_file_load(path, record_setting, settings);
+    unlink(path);
+    return text;
+}
+
+/**
+ * @brief Checks that a file loads into the expected settings.
+ * @param name What the case checks, for the report.
+ * @param contents The file.
+ * @param expected Alternating keys and values, NULL-terminated.
+ * @return 0 if it does, 1 if not.
+ */
+static int check(const char *name, const char *contents, const char **expected) {
+    Settings settings;
+    char *text = load_text(contents, &settings);
+    int failed = !text;
+    int i = 0;
+    for (; !failed && expected[2 * i]; i++) {
+        failed = i >= settings.count || strcmp(settings.keys[i], expected[2 * i]) != 0 ||
+                 strcmp(settings.values[i], expected[2 * i + 1]) != 0;
+    }
+    if (!failed && i != settings.count) failed = 1;
+    printf("%s: %s\n", failed ? "FAIL" : "ok", name);
+    free(text);
+    return failed;
+}
+
+
+// --- Main Function ---
+int main() {
+    int failures = 0;
+
+    const char *plain[] = { "port", "8080", "engine", "epoll", NULL };
+    failures += check("plain settings", "port = 8080\n  engine=epoll  \n", plain);
+
+    const char *comments[] = { "port", "8080", "engine", "epoll", NULL };
+    failures += check("comments and blank lines",
+                      "# A comment\n\n   # An indented one\nport = 8080 # trailing\nengine = epoll\t# after a tab\n",
+                      comments);
+
+    const char *hash_in_value[] = { "access_log", "/var/log/proxy#1", "cache_snapshot", "/tmp/a#b#c", NULL };
+    failures += check("'#' inside a value",
+                      "access_log = /var/log/proxy#1\ncache_snapshot = /tmp/a#b#c # the snapshot\n",
+                      hash_in_value);
+
+    const char *none[] = { NULL };
+    Settings settings;
+    char *text = load_text("port 8080\n", &settings);
+    printf("%s: a line without '='\n", text ? "FAIL" : "ok");
+    failures += text != NULL;
+    free(text);
+    failures += check("empty file", "", none);
+
+    if (failures) {
+        printf("%d case(s) failed.\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All cases passed.\n");
+    return EXIT_SUCCESS;
+}
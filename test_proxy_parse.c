@@ -0,0 +1,256 @@
+/**
+ * @file test_proxy_parse.c
+ * @author Shubham More
+ * @brief Checks of the HTTP request parser.
+ *
+ * Each case feeds a request head to ParsedRequest_feed() or
+ * ParsedRequest_parse() and compares what comes out with what is
+ * expected: where the head ends however it is split across reads, how the
+ * body is framed, the head size limit, and the origin an absolute-form or
+ * origin-form request names. Run with 'make test'; exits non-zero if a
+ * case fails.
+ */
+
+#include "proxy_parse.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A head followed by the start of its body, as a client would send it
+#define SPLIT_REQUEST "GET http://example.com:8080/a/b?c=d HTTP/1.1\r\n" \
+                      "Host: example.com:8080\r\n" \
+                      "Content-Length: 5\r\n" \
+                      "\r\n" \
+                      "hello"
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Creates a request, exiting if that fails.
+ */
+static struct ParsedRequest *create_request() {
+    struct ParsedRequest *pr = ParsedRequest_create();
+    if (!pr) {
+        perror("ParsedRequest_create");
+        exit(EXIT_FAILURE);
+    }
+    return pr;
+}
+
+/**
+ * @brief Whether a parsed field has the expected value; NULL expects none.
+ */
+static int field_is(const char *field, const char *expected) {
+    if (!field || !expected) return field == expected;
+    return strcmp(field, expected) == 0;
+}
+
+/**
+ * @brief Prints a case's result.
+ * @return 0 if it passed, 1 if not.
+ */
+static int report(const char *name, int failed) {
+    printf("%s: %s\n", failed ? "FAIL" : "ok", name);
+    return failed;
+}
+
+/**
+ * @brief Feeds a buffer in pieces ending at the given offsets, the way a
+ * client's reads fill it, then the rest.
+ * @param cuts Offsets into buf where a read ends, ascending.
+ * @return What the last feed returned, or -2 if a feed returned a head
+ * length before the head could be complete.
+ */
+static ssize_t feed_pieces(struct ParsedRequest *pr, const char *buf, size_t len, const size_t *cuts,
+                           int num_cuts, size_t head_len) {
+    for (int i = 0; i < num_cuts; i++) {
+        ssize_t fed = ParsedRequest_feed(pr, buf, cuts[i]);
+        if (fed != 0) return cuts[i] >= head_len && fed == (ssize_t)head_len ? fed : -2;
+    }
+    return ParsedRequest_feed(pr, buf, len);
+}
+
+/**
+ * @brief Checks that the head of SPLIT_REQUEST is found and parsed the
+ * same wherever it is cut into two or three reads, and when it arrives a
+ * byte at a time.
+ * @return The number of failed cases.
+ */
+static int check_splits() {
+    const char *buf = SPLIT_REQUEST;
+    size_t len = strlen(buf);
+    size_t head_len = strstr(buf, "\r\n\r\n") + 4 - buf;
+    struct ParsedRequest *pr = create_request();
+    int failures = 0;
+
+    int failed = 0;
+    for (size_t a = 1; a < len && !failed; a++) {
+        for (size_t b = a; b < len && !failed; b++) {
+            size_t cuts[2] = { a, b };
+            ParsedRequest_reset(pr);
+            failed = feed_pieces(pr, buf, len, cuts, b > a ? 2 : 1, head_len) != (ssize_t)head_len ||
+                     !field_is(pr->host, "example.com") || !field_is(pr->port, "8080") ||
+                     !field_is(pr->path, "/a/b?c=d");
+            if (failed) printf("  cut at %zu and %zu\n", a, b);
+        }
+    }
+    failures += report("head split at every pair of offsets", failed);
+
+    ParsedRequest_reset(pr);
+    ssize_t fed = 0;
+    size_t n = 1;
+    for (; n <= len && fed == 0; n++) fed = ParsedRequest_feed(pr, buf, n);
+    failures += report("head fed a byte at a time", fed != (ssize_t)head_len || n - 1 != head_len);
+
+    // Each read ends inside the blank line, one byte further in
+    ParsedRequest_reset(pr);
+    size_t blank[3] = { head_len - 3, head_len - 2, head_len - 1 };
+    failures += report("reads ending inside \\r\\n\\r\\n",
+                       feed_pieces(pr, buf, len, blank, 3, head_len) != (ssize_t)head_len);
+
+    ParsedRequest_destroy(pr);
+    return failures;
+}
+
+/**
+ * @brief Checks the body framing of a head.
+ * @param name What the case checks, for the report.
+ * @param head A complete request head.
+ * @param expected The framing it should have.
+ * @param expected_length The Content-Length it should report.
+ * @return 0 if it has it, 1 if not.
+ */
+static int check_framing(const char *name, const char *head, request_body_t expected, size_t expected_length) {
+    struct ParsedRequest *pr = create_request();
+    size_t length = 0;
+    int failed = ParsedRequest_parse(pr, head, strlen(head)) != 0 ||
+                 ParsedRequest_bodyFraming(pr, &length) != expected || length != expected_length;
+    ParsedRequest_destroy(pr);
+    return report(name, failed);
+}
+
+/**
+ * @brief Builds a head of the given length: a request line, one header
+ * padded to fit, and the blank line if complete.
+ * @return The head (free with free()).
+ */
+static char *build_head(size_t len, int complete) {
+    const char *line = "GET http://example.com/ HTTP/1.1\r\nX-Pad: ";
+    size_t tail = complete ? 4 : 2;
+    char *head = malloc(len + 1);
+    if (!head) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t line_len = strlen(line);
+    memcpy(head, line, line_len);
+    memset(head + line_len, 'x', len - line_len - tail);
+    memcpy(head + len - tail, complete ? "\r\n\r\n" : "\r\n", tail);
+    head[len] = '\0';
+    return head;
+}
+
+/**
+ * @brief Checks that heads up to MAX_REQUEST_HEAD_SIZE parse and longer
+ * ones are refused, complete or still arriving.
+ * @return The number of failed cases.
+ */
+static int check_head_limit() {
+    struct ParsedRequest *pr = create_request();
+    int failures = 0;
+
+    char *head = build_head(MAX_REQUEST_HEAD_SIZE, 1);
+    failures += report("head of exactly MAX_REQUEST_HEAD_SIZE",
+                       ParsedRequest_feed(pr, head, MAX_REQUEST_HEAD_SIZE) != MAX_REQUEST_HEAD_SIZE);
+    free(head);
+
+    ParsedRequest_reset(pr);
+    head = build_head(MAX_REQUEST_HEAD_SIZE + 1, 1);
+    failures += report("complete head over MAX_REQUEST_HEAD_SIZE",
+                       ParsedRequest_feed(pr, head, MAX_REQUEST_HEAD_SIZE + 1) != -1);
+    free(head);
+
+    // Still no blank line: waits up to the limit, then gives up
+    ParsedRequest_reset(pr);
+    head = build_head(MAX_REQUEST_HEAD_SIZE + 1, 0);
+    int failed = ParsedRequest_feed(pr, head, MAX_REQUEST_HEAD_SIZE) != 0 ||
+                 ParsedRequest_feed(pr, head, MAX_REQUEST_HEAD_SIZE + 1) != -1;
+    failures += report("unfinished head over MAX_REQUEST_HEAD_SIZE", failed);
+    free(head);
+
+    ParsedRequest_destroy(pr);
+    return failures;
+}
+
+/**
+ * @brief Checks the origin and cache key a head names.
+ * @param name What the case checks, for the report.
+ * @param head A complete request head.
+ * @param host The host it should have, or NULL for none.
+ * @param port The port it should have (ignored without a host).
+ * @param path The path it should have.
+ * @param url The cache key it should have, or NULL for none.
+ * @return 0 if it does, 1 if not.
+ */
+static int check_target(const char *name, const char *head, const char *host, const char *port,
+                        const char *path, const char *url) {
+    struct ParsedRequest *pr = create_request();
+    int failed = ParsedRequest_parse(pr, head, strlen(head)) != 0 || !field_is(pr->host, host) ||
+                 (host && !field_is(pr->port, port)) || !field_is(pr->path, path) ||
+                 !field_is(ParsedRequest_url(pr), url);
+    ParsedRequest_destroy(pr);
+    return report(name, failed);
+}
+
+
+// --- Main Function ---
+int main() {
+    int failures = check_splits();
+
+    failures += check_framing("no body", "GET http://a/ HTTP/1.1\r\nHost: a\r\n\r\n", REQUEST_BODY_NONE, 0);
+    failures += check_framing("Content-Length",
+                              "POST http://a/ HTTP/1.1\r\nContent-Length: 42\r\n\r\n", REQUEST_BODY_LENGTH, 42);
+    failures += check_framing("duplicate Content-Length with the same value",
+                              "POST http://a/ HTTP/1.1\r\nContent-Length: 42\r\ncontent-length: 42\r\n\r\n",
+                              REQUEST_BODY_LENGTH, 42);
+    failures += check_framing("conflicting Content-Length",
+                              "POST http://a/ HTTP/1.1\r\nContent-Length: 42\r\nContent-Length: 7\r\n\r\n",
+                              REQUEST_BODY_INVALID, 0);
+    failures += check_framing("Content-Length that is not a number",
+                              "POST http://a/ HTTP/1.1\r\nContent-Length: 4x\r\n\r\n", REQUEST_BODY_INVALID, 0);
+    failures += check_framing("chunked",
+                              "POST http://a/ HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n",
+                              REQUEST_BODY_CHUNKED, 0);
+    failures += check_framing("chunked and Content-Length",
+                              "POST http://a/ HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 42\r\n\r\n",
+                              REQUEST_BODY_INVALID, 0);
+    failures += check_framing("Content-Length and chunked",
+                              "POST http://a/ HTTP/1.1\r\nContent-Length: 42\r\nTransfer-Encoding: chunked\r\n\r\n",
+                              REQUEST_BODY_INVALID, 0);
+    failures += check_framing("transfer coding not ending in chunked",
+                              "POST http://a/ HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n",
+                              REQUEST_BODY_INVALID, 0);
+
+    failures += check_head_limit();
+
+    failures += check_target("absolute-form", "GET http://example.com:8080/x?y HTTP/1.1\r\n\r\n",
+                             "example.com", "8080", "/x?y", "http://example.com:8080/x?y");
+    failures += check_target("absolute-form, default port and path", "GET http://example.com HTTP/1.1\r\n\r\n",
+                             "example.com", "80", "/", "http://example.com:80/");
+    failures += check_target("absolute-form wins over Host",
+                             "GET http://example.com/x HTTP/1.1\r\nHost: other.example:81\r\n\r\n",
+                             "example.com", "80", "/x", "http://example.com:80/x");
+    failures += check_target("origin-form with Host", "GET /x?y HTTP/1.1\r\nHost: example.com:8081 \r\n\r\n",
+                             "example.com", "8081", "/x?y", "http://example.com:8081/x?y");
+    failures += check_target("origin-form with Host, default port", "GET /x HTTP/1.1\r\nHost: example.com\r\n\r\n",
+                             "example.com", "80", "/x", "http://example.com:80/x");
+    failures += check_target("origin-form without Host", "GET /x HTTP/1.1\r\nAccept: */*\r\n\r\n",
+                             NULL, NULL, "/x", NULL);
+
+    if (failures) {
+        printf("%d case(s) failed.\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All cases passed.\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+/**
+ * @file thread_pool.c
+ * @author Shubham More
+ * @brief Implementation of the worker pool and its lock-free handoff queue.
+ *
+ * The queue is a bounded MPMC ring in the style of Dmitry Vyukov's design:
+ * every slot carries a sequence number that tells producers and consumers
+ * whether the slot is free for the current lap, so both sides only need a
+ * compare-and-swap on their own end index. A counting semaphore tracks the
+ * number of queued items so idle workers can block instead of spinning.
+ */
+
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <errno.h>
+
+#define CACHE_LINE_SIZE 64
+#define STOP_FD -1   // Sentinel that tells a worker to exit
+
+// A slot in the ring buffer
+typedef struct {
+    atomic_size_t sequence;
+    int fd;
+} RingCell;
+
+struct ThreadPool {
+    RingCell *cells;
+    size_t mask;
+    // Producer and consumer indices live on separate cache lines
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+    _Alignas(CACHE_LINE_SIZE) sem_t items;
+
+    thread_pool_handler_t handler;
+    pthread_t *threads;
+    int num_workers;
+};
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Lock-free enqueue. Returns 0 on success, -1 if the ring is full.
+ */
+static int ring_push(ThreadPool *pool, int fd) {
+    size_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        RingCell *cell = &pool->cells[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // Slot is free for this lap; claim it
+            if (atomic_compare_exchange_weak_explicit(&pool->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->fd = fd;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // Consumer has not freed this slot yet: full
+        } else {
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Lock-free dequeue. Returns 0 on success, -1 if the ring is empty.
+ */
+static int ring_pop(ThreadPool *pool, int *fd) {
+    size_t pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        RingCell *cell = &pool->cells[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *fd = cell->fd;
+                // Mark the slot free for the producer's next lap
+                atomic_store_explicit(&cell->sequence, pos + pool->mask + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // Nothing published in this slot yet: empty
+        } else {
+            pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Entry point of a worker thread.
+ */
+static void *worker_main(void *args) {
+    ThreadPool *pool = (ThreadPool *)args;
+
+    while (1) {
+        while (sem_wait(&pool->items) != 0 && errno == EINTR) {}
+
+        int fd;
+        // The semaphore guarantees an item; a pop can only lose a race briefly
+        while (ring_pop(pool, &fd) != 0) {}
+
+        if (fd == STOP_FD) break;
+        pool->handler(fd);
+    }
+    return NULL;
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Creates the pool and spawns its workers.
+ */
+ThreadPool* thread_pool_create(int num_workers, size_t queue_depth, size_t stack_size,
+                               thread_pool_handler_t handler) {
+    if (num_workers < 1 || queue_depth < 1 || !handler) return NULL;
+
+    // The sequence scheme needs at least two slots to tell full from empty
+    size_t capacity = 2;
+    while (capacity < queue_depth) capacity <<= 1;
+
+    ThreadPool *pool = aligned_alloc(CACHE_LINE_SIZE, sizeof(ThreadPool));
+    if (!pool) return NULL;
+
+    pool->cells = malloc(capacity * sizeof(RingCell));
+    pool->threads = malloc(num_workers * sizeof(pthread_t));
+    if (!pool->cells || !pool->threads) {
+        free(pool->cells); free(pool->threads); free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&pool->cells[i].sequence, i);
+    }
+    pool->mask = capacity - 1;
+    atomic_init(&pool->enqueue_pos, 0);
+    atomic_init(&pool->dequeue_pos, 0);
+    pool->handler = handler;
+    pool->num_workers = 0;
+
+    if (sem_init(&pool->items, 0, 0) != 0) {
+        perror("sem_init");
+        free(pool->cells); free(pool->threads); free(pool);
+        return NULL;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (stack_size > 0) {
+        if (stack_size < PTHREAD_STACK_MIN) stack_size = PTHREAD_STACK_MIN;
+        if (pthread_attr_setstacksize(&attr, stack_size) != 0) perror("pthread_attr_setstacksize");
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->threads[i], &attr, worker_main, pool) != 0) {
+            perror("pthread_create (worker)");
+            break;
+        }
+        pool->num_workers++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (pool->num_workers == 0) {
+        sem_destroy(&pool->items);
+        free(pool->cells); free(pool->threads); free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/**
+ * @brief Hands a descriptor to the workers.
+ */
+int thread_pool_submit(ThreadPool *pool, int fd) {
+    if (ring_push(pool, fd) != 0) return -1;
+    sem_post(&pool->items);
+    return 0;
+}
+
+/**
+ * @brief Stops all workers and frees the pool.
+ */
+void thread_pool_destroy(ThreadPool *pool) {
+    if (!pool) return;
+
+    // One stop sentinel per worker, queued behind any outstanding work
+    for (int i = 0; i < pool->num_workers; i++) {
+        while (thread_pool_submit(pool, STOP_FD) != 0) sched_yield();
+    }
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    sem_destroy(&pool->items);
+    free(pool->cells);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,54 @@
+/**
+ * @file thread_pool.h
+ * @author Shubham More
+ * @brief Interface for a fixed-size worker pool fed by a lock-free queue.
+ *
+ * The accept loop hands accepted client sockets to a pre-spawned set of
+ * worker threads through a bounded multi-producer/multi-consumer ring
+ * buffer. Enqueue and dequeue are lock-free; idle workers sleep on a
+ * semaphore, which only enters the kernel when a worker actually has to
+ * wait. When the ring is full, submission fails immediately so the caller
+ * can shed load instead of growing without bound.
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+typedef struct ThreadPool ThreadPool;
+
+/**
+ * @brief Function run by a worker for every submitted file descriptor.
+ * The handler owns the descriptor and must close it.
+ */
+typedef void (*thread_pool_handler_t)(int fd);
+
+/**
+ * @brief Creates a pool and starts its worker threads.
+ * @param num_workers The number of worker threads to spawn.
+ * @param queue_depth The maximum number of queued descriptors (rounded up
+ * to a power of two, at least 2).
+ * @param stack_size Stack size of each worker in bytes (at least
+ * PTHREAD_STACK_MIN), or 0 for the system default.
+ * @param handler The function each worker runs for a dequeued descriptor.
+ * @return A pointer to the new pool, or NULL on failure.
+ */
+ThreadPool* thread_pool_create(int num_workers, size_t queue_depth, size_t stack_size,
+                               thread_pool_handler_t handler);
+
+/**
+ * @brief Queues a descriptor for the next free worker.
+ * @param pool The pool.
+ * @param fd The descriptor to hand off.
+ * @return 0 on success, -1 if the queue is full (the caller keeps the fd).
+ */
+int thread_pool_submit(ThreadPool *pool, int fd);
+
+/**
+ * @brief Stops the workers once the queue has drained and frees the pool.
+ * @param pool The pool to destroy.
+ */
+void thread_pool_destroy(ThreadPool *pool);
+
+#endif
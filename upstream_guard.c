@@ -0,0 +1,266 @@
+/**
+ * @file upstream_guard.c
+ * @author Shubham More
+ * @brief Implementation of the per-origin concurrency limits and circuit
+ * breakers.
+ *
+ * Guards live in a chained hash table keyed by "host:port" whose chains
+ * only ever grow, the way the metrics and logger registries do: a guard is
+ * pushed onto its chain with a compare-and-swap and stays there until
+ * shutdown, so finding one takes no lock and the pointer a request holds
+ * stays valid. Each guard's state is a handful of counters updated with
+ * atomics, and the circuit is a single timestamp: 0 while it is closed,
+ * otherwise the time until which it refuses requests. Only once that time
+ * has passed may one request claim the trial slot and go through.
+ *
+ * The options and the timeouts are plain integers read and written with
+ * relaxed atomics, so a reload changes them under running requests. Every
+ * request a guard admits counts as active, limit or not, so a limit set
+ * later starts from the right count.
+ */
+
+#define _GNU_SOURCE
+#include "upstream_guard.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define GUARD_TABLE_SIZE 256 // Power of 2 for efficient modulo
+#define MAX_GUARD_KEY 320    // "host:port"
+
+// The limits and circuit of one origin
+struct UpstreamGuard {
+    char key[MAX_GUARD_KEY];
+    int active;             // Requests admitted and not yet released
+    int failures;           // Consecutive failed exchanges
+    uint64_t open_until;    // Milliseconds the circuit stays open until, or 0 while closed
+    int trial;              // A request is trying the origin while the circuit is half-open
+    struct UpstreamGuard *next; // Link in the append-only chain
+};
+
+// --- Global Guard State ---
+static upstream_guard_config_t guard_config;
+static upstream_timeouts_t origin_timeouts;
+static UpstreamGuard *guard_table[GUARD_TABLE_SIZE];
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Milliseconds on the monotonic clock.
+ */
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief FNV-1a hash of a guard key.
+ */
+static unsigned int hash_key(const char *key) {
+    unsigned int h = 2166136261u;
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h & (GUARD_TABLE_SIZE - 1);
+}
+
+/**
+ * @brief Finds a guard on a chain, starting from the given head.
+ */
+static UpstreamGuard *find_guard(UpstreamGuard *guard, const char *key) {
+    for (; guard; guard = guard->next) {
+        if (strcmp(guard->key, key) == 0) return guard;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the guard of an origin, creating it on first use.
+ * @return The guard, or NULL if none could be allocated.
+ */
+static UpstreamGuard *get_guard(const char *host, const char *port) {
+    char key[MAX_GUARD_KEY];
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    UpstreamGuard **chain = &guard_table[hash_key(key)];
+
+    UpstreamGuard *head = __atomic_load_n(chain, __ATOMIC_ACQUIRE);
+    UpstreamGuard *guard = find_guard(head, key);
+    if (guard) return guard;
+
+    UpstreamGuard *created = calloc(1, sizeof(UpstreamGuard));
+    if (!created) return NULL;
+    snprintf(created->key, sizeof(created->key), "%s", key);
+    created->next = head;
+    while (!__atomic_compare_exchange_n(chain, &created->next, created, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        // Another thread pushed first; it may have added this very origin
+        guard = find_guard(created->next, key);
+        if (guard) {
+            free(created);
+            return guard;
+        }
+    }
+    return created;
+}
+
+/**
+ * @brief Opens a guard's circuit for the configured time.
+ * @param trial The caller held the half-open circuit's trial, which it
+ * gives up; anyone else leaves a trial in flight alone.
+ */
+static void open_circuit(UpstreamGuard *guard, int failures, int trial) {
+    int open_ms = __atomic_load_n(&guard_config.open_ms, __ATOMIC_RELAXED);
+    uint64_t was = __atomic_exchange_n(&guard->open_until, now_ms() + open_ms, __ATOMIC_ACQ_REL);
+    if (trial) __atomic_store_n(&guard->trial, 0, __ATOMIC_RELEASE);
+    if (was == 0) {
+        log_message(LOG_LEVEL_WARN, "Circuit to %s opened after %d consecutive failure(s).", guard->key, failures);
+    }
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Sets the limits every origin gets.
+ */
+int upstream_guard_init(const upstream_guard_config_t *config) {
+    memset(guard_table, 0, sizeof(guard_table));
+    return upstream_guard_configure(config);
+}
+
+/**
+ * @brief Changes the limits; each is stored on its own.
+ */
+int upstream_guard_configure(const upstream_guard_config_t *config) {
+    if (config->max_active < 0 || config->failure_threshold < 0 || config->open_ms < 0) return -1;
+    __atomic_store_n(&guard_config.open_ms, config->open_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&guard_config.failure_threshold, config->failure_threshold, __ATOMIC_RELAXED);
+    __atomic_store_n(&guard_config.max_active, config->max_active, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Sets the timeouts, each on its own.
+ */
+void upstream_guard_set_timeouts(const upstream_timeouts_t *timeouts) {
+    __atomic_store_n(&origin_timeouts.connect_ms, timeouts->connect_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&origin_timeouts.first_byte_ms, timeouts->first_byte_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&origin_timeouts.idle_ms, timeouts->idle_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&origin_timeouts.deadline_ms, timeouts->deadline_ms, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Reads the timeouts.
+ */
+upstream_timeouts_t upstream_guard_timeouts() {
+    upstream_timeouts_t timeouts = {
+        __atomic_load_n(&origin_timeouts.connect_ms, __ATOMIC_RELAXED),
+        __atomic_load_n(&origin_timeouts.first_byte_ms, __ATOMIC_RELAXED),
+        __atomic_load_n(&origin_timeouts.idle_ms, __ATOMIC_RELAXED),
+        __atomic_load_n(&origin_timeouts.deadline_ms, __ATOMIC_RELAXED),
+    };
+    return timeouts;
+}
+
+/**
+ * @brief Frees every guard.
+ */
+void upstream_guard_destroy() {
+    for (int i = 0; i < GUARD_TABLE_SIZE; i++) {
+        UpstreamGuard *guard = guard_table[i];
+        while (guard) {
+            UpstreamGuard *next = guard->next;
+            free(guard);
+            guard = next;
+        }
+        guard_table[i] = NULL;
+    }
+    __atomic_store_n(&guard_config.max_active, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&guard_config.failure_threshold, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Admits a request to its origin unless the origin is at its limit
+ * or its circuit is open.
+ */
+UpstreamGuard *upstream_guard_acquire(const char *host, const char *port, upstream_admission_t *admission,
+                                      int *trial) {
+    *admission = UPSTREAM_ADMITTED;
+    *trial = 0;
+    int max_active = __atomic_load_n(&guard_config.max_active, __ATOMIC_RELAXED);
+    int failure_threshold = __atomic_load_n(&guard_config.failure_threshold, __ATOMIC_RELAXED);
+    if (max_active == 0 && failure_threshold == 0) return NULL;
+    UpstreamGuard *guard = get_guard(host, port);
+    if (!guard) return NULL; // Out of memory: let it through unguarded
+
+    // A circuit left open when the breaker was turned off no longer refuses
+    uint64_t open_until = failure_threshold ? __atomic_load_n(&guard->open_until, __ATOMIC_ACQUIRE) : 0;
+    if (open_until) {
+        // Half-open once the time is up: exactly one request gets to try
+        int expected = 0;
+        if (now_ms() < open_until ||
+            !__atomic_compare_exchange_n(&guard->trial, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            *admission = UPSTREAM_OPEN;
+            return NULL;
+        }
+        *trial = 1;
+    }
+
+    int active = __atomic_add_fetch(&guard->active, 1, __ATOMIC_RELAXED);
+    if (max_active > 0 && active > max_active) {
+        __atomic_sub_fetch(&guard->active, 1, __ATOMIC_RELAXED);
+        if (*trial) __atomic_store_n(&guard->trial, 0, __ATOMIC_RELEASE);
+        *trial = 0;
+        *admission = UPSTREAM_BUSY;
+        return NULL;
+    }
+    return guard;
+}
+
+/**
+ * @brief Ends an exchange: a success closes the circuit, a failure counts
+ * towards opening it (or reopens a half-open one).
+ */
+void upstream_guard_release(UpstreamGuard *guard, int trial, upstream_outcome_t outcome) {
+    if (!guard) return;
+    __atomic_sub_fetch(&guard->active, 1, __ATOMIC_RELAXED);
+    int failure_threshold = __atomic_load_n(&guard_config.failure_threshold, __ATOMIC_RELAXED);
+    if (failure_threshold == 0) {
+        // The breaker was turned off while this exchange ran
+        if (trial) __atomic_store_n(&guard->trial, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    switch (outcome) {
+        case UPSTREAM_OK:
+            // Plain loads first, so the common case writes nothing shared
+            if (__atomic_load_n(&guard->failures, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&guard->failures, 0, __ATOMIC_RELAXED);
+            }
+            if (__atomic_load_n(&guard->open_until, __ATOMIC_ACQUIRE) &&
+                __atomic_exchange_n(&guard->open_until, 0, __ATOMIC_ACQ_REL)) {
+                __atomic_store_n(&guard->trial, 0, __ATOMIC_RELEASE);
+                log_message(LOG_LEVEL_INFO, "Circuit to %s closed.", guard->key);
+            }
+            break;
+        case UPSTREAM_FAILED: {
+            int failures = __atomic_add_fetch(&guard->failures, 1, __ATOMIC_RELAXED);
+            // A failed trial reopens the circuit straight away
+            if (failures >= failure_threshold ||
+                __atomic_load_n(&guard->open_until, __ATOMIC_ACQUIRE)) {
+                open_circuit(guard, failures, trial);
+            }
+            break;
+        }
+        case UPSTREAM_ABANDONED:
+            // Tells nothing; if this was the trial, let another request try. A
+            // request admitted before the circuit opened leaves the trial alone.
+            if (trial) __atomic_store_n(&guard->trial, 0, __ATOMIC_RELEASE);
+            break;
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * @file upstream_guard.h
+ * @author Shubham More
+ * @brief Interface for the per-origin concurrency limits and circuit breakers,
+ * and the timeouts that bound every exchange with an origin.
+ *
+ * Before a request goes to an origin it asks that origin's guard for
+ * admission, and it reports how the exchange went once it is over. A guard
+ * caps how many requests may be in flight to its origin at once, so a slow
+ * origin can tie up no more than that many workers or connections, and it
+ * counts consecutive failures: after enough of them the origin's circuit
+ * opens, and requests to it are refused on the spot instead of waiting on
+ * it. Once the circuit has been open for a while a single trial request is
+ * let through, and the circuit closes again if that one succeeds.
+ *
+ * Timeouts, failures and refusals never touch the cache: hits are served
+ * however their origin is doing.
+ *
+ * The limits and the timeouts can both be changed while the proxy runs;
+ * requests already in flight go on counting against their guards.
+ */
+
+#ifndef UPSTREAM_GUARD_H
+#define UPSTREAM_GUARD_H
+
+/**
+ * @struct upstream_timeouts_t
+ * @brief How long each stage of an exchange with an origin may take, in
+ * milliseconds; 0 for no limit.
+ */
+typedef struct {
+    int connect_ms;     // Connecting to one of the origin's addresses
+    int first_byte_ms;  // From the request being sent to the first byte of the response
+    int idle_ms;        // Longest pause in sending to or receiving from the origin
+    int deadline_ms;    // The whole exchange, counted from the arrival of the request head
+} upstream_timeouts_t;
+
+/**
+ * @struct upstream_guard_config_t
+ * @brief Options for the origin guards.
+ */
+typedef struct {
+    int max_active;         // Requests in flight to one origin at once; 0 for no limit
+    int failure_threshold;  // Consecutive failures that open an origin's circuit; 0 disables the breaker
+    int open_ms;            // How long an open circuit refuses requests before a trial
+} upstream_guard_config_t;
+
+// Whether a request may go to its origin
+typedef enum {
+    UPSTREAM_ADMITTED,  // Go ahead, and release the guard when done
+    UPSTREAM_BUSY,      // The origin already has max_active requests in flight
+    UPSTREAM_OPEN       // The origin's circuit is open
+} upstream_admission_t;
+
+// How an exchange with an origin ended
+typedef enum {
+    UPSTREAM_OK,        // The origin answered in full
+    UPSTREAM_FAILED,    // It could not be reached, timed out or broke off its response
+    UPSTREAM_ABANDONED  // The client went away first; says nothing about the origin
+} upstream_outcome_t;
+
+typedef struct UpstreamGuard UpstreamGuard;
+
+/**
+ * @brief Sets the limits every origin gets.
+ * @param config The options.
+ * @return 0 on success, -1 on invalid options.
+ */
+int upstream_guard_init(const upstream_guard_config_t *config);
+
+/**
+ * @brief Changes the limits every origin gets, for the requests admitted
+ * from now on.
+ * @param config The options.
+ * @return 0 on success, -1 on invalid options (nothing changes).
+ */
+int upstream_guard_configure(const upstream_guard_config_t *config);
+
+/**
+ * @brief Sets the timeouts of every exchange started from now on.
+ * @param timeouts The timeouts.
+ */
+void upstream_guard_set_timeouts(const upstream_timeouts_t *timeouts);
+
+/**
+ * @brief Reads the timeouts. A reader racing a change may see some of the
+ * new ones alongside some of the old.
+ * @return The timeouts.
+ */
+upstream_timeouts_t upstream_guard_timeouts();
+
+/**
+ * @brief Frees every origin's guard. No request may hold one.
+ */
+void upstream_guard_destroy();
+
+/**
+ * @brief Asks for admission to an origin.
+ * @param host The origin host name.
+ * @param port The origin port.
+ * @param admission Set to whether the request may go ahead.
+ * @param trial Set to whether the request is the half-open circuit's trial.
+ * @return The guard to release once the exchange is over, or NULL when
+ * there is nothing to release (refused, or no limits are configured).
+ */
+UpstreamGuard *upstream_guard_acquire(const char *host, const char *port, upstream_admission_t *admission,
+                                      int *trial);
+
+/**
+ * @brief Ends an admitted exchange and counts its outcome.
+ * @param guard What upstream_guard_acquire() returned; NULL is ignored.
+ * @param trial What upstream_guard_acquire() set it to.
+ * @param outcome How the exchange ended.
+ */
+void upstream_guard_release(UpstreamGuard *guard, int trial, upstream_outcome_t outcome);
+
+#endif
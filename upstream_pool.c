@@ -0,0 +1,270 @@
+/**
+ * @file upstream_pool.c
+ * @author Shubham More
+ * @brief Implementation of the idle origin connection pool.
+ *
+ * Origins live in a small chained hash table keyed by "host:port"; each
+ * keeps its idle sockets in a LIFO array so the most recently used (and
+ * least likely to have been closed by the origin) is handed out first.
+ * Expired connections are reaped lazily, at most once per second, by
+ * whichever thread touches the pool. A single mutex protects the table;
+ * critical sections are a few pointer operations long.
+ */
+
+#include "upstream_pool.h"
+#include "proxy_parse.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#define ORIGIN_TABLE_SIZE 256 // Power of 2 for efficient modulo
+#define MAX_ORIGIN_KEY 320    // "host:port"
+
+// An idle connection
+typedef struct {
+    int fd;
+    time_t idle_since;
+} IdleConn;
+
+// All idle connections to one origin
+typedef struct Origin {
+    char key[MAX_ORIGIN_KEY];
+    IdleConn *idle;
+    int idle_count;
+    struct Origin *next; // For handling hash collisions
+} Origin;
+
+// --- Global Pool State ---
+static int max_idle_per_origin = 0;
+static int idle_timeout = 0;
+static time_t last_reap = 0;
+static Origin *origin_table[ORIGIN_TABLE_SIZE];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief Seconds on the monotonic clock.
+ */
+static time_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @brief FNV-1a hash of an origin key.
+ */
+static unsigned int hash_key(const char *key) {
+    unsigned int h = 2166136261u;
+    for (; *key; ++key) {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h & (ORIGIN_TABLE_SIZE - 1);
+}
+
+/**
+ * @brief Finds (and optionally creates) the entry for an origin.
+ */
+static Origin *find_origin(const char *key, int create) {
+    unsigned int index = hash_key(key);
+    for (Origin *o = origin_table[index]; o; o = o->next) {
+        if (strcmp(o->key, key) == 0) return o;
+    }
+    if (!create) return NULL;
+
+    Origin *o = calloc(1, sizeof(Origin));
+    if (!o) return NULL;
+    o->idle = malloc(max_idle_per_origin * sizeof(IdleConn));
+    if (!o->idle) {
+        free(o);
+        return NULL;
+    }
+    snprintf(o->key, sizeof(o->key), "%s", key);
+    o->next = origin_table[index];
+    origin_table[index] = o;
+    return o;
+}
+
+/**
+ * @brief Checks that an idle socket is still open and has no stray data.
+ */
+static int connection_is_healthy(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    // Only "nothing to read yet" means the origin is still waiting for us
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * @brief Closes idle connections older than the idle timeout. Lock must be held.
+ */
+static void reap_expired(time_t now) {
+    if (now == last_reap) return;
+    last_reap = now;
+
+    for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        for (Origin *o = origin_table[i]; o; o = o->next) {
+            int kept = 0;
+            for (int j = 0; j < o->idle_count; j++) {
+                if (now - o->idle[j].idle_since >= idle_timeout) close(o->idle[j].fd);
+                else o->idle[kept++] = o->idle[j];
+            }
+            o->idle_count = kept;
+        }
+    }
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Initializes the pool.
+ */
+int upstream_pool_init(int max_idle_per_host, int idle_timeout_sec) {
+    if (max_idle_per_host < 0 || idle_timeout_sec < 0) return -1;
+    max_idle_per_origin = max_idle_per_host;
+    idle_timeout = idle_timeout_sec;
+    memset(origin_table, 0, sizeof(origin_table));
+    return 0;
+}
+
+/**
+ * @brief Closes all idle connections and frees the pool.
+ */
+void upstream_pool_destroy() {
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < ORIGIN_TABLE_SIZE; i++) {
+        Origin *o = origin_table[i];
+        while (o) {
+            Origin *next = o->next;
+            for (int j = 0; j < o->idle_count; j++) close(o->idle[j].fd);
+            free(o->idle);
+            free(o);
+            o = next;
+        }
+        origin_table[i] = NULL;
+    }
+    max_idle_per_origin = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Whether pooling is enabled.
+ */
+int upstream_pool_enabled() {
+    return max_idle_per_origin > 0;
+}
+
+/**
+ * @brief Takes a healthy idle connection to an origin, if any.
+ */
+int upstream_pool_get(const char *host, const char *port) {
+    if (max_idle_per_origin <= 0) return -1;
+
+    char key[MAX_ORIGIN_KEY];
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+
+    pthread_mutex_lock(&pool_lock);
+    time_t now = now_seconds();
+    reap_expired(now);
+
+    Origin *o = find_origin(key, 0);
+    while (o && o->idle_count > 0) {
+        IdleConn conn = o->idle[--o->idle_count];
+        pthread_mutex_unlock(&pool_lock);
+
+        // Health check outside the lock; a syscall per reuse is cheap
+        // compared to a handshake
+        if (now - conn.idle_since < idle_timeout && connection_is_healthy(conn.fd)) {
+            return conn.fd;
+        }
+        close(conn.fd);
+
+        pthread_mutex_lock(&pool_lock);
+        o = find_origin(key, 0);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return -1;
+}
+
+/**
+ * @brief Parks a reusable connection, or closes it if the origin's slots are full.
+ */
+void upstream_pool_put(const char *host, const char *port, int fd) {
+    if (max_idle_per_origin <= 0) {
+        close(fd);
+        return;
+    }
+
+    char key[MAX_ORIGIN_KEY];
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+
+    pthread_mutex_lock(&pool_lock);
+    time_t now = now_seconds();
+    reap_expired(now);
+
+    Origin *o = find_origin(key, 1);
+    if (o && o->idle_count < max_idle_per_origin) {
+        o->idle[o->idle_count].fd = fd;
+        o->idle[o->idle_count].idle_since = now;
+        o->idle_count++;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (fd >= 0) close(fd);
+}
+
+/**
+ * @brief Whether a request can be sent to the origin with keep-alive.
+ */
+int upstream_should_keep_alive(struct ParsedRequest *req) {
+    return upstream_pool_enabled() && req->version && strcmp(req->version, "HTTP/1.1") == 0;
+}
+
+/**
+ * @brief Rewrites and serializes a request for the origin.
+ */
+char* upstream_build_request(struct ParsedRequest *req, int keep_alive, size_t *out_len) {
+    req->version = keep_alive ? "HTTP/1.1" : "HTTP/1.0";
+
+    ParsedHeader_set(req, "Host", req->host);
+    ParsedHeader_remove(req, "Proxy-Connection");
+    ParsedHeader_remove(req, "Keep-Alive");
+    // The proxy answers 100-continue itself, and a chunked body is framed by
+    // its chunks alone: a Content-Length beside it could desync the origin
+    size_t body_length;
+    ParsedHeader_remove(req, "Expect");
+    if (ParsedRequest_bodyFraming(req, &body_length) == REQUEST_BODY_CHUNKED) {
+        ParsedHeader_remove(req, "Content-Length");
+    }
+    ParsedHeader_set(req, "Connection", keep_alive ? "keep-alive" : "close");
+
+    size_t req_line_len = ParsedRequest_requestLineLen(req);
+    size_t headers_len = ParsedHeader_headersLen(req);
+    size_t total_req_len = req_line_len + headers_len;
+
+    char *request_to_send = malloc(total_req_len + 1);
+    if (!request_to_send) return NULL;
+
+    int written_line_len = ParsedRequest_unparse(req, request_to_send, total_req_len);
+    if (written_line_len < 0 ||
+        ParsedRequest_unparse_headers(req, request_to_send + written_line_len,
+                                      total_req_len - written_line_len) < 0) {
+        log_message(LOG_LEVEL_WARN, "Failed to unparse request.");
+        free(request_to_send);
+        return NULL;
+    }
+
+    *out_len = total_req_len;
+    return request_to_send;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file upstream_pool.h
+ * @author Shubham More
+ * @brief Interface for a pool of idle, persistent origin connections.
+ *
+ * Connections to origin servers that completed a keep-alive HTTP/1.1
+ * exchange are parked here, keyed by (host, port), so the next request to
+ * the same origin can skip DNS, the TCP handshake and slow start. Idle
+ * connections are bounded per origin, expire after an idle timeout, and are
+ * health-checked before being handed out again.
+ */
+
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include <stddef.h>
+
+struct ParsedRequest;
+
+/**
+ * @brief Initializes the pool.
+ * @param max_idle_per_host Idle connections kept per origin; 0 disables pooling.
+ * @param idle_timeout_sec Seconds an idle connection may stay in the pool.
+ * @return 0 on success, -1 on failure.
+ */
+int upstream_pool_init(int max_idle_per_host, int idle_timeout_sec);
+
+/**
+ * @brief Closes every pooled connection and frees the pool.
+ */
+void upstream_pool_destroy();
+
+/**
+ * @brief Whether pooling (and therefore upstream keep-alive) is enabled.
+ * @return Non-zero if idle connections are kept.
+ */
+int upstream_pool_enabled();
+
+/**
+ * @brief Takes a healthy idle connection to the given origin.
+ * @param host The origin host name.
+ * @param port The origin port.
+ * @return A connected socket owned by the caller, or -1 if none is available.
+ */
+int upstream_pool_get(const char *host, const char *port);
+
+/**
+ * @brief Returns a connection whose last response was fully read.
+ *
+ * If the origin already has max_idle_per_host idle connections, or pooling
+ * is disabled, the connection is closed instead.
+ * @param host The origin host name.
+ * @param port The origin port.
+ * @param fd The connected socket; ownership passes to the pool.
+ */
+void upstream_pool_put(const char *host, const char *port, int fd);
+
+/**
+ * @brief Decides whether a request may use a persistent origin connection.
+ *
+ * Only HTTP/1.1 clients are upgraded to keep-alive upstream, since an
+ * HTTP/1.1 origin may answer with chunked framing an HTTP/1.0 client does
+ * not understand.
+ * @param req The client's request.
+ * @return Non-zero if the request should be sent with keep-alive.
+ */
+int upstream_should_keep_alive(struct ParsedRequest *req);
+
+/**
+ * @brief Rewrites a client request for the origin and serializes it.
+ *
+ * Sets Host, drops hop-by-hop proxy headers (and Expect, which the proxy
+ * answers itself), and either asks for a
+ * persistent HTTP/1.1 connection or falls back to HTTP/1.0 with
+ * Connection: close.
+ * @param req The client's request (modified in place).
+ * @param keep_alive Non-zero to request a persistent connection.
+ * @param out_len Filled with the length of the serialized request.
+ * @return A malloc'd buffer the caller must free, or NULL on failure.
+ */
+char* upstream_build_request(struct ParsedRequest *req, int keep_alive, size_t *out_len);
+
+#endif
@@ -0,0 +1,379 @@
+/**
+ * @file uring.c
+ * @author Shubham More
+ * @brief Implementation of the raw io_uring wrapper.
+ *
+ * The submission and completion rings are shared with the kernel, so the
+ * indexes each side advances are published with release stores and read
+ * with acquire loads. Submission entries are used in ring order and the
+ * submission array maps every slot to the entry of the same index, so it
+ * is filled in once at setup. Registered receive buffers work the same
+ * way in the other direction: we publish free ones at the tail of their
+ * ring and the kernel consumes them from the head.
+ */
+
+#define _GNU_SOURCE
+#include "uring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define URING_CQ_FACTOR 8 // Completion slots per submission slot; multishot ops post many
+
+// --- Private Helper Functions ---
+
+/**
+ * @brief The io_uring_setup(2) system call.
+ */
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+/**
+ * @brief The io_uring_enter(2) system call.
+ */
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              const void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+/**
+ * @brief The io_uring_register(2) system call.
+ */
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @brief Hands the queued entries to the kernel, optionally waiting for a
+ * completion in the same call.
+ */
+static int enter(Uring *ring, unsigned min_complete, int timeout_ms) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    const void *argp = NULL;
+    size_t arg_size = 0;
+    if (min_complete && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        arg_size = sizeof(arg);
+    }
+
+    // Everything published and not yet consumed by the kernel
+    unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return sys_io_uring_enter(ring->fd, to_submit, min_complete, flags, argp, arg_size) < 0 ? -1 : 0;
+}
+
+
+// --- Public API Functions ---
+
+/**
+ * @brief Creates a ring and maps its queues.
+ */
+int uring_init(Uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    // Cooperative task running saves an interrupt per completion; older kernels lack it
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = entries * URING_CQ_FACTOR;
+    int fd = sys_io_uring_setup(entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * URING_CQ_FACTOR;
+        fd = sys_io_uring_setup(entries, &params);
+    }
+    if (fd < 0) return -1;
+
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        close(fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+    ring->fd = fd;
+
+    // One mapping covers both rings
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_SQ_RING);
+    if (ring->ring_mem == MAP_FAILED) {
+        ring->ring_mem = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    char *mem = ring->ring_mem;
+    ring->sq_head = (unsigned *)(mem + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(mem + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(mem + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    unsigned *array = (unsigned *)(mem + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+
+    ring->cq_head = (unsigned *)(mem + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(mem + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(mem + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(mem + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Unmaps and closes a ring.
+ */
+void uring_destroy(Uring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring_mem) munmap(ring->ring_mem, ring->ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    ring->sqes = NULL;
+    ring->ring_mem = NULL;
+    ring->fd = -1;
+}
+
+/**
+ * @brief Takes the next free submission entry, submitting first if full.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (enter(ring, 0, -1) < 0) {
+            perror("io_uring_enter");
+            return NULL;
+        }
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    // Published now; the kernel only looks at it once asked to by io_uring_enter()
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * @brief Submits the queued entries and waits for a completion.
+ */
+int uring_wait(Uring *ring, int timeout_ms) {
+    if (enter(ring, 1, timeout_ms) < 0) {
+        // A timeout is not a failure; neither is a busy kernel, the next wait retries
+        if (errno == ETIME || errno == EBUSY || errno == EAGAIN) return 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief The oldest unconsumed completion, if any.
+ */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/**
+ * @brief Consumes the oldest completion.
+ */
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Prepares a (possibly multishot) poll.
+ */
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events, int multishot, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+}
+
+/**
+ * @brief Prepares the cancellation of an operation by its user_data.
+ */
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+/**
+ * @brief Prepares a (possibly multishot) accept.
+ */
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, int flags, int multishot, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = (uint32_t)flags;
+    sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = user_data;
+}
+
+/**
+ * @brief Registers a group of receive buffers.
+ */
+int uring_buffers_init(Uring *ring, UringBuffers *buffers, unsigned count, size_t size, unsigned short group) {
+    memset(buffers, 0, sizeof(*buffers));
+    buffers->count = count;
+    buffers->buffer_size = size;
+    buffers->group = group;
+
+    // The address ring must be page aligned; an anonymous mapping is, and starts zeroed
+    buffers->ring_size = count * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return -1;
+    buffers->ring = mem;
+    buffers->data = malloc(count * size);
+    if (!buffers->data) {
+        munmap(mem, buffers->ring_size);
+        buffers->ring = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved = errno;
+        free(buffers->data);
+        munmap(mem, buffers->ring_size);
+        buffers->ring = NULL;
+        buffers->data = NULL;
+        errno = saved;
+        return -1;
+    }
+    for (unsigned id = 0; id < count; id++) uring_buffer_recycle(buffers, id);
+    return 0;
+}
+
+/**
+ * @brief Unregisters and frees a group of receive buffers.
+ */
+void uring_buffers_destroy(Uring *ring, UringBuffers *buffers) {
+    if (!buffers->ring) return;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = buffers->group;
+    if (ring->fd >= 0) sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(buffers->ring, buffers->ring_size);
+    free(buffers->data);
+    buffers->ring = NULL;
+    buffers->data = NULL;
+}
+
+/**
+ * @brief The buffer with an id.
+ */
+char *uring_buffer(const UringBuffers *buffers, unsigned id) {
+    return buffers->data + (size_t)id * buffers->buffer_size;
+}
+
+/**
+ * @brief Publishes a buffer as free again.
+ */
+void uring_buffer_recycle(UringBuffers *buffers, unsigned id) {
+    struct io_uring_buf *buf = &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(buffers, id);
+    buf->len = (uint32_t)buffers->buffer_size;
+    buf->bid = (unsigned short)id;
+    buffers->tail++;
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Whether ring receives on non-blocking sockets wait for data.
+ */
+int uring_recv_waits(Uring *ring) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) return 0;
+    static char byte;
+    int waits = 0;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fds[0];
+        sqe->addr = (uint64_t)(uintptr_t)&byte;
+        sqe->len = 1;
+        // Nothing to read yet: the receive either fails at once, or waits for the byte sent after it
+        if (enter(ring, 0, -1) == 0 && send(fds[1], &byte, 1, MSG_NOSIGNAL) == 1) {
+            int done = 0;
+            for (int tries = 0; !done && tries < 10; tries++) {
+                if (uring_wait(ring, 100) < 0) break;
+                struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+                if (!cqe) continue;
+                waits = cqe->res == 1;
+                done = 1;
+                uring_cqe_seen(ring);
+            }
+        }
+    }
+    // A receive still waiting keeps its socket open and completes harmlessly with user_data 0
+    close(fds[0]);
+    close(fds[1]);
+    return waits;
+}
+
+/**
+ * @brief Prepares a receive into a buffer picked from a group.
+ */
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, size_t len, unsigned short group, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = (uint32_t)len;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+/**
+ * @brief Prepares a send from one buffer.
+ */
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *data, size_t len, int flags,
+                     uint64_t user_data) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = (uint32_t)flags;
+    sqe->user_data = user_data;
+}
+
+/**
+ * @brief Prepares a send from several buffers.
+ */
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, int flags,
+                        uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = (uint32_t)flags;
+    sqe->user_data = user_data;
+}
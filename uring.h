@@ -0,0 +1,237 @@
+/**
+ * @file uring.h
+ * @author Shubham More
+ * @brief Minimal io_uring access through the raw system calls.
+ *
+ * Just enough of io_uring for an event loop to use it as its event source:
+ * setting a ring up, queueing submissions, handing them all to the kernel
+ * in the same call that waits for completions, and walking the completions.
+ * No liburing is needed; the ring is driven through io_uring_setup(2) and
+ * io_uring_enter(2) and the shared memory they map. A ring belongs to one
+ * thread and is not locked.
+ *
+ * Besides polls, a ring can receive and send: a receive picks its buffer
+ * from a group of buffers registered with the ring, so no memory is tied
+ * up by sockets that have nothing to read.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * @struct Uring
+ * @brief An io_uring instance and its mapped submission and completion queues.
+ */
+typedef struct {
+    int fd;
+    void *ring_mem;        // Shared SQ/CQ ring mapping
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;     // Advanced by the kernel
+    unsigned *sq_tail;     // Advanced by us
+    unsigned sq_mask;
+    unsigned sq_entries;
+
+    unsigned *cq_head;     // Advanced by us
+    unsigned *cq_tail;     // Advanced by the kernel
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} Uring;
+
+/**
+ * @struct UringBuffers
+ * @brief A group of equal buffers the kernel picks from for receives.
+ *
+ * The kernel takes buffers from a ring of their addresses shared with it;
+ * a completion names the one it filled, which is the caller's until handed
+ * back with uring_buffer_recycle().
+ */
+typedef struct {
+    struct io_uring_buf_ring *ring; // Shared with the kernel
+    size_t ring_size;
+    char *data;                     // The buffers, back to back
+    size_t buffer_size;
+    unsigned count;                 // A power of two
+    unsigned short tail;            // Next slot to publish a buffer in
+    unsigned short group;
+} UringBuffers;
+
+/**
+ * @brief Creates a ring.
+ *
+ * Fails on kernels without io_uring, where it is disabled, or where it
+ * lacks the features the proxy relies on (a single ring mapping, no
+ * dropped completions, and waits with a timeout).
+ * @param ring The ring to set up.
+ * @param entries Submission queue size; the completion queue is larger.
+ * @return 0 on success, -1 on failure (errno is set).
+ */
+int uring_init(Uring *ring, unsigned entries);
+
+/**
+ * @brief Unmaps and closes a ring. Operations still in flight are cancelled.
+ * @param ring The ring.
+ */
+void uring_destroy(Uring *ring);
+
+/**
+ * @brief Takes the next free submission queue entry, cleared.
+ *
+ * The entry is handed to the kernel by the next uring_wait(). If the queue
+ * is full, what is queued is submitted first to make room.
+ * @param ring The ring.
+ * @return The entry, or NULL if the kernel would not take the queued ones.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+/**
+ * @brief Submits everything queued and waits for at least one completion.
+ * @param ring The ring.
+ * @param timeout_ms Longest wait, or -1 to wait indefinitely.
+ * @return 0 on success or timeout, -1 on failure (errno is set; EINTR
+ * means a signal arrived).
+ */
+int uring_wait(Uring *ring, int timeout_ms);
+
+/**
+ * @brief The oldest completion not consumed yet.
+ * @param ring The ring.
+ * @return The completion, or NULL if there is none; consume it with
+ * uring_cqe_seen() once done with it.
+ */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+
+/**
+ * @brief Consumes the completion returned by uring_peek_cqe().
+ * @param ring The ring.
+ */
+void uring_cqe_seen(Uring *ring);
+
+/**
+ * @brief Prepares a poll for readiness on a descriptor.
+ * @param sqe The entry to fill in.
+ * @param fd The descriptor to watch.
+ * @param events poll(2) events to wait for.
+ * @param multishot Non-zero to keep the poll armed and complete on every
+ * wakeup (each completion has IORING_CQE_F_MORE set while it stays armed).
+ * @param user_data Tag returned in the completions.
+ */
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events, int multishot, uint64_t user_data);
+
+/**
+ * @brief Prepares the cancellation of an operation in flight.
+ *
+ * Unlike IORING_OP_POLL_REMOVE, which gives up on a poll whose wakeup is
+ * being handled at that moment, this always takes effect: the operation
+ * completes with -ECANCELED.
+ * @param sqe The entry to fill in.
+ * @param target The user_data of the operation to cancel.
+ * @param user_data Tag returned in the cancellation's own completion.
+ */
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data);
+
+/**
+ * @brief Prepares an accept on a listening socket.
+ * @param sqe The entry to fill in.
+ * @param fd The listening socket.
+ * @param flags accept4(2) flags for the new sockets.
+ * @param multishot Non-zero to keep accepting; every completion carries
+ * one new socket, with IORING_CQE_F_MORE set while it stays armed.
+ * @param user_data Tag returned in the completions.
+ */
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, int flags, int multishot, uint64_t user_data);
+
+/**
+ * @brief Registers a group of buffers for receives, all of them free.
+ *
+ * Fails on kernels without registered buffer rings (before 5.19).
+ * @param ring The ring.
+ * @param buffers The group to set up.
+ * @param count How many buffers; a power of two up to 32768.
+ * @param size Bytes in each.
+ * @param group The group's id, named by the receives that use it.
+ * @return 0 on success, -1 on failure (errno is set).
+ */
+int uring_buffers_init(Uring *ring, UringBuffers *buffers, unsigned count, size_t size, unsigned short group);
+
+/**
+ * @brief Unregisters a group of buffers and frees them.
+ *
+ * No receive that uses the group may be in flight.
+ * @param ring The ring.
+ * @param buffers The group.
+ */
+void uring_buffers_destroy(Uring *ring, UringBuffers *buffers);
+
+/**
+ * @brief The buffer a completion names.
+ * @param buffers The group.
+ * @param id The id from the completion's flags (>> IORING_CQE_BUFFER_SHIFT).
+ * @return The buffer's start.
+ */
+char *uring_buffer(const UringBuffers *buffers, unsigned id);
+
+/**
+ * @brief Hands a buffer back to the kernel for later receives.
+ * @param buffers The group.
+ * @param id The buffer's id.
+ */
+void uring_buffer_recycle(UringBuffers *buffers, unsigned id);
+
+/**
+ * @brief Whether a receive on a non-blocking socket waits in the ring for
+ * data rather than failing with EAGAIN.
+ *
+ * Checked once with a socket pair; a submission is made and reaped, so the
+ * ring must have nothing else in flight.
+ * @param ring The ring.
+ * @return 1 if it waits, 0 if not or if that could not be told.
+ */
+int uring_recv_waits(Uring *ring);
+
+/**
+ * @brief Prepares a receive into a buffer the kernel picks from a group.
+ *
+ * The completion's flags carry IORING_CQE_F_BUFFER and the buffer's id
+ * whenever there were bytes; it is -ENOBUFS if the group ran out.
+ * @param sqe The entry to fill in.
+ * @param fd The socket.
+ * @param len Most bytes to take, at most the group's buffer size.
+ * @param group The group's id.
+ * @param user_data Tag returned in the completion.
+ */
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, size_t len, unsigned short group, uint64_t user_data);
+
+/**
+ * @brief Prepares a send from one buffer.
+ * @param sqe The entry to fill in.
+ * @param fd The socket.
+ * @param data The bytes, which must stay put until the completion.
+ * @param len How many.
+ * @param flags send(2) flags; MSG_DONTWAIT completes at once with what the
+ * socket took, or -EAGAIN, rather than waiting for room.
+ * @param user_data Tag returned in the completion.
+ */
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *data, size_t len, int flags,
+                     uint64_t user_data);
+
+/**
+ * @brief Prepares a send from several buffers.
+ * @param sqe The entry to fill in.
+ * @param fd The socket.
+ * @param msg The message; it and the bytes it points at must stay put
+ * until the completion.
+ * @param flags sendmsg(2) flags.
+ * @param user_data Tag returned in the completion.
+ */
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, int flags,
+                        uint64_t user_data);
+
+#endif